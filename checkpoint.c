@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "checkpoint.h"
+#include "detail.h"
+#include "fluid.h"
+#include "timer.h"
+
+#define FLOAT_PLANE_COUNT 4
+
+typedef struct {
+    const char* name;
+    size_t plane;                // offsetof(Simulation, ...)
+} FloatPlane;
+
+// The state that carries from one step to the next; pressure, divergence
+// and scratch are rebuilt every step
+FloatPlane float_planes[FLOAT_PLANE_COUNT] = {
+    {"density", offsetof(Simulation, scalars.density)},
+    {"temperature", offsetof(Simulation, scalars.temperature)},
+    {"velocity_x", offsetof(Simulation, fields.velocity_x)},
+    {"velocity_y", offsetof(Simulation, fields.velocity_y)},
+};
+
+// One save in flight at a time; the image is handed to the writer thread
+pthread_t writer_thread;
+int writer_started = 0;
+atomic_int writer_busy;
+unsigned char* writer_image;
+size_t writer_bytes;
+char writer_path[4096];
+
+size_t align_page(size_t bytes) {
+    return (bytes + CHECKPOINT_ALIGN - 1) & ~(size_t)(CHECKPOINT_ALIGN - 1);
+}
+
+void add_plane(CheckpointHeader* header, const char* name, uint32_t element_bytes, size_t bytes, size_t* offset) {
+    CheckpointPlane* plane = &header->planes[header->plane_count++];
+    snprintf(plane->name, sizeof(plane->name), "%s", name);
+    plane->element_bytes = element_bytes;
+    plane->offset = *offset;
+    plane->bytes = bytes;
+    *offset += align_page(bytes);
+}
+
+// The whole file in memory: header page, then every plane page-aligned
+unsigned char* capture_image(long long step, size_t* image_bytes) {
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.header_bytes = CHECKPOINT_ALIGN;
+    header.width = sim->grid_width;
+    header.height = sim->grid_height;
+    header.step = step;
+    header.noise_seed = sim->noise_seed;
+    header.noise_step = sim->noise_step;
+    header.noise_time = sim->noise_time;
+    header.max_speed = sim->max_speed;
+    header.pressure_solver = sim->pressure_solver;
+    header.viscosity_solver = sim->viscosity_solver;
+    header.turbulence_mode = sim->turbulence_mode;
+    header.sparse_tiles = sim->sparse_tiles;
+    header.emission_density_amount = sim->emission_density_amount;
+    header.cfl_limit = sim->cfl_limit;
+    header.max_substeps = sim->max_substeps;
+    header.params = sim->params;
+    header.scalar_storage = sim->scalar_storage;
+
+    size_t offset = CHECKPOINT_ALIGN;
+    size_t plane_bytes = (size_t)sim->grid_size * sizeof(float);
+    for (int p = 0; p < FLOAT_PLANE_COUNT; p++) {
+        add_plane(&header, float_planes[p].name, sizeof(float), plane_bytes, &offset);
+    }
+    add_plane(&header, "tiles", 1, (size_t)sim->tiles_x * sim->tiles_y, &offset);
+
+    unsigned char* image = calloc(1, offset);
+    if (!image) return NULL;
+    memcpy(image, &header, sizeof(header));
+    for (int p = 0; p < FLOAT_PLANE_COUNT; p++) {
+        fluid_read_cells(SIM_PLANE(float_planes[p].plane), 0, sim->grid_size, (float*)(image + header.planes[p].offset));
+    }
+    memcpy(image + header.planes[FLOAT_PLANE_COUNT].offset, sim->tile_processed, (size_t)sim->tiles_x * sim->tiles_y);
+    *image_bytes = offset;
+    return image;
+}
+
+// Writes beside the target and renames, so a crash never leaves half a file
+int write_image(const char* path, const unsigned char* image, size_t bytes) {
+    char temp[4096 + 8];
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    FILE* file = fopen(temp, "wb");
+    if (!file) {
+        fprintf(stderr, "Cannot open %s for writing\n", temp);
+        return 0;
+    }
+    int ok = fwrite(image, 1, bytes, file) == bytes;
+    if (fclose(file) != 0) ok = 0;
+#ifdef _WIN32
+    if (ok) remove(path);
+#endif
+    if (ok && rename(temp, path) != 0) ok = 0;
+    if (!ok) {
+        fprintf(stderr, "Writing %s failed\n", path);
+        remove(temp);
+    }
+    return ok;
+}
+
+int checkpoint_save(const char* path, long long step) {
+    size_t bytes;
+    unsigned char* image = capture_image(step, &bytes);
+    if (!image) {
+        fprintf(stderr, "Out of memory for checkpoint\n");
+        return 0;
+    }
+    int ok = write_image(path, image, bytes);
+    free(image);
+    return ok;
+}
+
+void* writer_main(void* arg) {
+    double start = timer_seconds();
+    if (write_image(writer_path, writer_image, writer_bytes)) {
+        printf("Checkpoint %s written in %.1f ms\n", writer_path, (timer_seconds() - start) * 1e3);
+    }
+    free(writer_image);
+    writer_image = NULL;
+    atomic_store_explicit(&writer_busy, 0, memory_order_release);
+    return NULL;
+}
+
+// Copies the state now and writes it on a background thread. Returns 0
+// without saving if the previous save is still being written.
+int checkpoint_save_async(const char* path, long long step) {
+    if (atomic_load_explicit(&writer_busy, memory_order_acquire)) {
+        printf("Checkpoint still being written, %s skipped\n", path);
+        return 0;
+    }
+    checkpoint_wait();
+    writer_image = capture_image(step, &writer_bytes);
+    if (!writer_image) {
+        fprintf(stderr, "Out of memory for checkpoint\n");
+        return 0;
+    }
+    snprintf(writer_path, sizeof(writer_path), "%s", path);
+    atomic_store(&writer_busy, 1);
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+        atomic_store(&writer_busy, 0);
+        free(writer_image);
+        writer_image = NULL;
+        return checkpoint_save(path, step);
+    }
+    writer_started = 1;
+    return 1;
+}
+
+// Blocks until a background save has finished
+void checkpoint_wait() {
+    if (!writer_started) return;
+    pthread_join(writer_thread, NULL);
+    writer_started = 0;
+}
+
+// Read-only view of a whole file; the OS pages it in on demand
+typedef struct {
+    const unsigned char* data;
+    size_t bytes;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} MappedFile;
+
+int map_file(const char* path, MappedFile* map) {
+#ifdef _WIN32
+    map->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (map->file == INVALID_HANDLE_VALUE) return 0;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(map->file, &size) || size.QuadPart == 0) {
+        CloseHandle(map->file);
+        return 0;
+    }
+    map->bytes = (size_t)size.QuadPart;
+    map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    map->data = map->mapping ? MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (!map->data) {
+        if (map->mapping) CloseHandle(map->mapping);
+        CloseHandle(map->file);
+        return 0;
+    }
+    return 1;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    map->bytes = (size_t)info.st_size;
+    void* data = mmap(NULL, map->bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+    map->data = data;
+    return 1;
+#endif
+}
+
+void unmap_file(MappedFile* map) {
+#ifdef _WIN32
+    UnmapViewOfFile(map->data);
+    CloseHandle(map->mapping);
+    CloseHandle(map->file);
+#else
+    munmap((void*)map->data, map->bytes);
+#endif
+}
+
+const CheckpointPlane* find_plane(const CheckpointHeader* header, const char* name, size_t bytes, size_t file_bytes) {
+    for (uint32_t p = 0; p < header->plane_count; p++) {
+        const CheckpointPlane* plane = &header->planes[p];
+        if (strncmp(plane->name, name, CHECKPOINT_NAME_SIZE) != 0) continue;
+        if (plane->bytes != bytes || plane->offset % CHECKPOINT_ALIGN != 0 ||
+            plane->offset > file_bytes || plane->bytes > file_bytes - plane->offset) {
+            return NULL;
+        }
+        return plane;
+    }
+    return NULL;
+}
+
+// Restores a checkpoint, resizing the grid if needed. step and header, if
+// not NULL, receive the saved step count and the full header. On failure
+// the current state is untouched unless the grid had to be resized.
+int checkpoint_load(const char* path, long long* step, CheckpointHeader* header_out) {
+    MappedFile map;
+    if (!map_file(path, &map)) {
+        fprintf(stderr, "Cannot map %s\n", path);
+        return 0;
+    }
+    CheckpointHeader header;
+    int ok = map.bytes >= sizeof(header);
+    if (ok) memcpy(&header, map.data, sizeof(header));
+    if (!ok || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s is not a checkpoint\n", path);
+        unmap_file(&map);
+        return 0;
+    }
+    if (header.version < 1 || header.version > CHECKPOINT_VERSION || header.plane_count > CHECKPOINT_MAX_PLANES) {
+        fprintf(stderr, "%s has unsupported checkpoint version %u\n", path, header.version);
+        unmap_file(&map);
+        return 0;
+    }
+
+    size_t plane_bytes = (size_t)header.width * header.height * sizeof(float);
+    const CheckpointPlane* planes[FLOAT_PLANE_COUNT];
+    for (int p = 0; p < FLOAT_PLANE_COUNT && ok; p++) {
+        planes[p] = find_plane(&header, float_planes[p].name, plane_bytes, map.bytes);
+        if (!planes[p]) {
+            fprintf(stderr, "%s has no valid %s plane\n", path, float_planes[p].name);
+            ok = 0;
+        }
+    }
+    FieldStorage storage = sim->scalar_storage;
+    if (header.version >= 2) {
+        if (header.scalar_storage < 0 || header.scalar_storage >= FIELD_STORAGE_COUNT) {
+            fprintf(stderr, "%s has unknown scalar storage %d\n", path, header.scalar_storage);
+            ok = 0;
+        }
+        storage = header.scalar_storage;
+    }
+    if (ok && (header.width != sim->grid_width || header.height != sim->grid_height || storage != sim->scalar_storage)) {
+        FieldStorage previous = sim->scalar_storage;
+        sim->scalar_storage = storage;
+        ok = fluid_resize(header.width, header.height);
+        if (!ok) {
+            sim->scalar_storage = previous;
+            fprintf(stderr, "Cannot allocate the %dx%d grid of %s\n", header.width, header.height, path);
+        }
+    }
+    if (!ok) {
+        unmap_file(&map);
+        return 0;
+    }
+
+    init_grid();
+    for (int p = 0; p < FLOAT_PLANE_COUNT; p++) {
+        fluid_write_cells(SIM_PLANE(float_planes[p].plane), 0, sim->grid_size, (const float*)(map.data + planes[p]->offset));
+    }
+    // Older tile layouts are simply rebuilt by the next step
+    const CheckpointPlane* tiles = find_plane(&header, "tiles", (size_t)sim->tiles_x * sim->tiles_y, map.bytes);
+    if (tiles) memcpy(sim->tile_processed, map.data + tiles->offset, tiles->bytes);
+    sim->noise_seed = header.noise_seed;
+    sim->noise_step = header.noise_step;
+    sim->noise_time = header.noise_time;
+    sim->max_speed = header.max_speed;
+    if (header.version >= 2) sim->params = header.params;
+    // Checkpoints hold the simulation grid only; the fine scalars restart from it
+    if (sim->detail) detail_fill(sim->detail);
+    unmap_file(&map);
+
+    if (step) *step = header.step;
+    if (header_out) *header_out = header;
+    return 1;
+}
@@ -0,0 +1,65 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+
+#include "fluid.h"
+
+// Versioned binary snapshots of the solver state. A file is one
+// CHECKPOINT_ALIGN-byte header page followed by the raw planes, each
+// starting on a page boundary, so a loader can map the file and read the
+// planes in place. Multi-byte values are in the writer's byte order; the
+// magic and version reject anything else.
+//
+// The header records the grid, step count, RNG position, the physical
+// parameters, the scalar storage and the solver settings. Loading restores
+// the state, the RNG, the parameters, the storage and the time-step
+// controller so a run continues bit for bit; solver settings are kept for
+// reference and left to the caller to apply. Version 1 files, which have no
+// parameters or storage, load under the loader's own.
+
+#define CHECKPOINT_MAGIC "SMOKECKP"
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_ALIGN 4096
+#define CHECKPOINT_MAX_PLANES 16
+#define CHECKPOINT_NAME_SIZE 16
+
+typedef struct {
+    char name[CHECKPOINT_NAME_SIZE];
+    uint32_t element_bytes;
+    uint32_t reserved;
+    uint64_t offset;             // From the start of the file, a multiple of CHECKPOINT_ALIGN
+    uint64_t bytes;
+} CheckpointPlane;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_bytes;
+    int32_t width;
+    int32_t height;
+    int64_t step;
+    uint32_t noise_seed;
+    uint32_t noise_step;
+    float noise_time;
+    float max_speed;
+    int32_t pressure_solver;
+    int32_t viscosity_solver;
+    int32_t turbulence_mode;
+    int32_t sparse_tiles;
+    float emission_density_amount;
+    float cfl_limit;
+    int32_t max_substeps;
+    uint32_t plane_count;
+    CheckpointPlane planes[CHECKPOINT_MAX_PLANES];
+    // Version 2 on; version 1 left this part of the header page zero
+    FluidParams params;
+    int32_t scalar_storage;
+} CheckpointHeader;
+
+int checkpoint_save(const char* path, long long step);
+int checkpoint_save_async(const char* path, long long step);
+void checkpoint_wait();
+int checkpoint_load(const char* path, long long* step, CheckpointHeader* header);
+
+#endif
@@ -1,2 +1,5 @@
 @echo off
-gcc smoke_simulation.c -o smoke_simulation -I"C:\SDL2\include" -L"C:\SDL2\lib" -lSDL2main -lSDL2 -lSDL2_ttf -lSDL2_image -lm 
\ No newline at end of file
+gcc smoke_simulation.c sim_thread.c fluid.c thread_pool.c render.c timer.c profile.c checkpoint.c recording.c governor.c particles.c detail.c obstacles.c -o smoke_simulation -I"C:\SDL2\include" -L"C:\SDL2\lib" -lSDL2main -lSDL2 -lSDL2_ttf -lSDL2_image -lm -pthread
+gcc smoke_headless.c fluid.c thread_pool.c render.c timer.c profile.c checkpoint.c recording.c governor.c particles.c detail.c obstacles.c -o smoke_headless -lm -pthread
+gcc smoke_bench.c fluid.c thread_pool.c render.c timer.c profile.c checkpoint.c recording.c governor.c particles.c detail.c obstacles.c -o smoke_bench -lm -pthread
+gcc smoke_ensemble.c fluid.c thread_pool.c render.c timer.c profile.c checkpoint.c recording.c governor.c particles.c detail.c obstacles.c -o smoke_ensemble -lm -pthread
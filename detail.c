@@ -0,0 +1,389 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "detail.h"
+#include "fluid.h"
+#include "obstacles.h"
+#include "rng.h"
+#include "thread_pool.h"
+
+#define DETAIL_KEY 0x64746cu         // Second key word of the swirl lattice draws
+
+static inline float detail_smoothstep(float t) {
+    return t * t * (3.0f - 2.0f * t);
+}
+
+// A detail grid for the current simulation, filled from its scalars; NULL
+// for a scale out of range or when it cannot be allocated
+DetailGrid* detail_create(int scale) {
+    if (scale < 2 || scale > DETAIL_MAX_SCALE) return NULL;
+    DetailGrid* detail = calloc(1, sizeof(DetailGrid));
+    if (!detail) return NULL;
+    detail->scale = scale;
+    if (!detail_fit(detail)) {
+        detail_destroy(detail);
+        return NULL;
+    }
+    detail_fill(detail);
+    return detail;
+}
+
+void detail_destroy(DetailGrid* detail) {
+    if (!detail) return;
+    free(detail->block);
+    free(detail);
+}
+
+// Sizes the fine grid for the current simulation grid, cleared. Returns 0
+// and leaves width 0, so nothing is stepped, when a side would exceed
+// MAX_GRID_SIZE or the allocation fails.
+int detail_fit(DetailGrid* detail) {
+    int width = (sim->grid_width - 2) * detail->scale + 2;
+    int height = (sim->grid_height - 2) * detail->scale + 2;
+    free(detail->block);
+    detail->block = NULL;
+    detail->width = detail->height = 0;
+    if (width > MAX_GRID_SIZE || height > MAX_GRID_SIZE) return 0;
+
+    size_t cells = (size_t)width * height;
+    size_t floats = 4 * cells + 3 * (size_t)sim->grid_size + width;
+    size_t tiles = (size_t)sim->tiles_x * sim->tiles_y;
+    char* block = calloc(1, floats * sizeof(float) + width * sizeof(int) + tiles);
+    if (!block) return 0;
+    float* planes = (float*)block;
+    detail->density = planes;
+    detail->temperature = planes + cells;
+    detail->prev_density = planes + 2 * cells;
+    detail->prev_temperature = planes + 3 * cells;
+    detail->lattice = planes + 4 * cells;
+    detail->weight = detail->lattice + 3 * (size_t)sim->grid_size;
+    detail->column = (int*)(detail->weight + width);
+    detail->tiles = (uint8_t*)(detail->column + width);
+    detail->block = block;
+    detail->width = width;
+    detail->height = height;
+    detail->lattice_slice = UINT32_MAX;
+
+    // Interior onto interior; the outer fine cells lean on the ring
+    for (int x = 0; x < width; x++) {
+        float c = fmaxf(0.0f, fminf(sim->grid_width - 1.001f, (x - 0.5f) / detail->scale + 0.5f));
+        detail->column[x] = (int)c;
+        detail->weight[x] = c - (int)c;
+    }
+    return 1;
+}
+
+void detail_clear(DetailGrid* detail) {
+    if (!detail->width) return;
+    memset(detail->density, 0, 4 * (size_t)detail->width * detail->height * sizeof(float));
+    memset(detail->tiles, 0, (size_t)sim->tiles_x * sim->tiles_y);
+    detail->lattice_slice = UINT32_MAX;
+}
+
+// Sets the fine scalars to the simulation's, bilinearly upsampled, after
+// those were written from outside; checkpoint_load() calls it
+void detail_fill(DetailGrid* detail) {
+    if (!detail->width) return;
+    float top[MAX_GRID_SIZE];
+    float bottom[MAX_GRID_SIZE];
+    for (int field = 0; field < SCALAR_COUNT; field++) {
+        const void* plane = field == SCALAR_DENSITY ? sim->scalars.density : sim->scalars.temperature;
+        float* fine = field == SCALAR_DENSITY ? detail->density : detail->temperature;
+        for (int y = 0; y < detail->height; y++) {
+            float c = fmaxf(0.0f, fminf(sim->grid_height - 1.001f, (y - 0.5f) / detail->scale + 0.5f));
+            int y0 = (int)c;
+            float t = c - y0;
+            fluid_read_cells(plane, IX(0, y0), sim->grid_width, top);
+            fluid_read_cells(plane, IX(0, y0 + 1), sim->grid_width, bottom);
+            float* row = fine + (size_t)y * detail->width;
+            for (int x = 0; x < detail->width; x++) {
+                int x0 = detail->column[x];
+                float s = detail->weight[x];
+                float upper = top[x0] + s * (top[x0 + 1] - top[x0]);
+                float lower = bottom[x0] + s * (bottom[x0 + 1] - bottom[x0]);
+                row[x] = upper + t * (lower - upper);
+            }
+        }
+    }
+    size_t cells = (size_t)detail->width * detail->height;
+    memcpy(detail->prev_density, detail->density, cells * sizeof(float));
+    memcpy(detail->prev_temperature, detail->temperature, cells * sizeof(float));
+    // Every tile counts as stepped, so the next substep clears the idle ones
+    memset(detail->tiles, 1, (size_t)sim->tiles_x * sim->tiles_y);
+    detail->lattice_slice = UINT32_MAX;
+}
+
+// Called by add_smoke() for the fine cells of simulation cell (x, y)
+void detail_emit(DetailGrid* detail, int x, int y, float density, float temperature) {
+    if (!detail->width) return;
+    const int scale = detail->scale;
+    int x_begin = 1 + (x - 1) * scale > 0 ? 1 + (x - 1) * scale : 0;
+    int x_end = 1 + x * scale < detail->width ? 1 + x * scale : detail->width;
+    int y_begin = 1 + (y - 1) * scale > 0 ? 1 + (y - 1) * scale : 0;
+    int y_end = 1 + y * scale < detail->height ? 1 + y * scale : detail->height;
+    for (int fy = y_begin; fy < y_end; fy++) {
+        for (int fx = x_begin; fx < x_end; fx++) {
+            size_t i = (size_t)fy * detail->width + fx;
+            detail->density[i] += density;
+            detail->temperature[i] = temperature;
+        }
+    }
+}
+
+void detail_draw_rows(void* ctx, int begin, int end, int thread) {
+    const DetailGrid* detail = ctx;
+    float* pattern = detail->lattice + sim->grid_size;
+    for (int i = begin; i < end; i++) {
+        Philox4x32 r = philox4x32((uint32_t)i, detail->lattice_slice + 1, 0, 0, sim->noise_seed, DETAIL_KEY);
+        pattern[i] = rng_signed(r.v[0]);
+    }
+}
+
+// Draws the stream function patterns the swirl is between now and blends
+// them into the third lattice
+void detail_update_lattice(DetailGrid* detail) {
+    const size_t cells = (size_t)sim->grid_size;
+    float phase = sim->noise_time / DETAIL_PERIOD;
+    uint32_t slice = (uint32_t)phase;
+    if (slice != detail->lattice_slice) {
+        if (detail->lattice_slice != UINT32_MAX && slice == detail->lattice_slice + 1) {
+            memcpy(detail->lattice, detail->lattice + cells, cells * sizeof(float));
+        } else {
+            detail->lattice_slice = slice - 1;
+            parallel_for(0, sim->grid_size, detail_draw_rows, detail);
+            memcpy(detail->lattice, detail->lattice + cells, cells * sizeof(float));
+        }
+        detail->lattice_slice = slice;
+        parallel_for(0, sim->grid_size, detail_draw_rows, detail);
+    }
+    float blend = detail_smoothstep(phase - slice);
+    const float* from = detail->lattice;
+    const float* to = detail->lattice + cells;
+    float* blended = detail->lattice + 2 * cells;
+    for (size_t i = 0; i < cells; i++) blended[i] = from[i] + blend * (to[i] - from[i]);
+}
+
+// Fine rows of simulation row y over simulation columns x_begin..x_end - 1:
+// semi-Lagrangian advection through the upsampled velocity plus the swirl,
+// decay, and the means written back to the simulation's scalars
+void detail_span(const DetailGrid* detail, int y, int x_begin, int x_end) {
+    const int scale = detail->scale;
+    const int width = detail->width;
+    const float h = sim->substep;
+    const float density_decay = powf(sim->params.density_decay, h);
+    const float temperature_decay = powf(sim->params.temperature_decay, h);
+    const float hi_x = width - 2.0f;
+    const float hi_y = detail->height - 2.0f;
+    const float* src_density = detail->prev_density;
+    const float* src_temperature = detail->prev_temperature;
+    const float* lattice = detail->lattice + 2 * (size_t)sim->grid_size;
+    int fx_begin = 1 + (x_begin - 1) * scale;
+    int fx_end = 1 + (x_end - 1) * scale;
+    int c_begin = detail->column[fx_begin];
+    int c_end = detail->column[fx_end - 1] + 2;
+    float u_row[MAX_GRID_SIZE];
+    float v_row[MAX_GRID_SIZE];
+    float density_sum[MAX_GRID_SIZE];
+    float temperature_sum[MAX_GRID_SIZE];
+    memset(density_sum + x_begin, 0, (x_end - x_begin) * sizeof(float));
+    memset(temperature_sum + x_begin, 0, (x_end - x_begin) * sizeof(float));
+
+    for (int k = 0; k < scale; k++) {
+        int fy = 1 + (y - 1) * scale + k;
+        float c = (fy - 0.5f) / scale + 0.5f;
+        int y0 = (int)c;
+        float t = c - y0;
+        // The two simulation rows around this fine row, blended, in fine cells per step
+        const float* vx = sim->prev_fields.velocity_x + IX(0, y0);
+        const float* vy = sim->prev_fields.velocity_y + IX(0, y0);
+        const int below = sim->grid_width;
+        for (int x = c_begin; x < c_end; x++) {
+            u_row[x] = (vx[x] + t * (vx[x + below] - vx[x])) * scale;
+            v_row[x] = (vy[x] + t * (vy[x + below] - vy[x])) * scale;
+        }
+        const float* psi_top = lattice + IX(0, y0);
+        const float* psi_bottom = psi_top + below;
+        float wy = detail_smoothstep(t);
+        float dwy = 6.0f * t * (1.0f - t);
+
+        float* density = detail->density + (size_t)fy * width;
+        float* temperature = detail->temperature + (size_t)fy * width;
+        for (int fx = fx_begin; fx < fx_end; fx++) {
+            int x0 = detail->column[fx];
+            float s = detail->weight[fx];
+            float u = u_row[x0] + s * (u_row[x0 + 1] - u_row[x0]);
+            float v = v_row[x0] + s * (v_row[x0 + 1] - v_row[x0]);
+            if (detail->amount > 0.0f) {
+                float wx = detail_smoothstep(s);
+                float dwx = 6.0f * s * (1.0f - s);
+                float dtop = psi_top[x0 + 1] - psi_top[x0];
+                float dbottom = psi_bottom[x0 + 1] - psi_bottom[x0];
+                float top = psi_top[x0] + wx * dtop;
+                float bottom = psi_bottom[x0] + wx * dbottom;
+                float dpsi_dx = dwx * (dtop + wy * (dbottom - dtop));
+                float dpsi_dy = dwy * (bottom - top);
+                float swirl = detail->amount * sqrtf(u * u + v * v);
+                u += swirl * dpsi_dy;
+                v -= swirl * dpsi_dx;
+            }
+
+            float px = fmaxf(1.0f, fminf(hi_x, fx - h * u));
+            float py = fmaxf(1.0f, fminf(hi_y, fy - h * v));
+            int sx = (int)px;
+            int sy = (int)py;
+            float s1 = px - sx;
+            float s0 = 1.0f - s1;
+            float t1 = py - sy;
+            float t0 = 1.0f - t1;
+            size_t i00 = (size_t)sy * width + sx;
+            size_t i01 = i00 + width;
+            float d = s0 * (t0 * src_density[i00] + t1 * src_density[i01]) +
+                      s1 * (t0 * src_density[i00 + 1] + t1 * src_density[i01 + 1]);
+            float T = s0 * (t0 * src_temperature[i00] + t1 * src_temperature[i01]) +
+                      s1 * (t0 * src_temperature[i00 + 1] + t1 * src_temperature[i01 + 1]);
+            density[fx] = d * density_decay;
+            temperature[fx] = T * temperature_decay;
+            int cell = 1 + (fx - 1) / scale;
+            density_sum[cell] += density[fx];
+            temperature_sum[cell] += temperature[fx];
+        }
+    }
+
+    float inv_cells = 1.0f / (scale * scale);
+    for (int x = x_begin; x < x_end; x++) {
+        density_sum[x] *= inv_cells;
+        temperature_sum[x] *= inv_cells;
+    }
+    fluid_write_cells(sim->scalars.density, IX(x_begin, y), x_end - x_begin, density_sum + x_begin);
+    fluid_write_cells(sim->scalars.temperature, IX(x_begin, y), x_end - x_begin, temperature_sum + x_begin);
+}
+
+void detail_clear_span(const DetailGrid* detail, int y, int x_begin, int x_end) {
+    float* planes[4] = {detail->density, detail->temperature, detail->prev_density, detail->prev_temperature};
+    int fx_begin = 1 + (x_begin - 1) * detail->scale;
+    size_t bytes = (size_t)(x_end - x_begin) * detail->scale * sizeof(float);
+    for (int k = 0; k < detail->scale; k++) {
+        size_t row = (size_t)(1 + (y - 1) * detail->scale + k) * detail->width;
+        for (int p = 0; p < 4; p++) memset(planes[p] + row + fx_begin, 0, bytes);
+    }
+}
+
+// Simulation rows y_begin..y_end - 1, a run of tiles in the same state at a
+// time: processed ones are stepped, ones that just left the set cleared
+void detail_rows(void* ctx, int y_begin, int y_end, int thread) {
+    const DetailGrid* detail = ctx;
+    const int tiles_x = sim->tiles_x;
+    for (int y = y_begin; y < y_end; y++) {
+        const uint8_t* processed = sim->sparse_tiles ? sim->tile_processed + (y / TILE_SIZE) * tiles_x : NULL;
+        const uint8_t* stepped = detail->tiles + (y / TILE_SIZE) * tiles_x;
+        int tx = 0;
+        while (tx < tiles_x) {
+            int state = processed ? processed[tx] * 2 + stepped[tx] : 2;
+            int run = tx + 1;
+            while (run < tiles_x && (processed ? processed[run] * 2 + stepped[run] : 2) == state) run++;
+            int x_begin = tx * TILE_SIZE > 1 ? tx * TILE_SIZE : 1;
+            int x_end = run * TILE_SIZE < sim->grid_width - 1 ? run * TILE_SIZE : sim->grid_width - 1;
+            if (x_begin < x_end) {
+                if (state >= 2) {
+                    detail_span(detail, y, x_begin, x_end);
+                } else if (state == 1) {
+                    detail_clear_span(detail, y, x_begin, x_end);
+                }
+            }
+            tx = run;
+        }
+    }
+}
+
+// STAGE_ADVECTION, after the simulation grid's own advection
+// Empties the source cells under the gaps between the fluid runs, so
+// backtraces into an obstacle find no smoke, as on the simulation grid
+void detail_clear_solids(void* ctx, int y_begin, int y_end, int thread) {
+    const DetailGrid* detail = ctx;
+    const ObstacleMap* map = sim->obstacles;
+    const int scale = detail->scale;
+    for (int y = y_begin; y < y_end; y++) {
+        int x = 1;
+        for (int r = map->row_runs[y]; r <= map->row_runs[y + 1]; r++) {
+            int gap_end = r < map->row_runs[y + 1] ? map->run_begin[r] : sim->grid_width - 1;
+            if (gap_end > x) {
+                size_t count = (size_t)(gap_end - x) * scale * sizeof(float);
+                for (int k = 0; k < scale; k++) {
+                    size_t i = (size_t)(1 + (y - 1) * scale + k) * detail->width + 1 + (x - 1) * scale;
+                    memset(detail->prev_density + i, 0, count);
+                    memset(detail->prev_temperature + i, 0, count);
+                }
+            }
+            if (r < map->row_runs[y + 1]) x = map->run_end[r];
+        }
+    }
+}
+
+void detail_advect(DetailGrid* detail) {
+    if (!detail->width) return;
+    float* swap = detail->density;
+    detail->density = detail->prev_density;
+    detail->prev_density = swap;
+    swap = detail->temperature;
+    detail->temperature = detail->prev_temperature;
+    detail->prev_temperature = swap;
+    if (detail->amount > 0.0f) detail_update_lattice(detail);
+    if (sim->obstacles) parallel_for(1, sim->grid_height - 1, detail_clear_solids, detail);
+    parallel_for(1, sim->grid_height - 1, detail_rows, detail);
+    size_t tiles = (size_t)sim->tiles_x * sim->tiles_y;
+    if (sim->sparse_tiles) {
+        memcpy(detail->tiles, sim->tile_processed, tiles);
+    } else {
+        memset(detail->tiles, 1, tiles);
+    }
+}
+
+void detail_stamp_rows(void* ctx, int y_begin, int y_end, int thread) {
+    const DetailGrid* detail = ctx;
+    const int scale = detail->scale;
+    for (int fy = y_begin; fy < y_end; fy++) {
+        float c_y = (fy - 0.5f) / scale + 0.5f;
+        float* density = detail->density + (size_t)fy * detail->width;
+        float* temperature = detail->temperature + (size_t)fy * detail->width;
+        for (int k = 0; k < sim->stamp_count; k++) {
+            const Stamp* s = &sim->stamps[k];
+            if (!stamp_has_scalars(s) || c_y < s->y_begin - 1 || c_y > s->y_end) continue;
+            int lo = 1 + (s->x_begin - 2) * scale;
+            int hi = 1 + s->x_end * scale;
+            if (lo < 1) lo = 1;
+            if (hi > detail->width - 1) hi = detail->width - 1;
+            for (int fx = lo; fx < hi; fx++) {
+                if (s->min_density > 0.0f && density[fx] <= s->min_density) continue;
+                float push_x, push_y;
+                float weight = stamp_weight(s, (fx - 0.5f) / scale + 0.5f - s->x, c_y - s->y, &push_x, &push_y);
+                if (weight > 0.0f) stamp_scalars(s, weight, &density[fx], &temperature[fx]);
+            }
+        }
+    }
+}
+
+// The scalar part of the stamps on the fine cells, after apply_stamps()
+void detail_stamps(DetailGrid* detail) {
+    if (!detail->width) return;
+    const int scale = detail->scale;
+    int y_begin = detail->height - 1;
+    int y_end = 1;
+    for (int k = 0; k < sim->stamp_count; k++) {
+        const Stamp* s = &sim->stamps[k];
+        if (!stamp_has_scalars(s)) continue;
+        int begin = 1 + (s->y_begin - 2) * scale;
+        int end = 1 + s->y_end * scale;
+        if (begin < y_begin) y_begin = begin;
+        if (end > y_end) y_end = end;
+    }
+    if (y_begin < 1) y_begin = 1;
+    if (y_end > detail->height - 1) y_end = detail->height - 1;
+    if (y_begin < y_end) parallel_for(y_begin, y_end, detail_stamp_rows, detail);
+}
+
+uint64_t detail_hash(const DetailGrid* detail, uint64_t hash) {
+    size_t bytes = (size_t)detail->width * detail->height * sizeof(float);
+    hash = fluid_hash(hash, detail->density, bytes);
+    return fluid_hash(hash, detail->temperature, bytes);
+}
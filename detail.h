@@ -0,0 +1,58 @@
+#ifndef DETAIL_H
+#define DETAIL_H
+
+#include <stdint.h>
+
+// Density and temperature on a grid scale times finer than the flow.
+// Velocity, pressure and so the projection stay on the simulation grid;
+// with a detail grid attached the fine scalars are what the smoke is. In
+// STAGE_ADVECTION they are carried through the bilinearly upsampled
+// velocity and decayed, and each simulation cell then takes the mean of
+// its fine cells, so buoyancy and the active tiles follow the fine smoke.
+// Emitters and the scalar part of stamps write both grids.
+//
+// Fine cells map onto simulation cells interior to interior, scale of them
+// per cell on each axis. Only the fine cells under processed tiles are
+// stepped; a tile leaving the set is cleared like the coarse one.
+//
+// amount adds a procedural swirl for the flow the simulation grid cannot
+// resolve: the curl of a smooth random stream function with one lattice
+// point per simulation cell, drifting to a new pattern every DETAIL_PERIOD
+// reference steps and scaled by the resolved speed. Being a curl it moves
+// the smoke around without adding or removing any.
+//
+// Slabs do not carry a detail grid.
+
+#define DETAIL_MAX_SCALE 4
+#define DETAIL_PERIOD 30.0f          // Reference steps for the swirl to drift to a new pattern
+
+typedef struct DetailGrid {
+    int scale;                   // Fine cells per simulation cell on each axis
+    int width;                   // Fine grid including its ring; 0 when it could not follow the simulation
+    int height;
+    float* density;
+    float* temperature;
+    float* prev_density;         // The advection source, swapped with the current planes each substep
+    float* prev_temperature;
+    float amount;                // Swirl speed relative to the resolved speed; 0 for none
+
+    // Set by detail_fit()
+    int* column;                 // Per fine column: the simulation column left of its centre
+    float* weight;               // Per fine column: its position between that column and the next
+    uint8_t* tiles;              // Simulation tiles stepped last substep
+    float* lattice;              // Stream function at the simulation cells: two patterns and their blend
+    uint32_t lattice_slice;      // Pattern the first of them holds, or UINT32_MAX for none
+    void* block;
+} DetailGrid;
+
+DetailGrid* detail_create(int scale);
+void detail_destroy(DetailGrid* detail);
+int detail_fit(DetailGrid* detail);
+void detail_clear(DetailGrid* detail);
+void detail_fill(DetailGrid* detail);
+void detail_emit(DetailGrid* detail, int x, int y, float density, float temperature);
+void detail_advect(DetailGrid* detail);
+void detail_stamps(DetailGrid* detail);
+uint64_t detail_hash(const DetailGrid* detail, uint64_t hash);
+
+#endif
@@ -0,0 +1,170 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "distributed.h"
+#include "timer.h"
+
+// Rows a substep can reach across a slab edge: the backtrace, the bilinear
+// footprint and the one-cell stencils of the other passes
+int slab_halo(float cfl_limit) {
+    return (int)ceilf(cfl_limit) + 2;
+}
+
+// Splits the rows as evenly as possible. Each slab's first held row is even
+// so the red-black colouring matches the whole grid's. Returns 0 when a
+// slab would own fewer rows than its neighbours need from it.
+int slab_layout(SlabLayout* layout, int width, int height, int ranks, int halo) {
+    if (ranks < 1 || ranks > MAX_RANKS) return 0;
+    layout->width = width;
+    layout->height = height;
+    layout->ranks = ranks;
+    layout->halo = halo;
+    for (int r = 0; r <= ranks; r++) layout->own_begin[r] = (int)((long long)height * r / ranks);
+    for (int r = 0; r < ranks; r++) {
+        if (ranks > 1 && layout->own_begin[r + 1] - layout->own_begin[r] < halo + 1) return 0;
+        int origin = layout->own_begin[r] - halo;
+        layout->origin[r] = origin > 0 ? origin & ~1 : 0;
+        int end = layout->own_begin[r + 1] + halo;
+        layout->end[r] = end < height ? end : height;
+    }
+    return 1;
+}
+
+unsigned char* slab_row(SlabContext* context, void* plane, size_t element_bytes, int global_y) {
+    int origin = context->layout->origin[context->transport->rank];
+    return (unsigned char*)plane + (size_t)(global_y - origin) * context->layout->width * element_bytes;
+}
+
+// Boundaries alternate between two phases, and on each the upper rank
+// sends first, so no two ranks ever wait to send to each other. A failed
+// transfer latches context->failed for the step loop to stop on.
+void slab_exchange(Slab* slab, void* plane, size_t element_bytes) {
+    SlabContext* context = slab->context;
+    Transport* t = context->transport;
+    const SlabLayout* layout = context->layout;
+    if (context->failed) return;
+    double start = timer_seconds();
+    int rank = t->rank;
+    size_t row = (size_t)layout->width * element_bytes;
+    int ok = 1;
+    for (int phase = 0; phase < 2 && ok; phase++) {
+        if (rank > 0 && (rank - 1) % 2 == phase) {
+            int own = layout->own_begin[rank];
+            ok = t->recv(t, rank - 1, slab_row(context, plane, element_bytes, layout->origin[rank]),
+                         (own - layout->origin[rank]) * row) &&
+                 t->send(t, rank - 1, slab_row(context, plane, element_bytes, own),
+                         (layout->end[rank - 1] - own) * row);
+        }
+        if (ok && rank < layout->ranks - 1 && rank % 2 == phase) {
+            int next = layout->own_begin[rank + 1];
+            ok = t->send(t, rank + 1, slab_row(context, plane, element_bytes, layout->origin[rank + 1]),
+                         (next - layout->origin[rank + 1]) * row) &&
+                 t->recv(t, rank + 1, slab_row(context, plane, element_bytes, next),
+                         (layout->end[rank] - next) * row);
+        }
+    }
+    if (!ok) context->failed = 1;
+    context->exchange_seconds += timer_seconds() - start;
+    context->exchanges++;
+}
+
+float slab_reduce_max(Slab* slab, float value) {
+    SlabContext* context = slab->context;
+    double start = timer_seconds();
+    value = transport_max(context->transport, value);
+    context->exchange_seconds += timer_seconds() - start;
+    return value;
+}
+
+// Makes the calling thread's simulation this rank's slab of the layout and
+// clears it. The slab steps densely with the Gauss-Seidel solvers.
+int slab_attach(SlabContext* context, Transport* transport, const SlabLayout* layout) {
+    int rank = transport->rank;
+    *context = (SlabContext){
+        .slab = {
+            .own_begin = layout->own_begin[rank] - layout->origin[rank],
+            .own_end = layout->own_begin[rank + 1] - layout->origin[rank],
+            .exchange = slab_exchange,
+            .reduce_max = slab_reduce_max,
+            .context = context,
+        },
+        .transport = transport,
+        .layout = layout,
+    };
+    sim->sparse_tiles = 0;
+    sim->pressure_solver = PRESSURE_SOLVER_GAUSS_SEIDEL;
+    sim->viscosity_solver = VISCOSITY_SOLVER_GAUSS_SEIDEL;
+    sim->origin_y = layout->origin[rank];
+    sim->slab = NULL;
+    if (!fluid_resize(layout->width, layout->end[rank] - layout->origin[rank])) return 0;
+    sim->slab = &context->slab;
+    return 1;
+}
+
+// fluid_checksum() of the whole grid into checksum on rank 0, which hashes
+// every slab's owned rows in order. Returns 0 if the transfer fails.
+int slab_checksum(SlabContext* context, uint64_t* checksum) {
+    Transport* t = context->transport;
+    const SlabLayout* layout = context->layout;
+    size_t stored = storage_bytes(sim->scalar_storage);
+    void* planes[4] = {sim->scalars.density, sim->scalars.temperature, sim->fields.velocity_x, sim->fields.velocity_y};
+    size_t element[4] = {stored, stored, sizeof(float), sizeof(float)};
+    uint64_t hash = FLUID_HASH_SEED;
+    unsigned char* buffer = NULL;
+    if (t->rank == 0) {
+        int rows = 0;
+        for (int r = 0; r < layout->ranks; r++) {
+            int owned = layout->own_begin[r + 1] - layout->own_begin[r];
+            rows = owned > rows ? owned : rows;
+        }
+        buffer = malloc((size_t)rows * layout->width * sizeof(float));
+        if (!buffer) return 0;
+    }
+    for (int p = 0; p < 4; p++) {
+        size_t row = (size_t)layout->width * element[p];
+        for (int r = 0; r < layout->ranks; r++) {
+            size_t bytes = (layout->own_begin[r + 1] - layout->own_begin[r]) * row;
+            if (t->rank == 0 && r == 0) {
+                hash = fluid_hash(hash, slab_row(context, planes[p], element[p], layout->own_begin[0]), bytes);
+            } else if (t->rank == 0) {
+                if (!t->recv(t, r, buffer, bytes)) {
+                    free(buffer);
+                    return 0;
+                }
+                hash = fluid_hash(hash, buffer, bytes);
+            } else if (t->rank == r) {
+                if (!t->send(t, 0, slab_row(context, planes[p], element[p], layout->own_begin[r]), bytes)) return 0;
+            }
+        }
+    }
+    free(buffer);
+    *checksum = hash;
+    return 1;
+}
+
+// Assembles a whole plane, as floats, into out on rank 0; out is unused
+// elsewhere. Returns 0 if the transfer fails.
+int slab_gather(SlabContext* context, const void* plane, float* out) {
+    Transport* t = context->transport;
+    const SlabLayout* layout = context->layout;
+    int rank = t->rank;
+    int local_begin = context->slab.own_begin;
+    int owned = context->slab.own_end - context->slab.own_begin;
+    if (rank == 0) {
+        fluid_read_cells(plane, IX(0, local_begin), owned * layout->width,
+                         out + (size_t)layout->own_begin[0] * layout->width);
+        for (int r = 1; r < layout->ranks; r++) {
+            size_t cells = (size_t)(layout->own_begin[r + 1] - layout->own_begin[r]) * layout->width;
+            if (!t->recv(t, r, out + (size_t)layout->own_begin[r] * layout->width, cells * sizeof(float))) return 0;
+        }
+        return 1;
+    }
+    float* rows = malloc((size_t)owned * layout->width * sizeof(float));
+    if (!rows) return 0;
+    fluid_read_cells(plane, IX(0, local_begin), owned * layout->width, rows);
+    int ok = t->send(t, 0, rows, (size_t)owned * layout->width * sizeof(float));
+    free(rows);
+    return ok;
+}
@@ -0,0 +1,44 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <stdint.h>
+
+#include "fluid.h"
+#include "transport.h"
+
+// A grid split into horizontal slabs, one per rank. Each rank simulates its
+// owned rows plus a halo of the neighbours' rows deep enough for one pass:
+// the furthest a substep backtraces (the CFL limit) plus the stencils. The
+// halos are refreshed after every pass, and after every iteration of the
+// red-black solvers, so a run matches the single-process one bit for bit
+// as long as no substep exceeds the CFL limit.
+//
+// The multigrid and spectral solvers need the whole grid at once, so the
+// slabs use Gauss-Seidel for both pressure and viscosity, and step densely.
+
+typedef struct {
+    int width;                   // Global grid, boundary ring included
+    int height;
+    int ranks;
+    int halo;
+    int own_begin[MAX_RANKS + 1];    // Global rows owned by rank r: own_begin[r]..own_begin[r + 1] - 1
+    int origin[MAX_RANKS];           // Global rows held by rank r, halo included
+    int end[MAX_RANKS];
+} SlabLayout;
+
+typedef struct {
+    Slab slab;
+    Transport* transport;
+    const SlabLayout* layout;
+    double exchange_seconds;
+    long long exchanges;
+    int failed;                  // A halo transfer failed; the halos are stale and later exchanges are skipped
+} SlabContext;
+
+int slab_halo(float cfl_limit);
+int slab_layout(SlabLayout* layout, int width, int height, int ranks, int halo);
+int slab_attach(SlabContext* context, Transport* transport, const SlabLayout* layout);
+int slab_checksum(SlabContext* context, uint64_t* checksum);
+int slab_gather(SlabContext* context, const void* plane, float* out);
+
+#endif
@@ -0,0 +1,3203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <cpuid.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#include "detail.h"
+#include "fluid.h"
+#include "obstacles.h"
+#include "particles.h"
+#include "profile.h"
+#include "rng.h"
+
+#define MOUSE_RADIUS 50
+#define MULTIGRID_COARSEST 8
+#define MULTIGRID_PRE_SWEEPS 2
+#define MULTIGRID_POST_SWEEPS 2
+#define MULTIGRID_COARSE_SWEEPS 32
+#define CURL_CELL 16             // Cells per curl-noise lattice cell
+#define CURL_PERIOD 40.0f        // Reference steps for the curl field to drift to a new pattern
+#define CURL_AMOUNT 0.02f        // Curl-noise kick per reference step, roughly cells per step
+#define TILE_EPSILON 1e-3f       // Density or temperature that keeps a tile active
+#define TILE_SPEED 1.0f          // Cells per step that wake a tile; turbulence alone stays below
+#define PLUME_EPSILON 1e-2f      // Density that counts towards the plume height
+#define DENSITY_RANGE 16.0f      // Densest smoke the fixed-point storage holds
+#define TEMPERATURE_RANGE 2.0f   // Hottest, likewise; the emitters stay below 1.2
+#define CELL_CHUNK 256           // Cells converted at a time by the compact passes
+
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+// Settings every simulation starts with
+#define SIMULATION_DEFAULTS {                             \
+    .params = DEFAULT_FLUID_PARAMS,                       \
+    .pressure_solver = PRESSURE_SOLVER_MULTIGRID,         \
+    .viscosity_solver = VISCOSITY_SOLVER_GAUSS_SEIDEL,    \
+    .effort = DEFAULT_SOLVER_EFFORT,                      \
+    .sparse_tiles = 1,                                    \
+    .cfl_limit = DEFAULT_CFL,                             \
+    .max_substeps = DEFAULT_MAX_SUBSTEPS,                 \
+    .substep = 1.0f,                                      \
+    .noise_seed = 1,                                      \
+    .turbulence_mode = TURBULENCE_WHITE,                  \
+    .emission_density_amount = 0.25f,                     \
+}
+
+Simulation default_simulation = SIMULATION_DEFAULTS;
+_Thread_local Simulation* sim = &default_simulation;
+
+const char* fluid_param_names[FLUID_PARAM_COUNT] = {
+    "buoyancy", "turbulence_amount", "vorticity_strength", "density_decay", "temperature_decay", "mouse_force"
+};
+
+const char* pressure_solver_names[PRESSURE_SOLVER_COUNT] = {"Gauss-Seidel", "Multigrid", "Spectral"};
+const char* viscosity_solver_names[VISCOSITY_SOLVER_COUNT] = {"Gauss-Seidel", "Spectral"};
+// How the command lines spell the solvers
+const char* pressure_solver_options[PRESSURE_SOLVER_COUNT] = {"gauss-seidel", "multigrid", "spectral"};
+const char* viscosity_solver_options[VISCOSITY_SOLVER_COUNT] = {"gauss-seidel", "spectral"};
+const char* simd_level_names[SIMD_LEVEL_COUNT] = {"scalar", "sse4.1", "avx2"};
+SimdLevel simd_level = SIMD_SCALAR;
+
+const char* stage_names[STAGE_COUNT] = {
+    "tiles", "advection", "forces", "vorticity", "viscosity",
+    "divergence", "pressure_solve", "pressure_apply", "damping", "particles"
+};
+
+// Philox counter words: the cell or lattice point, the step, the stream
+enum {
+    NOISE_STREAM_TURBULENCE,
+    NOISE_STREAM_EMISSION,
+    NOISE_STREAM_CURL
+};
+
+const char* turbulence_mode_names[TURBULENCE_MODE_COUNT] = {"white", "curl"};
+const char* stamp_shape_names[STAMP_SHAPE_COUNT] = {"radial", "directional", "vortex", "line", "box"};
+const char* field_storage_names[FIELD_STORAGE_COUNT] = {"float32", "float16", "fixed16", "fixed8"};
+
+// Seeds every random draw and restarts the step count. Runs with the same
+// seed, grid and inputs match bit for bit on any platform and thread count.
+void fluid_seed(uint32_t seed) {
+    sim->noise_seed = seed;
+    sim->noise_step = 0;
+    sim->noise_time = 0.0f;
+}
+
+Philox4x32 noise_draw(uint32_t index, uint32_t stream) {
+    return philox4x32(index + sim->cell_origin, sim->noise_step, stream, 0, sim->noise_seed, 0);
+}
+
+// Exchange the front and back buffers instead of copying the state
+void swap_fields() {
+    FieldSet tmp = sim->fields;
+    sim->fields = sim->prev_fields;
+    sim->prev_fields = tmp;
+    ScalarSet stored = sim->scalars;
+    sim->scalars = sim->prev_scalars;
+    sim->prev_scalars = stored;
+}
+
+size_t align64(size_t bytes) {
+    return (bytes + 63) & ~(size_t)63;
+}
+
+void* arena_alloc(Arena* a, size_t bytes) {
+    void* p = a->base + a->used;
+    a->used += align64(bytes);
+    return p;
+}
+
+size_t plane_bytes(int width, int height) {
+    return align64((size_t)width * height * sizeof(float));
+}
+
+// Reduced-precision scalars. Each compact store converts from fp32 once;
+// every pass loads to fp32, computes and stores back, so the rounding never
+// compounds within a pass.
+size_t storage_bytes(FieldStorage storage) {
+    return storage == FIELD_STORAGE_FLOAT32 ? sizeof(float) : storage == FIELD_STORAGE_FIXED8 ? 1 : 2;
+}
+
+// All state planes in arena order; the density and temperature ones are
+// stored in the simulation's scalar_storage
+size_t state_bytes(int width, int height) {
+    size_t scalar = align64((size_t)width * height * storage_bytes(sim->scalar_storage));
+    return 4 * scalar + (PLANE_COUNT - 4) * plane_bytes(width, height);
+}
+
+int is_scalar_plane(int plane) {
+    return plane == PLANE_DENSITY_0 || plane == PLANE_TEMPERATURE_0 ||
+           plane == PLANE_DENSITY_1 || plane == PLANE_TEMPERATURE_1;
+}
+
+// Value of one fixed-point step of field
+float storage_step(FieldStorage storage, int field) {
+    float range = field == SCALAR_DENSITY ? DENSITY_RANGE : TEMPERATURE_RANGE;
+    return range / (storage == FIELD_STORAGE_FIXED8 ? 255.0f : 65535.0f);
+}
+
+float storage_inv_step(FieldStorage storage, int field) {
+    float range = field == SCALAR_DENSITY ? DENSITY_RANGE : TEMPERATURE_RANGE;
+    return (storage == FIELD_STORAGE_FIXED8 ? 255.0f : 65535.0f) / range;
+}
+
+// Where a compact store happens. Two stores to one cell in the same step
+// get independent rounding noise as long as they come from different sites.
+enum {
+    DITHER_ADVECT,
+    DITHER_DECAY,
+    DITHER_EMIT,
+    DITHER_RING,
+    DITHER_LOAD,
+    DITHER_SITE_COUNT
+};
+
+uint32_t dither_key(int field, int site) {
+    return sim->noise_seed * 0x9E3779B1u ^ sim->noise_step * 0x632BE5ABu ^
+           (uint32_t)(field * DITHER_SITE_COUNT + site + 1) * 0x2545F491u;
+}
+
+// Uniform in [0, 1) per cell and key: the fixed-point stores add it before
+// truncating, which rounds up with probability equal to the remainder
+ALWAYS_INLINE float dither_unit(uint32_t i, uint32_t key) {
+    uint32_t h = ((i + sim->cell_origin) ^ key) * 0x9E3779B1u;
+    h ^= h >> 15;
+    h *= 0x85EBCA77u;
+    h ^= h >> 13;
+    return (float)(h >> 8) * (1.0f / 16777216.0f);
+}
+
+// IEEE half precision, round to nearest even like F16C
+ALWAYS_INLINE uint16_t float_to_half(float value) {
+    uint32_t f;
+    memcpy(&f, &value, sizeof(f));
+    uint32_t sign = (f >> 16) & 0x8000u;
+    f &= 0x7fffffffu;
+    uint16_t h;
+    if (f >= (127u + 16u) << 23) {
+        h = f > 255u << 23 ? 0x7e00 : 0x7c00;
+    } else if (f < 113u << 23) {
+        // Subnormal: the float add aligns the mantissa and rounds it
+        const uint32_t magic_bits = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+        float magic, scaled;
+        memcpy(&magic, &magic_bits, sizeof(magic));
+        memcpy(&scaled, &f, sizeof(scaled));
+        scaled += magic;
+        memcpy(&f, &scaled, sizeof(f));
+        h = (uint16_t)(f - magic_bits);
+    } else {
+        uint32_t odd = (f >> 13) & 1u;
+        f += ((uint32_t)(15 - 127) << 23) + 0xfffu + odd;
+        h = (uint16_t)(f >> 13);
+    }
+    return h | (uint16_t)sign;
+}
+
+ALWAYS_INLINE float half_to_float(uint16_t h) {
+    const uint32_t magic_bits = 113u << 23;
+    uint32_t f = (uint32_t)(h & 0x7fffu) << 13;
+    uint32_t exponent = f & (0x7c00u << 13);
+    f += (127u - 15u) << 23;
+    if (exponent == 0x7c00u << 13) {
+        f += (128u - 16u) << 23;
+    } else if (exponent == 0) {
+        float magic, value;
+        memcpy(&magic, &magic_bits, sizeof(magic));
+        f += 1u << 23;
+        memcpy(&value, &f, sizeof(value));
+        value -= magic;
+        memcpy(&f, &value, sizeof(f));
+    }
+    f |= (uint32_t)(h & 0x8000u) << 16;
+    float value;
+    memcpy(&value, &f, sizeof(value));
+    return value;
+}
+
+// Cell i of a plane in storage, as fp32; step is storage_step() for the
+// fixed-point formats. Callers pass storage as a constant.
+ALWAYS_INLINE float scalar_get(const void* plane, int i, const int storage, float step) {
+    switch (storage) {
+    case FIELD_STORAGE_FLOAT16: return half_to_float(((const uint16_t*)plane)[i]);
+    case FIELD_STORAGE_FIXED16: return ((const uint16_t*)plane)[i] * step;
+    case FIELD_STORAGE_FIXED8: return ((const uint8_t*)plane)[i] * step;
+    default: return ((const float*)plane)[i];
+    }
+}
+
+// Stores value into cell i, saturating the fixed-point formats at 0 and
+// their range; those add dither, in [0, 1), before truncating. NaN stores
+// as 0.
+ALWAYS_INLINE void scalar_put(void* plane, int i, float value, const int storage, float inv_step, float dither) {
+    float q;
+    switch (storage) {
+    case FIELD_STORAGE_FLOAT16:
+        ((uint16_t*)plane)[i] = float_to_half(value);
+        break;
+    case FIELD_STORAGE_FIXED16:
+        q = value * inv_step + dither;
+        ((uint16_t*)plane)[i] = q > 0.0f ? q < 65536.0f ? (uint16_t)q : 65535 : 0;
+        break;
+    case FIELD_STORAGE_FIXED8:
+        q = value * inv_step + dither;
+        ((uint8_t*)plane)[i] = q > 0.0f ? q < 256.0f ? (uint8_t)q : 255 : 0;
+        break;
+    default:
+        ((float*)plane)[i] = value;
+        break;
+    }
+}
+
+// Copies cell from to cell to without converting
+ALWAYS_INLINE void scalar_copy(void* plane, int to, int from, const int storage) {
+    switch (storage) {
+    case FIELD_STORAGE_FLOAT16:
+    case FIELD_STORAGE_FIXED16: ((uint16_t*)plane)[to] = ((const uint16_t*)plane)[from]; break;
+    case FIELD_STORAGE_FIXED8: ((uint8_t*)plane)[to] = ((const uint8_t*)plane)[from]; break;
+    default: ((float*)plane)[to] = ((const float*)plane)[from]; break;
+    }
+}
+
+// Expands the body once per scalar storage, with STORAGE a constant
+#define STORAGE_CASE(s, ...) case s: { enum { STORAGE = s }; __VA_ARGS__; break; }
+#define STORAGE_DISPATCH(...)                                \
+    switch (sim->scalar_storage) {                           \
+    STORAGE_CASE(FIELD_STORAGE_FLOAT16, __VA_ARGS__)         \
+    STORAGE_CASE(FIELD_STORAGE_FIXED16, __VA_ARGS__)         \
+    STORAGE_CASE(FIELD_STORAGE_FIXED8, __VA_ARGS__)          \
+    default: { enum { STORAGE = FIELD_STORAGE_FLOAT32 }; __VA_ARGS__; break; } \
+    }
+
+ALWAYS_INLINE void load_cells_s(const void* plane, int field, int begin, int count, float* out, const int storage) {
+    float step = storage_step(storage, field);
+    for (int k = 0; k < count; k++) out[k] = scalar_get(plane, begin + k, storage, step);
+}
+
+// Loads round to nearest instead, so fp32 copies of stored values, such as
+// checkpoints, convert back to exactly what was stored
+ALWAYS_INLINE void store_cells_s(void* plane, int field, int begin, int count, const float* in, int site, const int storage) {
+    float inv_step = storage_inv_step(storage, field);
+    uint32_t key = dither_key(field, site);
+    for (int k = 0; k < count; k++) {
+        float dither = site == DITHER_LOAD ? 0.5f : dither_unit(begin + k, key);
+        scalar_put(plane, begin + k, in[k], storage, inv_step, dither);
+    }
+}
+
+typedef void (*CellLoader)(const void* plane, int field, int begin, int count, float* out);
+typedef void (*CellStorer)(void* plane, int field, int begin, int count, const float* in, int site);
+
+void load_cells(const void* plane, int field, int begin, int count, float* out) {
+    STORAGE_DISPATCH(load_cells_s(plane, field, begin, count, out, STORAGE));
+}
+
+void store_cells(void* plane, int field, int begin, int count, const float* in, int site) {
+    STORAGE_DISPATCH(store_cells_s(plane, field, begin, count, in, site, STORAGE));
+}
+
+// Convert runs of a scalar plane of the current simulation to and from fp32
+CellLoader load_cells_kernel = load_cells;
+CellStorer store_cells_kernel = store_cells;
+
+void* scalar_plane(const ScalarSet* set, int field) {
+    return field == SCALAR_DENSITY ? set->density : set->temperature;
+}
+
+float read_scalar(int field, int i) {
+    float value;
+    load_cells_kernel(scalar_plane(&sim->scalars, field), field, i, 1, &value);
+    return value;
+}
+
+void write_scalar(int field, int i, float value, int site) {
+    store_cells_kernel(scalar_plane(&sim->scalars, field), field, i, 1, &value, site);
+}
+
+// Cells x_begin..x_end of row y of a current scalar, indexed by x: the plane
+// itself when it is fp32, otherwise converted into row
+const float* scalar_row(int field, float* row, int y, int x_begin, int x_end) {
+    const void* plane = scalar_plane(&sim->scalars, field);
+    if (sim->scalar_storage == FIELD_STORAGE_FLOAT32) return (const float*)plane + IX(0, y);
+    if (x_begin < x_end) load_cells_kernel(plane, field, IX(x_begin, y), x_end - x_begin, row + x_begin);
+    return row;
+}
+
+// The scalar plane is one of the current simulation's compact density or
+// temperature planes, or -1 for an fp32 plane
+int stored_field(const void* plane) {
+    if (sim->scalar_storage == FIELD_STORAGE_FLOAT32) return -1;
+    if (plane == sim->scalars.density || plane == sim->prev_scalars.density) return SCALAR_DENSITY;
+    if (plane == sim->scalars.temperature || plane == sim->prev_scalars.temperature) return SCALAR_TEMPERATURE;
+    return -1;
+}
+
+// Copies count cells of any state plane of the current simulation, from
+// cell begin on, as fp32 whatever its storage
+void fluid_read_cells(const void* plane, int begin, int count, float* out) {
+    int field = stored_field(plane);
+    if (field < 0) {
+        memcpy(out, (const float*)plane + begin, (size_t)count * sizeof(float));
+    } else {
+        load_cells_kernel(plane, field, begin, count, out);
+    }
+}
+
+void fluid_write_cells(void* plane, int begin, int count, const float* in) {
+    int field = stored_field(plane);
+    if (field < 0) {
+        memcpy((float*)plane + begin, in, (size_t)count * sizeof(float));
+    } else {
+        store_cells_kernel(plane, field, begin, count, in, DITHER_LOAD);
+    }
+}
+
+void init_grid() {
+    int compact = sim->scalar_storage != FIELD_STORAGE_FLOAT32;
+    sim->fields = (FieldSet){
+        compact ? NULL : sim->field_planes[PLANE_DENSITY_0],
+        compact ? NULL : sim->field_planes[PLANE_TEMPERATURE_0],
+        sim->field_planes[PLANE_VELOCITY_X_0],
+        sim->field_planes[PLANE_VELOCITY_Y_0]
+    };
+    sim->prev_fields = (FieldSet){
+        compact ? NULL : sim->field_planes[PLANE_DENSITY_1],
+        compact ? NULL : sim->field_planes[PLANE_TEMPERATURE_1],
+        sim->field_planes[PLANE_VELOCITY_X_1],
+        sim->field_planes[PLANE_VELOCITY_Y_1]
+    };
+    sim->scalars = (ScalarSet){sim->field_planes[PLANE_DENSITY_0], sim->field_planes[PLANE_TEMPERATURE_0]};
+    sim->prev_scalars = (ScalarSet){sim->field_planes[PLANE_DENSITY_1], sim->field_planes[PLANE_TEMPERATURE_1]};
+    memset(sim->field_planes[0], 0, state_bytes(sim->grid_width, sim->grid_height));
+    memset(sim->tile_active, 0, (size_t)sim->tiles_x * sim->tiles_y);
+    memset(sim->tile_processed, 0, (size_t)sim->tiles_x * sim->tiles_y);
+    sim->max_speed = 0.0f;
+    sim->noise_step = 0;
+    sim->noise_time = 0.0f;
+    if (sim->particles) particles_clear(sim->particles);
+    if (sim->detail) detail_clear(sim->detail);
+}
+
+void add_smoke(int x, int y) {
+    if (x >= 0 && x < sim->grid_width && y >= 0 && y < sim->grid_height) {
+        int i = IX(x, y);
+        Philox4x32 r = noise_draw(i, NOISE_STREAM_EMISSION);
+        float density = read_scalar(SCALAR_DENSITY, i) + sim->emission_density_amount * sim->substep;
+        float temperature = 1.0f + 0.2f * rng_signed(r.v[0]);
+        if (temperature < 0.5f) temperature = 0.5f;
+        write_scalar(SCALAR_DENSITY, i, density, DITHER_EMIT);
+        write_scalar(SCALAR_TEMPERATURE, i, temperature, DITHER_EMIT);
+        
+        // Add more dynamic initial velocity
+        float angle = 2 * 3.14159f * rng_unit(r.v[1]);
+        float speed = 0.3f + 0.4f * rng_unit(r.v[2]);
+        sim->fields.velocity_y[i] = -0.5f + speed * sinf(angle);
+        sim->fields.velocity_x[i] = speed * cosf(angle);
+        if (sim->particles) particles_spawn(sim->particles, x, y, r.v[3]);
+        if (sim->detail) detail_emit(sim->detail, x, y, sim->emission_density_amount * sim->substep, temperature);
+    }
+}
+
+// Stepped candle-flame emitter whose base row is centred on (x, y)
+void add_candle(int x, int y) {
+    // Candle base
+    for (int i = -3; i <= 3; i++) {
+        add_smoke(x + i, y);
+    }
+
+    // Candle middle
+    for (int i = -2; i <= 2; i++) {
+        add_smoke(x + i, y - 1);
+    }
+
+    // Candle top
+    for (int i = -1; i <= 1; i++) {
+        add_smoke(x + i, y - 2);
+    }
+
+    // Candle tip
+    add_smoke(x, y - 3);
+}
+
+// Cell index of a stamp coordinate, kept in int range
+int stamp_cell(float v) {
+    return (int)floorf(fmaxf(-16777216.0f, fminf(16777216.0f, v)));
+}
+
+// Every cell whose centre the stamp can reach, before clipping
+void stamp_bounds(Stamp* stamp) {
+    float reach = stamp->shape == STAMP_BOX ? 0.0f : stamp->radius;
+    float x2 = stamp->shape >= STAMP_LINE ? stamp->x2 : stamp->x;
+    float y2 = stamp->shape >= STAMP_LINE ? stamp->y2 : stamp->y;
+    stamp->x_begin = -stamp_cell(-(fminf(stamp->x, x2) - reach));
+    stamp->x_end = stamp_cell(fmaxf(stamp->x, x2) + reach) + 1;
+    stamp->y_begin = -stamp_cell(-(fminf(stamp->y, y2) - reach));
+    stamp->y_end = stamp_cell(fmaxf(stamp->y, y2) + reach) + 1;
+}
+
+// Adds a stamp to the batch applied every substep. Returns 0 when the batch
+// is full or the stamp has no shape or radius.
+int stamp_add(const Stamp* stamp) {
+    if (sim->stamp_count == MAX_STAMPS || stamp->shape < 0 || stamp->shape >= STAMP_SHAPE_COUNT) return 0;
+    if (stamp->shape != STAMP_BOX && !(stamp->radius > 0.0f)) return 0;
+    Stamp s = *stamp;
+    float length = sqrtf(s.dir_x * s.dir_x + s.dir_y * s.dir_y);
+    s.dir_x = length > 0.0f ? s.dir_x / length : 0.0f;
+    s.dir_y = length > 0.0f ? s.dir_y / length : 0.0f;
+    stamp_bounds(&s);
+    sim->stamps[sim->stamp_count++] = s;
+    return 1;
+}
+
+void stamps_clear() {
+    sim->stamp_count = 0;
+}
+
+// Follows fluid_rescale() like the tracers; radii take the mean scale
+void stamps_rescale(float scale_x, float scale_y) {
+    for (int k = 0; k < sim->stamp_count; k++) {
+        Stamp* s = &sim->stamps[k];
+        s->x = (s->x - 0.5f) * scale_x + 0.5f;
+        s->y = (s->y - 0.5f) * scale_y + 0.5f;
+        s->x2 = (s->x2 - 0.5f) * scale_x + 0.5f;
+        s->y2 = (s->y2 - 0.5f) * scale_y + 0.5f;
+        s->radius *= 0.5f * (scale_x + scale_y);
+        stamp_bounds(s);
+    }
+}
+
+// The mouse push: smoke denser than 0.1 within MOUSE_RADIUS cells of (x, y)
+// is pushed away from it by the mouse_force parameter
+Stamp mouse_stamp(int x, int y) {
+    return (Stamp){
+        .shape = STAMP_RADIAL, .x = x, .y = y, .radius = MOUSE_RADIUS,
+        .force = sim->params.mouse_force, .min_density = 0.1f
+    };
+}
+
+// Parses "shape:name=value,...", shape from stamp_shape_names and names as
+// in Stamp from x to min_density. Returns 0 on a malformed description.
+int stamp_parse(const char* text, Stamp* stamp) {
+    static const char* names[] = {
+        "x", "y", "x2", "y2", "radius", "force", "dir_x", "dir_y",
+        "density", "temperature", "drain", "min_density"
+    };
+    float* values[] = {
+        &stamp->x, &stamp->y, &stamp->x2, &stamp->y2, &stamp->radius, &stamp->force, &stamp->dir_x,
+        &stamp->dir_y, &stamp->density, &stamp->temperature, &stamp->drain, &stamp->min_density
+    };
+    const int count = sizeof(names) / sizeof(names[0]);
+    const char* colon = strchr(text, ':');
+    size_t length = colon ? (size_t)(colon - text) : strlen(text);
+    int shape = -1;
+    for (int k = 0; k < STAMP_SHAPE_COUNT; k++) {
+        if (strlen(stamp_shape_names[k]) == length && strncmp(text, stamp_shape_names[k], length) == 0) shape = k;
+    }
+    if (shape < 0) return 0;
+    *stamp = (Stamp){.shape = shape, .radius = STAMP_DEFAULT_RADIUS};
+    for (const char* p = colon ? colon + 1 : ""; *p;) {
+        const char* equals = strchr(p, '=');
+        if (!equals) return 0;
+        int field = -1;
+        for (int k = 0; k < count; k++) {
+            if (strlen(names[k]) == (size_t)(equals - p) && strncmp(p, names[k], equals - p) == 0) field = k;
+        }
+        char* end;
+        float value = strtof(equals + 1, &end);
+        if (field < 0 || end == equals + 1 || (*end && *end != ',')) return 0;
+        *values[field] = value;
+        p = *end ? end + 1 : end;
+    }
+    return 1;
+}
+
+// Sparse tiles. The grid is cut into TILE_SIZE squares; at the start of each
+// step update_tiles() marks the ones holding smoke, heat or fast flow as
+// active and grows that set by one tile into tile_processed. Advection, the
+// forces, decay and rendering only visit processed tiles: smoke cannot leave
+// them within one step unless it moves faster than a tile per step.
+// Velocity outside is still projected, diffused and confined by the dense
+// passes; advection just carries it over unchanged. Tiles that drop out of
+// the processed set hold less than TILE_EPSILON and are cleared, which keeps
+// them exactly empty until smoke arrives again.
+typedef void (*SpanKernel)(int y, int x_begin, int x_end);
+
+// Runs active over the processed runs of each row and inactive, if any,
+// over the rest. Spans cover the interior, or the whole row with ring set.
+typedef struct {
+    SpanKernel active;
+    SpanKernel inactive;
+    int ring;
+} SparseSweep;
+
+void sparse_rows(void* ctx, int y_begin, int y_end, int thread) {
+    const SparseSweep* sweep = ctx;
+    int lo = sweep->ring ? 0 : 1;
+    int hi = sweep->ring ? sim->grid_width : sim->grid_width - 1;
+    for (int y = y_begin; y < y_end; y++) {
+        const uint8_t* tiles = &sim->tile_processed[(y / TILE_SIZE) * sim->tiles_x];
+        int tx = 0;
+        while (tx < sim->tiles_x) {
+            int run = tx + 1;
+            while (run < sim->tiles_x && tiles[run] == tiles[tx]) run++;
+            int x_begin = tx * TILE_SIZE > lo ? tx * TILE_SIZE : lo;
+            int x_end = run * TILE_SIZE < hi ? run * TILE_SIZE : hi;
+            SpanKernel span = tiles[tx] ? sweep->active : sweep->inactive;
+            if (span && x_begin < x_end) span(y, x_begin, x_end);
+            tx = run;
+        }
+    }
+}
+
+void sparse_for(SpanKernel active, SpanKernel inactive, int ring) {
+    SparseSweep sweep = {active, inactive, ring};
+    parallel_for(ring ? 0 : 1, ring ? sim->grid_height : sim->grid_height - 1, sparse_rows, &sweep);
+}
+
+// Whether any cell of each tile-wide run of a row is above the thresholds.
+// The planes are rows of the grid, indexed by x.
+typedef struct {
+    const float* density;
+    const float* temperature;
+    const float* velocity_x;
+    const float* velocity_y;
+} RowPlanes;
+
+uint8_t tile_run_flag(const RowPlanes* row, int x, int count) {
+    const float speed2 = TILE_SPEED * TILE_SPEED;
+    int any = 0;
+    for (int k = x; k < x + count; k++) {
+        float vx = row->velocity_x[k];
+        float vy = row->velocity_y[k];
+        any |= (row->density[k] > TILE_EPSILON) | (row->temperature[k] > TILE_EPSILON) |
+               (vx * vx + vy * vy > speed2);
+    }
+    return (uint8_t)any;
+}
+
+void tile_flag_rows(void* ctx, int y_begin, int y_end, int thread) {
+    int full = sim->grid_width / TILE_SIZE;
+    float density[MAX_GRID_SIZE];
+    float temperature[MAX_GRID_SIZE];
+    for (int y = y_begin; y < y_end; y++) {
+        uint8_t* flags = &sim->tile_row_flags[y * sim->tiles_x];
+        RowPlanes row = {
+            scalar_row(SCALAR_DENSITY, density, y, 0, sim->grid_width),
+            scalar_row(SCALAR_TEMPERATURE, temperature, y, 0, sim->grid_width),
+            sim->fields.velocity_x + IX(0, y),
+            sim->fields.velocity_y + IX(0, y)
+        };
+        // A constant count lets the compiler vectorise the full tiles
+        for (int tx = 0; tx < full; tx++) flags[tx] = tile_run_flag(&row, tx * TILE_SIZE, TILE_SIZE);
+        if (full < sim->tiles_x) flags[full] = tile_run_flag(&row, full * TILE_SIZE, sim->grid_width - full * TILE_SIZE);
+    }
+}
+
+void clear_tile(int tx, int ty) {
+    int x_end = (tx + 1) * TILE_SIZE < sim->grid_width ? (tx + 1) * TILE_SIZE : sim->grid_width;
+    int y_end = (ty + 1) * TILE_SIZE < sim->grid_height ? (ty + 1) * TILE_SIZE : sim->grid_height;
+    size_t element = storage_bytes(sim->scalar_storage);
+    for (int y = ty * TILE_SIZE; y < y_end; y++) {
+        size_t bytes = (size_t)(x_end - tx * TILE_SIZE) * element;
+        size_t offset = (size_t)IX(tx * TILE_SIZE, y) * element;
+        memset((char*)sim->scalars.density + offset, 0, bytes);
+        memset((char*)sim->scalars.temperature + offset, 0, bytes);
+    }
+}
+
+void update_tiles() {
+    parallel_for(0, sim->grid_height, tile_flag_rows, NULL);
+
+    int active_count = 0;
+    for (int ty = 0; ty < sim->tiles_y; ty++) {
+        int y_end = (ty + 1) * TILE_SIZE < sim->grid_height ? (ty + 1) * TILE_SIZE : sim->grid_height;
+        for (int tx = 0; tx < sim->tiles_x; tx++) {
+            uint8_t any = 0;
+            for (int y = ty * TILE_SIZE; y < y_end; y++) any |= sim->tile_row_flags[y * sim->tiles_x + tx];
+            sim->tile_active[ty * sim->tiles_x + tx] = any;
+            active_count += any;
+        }
+    }
+
+    for (int ty = 0; ty < sim->tiles_y; ty++) {
+        for (int tx = 0; tx < sim->tiles_x; tx++) {
+            uint8_t near = 0;
+            for (int ny = ty - 1; ny <= ty + 1; ny++) {
+                for (int nx = tx - 1; nx <= tx + 1; nx++) {
+                    if (nx >= 0 && nx < sim->tiles_x && ny >= 0 && ny < sim->tiles_y) near |= sim->tile_active[ny * sim->tiles_x + nx];
+                }
+            }
+            uint8_t* processed = &sim->tile_processed[ty * sim->tiles_x + tx];
+            if (*processed && !near) clear_tile(tx, ty);
+            *processed = near;
+        }
+    }
+    profile_counter("active_tiles", active_count);
+}
+
+size_t tile_bytes(int width, int height) {
+    int nx = (width + TILE_SIZE - 1) / TILE_SIZE;
+    int ny = (height + TILE_SIZE - 1) / TILE_SIZE;
+    return 2 * align64((size_t)nx * ny) + align64((size_t)height * nx);
+}
+
+// b == 1 mirrors velocity_x at the left/right walls, b == 2 mirrors velocity_y
+// at the top/bottom walls, b == 0 copies the neighbouring value (scalars, pressure).
+// This sets the ring cells of interior row y; row 1 also sets the top wall row
+// and its corners and row grid_height - 2 the bottom ones, so refreshing each
+// row once it is final leaves the same ring as set_bnd().
+void set_bnd_row(int b, float* field, int y) {
+    int w = sim->grid_width;
+    field[IX(0, y)] = b == 1 ? -field[IX(1, y)] : field[IX(1, y)];
+    field[IX(w - 1, y)] = b == 1 ? -field[IX(w - 2, y)] : field[IX(w - 2, y)];
+    for (int side = 0; side < 2; side++) {
+        int wall = side ? sim->grid_height - 1 : 0;
+        if (y != (side ? wall - 1 : 1)) continue;
+        for (int x = 1; x < w - 1; x++) {
+            field[IX(x, wall)] = b == 2 ? -field[IX(x, y)] : field[IX(x, y)];
+        }
+        field[IX(0, wall)] = (field[IX(1, wall)] + field[IX(0, y)]) * 0.5f;
+        field[IX(w - 1, wall)] = (field[IX(w - 2, wall)] + field[IX(w - 1, y)]) * 0.5f;
+    }
+}
+
+void set_bnd(int b, float* field) {
+    for (int y = 1; y < sim->grid_height - 1; y++) set_bnd_row(b, field, y);
+    if (sim->obstacles) obstacles_bound(sim->obstacles, b, field);
+}
+
+// Refreshes the halo rows of a plane when this simulation is a slab
+void exchange_plane(void* plane, size_t element_bytes) {
+    if (sim->slab) sim->slab->exchange(sim->slab, plane, element_bytes);
+}
+
+void exchange_state() {
+    size_t stored = storage_bytes(sim->scalar_storage);
+    exchange_plane(sim->scalars.density, stored);
+    exchange_plane(sim->scalars.temperature, stored);
+    exchange_plane(sim->fields.velocity_x, sizeof(float));
+    exchange_plane(sim->fields.velocity_y, sizeof(float));
+}
+
+// Max of a per-slab measure over the whole grid
+float global_max(float value) {
+    return sim->slab ? sim->slab->reduce_max(sim->slab, value) : value;
+}
+
+// set_bnd_row(0, ...) on a stored scalar. Copies move the stored bits; only
+// the corners are computed and rounded.
+ALWAYS_INLINE void set_bnd_row_stored_s(int field, void* plane, int y, const int storage) {
+    int w = sim->grid_width;
+    scalar_copy(plane, IX(0, y), IX(1, y), storage);
+    scalar_copy(plane, IX(w - 1, y), IX(w - 2, y), storage);
+    float step = storage_step(storage, field);
+    float inv_step = storage_inv_step(storage, field);
+    uint32_t key = dither_key(field, DITHER_RING);
+    for (int side = 0; side < 2; side++) {
+        int wall = side ? sim->grid_height - 1 : 0;
+        if (y != (side ? wall - 1 : 1)) continue;
+        for (int x = 1; x < w - 1; x++) scalar_copy(plane, IX(x, wall), IX(x, y), storage);
+        float left = (scalar_get(plane, IX(1, wall), storage, step) + scalar_get(plane, IX(0, y), storage, step)) * 0.5f;
+        float right = (scalar_get(plane, IX(w - 2, wall), storage, step) + scalar_get(plane, IX(w - 1, y), storage, step)) * 0.5f;
+        scalar_put(plane, IX(0, wall), left, storage, inv_step, dither_unit(IX(0, wall), key));
+        scalar_put(plane, IX(w - 1, wall), right, storage, inv_step, dither_unit(IX(w - 1, wall), key));
+    }
+}
+
+void set_bnd_row_scalars(int y) {
+    if (sim->scalar_storage == FIELD_STORAGE_FLOAT32) {
+        set_bnd_row(0, sim->fields.density, y);
+        set_bnd_row(0, sim->fields.temperature, y);
+        return;
+    }
+    STORAGE_DISPATCH(
+        set_bnd_row_stored_s(SCALAR_DENSITY, sim->scalars.density, y, STORAGE);
+        set_bnd_row_stored_s(SCALAR_TEMPERATURE, sim->scalars.temperature, y, STORAGE);
+    );
+}
+
+// Passes that write a field refresh its ring themselves, one row behind the
+// kernel while the row is still in cache, instead of a set_bnd() walk down
+// both walls of every plane after the pass
+typedef struct {
+    RangeKernel kernel;
+    void* ctx;
+    int scalars;     // Density and temperature
+    int velocity;    // Both velocity components
+} BoundedSweep;
+
+void bounded_rows(void* ctx, int y_begin, int y_end, int thread) {
+    const BoundedSweep* sweep = ctx;
+    for (int y = y_begin; y < y_end; y++) {
+        sweep->kernel(sweep->ctx, y, y + 1, thread);
+        if (sweep->scalars) set_bnd_row_scalars(y);
+        if (sweep->velocity) {
+            set_bnd_row(1, sim->fields.velocity_x, y);
+            set_bnd_row(2, sim->fields.velocity_y, y);
+        }
+    }
+}
+
+// kernel over the interior rows, then the ring of the chosen fields and the
+// obstacles' ghosts, which need whole neighbouring rows
+void bounded_for(RangeKernel kernel, void* ctx, int scalars, int velocity) {
+    BoundedSweep sweep = {kernel, ctx, scalars, velocity};
+    parallel_for(1, sim->grid_height - 1, bounded_rows, &sweep);
+    if (sim->obstacles) obstacles_bound_state(sim->obstacles, scalars, velocity);
+}
+
+// Stencil kernels come in two layers. The _w body takes the row stride as
+// the parameter width, which IXW() and the neighbour offsets inside it use;
+// it is always inlined. The kernel wrapper expands it through
+// WIDTH_DISPATCH, so common widths get a copy where the stride is a
+// compile-time constant and any other width falls back to the runtime value.
+#define IXW(x, y) ((y) * width + (x))
+#define WIDTH_CASE(w, ...) case w: { enum { WIDTH = w }; __VA_ARGS__; break; }
+#define WIDTH_DISPATCH(...)                                  \
+    switch (sim->grid_width) {                               \
+    WIDTH_CASE(128, __VA_ARGS__)                             \
+    WIDTH_CASE(200, __VA_ARGS__)                             \
+    WIDTH_CASE(256, __VA_ARGS__)                             \
+    WIDTH_CASE(400, __VA_ARGS__)                             \
+    WIDTH_CASE(512, __VA_ARGS__)                             \
+    default: { const int WIDTH = sim->grid_width; __VA_ARGS__; break; } \
+    }
+
+ALWAYS_INLINE void divergence_span_w(int y, int x_begin, int x_end, const int width) {
+    const float* vx = sim->fields.velocity_x;
+    const float* vy = sim->fields.velocity_y;
+    for (int x = x_begin; x < x_end; x++) {
+        int i = IXW(x, y);
+        sim->divergence[i] =
+            (vx[i + 1] - vx[i - 1] +
+             vy[i + width] - vy[i - width]) * 0.5f;
+    }
+}
+
+void divergence_span(int y, int x_begin, int x_end) {
+    divergence_span_w(y, x_begin, x_end, sim->grid_width);
+}
+
+void divergence_rows(void* ctx, int y_begin, int y_end, int thread) {
+    WIDTH_DISPATCH(
+        for (int y = y_begin; y < y_end; y++) divergence_span_w(y, 1, WIDTH - 1, WIDTH);
+    );
+}
+
+RangeKernel divergence_kernel = divergence_rows;
+
+// Only the fluid runs; the solid cells get none, so the whole-grid solvers
+// see no sources inside the obstacles
+void divergence_fluid_rows(void* ctx, int y_begin, int y_end, int thread) {
+    const ObstacleMap* map = ctx;
+    WIDTH_DISPATCH(
+        for (int y = y_begin; y < y_end; y++) {
+            memset(&sim->divergence[y * WIDTH + 1], 0, (WIDTH - 2) * sizeof(float));
+            for (int r = map->row_runs[y]; r < map->row_runs[y + 1]; r++) {
+                divergence_span_w(y, map->run_begin[r], map->run_end[r], WIDTH);
+            }
+        }
+    );
+}
+
+void calculate_divergence() {
+    if (sim->obstacles) {
+        parallel_for(1, sim->grid_height - 1, divergence_fluid_rows, sim->obstacles);
+        return;
+    }
+    parallel_for(1, sim->grid_height - 1, divergence_kernel, NULL);
+}
+
+// Red-black ordering: color 0 updates cells with even x + y, color 1 odd, so
+// the cells of one color only read the other and the rows can run in parallel
+ALWAYS_INLINE void pressure_sweep_rows_w(void* ctx, int y_begin, int y_end, const int width) {
+    int color = *(const int*)ctx;
+    for (int y = y_begin; y < y_end; y++) {
+        for (int x = 1 + ((y + 1 + color) & 1); x < width - 1; x += 2) {
+            int i = IXW(x, y);
+            sim->pressure[i] =
+                (sim->pressure[i - 1] + sim->pressure[i + 1] +
+                 sim->pressure[i - width] + sim->pressure[i + width] -
+                 sim->divergence[i]) * 0.25f;
+        }
+    }
+}
+
+void pressure_sweep_rows(void* ctx, int y_begin, int y_end, int thread) {
+    WIDTH_DISPATCH(pressure_sweep_rows_w(ctx, y_begin, y_end, WIDTH));
+}
+
+// The same over the fluid runs only; the boundary cells next to them hold
+// the obstacles' ghost pressure
+void pressure_sweep_fluid_rows(void* ctx, int y_begin, int y_end, int thread) {
+    int color = *(const int*)ctx;
+    const ObstacleMap* map = sim->obstacles;
+    WIDTH_DISPATCH(
+        for (int y = y_begin; y < y_end; y++) {
+            for (int r = map->row_runs[y]; r < map->row_runs[y + 1]; r++) {
+                int begin = map->run_begin[r];
+                for (int x = begin + ((begin + y + color) & 1); x < map->run_end[r]; x += 2) {
+                    int i = y * WIDTH + x;
+                    sim->pressure[i] =
+                        (sim->pressure[i - 1] + sim->pressure[i + 1] +
+                         sim->pressure[i - WIDTH] + sim->pressure[i + WIDTH] -
+                         sim->divergence[i]) * 0.25f;
+                }
+            }
+        }
+    );
+}
+
+void solve_pressure_gauss_seidel(int iterations) {
+    ObstacleMap* obstacles = sim->obstacles;
+    RangeKernel sweep = obstacles ? pressure_sweep_fluid_rows : pressure_sweep_rows;
+    for (int iter = 0; iter < iterations; iter++) {
+        for (int color = 0; color < 2; color++) {
+            parallel_for(1, sim->grid_height - 1, sweep, &color);
+            if (obstacles && color == 0) obstacles_bound(obstacles, 0, sim->pressure);
+        }
+        set_bnd(0, sim->pressure);
+        // Two half sweeps spoil at most the two rows next to a halo edge
+        exchange_plane(sim->pressure, sizeof(float));
+    }
+}
+
+
+// Face coefficients along one axis from the cell sizes; the outermost faces
+// are walls
+void mg_axis_coefficients(int n, const float* size, float* k_lo, float* k_hi) {
+    for (int i = 1; i <= n; i++) {
+        k_lo[i] = i > 1 ? 2.0f / ((size[i - 1] + size[i]) * size[i]) : 0.0f;
+        k_hi[i] = i < n ? 2.0f / ((size[i] + size[i + 1]) * size[i]) : 0.0f;
+    }
+}
+
+// Linear interpolation weights from coarse cell centres onto fine cell
+// centres, clamped to the nearest coarse cell beyond the outermost centres
+void mg_axis_prolongation(int fine_n, const float* fine_size, int coarse_n, const float* coarse_size, int* index, float* weight) {
+    float fine_edge = 0.0f;
+    float coarse_edge = 0.0f;
+    int c = 1;
+    float c_center = coarse_size[1] * 0.5f;
+    float c_next = coarse_size[1] + (coarse_n > 1 ? coarse_size[2] * 0.5f : 0.0f);
+
+    for (int i = 1; i <= fine_n; i++) {
+        float center = fine_edge + fine_size[i] * 0.5f;
+        fine_edge += fine_size[i];
+
+        while (c < coarse_n - 1 && center > c_next) {
+            coarse_edge += coarse_size[c];
+            c++;
+            c_center = c_next;
+            c_next = coarse_edge + coarse_size[c] + coarse_size[c + 1] * 0.5f;
+        }
+        index[i] = c;
+        if (coarse_n == 1 || center <= c_center) {
+            weight[i] = 0.0f;
+        } else if (center >= c_next) {
+            weight[i] = 1.0f;
+        } else {
+            weight[i] = (center - c_center) / (c_next - c_center);
+        }
+    }
+}
+
+// Must match the allocations in mg_allocate_level()
+size_t mg_level_bytes(int nx, int ny, int own_planes) {
+    size_t w = nx + 2;
+    size_t h = ny + 2;
+    return (own_planes ? 4 : 1) * plane_bytes(w, h) +
+           align64(w * 3 * sizeof(float)) + align64(h * 3 * sizeof(float)) +
+           align64(w * sizeof(int)) + align64(w * sizeof(float)) +
+           align64(h * sizeof(int)) + align64(h * sizeof(float));
+}
+
+void mg_allocate_level(MultigridLevel* level, int nx, int ny, int own_planes) {
+    int w = nx + 2;
+    int h = ny + 2;
+    size_t size = (size_t)w * h;
+    level->width = w;
+    level->height = h;
+
+    if (own_planes) {
+        level->u = arena_alloc(&sim->arena, size * sizeof(float));
+        level->f = arena_alloc(&sim->arena, size * sizeof(float));
+        level->r = arena_alloc(&sim->arena, size * sizeof(float));
+    }
+    level->inv_diag = arena_alloc(&sim->arena, size * sizeof(float));
+    level->cell_w = arena_alloc(&sim->arena, (size_t)w * 3 * sizeof(float));
+    level->k_west = level->cell_w + w;
+    level->k_east = level->k_west + w;
+    level->cell_h = arena_alloc(&sim->arena, (size_t)h * 3 * sizeof(float));
+    level->k_south = level->cell_h + h;
+    level->k_north = level->k_south + h;
+    level->prolong_x = arena_alloc(&sim->arena, w * sizeof(int));
+    level->prolong_wx = arena_alloc(&sim->arena, w * sizeof(float));
+    level->prolong_y = arena_alloc(&sim->arena, h * sizeof(int));
+    level->prolong_wy = arena_alloc(&sim->arena, h * sizeof(float));
+}
+
+void mg_finish_level(MultigridLevel* level) {
+    int nx = level->width - 2;
+    int ny = level->height - 2;
+    mg_axis_coefficients(nx, level->cell_w, level->k_west, level->k_east);
+    mg_axis_coefficients(ny, level->cell_h, level->k_south, level->k_north);
+
+    for (int y = 1; y <= ny; y++) {
+        for (int x = 1; x <= nx; x++) {
+            level->inv_diag[y * level->width + x] = 1.0f /
+                (level->k_west[x] + level->k_east[x] + level->k_south[y] + level->k_north[y]);
+        }
+    }
+}
+
+// Coarse levels halve each axis, rounding up, until one side reaches
+// MULTIGRID_COARSEST. Returns the arena bytes the hierarchy needs.
+size_t multigrid_bytes(int nx, int ny) {
+    size_t bytes = mg_level_bytes(nx, ny, 0);
+    for (int l = 1; l < MULTIGRID_MAX_LEVELS && nx > MULTIGRID_COARSEST && ny > MULTIGRID_COARSEST; l++) {
+        nx = (nx + 1) / 2;
+        ny = (ny + 1) / 2;
+        bytes += mg_level_bytes(nx, ny, 1);
+    }
+    return bytes;
+}
+
+// Builds the hierarchy in the arena; called by fluid_resize()
+void multigrid_init() {
+    MultigridLevel* finest = &sim->mg_levels[0];
+    mg_allocate_level(finest, sim->grid_width - 2, sim->grid_height - 2, 0);
+    finest->u = sim->pressure;
+    finest->f = sim->divergence;
+    finest->r = sim->scratch;
+    for (int x = 1; x < sim->grid_width - 1; x++) finest->cell_w[x] = 1.0f;
+    for (int y = 1; y < sim->grid_height - 1; y++) finest->cell_h[y] = 1.0f;
+    mg_finish_level(finest);
+    sim->mg_level_count = 1;
+
+    while (sim->mg_level_count < MULTIGRID_MAX_LEVELS) {
+        MultigridLevel* fine = &sim->mg_levels[sim->mg_level_count - 1];
+        int nx = fine->width - 2;
+        int ny = fine->height - 2;
+        if (nx <= MULTIGRID_COARSEST || ny <= MULTIGRID_COARSEST) break;
+
+        MultigridLevel* coarse = &sim->mg_levels[sim->mg_level_count];
+        int cnx = (nx + 1) / 2;
+        int cny = (ny + 1) / 2;
+        mg_allocate_level(coarse, cnx, cny, 1);
+        for (int x = 1; x <= cnx; x++) {
+            coarse->cell_w[x] = fine->cell_w[2 * x - 1] + (2 * x <= nx ? fine->cell_w[2 * x] : 0.0f);
+        }
+        for (int y = 1; y <= cny; y++) {
+            coarse->cell_h[y] = fine->cell_h[2 * y - 1] + (2 * y <= ny ? fine->cell_h[2 * y] : 0.0f);
+        }
+        mg_finish_level(coarse);
+        mg_axis_prolongation(nx, fine->cell_w, cnx, coarse->cell_w, fine->prolong_x, fine->prolong_wx);
+        mg_axis_prolongation(ny, fine->cell_h, cny, coarse->cell_h, fine->prolong_y, fine->prolong_wy);
+        sim->mg_level_count++;
+    }
+}
+
+// Red-black Gauss-Seidel: color 0 updates cells with even x + y, color 1 odd
+typedef struct {
+    MultigridLevel* level;
+    int color;
+} MultigridSweep;
+
+void mg_smooth_rows(void* ctx, int y_begin, int y_end, int thread) {
+    const MultigridSweep* sweep = ctx;
+    const MultigridLevel* level = sweep->level;
+    int w = level->width;
+    float* u = level->u;
+    const float* f = level->f;
+    const float* inv_diag = level->inv_diag;
+    const float* kw = level->k_west;
+    const float* ke = level->k_east;
+
+    for (int y = y_begin; y < y_end; y++) {
+        float ks = level->k_south[y];
+        float kn = level->k_north[y];
+        for (int x = 1 + ((y + 1 + sweep->color) & 1); x < w - 1; x += 2) {
+            int i = y * w + x;
+            u[i] = (kw[x] * u[i - 1] + ke[x] * u[i + 1] +
+                    ks * u[i - w] + kn * u[i + w] - f[i]) * inv_diag[i];
+        }
+    }
+}
+
+void mg_smooth(MultigridLevel* level, int sweeps) {
+    for (int i = 0; i < sweeps; i++) {
+        for (int color = 0; color < 2; color++) {
+            MultigridSweep sweep = {level, color};
+            parallel_for(1, level->height - 1, mg_smooth_rows, &sweep);
+        }
+    }
+}
+
+// r = f - A u, returns max |r|
+
+void mg_residual_rows(void* ctx, int y_begin, int y_end, int thread) {
+    const MultigridLevel* level = ctx;
+    int w = level->width;
+    const float* u = level->u;
+    const float* f = level->f;
+    const float* inv_diag = level->inv_diag;
+    const float* kw = level->k_west;
+    const float* ke = level->k_east;
+    float* r = level->r;
+    float max_r = sim->partial_max[thread];
+
+    for (int y = y_begin; y < y_end; y++) {
+        float ks = level->k_south[y];
+        float kn = level->k_north[y];
+        for (int x = 1; x < w - 1; x++) {
+            int i = y * w + x;
+            r[i] = f[i] - (kw[x] * u[i - 1] + ke[x] * u[i + 1] +
+                           ks * u[i - w] + kn * u[i + w] - u[i] / inv_diag[i]);
+            max_r = fmaxf(max_r, fabsf(r[i]));
+        }
+    }
+    sim->partial_max[thread] = max_r;
+}
+
+float mg_residual(MultigridLevel* level) {
+    memset(sim->partial_max, 0, sizeof(sim->partial_max));
+    parallel_for(1, level->height - 1, mg_residual_rows, level);
+
+    float max_r = 0.0f;
+    for (int t = 0; t < pool.thread_count; t++) max_r = fmaxf(max_r, sim->partial_max[t]);
+    return max_r;
+}
+
+// Area-weighted average of the children of each coarse cell
+typedef struct {
+    const MultigridLevel* fine;
+    const float* src;
+    const MultigridLevel* coarse;
+    float* dst;
+} MultigridTransfer;
+
+void mg_restrict_rows(void* ctx, int cy_begin, int cy_end, int thread) {
+    const MultigridTransfer* t = ctx;
+    const MultigridLevel* fine = t->fine;
+    const MultigridLevel* coarse = t->coarse;
+    const float* src = t->src;
+    int fw = fine->width;
+    int fnx = fine->width - 2;
+    int fny = fine->height - 2;
+    int cw = coarse->width;
+
+    for (int cy = cy_begin; cy < cy_end; cy++) {
+        int y0 = 2 * cy - 1;
+        int y1 = y0 + 1 <= fny ? y0 + 1 : y0;
+        float h0 = fine->cell_h[y0];
+        float h1 = y1 != y0 ? fine->cell_h[y1] : 0.0f;
+        for (int cx = 1; cx < cw - 1; cx++) {
+            int x0 = 2 * cx - 1;
+            int x1 = x0 + 1 <= fnx ? x0 + 1 : x0;
+            float w0 = fine->cell_w[x0];
+            float w1 = x1 != x0 ? fine->cell_w[x1] : 0.0f;
+            t->dst[cy * cw + cx] = (h0 * (w0 * src[y0 * fw + x0] + w1 * src[y0 * fw + x1]) +
+                                    h1 * (w0 * src[y1 * fw + x0] + w1 * src[y1 * fw + x1])) /
+                                   (coarse->cell_w[cx] * coarse->cell_h[cy]);
+        }
+    }
+}
+
+void mg_restrict(const MultigridLevel* fine, const float* src, MultigridLevel* coarse, float* dst) {
+    MultigridTransfer transfer = {fine, src, coarse, dst};
+    parallel_for(1, coarse->height - 1, mg_restrict_rows, &transfer);
+}
+
+// Bilinear interpolation of the coarse solution, added onto the fine one
+void mg_prolong_rows(void* ctx, int y_begin, int y_end, int thread) {
+    const MultigridTransfer* t = ctx;
+    const MultigridLevel* fine = t->fine;
+    int fw = fine->width;
+    int cw = t->coarse->width;
+    const float* c = t->src;
+    float* u = t->dst;
+
+    for (int y = y_begin; y < y_end; y++) {
+        const float* row0 = c + fine->prolong_y[y] * cw;
+        const float* row1 = row0 + cw;
+        float ty = fine->prolong_wy[y];
+        for (int x = 1; x < fw - 1; x++) {
+            int cx = fine->prolong_x[x];
+            float tx = fine->prolong_wx[x];
+            float lower = row0[cx] + tx * (row0[cx + 1] - row0[cx]);
+            float upper = row1[cx] + tx * (row1[cx + 1] - row1[cx]);
+            u[y * fw + x] += lower + ty * (upper - lower);
+        }
+    }
+}
+
+void mg_prolong(const MultigridLevel* coarse, MultigridLevel* fine) {
+    MultigridTransfer transfer = {fine, coarse->u, coarse, fine->u};
+    parallel_for(1, fine->height - 1, mg_prolong_rows, &transfer);
+}
+
+void mg_v_cycle(int l) {
+    MultigridLevel* level = &sim->mg_levels[l];
+
+    if (l == sim->mg_level_count - 1) {
+        mg_smooth(level, MULTIGRID_COARSE_SWEEPS);
+        return;
+    }
+
+    MultigridLevel* coarse = &sim->mg_levels[l + 1];
+    mg_smooth(level, MULTIGRID_PRE_SWEEPS);
+    mg_residual(level);
+    mg_restrict(level, level->r, coarse, coarse->f);
+    memset(coarse->u, 0, (size_t)coarse->width * coarse->height * sizeof(float));
+    mg_v_cycle(l + 1);
+    mg_prolong(coarse, level);
+    mg_smooth(level, MULTIGRID_POST_SWEEPS);
+}
+
+void divergence_sum_rows(void* ctx, int y_begin, int y_end, int thread) {
+    double sum = 0.0;
+    for (int y = y_begin; y < y_end; y++) {
+        for (int x = 1; x < sim->grid_width - 1; x++) {
+            sum += sim->divergence[IX(x, y)];
+        }
+    }
+    sim->partial_sum[thread] += sum;
+}
+
+// Subtracts the mean and records max |divergence|
+void divergence_center_rows(void* ctx, int y_begin, int y_end, int thread) {
+    float mean = *(const float*)ctx;
+    float max_f = sim->partial_max[thread];
+    for (int y = y_begin; y < y_end; y++) {
+        for (int x = 1; x < sim->grid_width - 1; x++) {
+            sim->divergence[IX(x, y)] -= mean;
+            max_f = fmaxf(max_f, fabsf(sim->divergence[IX(x, y)]));
+        }
+    }
+    sim->partial_max[thread] = max_f;
+}
+
+// Full multigrid: solve on the coarsest grid, interpolate up as the initial
+// guess for each finer level, then V-cycle on the finest grid until the
+// residual drops below the effort's tolerance relative to the right-hand
+// side. A warm start skips the first part and V-cycles the last pressure,
+// which after a calm substep may already be within tolerance.
+int solve_pressure_multigrid() {
+    // The all-Neumann problem is only solvable for a zero-mean right-hand side
+    memset(sim->partial_sum, 0, sizeof(sim->partial_sum));
+    parallel_for(1, sim->grid_height - 1, divergence_sum_rows, NULL);
+    double sum = 0.0;
+    for (int t = 0; t < pool.thread_count; t++) sum += sim->partial_sum[t];
+    float mean = (float)(sum / ((sim->grid_width - 2) * (sim->grid_height - 2)));
+
+    memset(sim->partial_max, 0, sizeof(sim->partial_max));
+    parallel_for(1, sim->grid_height - 1, divergence_center_rows, &mean);
+    float max_f = 0.0f;
+    for (int t = 0; t < pool.thread_count; t++) max_f = fmaxf(max_f, sim->partial_max[t]);
+    if (max_f == 0.0f) {
+        sim->pressure_residual = 0.0f;
+        return 0;
+    }
+
+    int cycles = 0;
+    if (!sim->effort.pressure_warm_start) {
+        for (int l = 1; l < sim->mg_level_count; l++) {
+            mg_restrict(&sim->mg_levels[l - 1], sim->mg_levels[l - 1].f, &sim->mg_levels[l], sim->mg_levels[l].f);
+            memset(sim->mg_levels[l].u, 0, (size_t)sim->mg_levels[l].width * sim->mg_levels[l].height * sizeof(float));
+        }
+        mg_v_cycle(sim->mg_level_count - 1);
+        for (int l = sim->mg_level_count - 2; l >= 0; l--) {
+            mg_prolong(&sim->mg_levels[l + 1], &sim->mg_levels[l]);
+            mg_v_cycle(l);
+        }
+        cycles = 1;
+    }
+
+    sim->pressure_residual = mg_residual(&sim->mg_levels[0]) / max_f;
+    while (sim->pressure_residual > sim->effort.pressure_tolerance && cycles < sim->effort.multigrid_max_cycles) {
+        mg_v_cycle(0);
+        sim->pressure_residual = mg_residual(&sim->mg_levels[0]) / max_f;
+        cycles++;
+    }
+    set_bnd(0, sim->pressure);
+    return cycles;
+}
+
+// Real-to-real transforms for the direct solvers. The cosine (DCT-II) and
+// sine (DST-II) bases are the eigenvectors of the 1D Laplacian with the
+// ghost-copy and ghost-negate walls set_bnd() imposes, so transforming rows
+// diagonalises the pressure and viscosity systems along x on the full box.
+// Each DCT is one complex FFT of the same length (Makhoul's reordering);
+// lengths that are not a power of two go through Bluestein's chirp-z.
+typedef enum {
+    TRANSFORM_COS,
+    TRANSFORM_SIN
+} TransformKind;
+
+// Per-thread buffers, so several lines can be transformed concurrently
+typedef struct {
+    float* work;             // n complex
+    float* conv;             // m complex, Bluestein only
+    float* line;             // n, partner for an unpaired line
+} FftScratch;
+
+typedef struct FftPlan {
+    int n;
+    int m;                   // power-of-two FFT length, n itself when n is one
+    int* bit_reverse;        // m
+    float* twiddle;          // m / 2 complex
+    float* chirp;            // n complex, exp(-i pi k^2 / n), Bluestein only
+    float* chirp_spectrum;   // m complex, Bluestein only
+    float* shift;            // n complex, exp(-i pi k / 2n)
+    float* lambda_cos;       // n, eigenvalues for the cosine basis
+    float* lambda_sin;       // n, eigenvalues for the sine basis
+    FftScratch scratch[MAX_THREADS];
+} FftPlan;
+
+void fft_free_plan(FftPlan* plan) {
+    free(plan->bit_reverse);
+    free(plan->twiddle);
+    free(plan->chirp);
+    free(plan->chirp_spectrum);
+    free(plan->shift);
+    free(plan->lambda_cos);
+    free(plan->lambda_sin);
+    for (int t = 0; t < MAX_THREADS; t++) {
+        free(plan->scratch[t].work);
+        free(plan->scratch[t].conv);
+        free(plan->scratch[t].line);
+    }
+    free(plan);
+}
+
+// Plans depend on the line length and the thread count at creation, so
+// they are dropped whenever the grid is resized
+void fft_clear_plans() {
+    for (int i = 0; i < sim->fft_plan_count; i++) fft_free_plan(sim->fft_plans[i]);
+    sim->fft_plan_count = 0;
+}
+
+// In-place radix-2 decimation-in-time FFT of m interleaved complex values
+void fft_radix2(const FftPlan* plan, float* data) {
+    int m = plan->m;
+    for (int i = 0; i < m; i++) {
+        int j = plan->bit_reverse[i];
+        if (j > i) {
+            float re = data[2 * i];
+            float im = data[2 * i + 1];
+            data[2 * i] = data[2 * j];
+            data[2 * i + 1] = data[2 * j + 1];
+            data[2 * j] = re;
+            data[2 * j + 1] = im;
+        }
+    }
+
+    for (int half = 1; half < m; half *= 2) {
+        int step = m / (2 * half);
+        for (int start = 0; start < m; start += 2 * half) {
+            for (int k = 0; k < half; k++) {
+                float wr = plan->twiddle[2 * k * step];
+                float wi = plan->twiddle[2 * k * step + 1];
+                float* a = data + 2 * (start + k);
+                float* b = data + 2 * (start + k + half);
+                float tr = b[0] * wr - b[1] * wi;
+                float ti = b[0] * wi + b[1] * wr;
+                b[0] = a[0] - tr;
+                b[1] = a[1] - ti;
+                a[0] += tr;
+                a[1] += ti;
+            }
+        }
+    }
+}
+
+FftPlan* fft_get_plan(int n) {
+    for (int i = 0; i < sim->fft_plan_count; i++) {
+        if (sim->fft_plans[i]->n == n) return sim->fft_plans[i];
+    }
+
+    FftPlan* plan = calloc(1, sizeof(FftPlan));
+    plan->n = n;
+    plan->m = 1;
+    while (plan->m < n) plan->m *= 2;
+    if (plan->m != n) {
+        plan->m = 1;
+        while (plan->m < 2 * n - 1) plan->m *= 2;
+    }
+    int m = plan->m;
+    int bits = 0;
+    while ((1 << bits) < m) bits++;
+
+    plan->bit_reverse = malloc(m * sizeof(int));
+    for (int i = 0; i < m; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++) {
+            if (i & (1 << b)) r |= 1 << (bits - 1 - b);
+        }
+        plan->bit_reverse[i] = r;
+    }
+    plan->twiddle = malloc(m * sizeof(float));
+    for (int k = 0; k < m / 2; k++) {
+        plan->twiddle[2 * k] = (float)cos(-2.0 * M_PI * k / m);
+        plan->twiddle[2 * k + 1] = (float)sin(-2.0 * M_PI * k / m);
+    }
+
+    if (m != n) {
+        plan->chirp = malloc(2 * n * sizeof(float));
+        plan->chirp_spectrum = calloc(2 * m, sizeof(float));
+        for (int k = 0; k < n; k++) {
+            // k^2 mod 2n keeps the phase argument small
+            double phase = M_PI * (double)(((long long)k * k) % (2 * n)) / n;
+            plan->chirp[2 * k] = (float)cos(phase);
+            plan->chirp[2 * k + 1] = (float)-sin(phase);
+        }
+        for (int k = 0; k < n; k++) {
+            float re = plan->chirp[2 * k];
+            float im = -plan->chirp[2 * k + 1];
+            plan->chirp_spectrum[2 * k] = re;
+            plan->chirp_spectrum[2 * k + 1] = im;
+            if (k > 0) {
+                plan->chirp_spectrum[2 * (m - k)] = re;
+                plan->chirp_spectrum[2 * (m - k) + 1] = im;
+            }
+        }
+        fft_radix2(plan, plan->chirp_spectrum);
+    }
+
+    plan->shift = malloc(2 * n * sizeof(float));
+    plan->lambda_cos = malloc(n * sizeof(float));
+    plan->lambda_sin = malloc(n * sizeof(float));
+    for (int k = 0; k < n; k++) {
+        plan->shift[2 * k] = (float)cos(-M_PI * k / (2.0 * n));
+        plan->shift[2 * k + 1] = (float)sin(-M_PI * k / (2.0 * n));
+        plan->lambda_cos[k] = (float)(2.0 * cos(M_PI * k / n) - 2.0);
+        plan->lambda_sin[k] = (float)(2.0 * cos(M_PI * (k + 1) / n) - 2.0);
+    }
+    for (int t = 0; t < pool.thread_count; t++) {
+        plan->scratch[t].work = malloc(2 * n * sizeof(float));
+        plan->scratch[t].conv = m != n ? malloc(2 * m * sizeof(float)) : NULL;
+        plan->scratch[t].line = malloc(n * sizeof(float));
+    }
+
+    if (sim->fft_plan_count < FFT_PLAN_CACHE) {
+        sim->fft_plans[sim->fft_plan_count++] = plan;
+    }
+    return plan;
+}
+
+// Forward DFT of n interleaved complex values in place
+void fft_forward(FftPlan* plan, int thread, float* data) {
+    int n = plan->n;
+    int m = plan->m;
+    if (n == m) {
+        fft_radix2(plan, data);
+        return;
+    }
+
+    float* conv = plan->scratch[thread].conv;
+    const float* chirp = plan->chirp;
+    for (int k = 0; k < n; k++) {
+        conv[2 * k] = data[2 * k] * chirp[2 * k] - data[2 * k + 1] * chirp[2 * k + 1];
+        conv[2 * k + 1] = data[2 * k] * chirp[2 * k + 1] + data[2 * k + 1] * chirp[2 * k];
+    }
+    memset(conv + 2 * n, 0, 2 * (m - n) * sizeof(float));
+    fft_radix2(plan, conv);
+
+    // Multiply by the chirp spectrum, then inverse FFT through conjugation
+    const float* spectrum = plan->chirp_spectrum;
+    for (int k = 0; k < m; k++) {
+        float re = conv[2 * k] * spectrum[2 * k] - conv[2 * k + 1] * spectrum[2 * k + 1];
+        float im = conv[2 * k] * spectrum[2 * k + 1] + conv[2 * k + 1] * spectrum[2 * k];
+        conv[2 * k] = re;
+        conv[2 * k + 1] = -im;
+    }
+    fft_radix2(plan, conv);
+
+    float scale = 1.0f / m;
+    for (int k = 0; k < n; k++) {
+        float re = conv[2 * k] * scale;
+        float im = -conv[2 * k + 1] * scale;
+        data[2 * k] = re * chirp[2 * k] - im * chirp[2 * k + 1];
+        data[2 * k + 1] = re * chirp[2 * k + 1] + im * chirp[2 * k];
+    }
+}
+
+// Unnormalised DCT-II, X[k] = sum x[i] cos(pi k (2i + 1) / 2n), of two real
+// lines at once: they ride in the real and imaginary parts of one FFT
+void dct2_pair(FftPlan* plan, int thread, float* a, float* b) {
+    int n = plan->n;
+    float* v = plan->scratch[thread].work;
+    for (int i = 0; i < (n + 1) / 2; i++) {
+        v[2 * i] = a[2 * i];
+        v[2 * i + 1] = b[2 * i];
+    }
+    for (int i = 0; i < n / 2; i++) {
+        v[2 * (n - 1 - i)] = a[2 * i + 1];
+        v[2 * (n - 1 - i) + 1] = b[2 * i + 1];
+    }
+    fft_forward(plan, thread, v);
+
+    for (int k = 0; k < n; k++) {
+        int j = k > 0 ? n - k : 0;
+        // Split Z = A + iB using the conjugate symmetry of real spectra
+        float ar = (v[2 * k] + v[2 * j]) * 0.5f;
+        float ai = (v[2 * k + 1] - v[2 * j + 1]) * 0.5f;
+        float br = (v[2 * k + 1] + v[2 * j + 1]) * 0.5f;
+        float bi = (v[2 * j] - v[2 * k]) * 0.5f;
+        float sr = plan->shift[2 * k];
+        float si = plan->shift[2 * k + 1];
+        a[k] = ar * sr - ai * si;
+        b[k] = br * sr - bi * si;
+    }
+}
+
+// Exact inverse of dct2_pair()
+void idct2_pair(FftPlan* plan, int thread, float* a, float* b) {
+    int n = plan->n;
+    float* v = plan->scratch[thread].work;
+    for (int k = 0; k < n; k++) {
+        // V[k] = (X[k] - i X[n - k]) exp(i pi k / 2n) for each line, packed
+        // as A + iB and conjugated so the forward FFT inverts
+        float sr = plan->shift[2 * k];
+        float si = -plan->shift[2 * k + 1];
+        float xa = a[k];
+        float ya = k > 0 ? -a[n - k] : 0.0f;
+        float xb = b[k];
+        float yb = k > 0 ? -b[n - k] : 0.0f;
+        float ar = xa * sr - ya * si;
+        float ai = xa * si + ya * sr;
+        float br = xb * sr - yb * si;
+        float bi = xb * si + yb * sr;
+        v[2 * k] = ar - bi;
+        v[2 * k + 1] = -(ai + br);
+    }
+    fft_forward(plan, thread, v);
+
+    float scale = 1.0f / n;
+    for (int i = 0; i < (n + 1) / 2; i++) {
+        a[2 * i] = v[2 * i] * scale;
+        b[2 * i] = -v[2 * i + 1] * scale;
+    }
+    for (int i = 0; i < n / 2; i++) {
+        a[2 * i + 1] = v[2 * (n - 1 - i)] * scale;
+        b[2 * i + 1] = -v[2 * (n - 1 - i) + 1] * scale;
+    }
+}
+
+void negate_odd(float* x, int n) {
+    for (int i = 1; i < n; i += 2) x[i] = -x[i];
+}
+
+void reverse_line(float* x, int n) {
+    for (int i = 0; i < n / 2; i++) {
+        float t = x[i];
+        x[i] = x[n - 1 - i];
+        x[n - 1 - i] = t;
+    }
+}
+
+// DST-II, Y[k] = sum x[i] sin(pi (k + 1) (2i + 1) / 2n), is the DCT-II of the
+// alternating-sign input read backwards
+void transform_pair(FftPlan* plan, int thread, TransformKind kind, int inverse, float* a, float* b) {
+    int n = plan->n;
+    if (kind == TRANSFORM_SIN) {
+        if (inverse) {
+            reverse_line(a, n);
+            reverse_line(b, n);
+        } else {
+            negate_odd(a, n);
+            negate_odd(b, n);
+        }
+    }
+
+    if (inverse) {
+        idct2_pair(plan, thread, a, b);
+    } else {
+        dct2_pair(plan, thread, a, b);
+    }
+
+    if (kind == TRANSFORM_SIN) {
+        if (inverse) {
+            negate_odd(a, n);
+            negate_odd(b, n);
+        } else {
+            reverse_line(a, n);
+            reverse_line(b, n);
+        }
+    }
+}
+
+typedef struct {
+    FftPlan* plan;
+    float* field;
+    TransformKind kind;
+    int inverse;
+} RowTransform;
+
+// Row pairs [pair_begin, pair_end), pair p covering rows 2p + 1 and 2p + 2
+void transform_row_pairs(void* ctx, int pair_begin, int pair_end, int thread) {
+    const RowTransform* t = ctx;
+    for (int y = 2 * pair_begin + 1; y < 2 * pair_end + 1; y += 2) {
+        float* a = &t->field[IX(1, y)];
+        float* b = y + 1 < sim->grid_height - 1 ? &t->field[IX(1, y + 1)] : t->plan->scratch[thread].line;
+        transform_pair(t->plan, thread, t->kind, t->inverse, a, b);
+    }
+}
+
+// Transforms every interior row of a plane along x, two rows per FFT
+void transform_rows(float* field, TransformKind kind, int inverse) {
+    RowTransform transform = {fft_get_plan(sim->grid_width - 2), field, kind, inverse};
+    parallel_for(0, (sim->grid_height - 1) / 2, transform_row_pairs, &transform);
+}
+
+typedef struct {
+    float* field;
+    const float* lambda_x;
+    float diag;
+    float coeff;
+    float wall;
+} TridiagonalSolve;
+
+// Thomas algorithm along y for x modes [k_begin, k_end), with c' kept in the
+// scratch plane. B_j = diag + coeff * (lambda - 2), plus the wall term in the
+// first and last rows; A_j = C_j = coeff
+void thomas_modes(void* ctx, int k_begin, int k_end, int thread) {
+    const TridiagonalSolve* t = ctx;
+    int ny = sim->grid_height - 2;
+    float diag = t->diag;
+    float coeff = t->coeff;
+    float* c_prime = sim->scratch;
+
+    for (int y = 1; y <= ny; y++) {
+        float end = (y == 1 || y == ny) ? t->wall : 0.0f;
+        if (ny == 1) end = 2.0f * t->wall;
+        float* d = &t->field[IX(1, y)];
+        float* cp = &c_prime[IX(1, y)];
+        const float* d_prev = d - sim->grid_width;
+        const float* cp_prev = cp - sim->grid_width;
+        for (int k = k_begin; k < k_end; k++) {
+            float b = diag + coeff * (t->lambda_x[k] - 2.0f) + end;
+            float m = y > 1 ? b - coeff * cp_prev[k] : b;
+            float dk = y > 1 ? d[k] - coeff * d_prev[k] : d[k];
+            if (fabsf(m) < 1e-12f) {
+                cp[k] = 0.0f;
+                d[k] = 0.0f;
+            } else {
+                cp[k] = coeff / m;
+                d[k] = dk / m;
+            }
+        }
+    }
+    for (int y = ny - 1; y >= 1; y--) {
+        float* u = &t->field[IX(1, y)];
+        const float* u_next = u + sim->grid_width;
+        const float* cp = &c_prime[IX(1, y)];
+        for (int k = k_begin; k < k_end; k++) {
+            u[k] -= cp[k] * u_next[k];
+        }
+    }
+}
+
+// Solves (diag + coeff * L) u = rhs exactly in place, where L is the 5-point
+// Laplacian with the walls given by the transform kinds (COS: ghost copies
+// the edge value, SIN: ghost negates it). Rows are transformed along x, which
+// leaves one tridiagonal system along y per x mode; those are solved with the
+// Thomas algorithm, each thread sweeping its band of modes row by row so the
+// loops stay contiguous. The singular constant mode of the pure-Neumann case is pinned
+// to zero after removing its mean.
+void solve_spectral(float* field, TransformKind kind_x, TransformKind kind_y, float diag, float coeff) {
+    int nx = sim->grid_width - 2;
+    int ny = sim->grid_height - 2;
+    FftPlan* plan = fft_get_plan(nx);
+    const float* lambda_x = kind_x == TRANSFORM_COS ? plan->lambda_cos : plan->lambda_sin;
+    float wall = kind_y == TRANSFORM_COS ? coeff : -coeff;
+
+    transform_rows(field, kind_x, 0);
+
+    if (diag == 0.0f && kind_x == TRANSFORM_COS && kind_y == TRANSFORM_COS) {
+        double sum = 0.0;
+        for (int y = 1; y <= ny; y++) sum += field[IX(1, y)];
+        float mean = (float)(sum / ny);
+        for (int y = 1; y <= ny; y++) field[IX(1, y)] -= mean;
+    }
+
+    TridiagonalSolve solve = {field, lambda_x, diag, coeff, wall};
+    parallel_for(0, nx, thomas_modes, &solve);
+
+    transform_rows(field, kind_x, 1);
+}
+
+void solve_pressure_spectral() {
+    for (int y = 1; y < sim->grid_height - 1; y++) {
+        memcpy(&sim->pressure[IX(1, y)], &sim->divergence[IX(1, y)], (sim->grid_width - 2) * sizeof(float));
+    }
+    solve_spectral(sim->pressure, TRANSFORM_COS, TRANSFORM_COS, 0.0f, 1.0f);
+    set_bnd(0, sim->pressure);
+    sim->pressure_residual = 0.0f;
+}
+
+void max_abs_divergence_rows(void* ctx, int y_begin, int y_end, int thread) {
+    float max_f = sim->partial_max[thread];
+    for (int y = y_begin; y < y_end; y++) {
+        for (int x = 1; x < sim->grid_width - 1; x++) {
+            max_f = fmaxf(max_f, fabsf(sim->divergence[IX(x, y)]));
+        }
+    }
+    sim->partial_max[thread] = max_f;
+}
+
+// Expects divergence from calculate_divergence(). While profiling, the
+// divergence and the residual of whichever solver ran are measured the same
+// way multigrid measures its own, so the counters compare across solvers.
+void solve_pressure() {
+    if (!sim->effort.pressure_warm_start) memset(sim->pressure, 0, sim->grid_size * sizeof(float));
+
+    if (profile_enabled) {
+        memset(sim->partial_max, 0, sizeof(sim->partial_max));
+        parallel_for(1, sim->grid_height - 1, max_abs_divergence_rows, NULL);
+        sim->max_divergence = 0.0f;
+        for (int t = 0; t < pool.thread_count; t++) sim->max_divergence = fmaxf(sim->max_divergence, sim->partial_max[t]);
+        sim->max_divergence = global_max(sim->max_divergence);
+    }
+
+    if (sim->pressure_solver == PRESSURE_SOLVER_MULTIGRID) {
+        int cycles = solve_pressure_multigrid();
+        sim->pressure_work += cycles;
+        profile_counter("multigrid_cycles", cycles);
+    } else if (sim->pressure_solver == PRESSURE_SOLVER_SPECTRAL) {
+        solve_pressure_spectral();
+        sim->pressure_work++;
+    } else {
+        solve_pressure_gauss_seidel(sim->effort.pressure_iterations);
+        sim->pressure_work += sim->effort.pressure_iterations;
+    }
+    // The whole-grid solvers take the obstacles for fluid; sweeps that see
+    // their walls correct the pressure around them
+    if (sim->obstacles && sim->pressure_solver != PRESSURE_SOLVER_GAUSS_SEIDEL) {
+        solve_pressure_gauss_seidel(OBSTACLE_PRESSURE_SWEEPS);
+    }
+
+    if (profile_enabled) {
+        // Level 0 aliases pressure and divergence; its residual plane is scratch
+        if (sim->pressure_solver != PRESSURE_SOLVER_MULTIGRID) {
+            float residual = global_max(mg_residual(&sim->mg_levels[0]));
+            sim->pressure_residual = sim->max_divergence > 0.0f ? residual / sim->max_divergence : 0.0f;
+        }
+        profile_counter("pressure_residual", sim->pressure_residual);
+        profile_counter("max_divergence", sim->max_divergence);
+    }
+}
+
+// Also finds the fastest cell for the time-step controller. Only damping
+// follows, and diffusion never raises the peak, so this bounds the step.
+ALWAYS_INLINE float apply_pressure_span_w(int y, int x_begin, int x_end, float max_s, const int width) {
+    for (int x = x_begin; x < x_end; x++) {
+        int i = IXW(x, y);
+        float vx = sim->fields.velocity_x[i] - (sim->pressure[i + 1] - sim->pressure[i - 1]) * 0.5f;
+        float vy = sim->fields.velocity_y[i] - (sim->pressure[i + width] - sim->pressure[i - width]) * 0.5f;
+        sim->fields.velocity_x[i] = vx;
+        sim->fields.velocity_y[i] = vy;
+        float speed2 = vx * vx + vy * vy;
+        max_s = speed2 > max_s ? speed2 : max_s;
+    }
+    return max_s;
+}
+
+void apply_pressure_rows(void* ctx, int y_begin, int y_end, int thread) {
+    float max_s = sim->partial_max[thread];
+    WIDTH_DISPATCH(
+        for (int y = y_begin; y < y_end; y++) max_s = apply_pressure_span_w(y, 1, WIDTH - 1, max_s, WIDTH);
+    );
+    sim->partial_max[thread] = max_s;
+}
+
+// With obstacles only the fluid runs are projected: the solid cells keep
+// their bodies' velocity and do not count towards the fastest cell
+void apply_pressure_fluid_rows(void* ctx, int y_begin, int y_end, int thread) {
+    const ObstacleMap* map = ctx;
+    float max_s = sim->partial_max[thread];
+    WIDTH_DISPATCH(
+        for (int y = y_begin; y < y_end; y++) {
+            for (int r = map->row_runs[y]; r < map->row_runs[y + 1]; r++) {
+                max_s = apply_pressure_span_w(y, map->run_begin[r], map->run_end[r], max_s, WIDTH);
+            }
+        }
+    );
+    sim->partial_max[thread] = max_s;
+}
+
+void apply_pressure() {
+    memset(sim->partial_max, 0, sizeof(sim->partial_max));
+    if (sim->obstacles) {
+        bounded_for(apply_pressure_fluid_rows, sim->obstacles, 0, 1);
+    } else {
+        bounded_for(apply_pressure_rows, NULL, 0, 1);
+    }
+    float max_s = 0.0f;
+    for (int t = 0; t < pool.thread_count; t++) max_s = fmaxf(max_s, sim->partial_max[t]);
+    // A slab's rows, halo included, are exact here, so every slab agrees on
+    // the substep count
+    sim->max_speed = sqrtf(global_max(max_s));
+}
+
+// White noise: an independent kick per cell, drawn from the cell index and
+// step so rows can run on any thread. Random kicks add up like a random
+// walk, so they scale with the square root of the substep: splitting a step
+// leaves the spread of velocities alone.
+void turbulence_span(int y, int x_begin, int x_end) {
+    float amount = sim->params.turbulence_amount * sqrtf(sim->substep);
+    for (int x = x_begin; x < x_end; x++) {
+        int i = IX(x, y);
+        Philox4x32 r = noise_draw(i, NOISE_STREAM_TURBULENCE);
+        sim->fields.velocity_x[i] += rng_signed(r.v[0]) * amount;
+        sim->fields.velocity_y[i] += rng_signed(r.v[1]) * amount;
+    }
+}
+
+SpanKernel turbulence_span_kernel = turbulence_span;
+
+// Curl noise: the velocity kick is the curl of a smooth stream function, so
+// it swirls without adding divergence for the projection to remove. The
+// stream function is value noise on a CURL_CELL lattice whose values blend
+// from one random pattern to the next every CURL_PERIOD reference steps.
+float smoothstep01(float t) {
+    return t * t * (3.0f - 2.0f * t);
+}
+
+// The lattice starts at the lattice row holding global row origin_y
+void update_curl_lattice() {
+    float phase = sim->noise_time / CURL_PERIOD;
+    uint32_t slice = (uint32_t)phase;
+    float blend = smoothstep01(phase - (float)slice);
+    int first_row = sim->origin_y / CURL_CELL;
+    for (int j = 0; j < sim->curl_lattice_height; j++) {
+        for (int i = 0; i < sim->curl_lattice_width; i++) {
+            uint32_t point = (uint32_t)((first_row + j) * sim->curl_lattice_width + i);
+            float a = rng_signed(philox4x32(point, slice, NOISE_STREAM_CURL, 0, sim->noise_seed, 0).v[0]);
+            float b = rng_signed(philox4x32(point, slice + 1, NOISE_STREAM_CURL, 0, sim->noise_seed, 0).v[0]);
+            // Lattice-sized amplitude keeps the stream function's slope, the kick, near 1
+            sim->curl_lattice[j * sim->curl_lattice_width + i] = (a + (b - a) * blend) * CURL_CELL;
+        }
+    }
+}
+
+// Lattice rows covering local rows 0..height - 1 and the row below the last
+int curl_lattice_rows(int height) {
+    return (sim->origin_y + height - 1) / CURL_CELL - sim->origin_y / CURL_CELL + 2;
+}
+
+// Samples the stream function into scratch, ring included, which nothing
+// reads until calculate_vorticity() replaces it
+void curl_potential_rows(void* ctx, int y_begin, int y_end, int thread) {
+    int first_row = sim->origin_y / CURL_CELL;
+    for (int y = y_begin; y < y_end; y++) {
+        int j = (sim->origin_y + y) / CURL_CELL;
+        float t = smoothstep01((float)(sim->origin_y + y - j * CURL_CELL) / CURL_CELL);
+        const float* top = &sim->curl_lattice[(j - first_row) * sim->curl_lattice_width];
+        const float* bottom = top + sim->curl_lattice_width;
+        for (int x = 0; x < sim->grid_width; x++) {
+            int i = sim->curl_column[x];
+            float s = sim->curl_weight[x];
+            float upper = top[i] + (top[i + 1] - top[i]) * s;
+            float lower = bottom[i] + (bottom[i + 1] - bottom[i]) * s;
+            sim->scratch[IX(x, y)] = upper + (lower - upper) * t;
+        }
+    }
+}
+
+// Central differences of a grid stream function have exactly zero central
+// difference divergence
+void curl_span(int y, int x_begin, int x_end) {
+    float amount = CURL_AMOUNT * sim->substep;
+    for (int x = x_begin; x < x_end; x++) {
+        int i = IX(x, y);
+        sim->fields.velocity_x[i] += (sim->scratch[i + sim->grid_width] - sim->scratch[i - sim->grid_width]) * 0.5f * amount;
+        sim->fields.velocity_y[i] -= (sim->scratch[i + 1] - sim->scratch[i - 1]) * 0.5f * amount;
+    }
+}
+
+// density and temperature are row y, indexed by x
+void buoyancy_span(int y, int x_begin, int x_end, const float* density, const float* temperature) {
+    for (int x = x_begin; x < x_end; x++) {
+        int i = IX(x, y);
+        sim->fields.velocity_y[i] -= density[x] * temperature[x] * sim->params.buoyancy * sim->substep;
+    }
+}
+
+// Buoyancy and the turbulence kick only add to the velocity, so one sweep
+// does both a row at a time while the row is in cache. Each cell still gets
+// them in that order.
+void forces_span(int y, int x_begin, int x_end) {
+    float temperature_row[MAX_GRID_SIZE];
+    float density_row[MAX_GRID_SIZE];
+    buoyancy_span(y, x_begin, x_end, scalar_row(SCALAR_DENSITY, density_row, y, x_begin, x_end),
+                  scalar_row(SCALAR_TEMPERATURE, temperature_row, y, x_begin, x_end));
+    if (sim->turbulence_mode == TURBULENCE_CURL) {
+        curl_span(y, x_begin, x_end);
+    } else {
+        turbulence_span_kernel(y, x_begin, x_end);
+    }
+}
+
+void forces_rows(void* ctx, int y_begin, int y_end, int thread) {
+    for (int y = y_begin; y < y_end; y++) forces_span(y, 1, sim->grid_width - 1);
+}
+
+// Cells lo..hi - 1 of local row y a stamp covers inside the walls; discs
+// are cut to their chord
+void stamp_row_span(const Stamp* s, int y, int* lo, int* hi) {
+    int gy = y + sim->origin_y;
+    *lo = s->x_begin > 1 ? s->x_begin : 1;
+    *hi = s->x_end < sim->grid_width - 1 ? s->x_end : sim->grid_width - 1;
+    if (gy < s->y_begin || gy >= s->y_end) {
+        *hi = *lo;
+    } else if (s->shape <= STAMP_VORTEX) {
+        float dy = gy - s->y;
+        float half = sqrtf(fmaxf(0.0f, s->radius * s->radius - dy * dy));
+        int begin = stamp_cell(s->x - half);
+        int end = stamp_cell(s->x + half) + 2;
+        if (begin > *lo) *lo = begin;
+        if (end < *hi) *hi = end;
+    }
+}
+
+int stamp_has_scalars(const Stamp* s) {
+    return s->density != 0.0f || s->temperature != 0.0f || s->drain > 0.0f;
+}
+
+// Weight of a stamp at offset (dx, dy) from its first point, 0 outside it,
+// and the direction it pushes there
+float stamp_weight(const Stamp* s, float dx, float dy, float* push_x, float* push_y) {
+    *push_x = s->dir_x;
+    *push_y = s->dir_y;
+    if (s->shape == STAMP_BOX) {
+        float span_x = s->x2 - s->x;
+        float span_y = s->y2 - s->y;
+        if (dx < fminf(0.0f, span_x) || dx > fmaxf(0.0f, span_x)) return 0.0f;
+        if (dy < fminf(0.0f, span_y) || dy > fmaxf(0.0f, span_y)) return 0.0f;
+        return 1.0f;
+    }
+    float inv_radius = 1.0f / s->radius;
+    if (s->shape == STAMP_LINE) {
+        float seg_x = s->x2 - s->x;
+        float seg_y = s->y2 - s->y;
+        float seg_length2 = seg_x * seg_x + seg_y * seg_y;
+        float inv_seg = seg_length2 > 0.0f ? 1.0f / seg_length2 : 0.0f;
+        float t = fmaxf(0.0f, fminf(1.0f, (dx * seg_x + dy * seg_y) * inv_seg));
+        float ox = dx - t * seg_x;
+        float oy = dy - t * seg_y;
+        float distance = sqrtf(ox * ox + oy * oy);
+        return distance < s->radius ? 1.0f - distance * inv_radius : 0.0f;
+    }
+    float distance2 = dx * dx + dy * dy;
+    if (distance2 >= s->radius * s->radius) return 0.0f;
+    float inv_distance = 1.0f / sqrtf(fmaxf(distance2, 1e-12f));
+    if (s->shape == STAMP_RADIAL) {
+        *push_x = dx * inv_distance;
+        *push_y = dy * inv_distance;
+    } else if (s->shape == STAMP_VORTEX) {
+        *push_x = -dy * inv_distance;
+        *push_y = dx * inv_distance;
+    }
+    return 1.0f - distance2 * inv_distance * inv_radius;
+}
+
+// The scalar part of a stamp on one cell at the given weight
+void stamp_scalars(const Stamp* s, float weight, float* density, float* temperature) {
+    const float h = sim->substep;
+    if (s->drain > 0.0f) {
+        float keep = 1.0f - fminf(1.0f, s->drain * weight * h);
+        *density *= keep;
+        *temperature *= keep;
+    }
+    *density = fmaxf(0.0f, *density + s->density * weight * h);
+    *temperature += s->temperature * weight * h;
+}
+
+// One stamp over cells lo..hi - 1 of row y; density and temperature are the
+// row, indexed by x, and are only written when the stamp has scalars
+void stamp_span(const Stamp* s, int y, int lo, int hi, float* density, float* temperature) {
+    const float h = sim->substep;
+    const int scalars = stamp_has_scalars(s);
+    float dy = y + sim->origin_y - s->y;
+    for (int x = lo; x < hi; x++) {
+        if (s->min_density > 0.0f && density[x] <= s->min_density) continue;
+        float push_x, push_y;
+        float weight = stamp_weight(s, x - s->x, dy, &push_x, &push_y);
+        if (weight <= 0.0f) continue;
+
+        int i = IX(x, y);
+        float force = weight * s->force * h;
+        sim->fields.velocity_x[i] += push_x * force;
+        sim->fields.velocity_y[i] += push_y * force;
+        if (scalars) stamp_scalars(s, weight, &density[x], &temperature[x]);
+    }
+}
+
+// Rows run the stamps on them in batch order. fp32 scalars are worked on in
+// place; compact ones are converted over each stamp's span and back.
+void stamp_rows(void* ctx, int y_begin, int y_end, int thread) {
+    const int compact = sim->scalar_storage != FIELD_STORAGE_FLOAT32;
+    float density_row[MAX_GRID_SIZE];
+    float temperature_row[MAX_GRID_SIZE];
+    for (int y = y_begin; y < y_end; y++) {
+        float* density = compact ? density_row : sim->fields.density + IX(0, y);
+        float* temperature = compact ? temperature_row : sim->fields.temperature + IX(0, y);
+        for (int k = 0; k < sim->stamp_count; k++) {
+            const Stamp* s = &sim->stamps[k];
+            int lo, hi;
+            stamp_row_span(s, y, &lo, &hi);
+            if (lo >= hi) continue;
+            int scalars = stamp_has_scalars(s);
+            if (compact && (scalars || s->min_density > 0.0f)) {
+                load_cells_kernel(sim->scalars.density, SCALAR_DENSITY, IX(lo, y), hi - lo, density_row + lo);
+            }
+            if (compact && scalars) {
+                load_cells_kernel(sim->scalars.temperature, SCALAR_TEMPERATURE, IX(lo, y), hi - lo, temperature_row + lo);
+            }
+            stamp_span(s, y, lo, hi, density, temperature);
+            if (compact && scalars) {
+                store_cells_kernel(sim->scalars.density, SCALAR_DENSITY, IX(lo, y), hi - lo, density_row + lo, DITHER_EMIT);
+                store_cells_kernel(sim->scalars.temperature, SCALAR_TEMPERATURE, IX(lo, y), hi - lo, temperature_row + lo, DITHER_EMIT);
+            }
+        }
+    }
+}
+
+// The whole batch in one parallel pass over the rows it covers; each stamp
+// only visits its own clipped footprint
+void apply_stamps() {
+    int y_begin = sim->grid_height - 1;
+    int y_end = 1;
+    for (int k = 0; k < sim->stamp_count; k++) {
+        int begin = sim->stamps[k].y_begin - sim->origin_y;
+        int end = sim->stamps[k].y_end - sim->origin_y;
+        if (begin < y_begin) y_begin = begin;
+        if (end > y_end) y_end = end;
+    }
+    if (y_begin < 1) y_begin = 1;
+    if (y_end > sim->grid_height - 1) y_end = sim->grid_height - 1;
+    if (y_begin < y_end) parallel_for(y_begin, y_end, stamp_rows, NULL);
+    if (sim->detail) detail_stamps(sim->detail);
+}
+
+void add_forces() {
+    if (sim->turbulence_mode == TURBULENCE_CURL) {
+        update_curl_lattice();
+        parallel_for(0, sim->grid_height, curl_potential_rows, NULL);
+    }
+    if (sim->sparse_tiles) {
+        sparse_for(forces_span, NULL, 0);
+    } else {
+        parallel_for(1, sim->grid_height - 1, forces_rows, NULL);
+    }
+    if (sim->stamp_count > 0) apply_stamps();
+    if (sim->obstacles) obstacles_bound_state(sim->obstacles, 1, 1);
+}
+
+// Decay of compact scalars, converted CELL_CHUNK cells at a time
+void decay_stored(int begin, int end) {
+    float decay[SCALAR_COUNT] = {
+        powf(sim->params.density_decay, sim->substep),
+        powf(sim->params.temperature_decay, sim->substep)
+    };
+    float chunk[CELL_CHUNK];
+    for (int field = 0; field < SCALAR_COUNT; field++) {
+        void* plane = scalar_plane(&sim->scalars, field);
+        for (int i = begin; i < end; i += CELL_CHUNK) {
+            int count = end - i < CELL_CHUNK ? end - i : CELL_CHUNK;
+            load_cells_kernel(plane, field, i, count, chunk);
+            for (int k = 0; k < count; k++) chunk[k] *= decay[field];
+            store_cells_kernel(plane, field, i, count, chunk, DITHER_DECAY);
+        }
+    }
+}
+
+void decay_span(int y, int x_begin, int x_end) {
+    if (sim->scalar_storage != FIELD_STORAGE_FLOAT32) {
+        decay_stored(IX(x_begin, y), IX(x_end, y));
+        return;
+    }
+    float density_decay = powf(sim->params.density_decay, sim->substep);
+    float temperature_decay = powf(sim->params.temperature_decay, sim->substep);
+    for (int i = IX(x_begin, y); i < IX(x_end, y); i++) {
+        sim->fields.density[i] *= density_decay;
+        sim->fields.temperature[i] *= temperature_decay;
+    }
+}
+
+void decay_rows(void* ctx, int y_begin, int y_end, int thread) {
+    if (sim->scalar_storage != FIELD_STORAGE_FLOAT32) {
+        decay_stored(y_begin * sim->grid_width, y_end * sim->grid_width);
+        return;
+    }
+    float density_decay = powf(sim->params.density_decay, sim->substep);
+    float temperature_decay = powf(sim->params.temperature_decay, sim->substep);
+    for (int i = y_begin * sim->grid_width; i < y_end * sim->grid_width; i++) {
+        sim->fields.density[i] *= density_decay;
+        sim->fields.temperature[i] *= temperature_decay;
+    }
+}
+
+// Decay of the interior rows y_begin..y_end and of the wall row beyond
+// either end, sparse or dense like the rest of the step
+void decay_band(void* ctx, int y_begin, int y_end, int thread) {
+    if (y_begin == 1) y_begin = 0;
+    if (y_end == sim->grid_height - 1) y_end = sim->grid_height;
+    if (sim->sparse_tiles) {
+        SparseSweep sweep = {decay_span, NULL, 1};
+        sparse_rows(&sweep, y_begin, y_end, thread);
+    } else {
+        decay_rows(NULL, y_begin, y_end, thread);
+    }
+}
+
+typedef struct {
+    float amount;
+    int color;
+    int decay;       // Also decay the scalars of the rows swept
+} DiffuseSweep;
+
+// One red-black half sweep of (1 + 4a) u - a * sum(neighbours) = u on both
+// velocity components
+ALWAYS_INLINE void diffuse_rows_w(void* ctx, int y_begin, int y_end, const int width) {
+    const DiffuseSweep* sweep = ctx;
+    float amount = sweep->amount;
+    float scale = 1.0f / (1 + 4 * amount);
+    float* vx = sim->fields.velocity_x;
+    float* vy = sim->fields.velocity_y;
+
+    for (int y = y_begin; y < y_end; y++) {
+        for (int x = 1 + ((y + 1 + sweep->color) & 1); x < width - 1; x += 2) {
+            int i = IXW(x, y);
+            vx[i] = (vx[i] + amount * (vx[i - 1] + vx[i + 1] + vx[i - width] + vx[i + width])) * scale;
+            vy[i] = (vy[i] + amount * (vy[i - 1] + vy[i + 1] + vy[i - width] + vy[i + width])) * scale;
+        }
+    }
+}
+
+void diffuse_rows(void* ctx, int y_begin, int y_end, int thread) {
+    if (((const DiffuseSweep*)ctx)->decay) decay_band(NULL, y_begin, y_end, thread);
+    WIDTH_DISPATCH(diffuse_rows_w(ctx, y_begin, y_end, WIDTH));
+}
+
+// Implicit velocity diffusion. The spectral path solves the system the
+// sweeps relax exactly, with the amounts of all iterations combined. With
+// decay set the scalars decay too: they are disjoint from the velocity, so
+// the first sweep does it instead of a pass of its own.
+void diffuse_velocity(float amount, int iterations, int decay) {
+    if (sim->viscosity_solver == VISCOSITY_SOLVER_SPECTRAL) {
+        if (decay) parallel_for(1, sim->grid_height - 1, decay_band, NULL);
+        solve_spectral(sim->fields.velocity_x, TRANSFORM_SIN, TRANSFORM_COS, 1.0f, -amount * iterations);
+        solve_spectral(sim->fields.velocity_y, TRANSFORM_COS, TRANSFORM_SIN, 1.0f, -amount * iterations);
+        set_bnd(1, sim->fields.velocity_x);
+        set_bnd(2, sim->fields.velocity_y);
+        return;
+    }
+
+    for (int iter = 0; iter < iterations; iter++) {
+        DiffuseSweep red = {amount, 0, decay && iter == 0};
+        parallel_for(1, sim->grid_height - 1, diffuse_rows, &red);
+        DiffuseSweep black = {amount, 1, 0};
+        bounded_for(diffuse_rows, &black, 0, 1);
+        exchange_plane(sim->fields.velocity_x, sizeof(float));
+        exchange_plane(sim->fields.velocity_y, sizeof(float));
+    }
+}
+
+ALWAYS_INLINE void vorticity_span_w(int y, int x_begin, int x_end, const int width) {
+    const float* vx = sim->fields.velocity_x;
+    const float* vy = sim->fields.velocity_y;
+    for (int x = x_begin; x < x_end; x++) {
+        int i = IXW(x, y);
+        sim->scratch[i] =
+            (vy[i + 1] - vy[i - 1]) * 0.5f -
+            (vx[i + width] - vx[i - width]) * 0.5f;
+    }
+}
+
+void vorticity_span(int y, int x_begin, int x_end) {
+    vorticity_span_w(y, x_begin, x_end, sim->grid_width);
+}
+
+void vorticity_rows(void* ctx, int y_begin, int y_end, int thread) {
+    WIDTH_DISPATCH(
+        for (int y = y_begin; y < y_end; y++) vorticity_span_w(y, 1, WIDTH - 1, WIDTH);
+    );
+}
+
+RangeKernel vorticity_kernel = vorticity_rows;
+
+// The ring gets no vorticity, so confinement sees none beyond the walls
+// whatever an earlier pass, such as the curl noise, left there
+void calculate_vorticity() {
+    float* omega = sim->scratch;
+    size_t row = (size_t)sim->grid_width * sizeof(float);
+    memset(omega, 0, row);
+    memset(&omega[IX(0, sim->grid_height - 1)], 0, row);
+    for (int y = 1; y < sim->grid_height - 1; y++) omega[IX(0, y)] = omega[IX(sim->grid_width - 1, y)] = 0.0f;
+    parallel_for(1, sim->grid_height - 1, vorticity_kernel, NULL);
+}
+
+ALWAYS_INLINE void confinement_span_w(int y, int x_begin, int x_end, float strength, const int width) {
+    for (int x = x_begin; x < x_end; x++) {
+        int i = IXW(x, y);
+        float omega = sim->scratch[i];
+
+        float grad_omega_x = (fabsf(sim->scratch[i + 1]) - fabsf(sim->scratch[i - 1])) * 0.5f;
+        float grad_omega_y = (fabsf(sim->scratch[i + width]) - fabsf(sim->scratch[i - width])) * 0.5f;
+
+        float grad_omega_mag = sqrtf(grad_omega_x * grad_omega_x + grad_omega_y * grad_omega_y);
+
+        if (grad_omega_mag > 1e-6) {
+            float Nx = grad_omega_x / grad_omega_mag;
+            float Ny = grad_omega_y / grad_omega_mag;
+
+            float force_x = Ny * omega;
+            float force_y = -Nx * omega;
+
+            sim->fields.velocity_x[i] += force_x * strength;
+            sim->fields.velocity_y[i] += force_y * strength;
+        }
+    }
+}
+
+void confinement_span(int y, int x_begin, int x_end, float strength) {
+    confinement_span_w(y, x_begin, x_end, strength, sim->grid_width);
+}
+
+void confinement_rows(void* ctx, int y_begin, int y_end, int thread) {
+    float strength = *(const float*)ctx;
+    WIDTH_DISPATCH(
+        for (int y = y_begin; y < y_end; y++) confinement_span_w(y, 1, WIDTH - 1, strength, WIDTH);
+    );
+}
+
+RangeKernel confinement_kernel = confinement_rows;
+
+void apply_vorticity_confinement(float strength) {
+    calculate_vorticity();
+    bounded_for(confinement_kernel, &strength, 0, 1);
+}
+
+// Semi-Lagrangian advection of every field from the back buffer into the front
+ALWAYS_INLINE void advect_span_w(int y, int x_begin, int x_end, const int width) {
+    const FieldSet src = sim->prev_fields;
+    const float h = sim->substep;
+    const int oy = sim->origin_y;
+    for (int x = x_begin; x < x_end; x++) {
+        int i = IXW(x, y);
+        float prev_x = x - h * src.velocity_x[i];
+        // Rows are global, so a slab rounds the backtrace as the whole grid does
+        float prev_y = (y + oy) - h * src.velocity_y[i];
+
+        prev_x = fmaxf(0.5f, fminf(width - 1.5f, prev_x));
+        prev_y = fmaxf(oy + 0.5f, fminf((oy + sim->grid_height) - 1.5f, prev_y));
+
+        int x0 = (int)prev_x;
+        int row = (int)prev_y;
+        int y0 = row - oy;
+
+        float s1 = prev_x - x0;
+        float s0 = 1.0f - s1;
+        float t1 = prev_y - row;
+        float t0 = 1.0f - t1;
+
+        int i00 = IXW(x0, y0);
+        int i01 = i00 + width;
+        int i10 = i00 + 1;
+        int i11 = i01 + 1;
+
+        sim->fields.density[i] = s0 * (t0 * src.density[i00] + t1 * src.density[i01]) +
+                            s1 * (t0 * src.density[i10] + t1 * src.density[i11]);
+
+        sim->fields.temperature[i] = s0 * (t0 * src.temperature[i00] + t1 * src.temperature[i01]) +
+                                s1 * (t0 * src.temperature[i10] + t1 * src.temperature[i11]);
+
+        sim->fields.velocity_x[i] = s0 * (t0 * src.velocity_x[i00] + t1 * src.velocity_x[i01]) +
+                               s1 * (t0 * src.velocity_x[i10] + t1 * src.velocity_x[i11]);
+
+        sim->fields.velocity_y[i] = s0 * (t0 * src.velocity_y[i00] + t1 * src.velocity_y[i01]) +
+                               s1 * (t0 * src.velocity_y[i10] + t1 * src.velocity_y[i11]);
+    }
+}
+
+void advect_span(int y, int x_begin, int x_end) {
+    advect_span_w(y, x_begin, x_end, sim->grid_width);
+}
+
+void advect_rows(void* ctx, int y_begin, int y_end, int thread) {
+    WIDTH_DISPATCH(
+        for (int y = y_begin; y < y_end; y++) advect_span_w(y, 1, WIDTH - 1, WIDTH);
+    );
+}
+
+// Same with compact scalars: the taps are converted as they are loaded and
+// the result rounded once on the store
+ALWAYS_INLINE void advect_stored_span_s(int y, int x_begin, int x_end, const int storage) {
+    const FieldSet src = sim->prev_fields;
+    const ScalarSet stored = sim->prev_scalars;
+    const float h = sim->substep;
+    const int width = sim->grid_width;
+    const int oy = sim->origin_y;
+    float d_step = storage_step(storage, SCALAR_DENSITY);
+    float t_step = storage_step(storage, SCALAR_TEMPERATURE);
+    float d_inv = storage_inv_step(storage, SCALAR_DENSITY);
+    float t_inv = storage_inv_step(storage, SCALAR_TEMPERATURE);
+    uint32_t d_key = dither_key(SCALAR_DENSITY, DITHER_ADVECT);
+    uint32_t t_key = dither_key(SCALAR_TEMPERATURE, DITHER_ADVECT);
+    for (int x = x_begin; x < x_end; x++) {
+        int i = IXW(x, y);
+        float prev_x = x - h * src.velocity_x[i];
+        // Rows are global, so a slab rounds the backtrace as the whole grid does
+        float prev_y = (y + oy) - h * src.velocity_y[i];
+
+        prev_x = fmaxf(0.5f, fminf(width - 1.5f, prev_x));
+        prev_y = fmaxf(oy + 0.5f, fminf((oy + sim->grid_height) - 1.5f, prev_y));
+
+        int x0 = (int)prev_x;
+        int row = (int)prev_y;
+        int y0 = row - oy;
+
+        float s1 = prev_x - x0;
+        float s0 = 1.0f - s1;
+        float t1 = prev_y - row;
+        float t0 = 1.0f - t1;
+
+        int i00 = IXW(x0, y0);
+        int i01 = i00 + width;
+        int i10 = i00 + 1;
+        int i11 = i01 + 1;
+
+        float d = s0 * (t0 * scalar_get(stored.density, i00, storage, d_step) +
+                        t1 * scalar_get(stored.density, i01, storage, d_step)) +
+                  s1 * (t0 * scalar_get(stored.density, i10, storage, d_step) +
+                        t1 * scalar_get(stored.density, i11, storage, d_step));
+        scalar_put(sim->scalars.density, i, d, storage, d_inv, dither_unit(i, d_key));
+
+        float t = s0 * (t0 * scalar_get(stored.temperature, i00, storage, t_step) +
+                        t1 * scalar_get(stored.temperature, i01, storage, t_step)) +
+                  s1 * (t0 * scalar_get(stored.temperature, i10, storage, t_step) +
+                        t1 * scalar_get(stored.temperature, i11, storage, t_step));
+        scalar_put(sim->scalars.temperature, i, t, storage, t_inv, dither_unit(i, t_key));
+
+        sim->fields.velocity_x[i] = s0 * (t0 * src.velocity_x[i00] + t1 * src.velocity_x[i01]) +
+                               s1 * (t0 * src.velocity_x[i10] + t1 * src.velocity_x[i11]);
+
+        sim->fields.velocity_y[i] = s0 * (t0 * src.velocity_y[i00] + t1 * src.velocity_y[i01]) +
+                               s1 * (t0 * src.velocity_y[i10] + t1 * src.velocity_y[i11]);
+    }
+}
+
+void advect_stored_span(int y, int x_begin, int x_end) {
+    STORAGE_DISPATCH(advect_stored_span_s(y, x_begin, x_end, STORAGE));
+}
+
+void advect_stored_rows(void* ctx, int y_begin, int y_end, int thread) {
+    for (int y = y_begin; y < y_end; y++) advect_stored_span(y, 1, sim->grid_width - 1);
+}
+
+RangeKernel advect_kernel = advect_rows;
+SpanKernel advect_span_kernel = advect_span;
+RangeKernel advect_stored_kernel = advect_stored_rows;
+SpanKernel advect_stored_span_kernel = advect_stored_span;
+
+// Outside the processed tiles the state carries over unchanged
+void carry_span(int y, int x_begin, int x_end) {
+    size_t bytes = (size_t)(x_end - x_begin) * sizeof(float);
+    size_t scalar_bytes = (size_t)(x_end - x_begin) * storage_bytes(sim->scalar_storage);
+    size_t scalar_offset = (size_t)IX(x_begin, y) * storage_bytes(sim->scalar_storage);
+    int i = IX(x_begin, y);
+    memcpy((char*)sim->scalars.density + scalar_offset, (const char*)sim->prev_scalars.density + scalar_offset, scalar_bytes);
+    memcpy((char*)sim->scalars.temperature + scalar_offset, (const char*)sim->prev_scalars.temperature + scalar_offset, scalar_bytes);
+    memcpy(&sim->fields.velocity_x[i], &sim->prev_fields.velocity_x[i], bytes);
+    memcpy(&sim->fields.velocity_y[i], &sim->prev_fields.velocity_y[i], bytes);
+}
+
+void advect() {
+    swap_fields();
+    int stored = sim->scalar_storage != FIELD_STORAGE_FLOAT32;
+    if (sim->sparse_tiles) {
+        SparseSweep sweep = {stored ? advect_stored_span_kernel : advect_span_kernel, carry_span, 0};
+        bounded_for(sparse_rows, &sweep, 1, 1);
+    } else {
+        bounded_for(stored ? advect_stored_kernel : advect_kernel, NULL, 1, 1);
+    }
+}
+
+// Explicit SIMD variants of the advection, divergence and vorticity kernels.
+// Each handles 8 (AVX2) or 4 (SSE4.1) cells per step and finishes the row
+// with the scalar span; simd_select() installs them after a runtime CPU check.
+#ifdef HAVE_X86_SIMD
+#define TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2_NO_FMA __attribute__((target("avx2,f16c")))  // Rounds exactly like the scalar path
+
+// Bilinear sample of f at the cells i00 with weights (s, t); the four taps
+// share one index vector by offsetting the base pointer
+TARGET_AVX2 __m256 bilerp_avx2(const float* f, __m256i i00, __m256 s0, __m256 s1, __m256 t0, __m256 t1) {
+    __m256 a00 = _mm256_i32gather_ps(f, i00, 4);
+    __m256 a01 = _mm256_i32gather_ps(f + sim->grid_width, i00, 4);
+    __m256 a10 = _mm256_i32gather_ps(f + 1, i00, 4);
+    __m256 a11 = _mm256_i32gather_ps(f + sim->grid_width + 1, i00, 4);
+    __m256 left = _mm256_fmadd_ps(t1, a01, _mm256_mul_ps(t0, a00));
+    __m256 right = _mm256_fmadd_ps(t1, a11, _mm256_mul_ps(t0, a10));
+    return _mm256_fmadd_ps(s1, right, _mm256_mul_ps(s0, left));
+}
+
+// 32x32 -> 64 bit products of all eight lanes, split into high and low words
+TARGET_AVX2_NO_FMA static inline __m256i mulhilo_avx2(__m256i a, __m256i m, __m256i* lo) {
+    __m256i even = _mm256_mul_epu32(a, m);
+    __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), m);
+    *lo = _mm256_mullo_epi32(a, m);
+    return _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+}
+
+// philox4x32() on eight counters at once, bit for bit the same
+TARGET_AVX2_NO_FMA static inline void philox4x32_avx2(__m256i c[4], uint32_t k0, uint32_t k1) {
+    const __m256i m0 = _mm256_set1_epi32((int)PHILOX_M0);
+    const __m256i m1 = _mm256_set1_epi32((int)PHILOX_M1);
+    for (int round = 0; round < PHILOX_ROUNDS; round++) {
+        __m256i lo0, lo1;
+        __m256i hi0 = mulhilo_avx2(c[0], m0, &lo0);
+        __m256i hi1 = mulhilo_avx2(c[2], m1, &lo1);
+        __m256i n0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c[1]), _mm256_set1_epi32((int)k0));
+        __m256i n2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c[3]), _mm256_set1_epi32((int)k1));
+        c[0] = n0;
+        c[1] = lo1;
+        c[2] = n2;
+        c[3] = lo0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+}
+
+// FMA would fuse the add and round differently from turbulence_span()
+TARGET_AVX2_NO_FMA void turbulence_span_avx2(int y, int x_begin, int x_end) {
+    const __m256 amount = _mm256_set1_ps(sim->params.turbulence_amount * sqrtf(sim->substep));
+    const __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    int x = x_begin;
+    for (; x + 8 <= x_end; x += 8) {
+        int i = IX(x, y);
+        __m256i c[4] = {
+            _mm256_add_epi32(_mm256_set1_epi32(i + (int)sim->cell_origin), lane),
+            _mm256_set1_epi32((int)sim->noise_step),
+            _mm256_set1_epi32(NOISE_STREAM_TURBULENCE),
+            _mm256_setzero_si256()
+        };
+        philox4x32_avx2(c, sim->noise_seed, 0);
+        // Same products as rng_signed() * amount in the scalar path
+        __m256 noise_x = _mm256_mul_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(c[0]), scale), amount);
+        __m256 noise_y = _mm256_mul_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(c[1]), scale), amount);
+        _mm256_storeu_ps(sim->fields.velocity_x + i, _mm256_add_ps(_mm256_loadu_ps(sim->fields.velocity_x + i), noise_x));
+        _mm256_storeu_ps(sim->fields.velocity_y + i, _mm256_add_ps(_mm256_loadu_ps(sim->fields.velocity_y + i), noise_y));
+    }
+    turbulence_span(y, x, x_end);
+}
+
+TARGET_AVX2 void advect_span_avx2(int y, int x_begin, int x_end) {
+    const FieldSet src = sim->prev_fields;
+    const __m256 lane = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+    const __m256 lo = _mm256_set1_ps(0.5f);
+    const __m256 hi_x = _mm256_set1_ps(sim->grid_width - 1.5f);
+    const __m256 lo_y = _mm256_set1_ps(sim->origin_y + 0.5f);
+    const __m256 hi_y = _mm256_set1_ps((sim->origin_y + sim->grid_height) - 1.5f);
+    const __m256i origin = _mm256_set1_epi32(sim->origin_y);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 h = _mm256_set1_ps(sim->substep);
+    const __m256i stride = _mm256_set1_epi32(sim->grid_width);
+    const __m256 row = _mm256_set1_ps((float)(y + sim->origin_y));
+
+    int x = x_begin;
+    for (; x + 8 <= x_end; x += 8) {
+        int i = IX(x, y);
+        __m256 prev_x = _mm256_sub_ps(_mm256_add_ps(_mm256_set1_ps((float)x), lane),
+                                      _mm256_mul_ps(h, _mm256_loadu_ps(src.velocity_x + i)));
+        __m256 prev_y = _mm256_sub_ps(row, _mm256_mul_ps(h, _mm256_loadu_ps(src.velocity_y + i)));
+        prev_x = _mm256_max_ps(lo, _mm256_min_ps(hi_x, prev_x));
+        prev_y = _mm256_max_ps(lo_y, _mm256_min_ps(hi_y, prev_y));
+
+        // Clamped coordinates are positive, so truncation is floor
+        __m256i x0 = _mm256_cvttps_epi32(prev_x);
+        __m256i y0 = _mm256_cvttps_epi32(prev_y);
+        __m256 s1 = _mm256_sub_ps(prev_x, _mm256_cvtepi32_ps(x0));
+        __m256 t1 = _mm256_sub_ps(prev_y, _mm256_cvtepi32_ps(y0));
+        __m256 s0 = _mm256_sub_ps(one, s1);
+        __m256 t0 = _mm256_sub_ps(one, t1);
+        __m256i i00 = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(y0, origin), stride), x0);
+
+        _mm256_storeu_ps(sim->fields.density + i, bilerp_avx2(src.density, i00, s0, s1, t0, t1));
+        _mm256_storeu_ps(sim->fields.temperature + i, bilerp_avx2(src.temperature, i00, s0, s1, t0, t1));
+        _mm256_storeu_ps(sim->fields.velocity_x + i, bilerp_avx2(src.velocity_x, i00, s0, s1, t0, t1));
+        _mm256_storeu_ps(sim->fields.velocity_y + i, bilerp_avx2(src.velocity_y, i00, s0, s1, t0, t1));
+    }
+    advect_span(y, x, x_end);
+}
+
+TARGET_AVX2 void advect_rows_avx2(void* ctx, int y_begin, int y_end, int thread) {
+    for (int y = y_begin; y < y_end; y++) advect_span_avx2(y, 1, sim->grid_width - 1);
+}
+
+// dither_unit() of cells i..i + 7
+TARGET_AVX2_NO_FMA static inline __m256 dither_avx2(int i, uint32_t key) {
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i h = _mm256_xor_si256(_mm256_add_epi32(_mm256_set1_epi32(i + (int)sim->cell_origin), lane), _mm256_set1_epi32((int)key));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32((int)0x9E3779B1u));
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32((int)0x85EBCA77u));
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+    return _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(h, 8)), _mm256_set1_ps(1.0f / 16777216.0f));
+}
+
+// scalar_get() and scalar_put() on cells i..i + 7
+TARGET_AVX2 static inline __m256 load8_avx2(const void* plane, int i, const int storage, __m256 step) {
+    switch (storage) {
+    case FIELD_STORAGE_FLOAT16:
+        return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)((const uint16_t*)plane + i)));
+    case FIELD_STORAGE_FIXED16:
+        return _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(
+            _mm_loadu_si128((const __m128i*)((const uint16_t*)plane + i)))), step);
+    case FIELD_STORAGE_FIXED8:
+        return _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+            _mm_loadl_epi64((const __m128i*)((const uint8_t*)plane + i)))), step);
+    default:
+        return _mm256_loadu_ps((const float*)plane + i);
+    }
+}
+
+TARGET_AVX2_NO_FMA static inline void store8_avx2(void* plane, int i, __m256 value, const int storage, __m256 inv_step, __m256 dither) {
+    if (storage == FIELD_STORAGE_FLOAT16) {
+        _mm_storeu_si128((__m128i*)((uint16_t*)plane + i), _mm256_cvtps_ph(value, _MM_FROUND_TO_NEAREST_INT));
+    } else if (storage == FIELD_STORAGE_FLOAT32) {
+        _mm256_storeu_ps((float*)plane + i, value);
+    } else {
+        // max() before min() sends NaN to 0 like the scalar path
+        __m256 top = _mm256_set1_ps(storage == FIELD_STORAGE_FIXED8 ? 255.0f : 65535.0f);
+        __m256 q = _mm256_add_ps(_mm256_mul_ps(value, inv_step), dither);
+        q = _mm256_min_ps(_mm256_max_ps(q, _mm256_setzero_ps()), top);
+        __m256i n = _mm256_cvttps_epi32(q);
+        __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(n), _mm256_extracti128_si256(n, 1));
+        if (storage == FIELD_STORAGE_FIXED16) {
+            _mm_storeu_si128((__m128i*)((uint16_t*)plane + i), words);
+        } else {
+            _mm_storel_epi64((__m128i*)((uint8_t*)plane + i), _mm_packus_epi16(words, words));
+        }
+    }
+}
+
+// Gathers eight stored cells by index. The narrow formats gather 32-bit
+// words and keep the low bytes; the extra bytes read lie inside the arena.
+TARGET_AVX2 static inline __m256 gather8_avx2(const void* plane, __m256i index, const int storage, __m256 step) {
+    const __m256i low16 = _mm256_set1_epi32(0xffff);
+    __m256i words;
+    switch (storage) {
+    case FIELD_STORAGE_FLOAT16:
+        words = _mm256_and_si256(_mm256_i32gather_epi32((const int*)plane, index, 2), low16);
+        // Both 128-bit halves pack to the same four halves; keep one of each
+        words = _mm256_permute4x64_epi64(_mm256_packus_epi32(words, words), _MM_SHUFFLE(3, 1, 2, 0));
+        return _mm256_cvtph_ps(_mm256_castsi256_si128(words));
+    case FIELD_STORAGE_FIXED16:
+        words = _mm256_and_si256(_mm256_i32gather_epi32((const int*)plane, index, 2), low16);
+        return _mm256_mul_ps(_mm256_cvtepi32_ps(words), step);
+    case FIELD_STORAGE_FIXED8:
+        words = _mm256_and_si256(_mm256_i32gather_epi32((const int*)plane, index, 1), _mm256_set1_epi32(0xff));
+        return _mm256_mul_ps(_mm256_cvtepi32_ps(words), step);
+    default:
+        return _mm256_i32gather_ps((const float*)plane, index, 4);
+    }
+}
+
+ALWAYS_INLINE TARGET_AVX2 void load_cells_avx2_s(const void* plane, int field, int begin, int count, float* out, const int storage) {
+    const __m256 step = _mm256_set1_ps(storage_step(storage, field));
+    int k = 0;
+    for (; k + 8 <= count; k += 8) _mm256_storeu_ps(out + k, load8_avx2(plane, begin + k, storage, step));
+    load_cells_s(plane, field, begin + k, count - k, out + k, storage);
+}
+
+ALWAYS_INLINE TARGET_AVX2_NO_FMA void store_cells_avx2_s(void* plane, int field, int begin, int count, const float* in, int site, const int storage) {
+    const __m256 inv_step = _mm256_set1_ps(storage_inv_step(storage, field));
+    uint32_t key = dither_key(field, site);
+    int k = 0;
+    for (; k + 8 <= count; k += 8) {
+        __m256 dither = site == DITHER_LOAD ? _mm256_set1_ps(0.5f) : dither_avx2(begin + k, key);
+        store8_avx2(plane, begin + k, _mm256_loadu_ps(in + k), storage, inv_step, dither);
+    }
+    store_cells_s(plane, field, begin + k, count - k, in + k, site, storage);
+}
+
+TARGET_AVX2 void load_cells_avx2(const void* plane, int field, int begin, int count, float* out) {
+    STORAGE_DISPATCH(load_cells_avx2_s(plane, field, begin, count, out, STORAGE));
+}
+
+TARGET_AVX2_NO_FMA void store_cells_avx2(void* plane, int field, int begin, int count, const float* in, int site) {
+    STORAGE_DISPATCH(store_cells_avx2_s(plane, field, begin, count, in, site, STORAGE));
+}
+
+TARGET_AVX2 static inline __m256 bilerp_stored_avx2(const void* plane, __m256i i00, const int storage, __m256 step,
+                                                     __m256 s0, __m256 s1, __m256 t0, __m256 t1) {
+    const __m256i stride = _mm256_set1_epi32(sim->grid_width);
+    const __m256i one = _mm256_set1_epi32(1);
+    __m256i i01 = _mm256_add_epi32(i00, stride);
+    __m256 a00 = gather8_avx2(plane, i00, storage, step);
+    __m256 a01 = gather8_avx2(plane, i01, storage, step);
+    __m256 a10 = gather8_avx2(plane, _mm256_add_epi32(i00, one), storage, step);
+    __m256 a11 = gather8_avx2(plane, _mm256_add_epi32(i01, one), storage, step);
+    __m256 left = _mm256_fmadd_ps(t1, a01, _mm256_mul_ps(t0, a00));
+    __m256 right = _mm256_fmadd_ps(t1, a11, _mm256_mul_ps(t0, a10));
+    return _mm256_fmadd_ps(s1, right, _mm256_mul_ps(s0, left));
+}
+
+ALWAYS_INLINE TARGET_AVX2 void advect_stored_span_avx2_s(int y, int x_begin, int x_end, const int storage) {
+    const FieldSet src = sim->prev_fields;
+    const ScalarSet stored = sim->prev_scalars;
+    const __m256 lane = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+    const __m256 lo = _mm256_set1_ps(0.5f);
+    const __m256 hi_x = _mm256_set1_ps(sim->grid_width - 1.5f);
+    const __m256 lo_y = _mm256_set1_ps(sim->origin_y + 0.5f);
+    const __m256 hi_y = _mm256_set1_ps((sim->origin_y + sim->grid_height) - 1.5f);
+    const __m256i origin = _mm256_set1_epi32(sim->origin_y);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 h = _mm256_set1_ps(sim->substep);
+    const __m256i stride = _mm256_set1_epi32(sim->grid_width);
+    const __m256 row = _mm256_set1_ps((float)(y + sim->origin_y));
+    const __m256 d_step = _mm256_set1_ps(storage_step(storage, SCALAR_DENSITY));
+    const __m256 t_step = _mm256_set1_ps(storage_step(storage, SCALAR_TEMPERATURE));
+    const __m256 d_inv = _mm256_set1_ps(storage_inv_step(storage, SCALAR_DENSITY));
+    const __m256 t_inv = _mm256_set1_ps(storage_inv_step(storage, SCALAR_TEMPERATURE));
+    uint32_t d_key = dither_key(SCALAR_DENSITY, DITHER_ADVECT);
+    uint32_t t_key = dither_key(SCALAR_TEMPERATURE, DITHER_ADVECT);
+
+    int x = x_begin;
+    for (; x + 8 <= x_end; x += 8) {
+        int i = IX(x, y);
+        __m256 prev_x = _mm256_sub_ps(_mm256_add_ps(_mm256_set1_ps((float)x), lane),
+                                      _mm256_mul_ps(h, _mm256_loadu_ps(src.velocity_x + i)));
+        __m256 prev_y = _mm256_sub_ps(row, _mm256_mul_ps(h, _mm256_loadu_ps(src.velocity_y + i)));
+        prev_x = _mm256_max_ps(lo, _mm256_min_ps(hi_x, prev_x));
+        prev_y = _mm256_max_ps(lo_y, _mm256_min_ps(hi_y, prev_y));
+
+        __m256i x0 = _mm256_cvttps_epi32(prev_x);
+        __m256i y0 = _mm256_cvttps_epi32(prev_y);
+        __m256 s1 = _mm256_sub_ps(prev_x, _mm256_cvtepi32_ps(x0));
+        __m256 t1 = _mm256_sub_ps(prev_y, _mm256_cvtepi32_ps(y0));
+        __m256 s0 = _mm256_sub_ps(one, s1);
+        __m256 t0 = _mm256_sub_ps(one, t1);
+        __m256i i00 = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(y0, origin), stride), x0);
+
+        store8_avx2(sim->scalars.density, i, bilerp_stored_avx2(stored.density, i00, storage, d_step, s0, s1, t0, t1),
+                    storage, d_inv, dither_avx2(i, d_key));
+        store8_avx2(sim->scalars.temperature, i, bilerp_stored_avx2(stored.temperature, i00, storage, t_step, s0, s1, t0, t1),
+                    storage, t_inv, dither_avx2(i, t_key));
+        _mm256_storeu_ps(sim->fields.velocity_x + i, bilerp_avx2(src.velocity_x, i00, s0, s1, t0, t1));
+        _mm256_storeu_ps(sim->fields.velocity_y + i, bilerp_avx2(src.velocity_y, i00, s0, s1, t0, t1));
+    }
+    advect_stored_span_s(y, x, x_end, storage);
+}
+
+TARGET_AVX2 void advect_stored_span_avx2(int y, int x_begin, int x_end) {
+    STORAGE_DISPATCH(advect_stored_span_avx2_s(y, x_begin, x_end, STORAGE));
+}
+
+TARGET_AVX2 void advect_stored_rows_avx2(void* ctx, int y_begin, int y_end, int thread) {
+    for (int y = y_begin; y < y_end; y++) advect_stored_span_avx2(y, 1, sim->grid_width - 1);
+}
+
+// SSE has no gather instruction; the taps are loaded lane by lane
+TARGET_SSE41 __m128 bilerp_sse41(const float* f, const int* i00, __m128 s0, __m128 s1, __m128 t0, __m128 t1) {
+    const float* f01 = f + sim->grid_width;
+    __m128 a00 = _mm_setr_ps(f[i00[0]], f[i00[1]], f[i00[2]], f[i00[3]]);
+    __m128 a01 = _mm_setr_ps(f01[i00[0]], f01[i00[1]], f01[i00[2]], f01[i00[3]]);
+    __m128 a10 = _mm_setr_ps(f[i00[0] + 1], f[i00[1] + 1], f[i00[2] + 1], f[i00[3] + 1]);
+    __m128 a11 = _mm_setr_ps(f01[i00[0] + 1], f01[i00[1] + 1], f01[i00[2] + 1], f01[i00[3] + 1]);
+    __m128 left = _mm_add_ps(_mm_mul_ps(t0, a00), _mm_mul_ps(t1, a01));
+    __m128 right = _mm_add_ps(_mm_mul_ps(t0, a10), _mm_mul_ps(t1, a11));
+    return _mm_add_ps(_mm_mul_ps(s0, left), _mm_mul_ps(s1, right));
+}
+
+TARGET_SSE41 void advect_span_sse41(int y, int x_begin, int x_end) {
+    const FieldSet src = sim->prev_fields;
+    const __m128 lane = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+    const __m128 lo = _mm_set1_ps(0.5f);
+    const __m128 hi_x = _mm_set1_ps(sim->grid_width - 1.5f);
+    const __m128 lo_y = _mm_set1_ps(sim->origin_y + 0.5f);
+    const __m128 hi_y = _mm_set1_ps((sim->origin_y + sim->grid_height) - 1.5f);
+    const __m128i origin = _mm_set1_epi32(sim->origin_y);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 h = _mm_set1_ps(sim->substep);
+    const __m128i stride = _mm_set1_epi32(sim->grid_width);
+    const __m128 row = _mm_set1_ps((float)(y + sim->origin_y));
+    int i00[4];
+
+    int x = x_begin;
+    for (; x + 4 <= x_end; x += 4) {
+        int i = IX(x, y);
+        __m128 prev_x = _mm_sub_ps(_mm_add_ps(_mm_set1_ps((float)x), lane),
+                                   _mm_mul_ps(h, _mm_loadu_ps(src.velocity_x + i)));
+        __m128 prev_y = _mm_sub_ps(row, _mm_mul_ps(h, _mm_loadu_ps(src.velocity_y + i)));
+        prev_x = _mm_max_ps(lo, _mm_min_ps(hi_x, prev_x));
+        prev_y = _mm_max_ps(lo_y, _mm_min_ps(hi_y, prev_y));
+
+        __m128i x0 = _mm_cvttps_epi32(prev_x);
+        __m128i y0 = _mm_cvttps_epi32(prev_y);
+        __m128 s1 = _mm_sub_ps(prev_x, _mm_cvtepi32_ps(x0));
+        __m128 t1 = _mm_sub_ps(prev_y, _mm_cvtepi32_ps(y0));
+        __m128 s0 = _mm_sub_ps(one, s1);
+        __m128 t0 = _mm_sub_ps(one, t1);
+        _mm_storeu_si128((__m128i*)i00, _mm_add_epi32(_mm_mullo_epi32(_mm_sub_epi32(y0, origin), stride), x0));
+
+        _mm_storeu_ps(sim->fields.density + i, bilerp_sse41(src.density, i00, s0, s1, t0, t1));
+        _mm_storeu_ps(sim->fields.temperature + i, bilerp_sse41(src.temperature, i00, s0, s1, t0, t1));
+        _mm_storeu_ps(sim->fields.velocity_x + i, bilerp_sse41(src.velocity_x, i00, s0, s1, t0, t1));
+        _mm_storeu_ps(sim->fields.velocity_y + i, bilerp_sse41(src.velocity_y, i00, s0, s1, t0, t1));
+    }
+    advect_span(y, x, x_end);
+}
+
+TARGET_SSE41 void advect_rows_sse41(void* ctx, int y_begin, int y_end, int thread) {
+    for (int y = y_begin; y < y_end; y++) advect_span_sse41(y, 1, sim->grid_width - 1);
+}
+
+TARGET_AVX2 void divergence_rows_avx2(void* ctx, int y_begin, int y_end, int thread) {
+    const float* vx = sim->fields.velocity_x;
+    const float* vy = sim->fields.velocity_y;
+    const __m256 half = _mm256_set1_ps(0.5f);
+    for (int y = y_begin; y < y_end; y++) {
+        int x = 1;
+        for (; x + 8 <= sim->grid_width - 1; x += 8) {
+            int i = IX(x, y);
+            __m256 d = _mm256_sub_ps(_mm256_loadu_ps(vx + i + 1), _mm256_loadu_ps(vx + i - 1));
+            d = _mm256_add_ps(d, _mm256_loadu_ps(vy + i + sim->grid_width));
+            d = _mm256_sub_ps(d, _mm256_loadu_ps(vy + i - sim->grid_width));
+            _mm256_storeu_ps(sim->divergence + i, _mm256_mul_ps(d, half));
+        }
+        divergence_span(y, x, sim->grid_width - 1);
+    }
+}
+
+TARGET_SSE41 void divergence_rows_sse41(void* ctx, int y_begin, int y_end, int thread) {
+    const float* vx = sim->fields.velocity_x;
+    const float* vy = sim->fields.velocity_y;
+    const __m128 half = _mm_set1_ps(0.5f);
+    for (int y = y_begin; y < y_end; y++) {
+        int x = 1;
+        for (; x + 4 <= sim->grid_width - 1; x += 4) {
+            int i = IX(x, y);
+            __m128 d = _mm_sub_ps(_mm_loadu_ps(vx + i + 1), _mm_loadu_ps(vx + i - 1));
+            d = _mm_add_ps(d, _mm_loadu_ps(vy + i + sim->grid_width));
+            d = _mm_sub_ps(d, _mm_loadu_ps(vy + i - sim->grid_width));
+            _mm_storeu_ps(sim->divergence + i, _mm_mul_ps(d, half));
+        }
+        divergence_span(y, x, sim->grid_width - 1);
+    }
+}
+
+TARGET_AVX2 void vorticity_rows_avx2(void* ctx, int y_begin, int y_end, int thread) {
+    const float* vx = sim->fields.velocity_x;
+    const float* vy = sim->fields.velocity_y;
+    const __m256 half = _mm256_set1_ps(0.5f);
+    for (int y = y_begin; y < y_end; y++) {
+        int x = 1;
+        for (; x + 8 <= sim->grid_width - 1; x += 8) {
+            int i = IX(x, y);
+            __m256 dvy = _mm256_sub_ps(_mm256_loadu_ps(vy + i + 1), _mm256_loadu_ps(vy + i - 1));
+            __m256 dvx = _mm256_sub_ps(_mm256_loadu_ps(vx + i + sim->grid_width), _mm256_loadu_ps(vx + i - sim->grid_width));
+            _mm256_storeu_ps(sim->scratch + i, _mm256_sub_ps(_mm256_mul_ps(dvy, half), _mm256_mul_ps(dvx, half)));
+        }
+        vorticity_span(y, x, sim->grid_width - 1);
+    }
+}
+
+TARGET_SSE41 void vorticity_rows_sse41(void* ctx, int y_begin, int y_end, int thread) {
+    const float* vx = sim->fields.velocity_x;
+    const float* vy = sim->fields.velocity_y;
+    const __m128 half = _mm_set1_ps(0.5f);
+    for (int y = y_begin; y < y_end; y++) {
+        int x = 1;
+        for (; x + 4 <= sim->grid_width - 1; x += 4) {
+            int i = IX(x, y);
+            __m128 dvy = _mm_sub_ps(_mm_loadu_ps(vy + i + 1), _mm_loadu_ps(vy + i - 1));
+            __m128 dvx = _mm_sub_ps(_mm_loadu_ps(vx + i + sim->grid_width), _mm_loadu_ps(vx + i - sim->grid_width));
+            _mm_storeu_ps(sim->scratch + i, _mm_sub_ps(_mm_mul_ps(dvy, half), _mm_mul_ps(dvx, half)));
+        }
+        vorticity_span(y, x, sim->grid_width - 1);
+    }
+}
+
+// Lanes with a vanishing gradient compute inf/NaN forces that the mask
+// replaces with zero, matching the scalar branch
+TARGET_AVX2 void confinement_rows_avx2(void* ctx, int y_begin, int y_end, int thread) {
+    float strength = *(const float*)ctx;
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    const __m256 eps = _mm256_set1_ps(1e-6f);
+    const __m256 scale = _mm256_set1_ps(strength);
+    for (int y = y_begin; y < y_end; y++) {
+        int x = 1;
+        for (; x + 8 <= sim->grid_width - 1; x += 8) {
+            int i = IX(x, y);
+            __m256 omega = _mm256_loadu_ps(sim->scratch + i);
+            __m256 east = _mm256_andnot_ps(sign, _mm256_loadu_ps(sim->scratch + i + 1));
+            __m256 west = _mm256_andnot_ps(sign, _mm256_loadu_ps(sim->scratch + i - 1));
+            __m256 north = _mm256_andnot_ps(sign, _mm256_loadu_ps(sim->scratch + i + sim->grid_width));
+            __m256 south = _mm256_andnot_ps(sign, _mm256_loadu_ps(sim->scratch + i - sim->grid_width));
+            __m256 grad_x = _mm256_mul_ps(_mm256_sub_ps(east, west), half);
+            __m256 grad_y = _mm256_mul_ps(_mm256_sub_ps(north, south), half);
+            __m256 mag = _mm256_sqrt_ps(_mm256_fmadd_ps(grad_x, grad_x, _mm256_mul_ps(grad_y, grad_y)));
+            __m256 mask = _mm256_cmp_ps(mag, eps, _CMP_GT_OQ);
+
+            // force = (Ny, -Nx) * omega * strength
+            __m256 k = _mm256_div_ps(_mm256_mul_ps(omega, scale), mag);
+            __m256 force_x = _mm256_and_ps(mask, _mm256_mul_ps(grad_y, k));
+            __m256 force_y = _mm256_and_ps(mask, _mm256_mul_ps(grad_x, k));
+            _mm256_storeu_ps(sim->fields.velocity_x + i, _mm256_add_ps(_mm256_loadu_ps(sim->fields.velocity_x + i), force_x));
+            _mm256_storeu_ps(sim->fields.velocity_y + i, _mm256_sub_ps(_mm256_loadu_ps(sim->fields.velocity_y + i), force_y));
+        }
+        confinement_span(y, x, sim->grid_width - 1, strength);
+    }
+}
+
+TARGET_SSE41 void confinement_rows_sse41(void* ctx, int y_begin, int y_end, int thread) {
+    float strength = *(const float*)ctx;
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    const __m128 eps = _mm_set1_ps(1e-6f);
+    const __m128 scale = _mm_set1_ps(strength);
+    for (int y = y_begin; y < y_end; y++) {
+        int x = 1;
+        for (; x + 4 <= sim->grid_width - 1; x += 4) {
+            int i = IX(x, y);
+            __m128 omega = _mm_loadu_ps(sim->scratch + i);
+            __m128 east = _mm_andnot_ps(sign, _mm_loadu_ps(sim->scratch + i + 1));
+            __m128 west = _mm_andnot_ps(sign, _mm_loadu_ps(sim->scratch + i - 1));
+            __m128 north = _mm_andnot_ps(sign, _mm_loadu_ps(sim->scratch + i + sim->grid_width));
+            __m128 south = _mm_andnot_ps(sign, _mm_loadu_ps(sim->scratch + i - sim->grid_width));
+            __m128 grad_x = _mm_mul_ps(_mm_sub_ps(east, west), half);
+            __m128 grad_y = _mm_mul_ps(_mm_sub_ps(north, south), half);
+            __m128 mag = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(grad_x, grad_x), _mm_mul_ps(grad_y, grad_y)));
+            __m128 mask = _mm_cmpgt_ps(mag, eps);
+
+            __m128 k = _mm_div_ps(_mm_mul_ps(omega, scale), mag);
+            __m128 force_x = _mm_and_ps(mask, _mm_mul_ps(grad_y, k));
+            __m128 force_y = _mm_and_ps(mask, _mm_mul_ps(grad_x, k));
+            _mm_storeu_ps(sim->fields.velocity_x + i, _mm_add_ps(_mm_loadu_ps(sim->fields.velocity_x + i), force_x));
+            _mm_storeu_ps(sim->fields.velocity_y + i, _mm_sub_ps(_mm_loadu_ps(sim->fields.velocity_y + i), force_y));
+        }
+        confinement_span(y, x, sim->grid_width - 1, strength);
+    }
+}
+#endif
+
+SimdLevel simd_detect() {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    // The AVX2 kernels also convert half floats with F16C, which every AVX2 CPU has
+    unsigned eax, ebx, ecx, edx;
+    int f16c = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_F16C);
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && f16c) return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return SIMD_SSE41;
+#endif
+    return SIMD_SCALAR;
+}
+
+// Installs the kernels for the requested level, capped at what the CPU runs
+void simd_select(SimdLevel requested) {
+    SimdLevel supported = simd_detect();
+    simd_level = requested < supported ? requested : supported;
+
+    advect_kernel = advect_rows;
+    advect_span_kernel = advect_span;
+    advect_stored_kernel = advect_stored_rows;
+    advect_stored_span_kernel = advect_stored_span;
+    load_cells_kernel = load_cells;
+    store_cells_kernel = store_cells;
+    turbulence_span_kernel = turbulence_span;
+    divergence_kernel = divergence_rows;
+    vorticity_kernel = vorticity_rows;
+    confinement_kernel = confinement_rows;
+#ifdef HAVE_X86_SIMD
+    if (simd_level == SIMD_AVX2) {
+        advect_kernel = advect_rows_avx2;
+        advect_span_kernel = advect_span_avx2;
+        advect_stored_kernel = advect_stored_rows_avx2;
+        advect_stored_span_kernel = advect_stored_span_avx2;
+        load_cells_kernel = load_cells_avx2;
+        store_cells_kernel = store_cells_avx2;
+        turbulence_span_kernel = turbulence_span_avx2;
+        divergence_kernel = divergence_rows_avx2;
+        vorticity_kernel = vorticity_rows_avx2;
+        confinement_kernel = confinement_rows_avx2;
+    } else if (simd_level == SIMD_SSE41) {
+        advect_kernel = advect_rows_sse41;
+        advect_span_kernel = advect_span_sse41;
+        divergence_kernel = divergence_rows_sse41;
+        vorticity_kernel = vorticity_rows_sse41;
+        confinement_kernel = confinement_rows_sse41;
+    }
+#endif
+}
+
+// FNV-1a, continued from hash; start from FLUID_HASH_SEED
+uint64_t fluid_hash(uint64_t hash, const void* data, size_t bytes) {
+    const unsigned char* p = data;
+    for (size_t i = 0; i < bytes; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// FNV-1a over the raw bits of the simulated fields as stored, boundary
+// included, to catch any numerical change between builds
+uint64_t fluid_checksum() {
+    const void* planes[4] = {sim->scalars.density, sim->scalars.temperature, sim->fields.velocity_x, sim->fields.velocity_y};
+    size_t element[4] = {storage_bytes(sim->scalar_storage), storage_bytes(sim->scalar_storage), sizeof(float), sizeof(float)};
+    uint64_t hash = FLUID_HASH_SEED;
+    for (int p = 0; p < 4; p++) hash = fluid_hash(hash, planes[p], (size_t)sim->grid_size * element[p]);
+    if (sim->detail) hash = detail_hash(sim->detail, hash);
+    return hash;
+}
+
+// Spreads the diffusion tuned for full_iterations sweeps over the ones the
+// effort allows, so fewer sweeps cost accuracy rather than viscosity
+void diffuse_substep(float amount, int iterations, int full_iterations, int decay) {
+    if (iterations < 1) iterations = 1;
+    diffuse_velocity(amount * sim->substep * full_iterations / iterations, iterations, decay);
+}
+
+void run_stage(SimulationStage stage) {
+    switch (stage) {
+    case STAGE_TILES:
+        if (sim->sparse_tiles) update_tiles();
+        break;
+    case STAGE_ADVECTION:
+        if (sim->obstacles) obstacles_step(sim->obstacles);
+        advect();
+        if (sim->detail) detail_advect(sim->detail);
+        break;
+    case STAGE_FORCES:
+        add_forces();
+        break;
+    case STAGE_VORTICITY:
+        if (sim->effort.vorticity) apply_vorticity_confinement(sim->params.vorticity_strength * sim->substep);
+        break;
+    case STAGE_VISCOSITY:
+        diffuse_substep(0.008f, sim->effort.viscosity_iterations, VISCOSITY_ITERATIONS, 0);
+        break;
+    case STAGE_DIVERGENCE:
+        calculate_divergence();
+        break;
+    case STAGE_PRESSURE_SOLVE:
+        solve_pressure();
+        break;
+    case STAGE_PRESSURE_APPLY:
+        apply_pressure();
+        break;
+    case STAGE_DAMPING:
+        diffuse_substep(0.05f, sim->effort.damping_iterations, DAMPING_ITERATIONS, 1);
+        break;
+    case STAGE_PARTICLES:
+        if (sim->particles) particles_advect(sim->particles);
+        break;
+    default:
+        break;
+    }
+    // The divergence and the pressure are only read within the solve, whose
+    // halo rows the solver refreshes itself
+    if (sim->slab && stage != STAGE_TILES && stage != STAGE_DIVERGENCE && stage != STAGE_PRESSURE_SOLVE &&
+        stage != STAGE_PARTICLES) {
+        exchange_state();
+    }
+}
+
+// Advances dt seconds. Each substep is sized from the speed measured after
+// the previous projection so it moves no cell more than cfl_limit cells,
+// unless that would take more than the remaining substep budget. Returns
+// the number of substeps taken.
+int update_simulation(float dt) {
+    float remaining = dt * REFERENCE_RATE;
+    int taken = 0;
+    memset(sim->stage_seconds, 0, sizeof(sim->stage_seconds));
+    sim->pressure_work = 0;
+    while (remaining > 0.0f && taken < sim->max_substeps) {
+        int left = sim->max_substeps - taken;
+        float needed = ceilf(remaining * sim->max_speed / sim->cfl_limit);
+        int count = needed < 1.0f ? 1 : needed > left ? left : (int)needed;
+        sim->substep = remaining / count;
+
+        if (sim->emit_sources) sim->emit_sources();
+        // Always timed: a governor adapts the effort from these
+        for (int stage = 0; stage < STAGE_COUNT; stage++) {
+            double start = timer_seconds();
+            run_stage(stage);
+            double end = timer_seconds();
+            sim->stage_seconds[stage] += end - start;
+            if (profile_enabled) profile_record(stage_names[stage], start, end);
+        }
+        taken++;
+        sim->noise_step++;
+        sim->noise_time += sim->substep;
+        // The last substep takes what is left exactly, without rounding error
+        if (count == 1) break;
+        remaining -= sim->substep;
+    }
+    sim->substep = 1.0f;
+    sim->substeps_taken = taken;
+    profile_counter("substeps", taken);
+    profile_counter("max_speed", sim->max_speed);
+    if (sim->particles) profile_counter("particles", sim->particles->live);
+    return taken;
+}
+
+void* aligned_block(size_t bytes) {
+#ifdef _WIN32
+    return _aligned_malloc(bytes, 64);
+#else
+    void* p = NULL;
+    return posix_memalign(&p, 64, bytes) == 0 ? p : NULL;
+#endif
+}
+
+void aligned_block_free(void* p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+// (Re)allocates the arena for a width x height grid, boundary ring included,
+// and clears the state. Returns 0 and keeps the current grid when the size
+// is out of range or the allocation fails.
+int fluid_resize(int width, int height) {
+    if (width < MIN_GRID_SIZE || height < MIN_GRID_SIZE ||
+        width > MAX_GRID_SIZE || height > MAX_GRID_SIZE) {
+        return 0;
+    }
+
+    size_t bytes = state_bytes(width, height) + multigrid_bytes(width - 2, height - 2) +
+                   tile_bytes(width, height) +
+                   align64(((width - 1) / CURL_CELL + 2) * curl_lattice_rows(height) * sizeof(float)) +
+                   align64(width * sizeof(float)) + align64(width * sizeof(int));
+    if (bytes != sim->arena.size) {
+        unsigned char* base = aligned_block(bytes);
+        if (!base) return 0;
+        aligned_block_free(sim->arena.base);
+        sim->arena.base = base;
+        sim->arena.size = bytes;
+    }
+    memset(sim->arena.base, 0, sim->arena.size);
+    sim->arena.used = 0;
+
+    sim->grid_width = width;
+    sim->grid_height = height;
+    sim->grid_size = width * height;
+    sim->cell_origin = (uint32_t)sim->origin_y * (uint32_t)width;
+    for (int p = 0; p < PLANE_COUNT; p++) {
+        size_t element = is_scalar_plane(p) ? storage_bytes(sim->scalar_storage) : sizeof(float);
+        sim->field_planes[p] = arena_alloc(&sim->arena, (size_t)sim->grid_size * element);
+    }
+    sim->pressure = sim->field_planes[PLANE_PRESSURE];
+    sim->divergence = sim->field_planes[PLANE_DIVERGENCE];
+    sim->scratch = sim->field_planes[PLANE_SCRATCH];
+
+    sim->mg_level_count = 0;
+    multigrid_init();
+    sim->tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    sim->tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    sim->tile_active = arena_alloc(&sim->arena, (size_t)sim->tiles_x * sim->tiles_y);
+    sim->tile_processed = arena_alloc(&sim->arena, (size_t)sim->tiles_x * sim->tiles_y);
+    sim->tile_row_flags = arena_alloc(&sim->arena, (size_t)height * sim->tiles_x);
+    sim->curl_lattice_width = (width - 1) / CURL_CELL + 2;
+    sim->curl_lattice_height = curl_lattice_rows(height);
+    sim->curl_lattice = arena_alloc(&sim->arena, (size_t)sim->curl_lattice_width * sim->curl_lattice_height * sizeof(float));
+    sim->curl_weight = arena_alloc(&sim->arena, (size_t)width * sizeof(float));
+    sim->curl_column = arena_alloc(&sim->arena, (size_t)width * sizeof(int));
+    for (int x = 0; x < width; x++) {
+        sim->curl_column[x] = x / CURL_CELL;
+        sim->curl_weight[x] = smoothstep01((float)(x % CURL_CELL) / CURL_CELL);
+    }
+    fft_clear_plans();
+    if (sim->detail) detail_fit(sim->detail);
+    // Obstacles that no longer fit are dropped rather than left laid out for the old grid
+    if (sim->obstacles && !obstacles_fit(sim->obstacles)) {
+        obstacles_destroy(sim->obstacles);
+        sim->obstacles = NULL;
+    }
+    init_grid();
+    return 1;
+}
+
+// Bilinear sample of a whole-grid plane at a fractional cell position
+float sample_plane(const float* plane, int width, int height, float x, float y) {
+    x = fmaxf(0.0f, fminf(width - 1.001f, x));
+    y = fmaxf(0.0f, fminf(height - 1.001f, y));
+    int x0 = (int)x;
+    int y0 = (int)y;
+    float s = x - x0;
+    float t = y - y0;
+    const float* row = plane + (size_t)y0 * width + x0;
+    float top = row[0] + (row[1] - row[0]) * s;
+    float bottom = row[width] + (row[width + 1] - row[width]) * s;
+    return top + (bottom - top) * t;
+}
+
+// Resizes the grid keeping the flow, unlike fluid_resize(): every plane of
+// the state is resampled, with velocities rescaled to the new cell size. The
+// RNG position carries on. Returns 0 and keeps the current grid on failure.
+int fluid_rescale(int width, int height) {
+    int old_width = sim->grid_width;
+    int old_height = sim->grid_height;
+    size_t cells = (size_t)sim->grid_size;
+    float* old = malloc(4 * cells * sizeof(float));
+    if (!old) return 0;
+    fluid_read_cells(sim->scalars.density, 0, sim->grid_size, old);
+    fluid_read_cells(sim->scalars.temperature, 0, sim->grid_size, old + cells);
+    memcpy(old + 2 * cells, sim->fields.velocity_x, cells * sizeof(float));
+    memcpy(old + 3 * cells, sim->fields.velocity_y, cells * sizeof(float));
+    uint32_t noise_step = sim->noise_step;
+    float noise_time = sim->noise_time;
+    float max_speed = sim->max_speed;
+    // Detached so the resize does not clear the tracers
+    ParticlePool* particles = sim->particles;
+    sim->particles = NULL;
+    int resized = fluid_resize(width, height);
+    sim->particles = particles;
+    if (!resized) {
+        free(old);
+        return 0;
+    }
+    sim->noise_step = noise_step;
+    sim->noise_time = noise_time;
+
+    // Interior cells map onto interior cells, centre to centre
+    float scale_x = (float)(old_width - 2) / (width - 2);
+    float scale_y = (float)(old_height - 2) / (height - 2);
+    float row[MAX_GRID_SIZE];
+    for (int p = 0; p < 4; p++) {
+        const float* src = old + p * cells;
+        float speed = p == 2 ? 1.0f / scale_x : p == 3 ? 1.0f / scale_y : 1.0f;
+        for (int y = 0; y < height; y++) {
+            float oy = (y - 0.5f) * scale_y + 0.5f;
+            for (int x = 0; x < width; x++) {
+                row[x] = sample_plane(src, old_width, old_height, (x - 0.5f) * scale_x + 0.5f, oy) * speed;
+            }
+            if (p < 2) {
+                fluid_write_cells(p ? sim->scalars.temperature : sim->scalars.density, IX(0, y), width, row);
+            } else {
+                memcpy((p == 2 ? sim->fields.velocity_x : sim->fields.velocity_y) + IX(0, y), row, width * sizeof(float));
+            }
+        }
+    }
+    free(old);
+    set_bnd(1, sim->fields.velocity_x);
+    set_bnd(2, sim->fields.velocity_y);
+    sim->max_speed = max_speed / fminf(scale_x, scale_y);
+    if (particles) particles_rescale(particles, 1.0f / scale_x, 1.0f / scale_y);
+    stamps_rescale(1.0f / scale_x, 1.0f / scale_y);
+    // The fine scalars start over from the resampled ones
+    if (sim->detail) detail_fill(sim->detail);
+    return 1;
+}
+
+// Switches how density and temperature are stored. A grid already
+// allocated is reallocated and cleared; on failure nothing changes.
+int fluid_set_storage(FieldStorage storage) {
+    if (storage < 0 || storage >= FIELD_STORAGE_COUNT) return 0;
+    FieldStorage previous = sim->scalar_storage;
+    sim->scalar_storage = storage;
+    if (sim->grid_width && !fluid_resize(sim->grid_width, sim->grid_height)) {
+        sim->scalar_storage = previous;
+        return 0;
+    }
+    return 1;
+}
+
+void fluid_shutdown() {
+    fft_clear_plans();
+    aligned_block_free(sim->arena.base);
+    sim->arena = (Arena){0};
+    sim->grid_width = sim->grid_height = sim->grid_size = 0;
+}
+
+// A separate simulation with its own arena and the default settings. The
+// arena is first touched by the calling thread, so on a NUMA machine create
+// it from the thread that will step it. The caller's sim is left as it was.
+Simulation* simulation_create(int width, int height) {
+    Simulation* created = malloc(sizeof(Simulation));
+    if (!created) return NULL;
+    *created = (Simulation)SIMULATION_DEFAULTS;
+
+    Simulation* previous = sim;
+    sim = created;
+    int ok = fluid_resize(width, height);
+    sim = previous;
+    if (!ok) {
+        free(created);
+        return NULL;
+    }
+    return created;
+}
+
+void simulation_destroy(Simulation* simulation) {
+    if (!simulation) return;
+    Simulation* previous = sim;
+    sim = simulation;
+    fluid_shutdown();
+    sim = previous == simulation ? &default_simulation : previous;
+    free(simulation);
+}
+
+// The parameter called name, or NULL; names are in fluid_param_names
+float* fluid_param(FluidParams* params, const char* name) {
+    float* values[FLUID_PARAM_COUNT] = {
+        &params->buoyancy, &params->turbulence_amount, &params->vorticity_strength,
+        &params->density_decay, &params->temperature_decay, &params->mouse_force
+    };
+    for (int p = 0; p < FLUID_PARAM_COUNT; p++) {
+        if (strcmp(name, fluid_param_names[p]) == 0) return values[p];
+    }
+    return NULL;
+}
+
+// Index of name in names, ignoring case, or -1
+int find_name(const char* name, const char* const* names, int count) {
+    for (int i = 0; i < count; i++) {
+        if (strcasecmp(name, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// Heights are measured up from the floor row, the last one inside the walls
+void fluid_summary(FluidSummary* summary) {
+    double density_sum = 0.0;
+    double energy = 0.0;
+    double moment = 0.0;
+    int top = -1;
+    float density_row[MAX_GRID_SIZE];
+    for (int y = 1; y < sim->grid_height - 1; y++) {
+        int height = sim->grid_height - 2 - y;
+        double row_density = 0.0;
+        const float* density = scalar_row(SCALAR_DENSITY, density_row, y, 1, sim->grid_width - 1);
+        for (int x = 1; x < sim->grid_width - 1; x++) {
+            int i = IX(x, y);
+            float d = density[x];
+            float vx = sim->fields.velocity_x[i];
+            float vy = sim->fields.velocity_y[i];
+            row_density += d;
+            energy += vx * vx + vy * vy;
+            if (d > PLUME_EPSILON && height > top) top = height;
+        }
+        density_sum += row_density;
+        moment += row_density * height;
+    }
+    summary->total_density = density_sum;
+    summary->kinetic_energy = 0.5 * energy;
+    summary->plume_height = top < 0 ? 0.0 : top + 1;
+    summary->centroid_height = density_sum > 0.0 ? moment / density_sum : 0.0;
+}
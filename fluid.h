@@ -0,0 +1,389 @@
+#ifndef FLUID_H
+#define FLUID_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "thread_pool.h"
+
+#define DEFAULT_GRID_WIDTH 200
+#define DEFAULT_GRID_HEIGHT 150
+#define MIN_GRID_SIZE 8
+#define MAX_GRID_SIZE 4096
+#define TILE_SIZE 16
+// Velocities are in cells per reference step, the fixed step the constants
+// were tuned at; a dt of 1 / REFERENCE_RATE seconds is one such step
+#define REFERENCE_RATE 60.0f
+#define DEFAULT_CFL 6.0f
+#define DEFAULT_MAX_SUBSTEPS 8
+#define MULTIGRID_MAX_LEVELS 12
+#define MULTIGRID_MAX_CYCLES 10
+#define PRESSURE_ITERATIONS 100
+#define PRESSURE_TOLERANCE 1e-3f
+#define VISCOSITY_ITERATIONS 2
+#define DAMPING_ITERATIONS 4
+#define FFT_PLAN_CACHE 8
+#define FLUID_HASH_SEED 14695981039346656037ull
+
+#define IX(x, y) ((y) * sim->grid_width + (x))
+
+// One plane per quantity so a pass only streams the fields it uses
+typedef struct {
+    float* density;
+    float* temperature;
+    float* velocity_x;
+    float* velocity_y;
+} FieldSet;
+
+// How density and temperature are stored. Velocity and pressure always stay
+// fp32; computation is fp32 throughout, the compact formats only convert on
+// load and store. The fixed-point formats cover [0, range] of each field
+// with stochastic rounding, so slow decay still reaches zero.
+typedef enum {
+    FIELD_STORAGE_FLOAT32,
+    FIELD_STORAGE_FLOAT16,
+    FIELD_STORAGE_FIXED16,
+    FIELD_STORAGE_FIXED8,
+    FIELD_STORAGE_COUNT
+} FieldStorage;
+
+enum {
+    SCALAR_DENSITY,
+    SCALAR_TEMPERATURE,
+    SCALAR_COUNT
+};
+
+// The passive scalars as stored. With FIELD_STORAGE_FLOAT32 they alias the
+// FieldSet planes; otherwise those are NULL and these hold the compact ones.
+typedef struct {
+    void* density;
+    void* temperature;
+} ScalarSet;
+
+typedef enum {
+    PRESSURE_SOLVER_GAUSS_SEIDEL,
+    PRESSURE_SOLVER_MULTIGRID,
+    PRESSURE_SOLVER_SPECTRAL,
+    PRESSURE_SOLVER_COUNT
+} PressureSolver;
+
+typedef enum {
+    VISCOSITY_SOLVER_GAUSS_SEIDEL,
+    VISCOSITY_SOLVER_SPECTRAL,
+    VISCOSITY_SOLVER_COUNT
+} ViscositySolver;
+
+typedef enum {
+    SIMD_SCALAR,
+    SIMD_SSE41,
+    SIMD_AVX2,
+    SIMD_LEVEL_COUNT
+} SimdLevel;
+
+typedef enum {
+    TURBULENCE_WHITE,    // Independent random kick per cell
+    TURBULENCE_CURL,     // Smooth, divergence-free, slowly drifting swirl
+    TURBULENCE_MODE_COUNT
+} TurbulenceMode;
+
+// update_simulation() runs these in order once per substep; the benchmark
+// times them one by one
+typedef enum {
+    STAGE_TILES,         // Refresh the active tile set from the incoming state
+    STAGE_ADVECTION,     // After moving the obstacles; then the detail grid's scalars, when one is attached
+    STAGE_FORCES,        // Buoyancy and turbulence in one sweep, then the stamps
+    STAGE_VORTICITY,
+    STAGE_VISCOSITY,
+    STAGE_DIVERGENCE,
+    STAGE_PRESSURE_SOLVE,
+    STAGE_PRESSURE_APPLY,
+    STAGE_DAMPING,       // Extra velocity diffusion after the projection, and the scalar decay
+    STAGE_PARTICLES,     // Tracers carried through the final velocity; nothing without a pool
+    STAGE_COUNT
+} SimulationStage;
+
+enum {
+    PLANE_DENSITY_0,
+    PLANE_TEMPERATURE_0,
+    PLANE_VELOCITY_X_0,
+    PLANE_VELOCITY_Y_0,
+    PLANE_DENSITY_1,
+    PLANE_TEMPERATURE_1,
+    PLANE_VELOCITY_X_1,
+    PLANE_VELOCITY_Y_1,
+    PLANE_PRESSURE,
+    PLANE_DIVERGENCE,
+    PLANE_SCRATCH,
+    PLANE_COUNT
+};
+
+// Every plane and multigrid array is carved out of one 64-byte aligned block
+// that fluid_resize() sizes for the grid; nothing is allocated per step
+typedef struct {
+    unsigned char* base;
+    size_t size;
+    size_t used;
+} Arena;
+
+// Level 0 aliases the pressure, divergence and scratch planes; every coarser
+// level merges 2x2 cells. Cells are finite volumes measured in finest-grid
+// units, so a level built from an odd count ends in a narrower cell and the
+// walls stay where they are on the fine grid. The walls carry no flux, which
+// is the same zero-gradient condition set_bnd(0, ...) imposes.
+typedef struct {
+    int width;   // including the one-cell boundary ring
+    int height;
+    float* u;
+    float* f;
+    float* r;
+    float* inv_diag;
+    float* cell_w;    // per column
+    float* cell_h;    // per row
+    float* k_west;    // per column, face coefficient over cell width
+    float* k_east;
+    float* k_south;   // per row, face coefficient over cell height
+    float* k_north;
+    int* prolong_x;   // per column, coarse cell to the left of the centre
+    float* prolong_wx;
+    int* prolong_y;
+    float* prolong_wy;
+} MultigridLevel;
+
+struct FftPlan;
+struct ParticlePool;
+struct DetailGrid;
+struct ObstacleMap;
+
+// Set on a simulation that is one horizontal slab of a grid split across
+// processes; see distributed.h. Local rows own_begin..own_end - 1 belong to
+// this slab and the rest are halo copies of the neighbours' rows. The passes
+// treat a halo edge as a wall, which is wrong only inside the halo, and
+// exchange() overwrites the halo from the neighbours after every pass that
+// writes the plane.
+typedef struct Slab {
+    int own_begin;
+    int own_end;
+    void (*exchange)(struct Slab* slab, void* plane, size_t element_bytes);
+    float (*reduce_max)(struct Slab* slab, float value);    // Max over every slab
+    void* context;
+} Slab;
+
+// The tunable physics, per simulation. Rates are per reference step and are
+// scaled to the substep where they are applied.
+typedef struct {
+    float buoyancy;              // Upward push per unit of density times temperature
+    float turbulence_amount;     // White-noise velocity kick
+    float vorticity_strength;    // Vorticity confinement
+    float density_decay;         // Fraction of density kept
+    float temperature_decay;
+    float mouse_force;           // Push at the centre of the mouse force
+} FluidParams;
+
+// How hard the solvers work each substep. The defaults are what the
+// constants were tuned with; governor.h trades them for frame time.
+typedef struct {
+    int pressure_iterations;     // Gauss-Seidel iterations per solve
+    int multigrid_max_cycles;    // V-cycles per solve at most
+    float pressure_tolerance;    // Multigrid stops below this residual relative to max |divergence|
+    int viscosity_iterations;
+    int damping_iterations;
+    int vorticity;               // 0 skips vorticity confinement
+    int pressure_warm_start;     // Start each solve from the last pressure instead of zero
+} SolverEffort;
+
+#define DEFAULT_SOLVER_EFFORT {PRESSURE_ITERATIONS, MULTIGRID_MAX_CYCLES, PRESSURE_TOLERANCE, \
+                               VISCOSITY_ITERATIONS, DAMPING_ITERATIONS, 1, 0}
+
+#define DEFAULT_FLUID_PARAMS {0.15f, 0.08f, 0.015f, 0.998f, 0.998f, 0.5f}
+#define FLUID_PARAM_COUNT 6
+
+extern const char* fluid_param_names[FLUID_PARAM_COUNT];
+
+#define MAX_STAMPS 256
+#define STAMP_DEFAULT_RADIUS 10.0f
+
+// How a stamp pushes the velocity; any shape can also emit, drain or heat
+typedef enum {
+    STAMP_RADIAL,        // Away from the centre of a disc, towards it when force is negative
+    STAMP_DIRECTIONAL,   // Along the direction, over a disc
+    STAMP_VORTEX,        // Around the centre of a disc, clockwise on screen
+    STAMP_LINE,          // Along the direction, within radius of a segment
+    STAMP_BOX,           // Along the direction, evenly over a rectangle
+    STAMP_SHAPE_COUNT
+} StampShape;
+
+// A force, emitter, sink or heat source applied every substep to the cells
+// it covers. Rates are per reference step at full weight, which falls from
+// 1 at the centre or the segment to 0 at radius and is 1 all over a box.
+// Positions are cells, with global rows for a slab.
+typedef struct {
+    StampShape shape;
+    float x, y;                  // Centre, start of a line or a corner of a box
+    float x2, y2;                // End of a line or the opposite corner of a box
+    float radius;
+    float force;                 // Velocity added
+    float dir_x, dir_y;          // Normalised by stamp_add()
+    float density;               // Smoke added
+    float temperature;           // Heat added; negative cools
+    float drain;                 // Share of smoke and heat removed, for sinks
+    float min_density;           // When positive, cells no denser than this are left alone
+    // Bounding box set by stamp_add(), cells begin..end - 1 before clipping
+    int x_begin, x_end;
+    int y_begin, y_end;
+} Stamp;
+
+extern const char* stamp_shape_names[STAMP_SHAPE_COUNT];
+
+// One independent simulation: grid, state, settings and solver caches.
+// Everything in fluid.c works on the one the calling thread has in sim, so
+// any number can be stepped at once from different threads.
+typedef struct Simulation {
+    Arena arena;
+    // Grid dimensions including the boundary ring; set by fluid_resize()
+    int grid_width;
+    int grid_height;
+    int grid_size;
+    // Global row of local row 0 and its first cell, nonzero only for a slab.
+    // Set origin_y before fluid_resize(); random draws are keyed by global
+    // cell so the slabs of a grid draw what the whole grid would.
+    int origin_y;
+    uint32_t cell_origin;
+    Slab* slab;
+
+    void* field_planes[PLANE_COUNT];
+    FieldSet fields;             // Current state, read and written by every pass
+    FieldSet prev_fields;        // Previous state, the advection source
+    FieldStorage scalar_storage;
+    ScalarSet scalars;           // Density and temperature of fields and prev_fields as stored
+    ScalarSet prev_scalars;
+    float* pressure;
+    float* divergence;
+    float* scratch;
+
+    FluidParams params;
+    PressureSolver pressure_solver;
+    ViscositySolver viscosity_solver;
+    SolverEffort effort;
+    float pressure_residual;     // Max residual of the last solve relative to max |divergence|
+    float max_divergence;        // Max |divergence| entering the last solve, kept while profiling
+
+    // Sparse stepping over TILE_SIZE tiles; 0 runs every pass on the whole grid
+    int sparse_tiles;
+    int tiles_x;
+    int tiles_y;
+    uint8_t* tile_active;        // Tiles holding smoke or fast flow after the last step
+    uint8_t* tile_processed;     // Active tiles plus a one-tile halo; the sparse passes cover these
+    uint8_t* tile_row_flags;     // Per grid row and tile column, scratch for update_tiles()
+
+    // Time-step control. update_simulation(dt) splits dt into substeps that
+    // move no cell further than cfl_limit cells, at most max_substeps of
+    // them. substep is the length of the one being run, in reference steps;
+    // max_speed is the fastest cell after the last projection, in cells per
+    // reference step.
+    float cfl_limit;
+    int max_substeps;
+    float substep;
+    float max_speed;
+    // What the last update_simulation() cost: wall time per stage and the
+    // Gauss-Seidel iterations or multigrid cycles the pressure solves ran
+    double stage_seconds[STAGE_COUNT];
+    int pressure_work;
+    int substeps_taken;
+
+    // Random draws are keyed by seed, step and cell rather than drawn from a
+    // shared sequence; see rng.h
+    uint32_t noise_seed;
+    uint32_t noise_step;
+    float noise_time;            // Reference steps simulated, animates the curl field
+    TurbulenceMode turbulence_mode;
+    float* curl_lattice;         // Stream function at the lattice points for the current step
+    float* curl_weight;          // Per column: smoothed position within its lattice cell
+    int* curl_column;            // Per column: lattice cell index
+    int curl_lattice_width;
+    int curl_lattice_height;
+
+    float emission_density_amount;
+    // Called at the start of every substep to add smoke; emitters added with
+    // add_smoke() there are scaled to the substep
+    void (*emit_sources)();
+    // Tracers spawned by add_smoke() and advected every substep, or NULL;
+    // owned by the caller, see particles.h
+    struct ParticlePool* particles;
+    // Finer density and temperature the smoke is carried on, or NULL; owned
+    // by the caller, see detail.h
+    struct DetailGrid* detail;
+    // Solid cells inside the box, or NULL; owned by the caller, see
+    // obstacles.h, except that fluid_resize() destroys them and sets NULL
+    // when they cannot be laid out for the new grid. Not supported on a slab.
+    struct ObstacleMap* obstacles;
+    // Applied in STAGE_FORCES every substep, in order, in one pass over the
+    // rows they cover; front ends rebuild the batch each frame or keep it
+    Stamp stamps[MAX_STAMPS];
+    int stamp_count;
+
+    MultigridLevel mg_levels[MULTIGRID_MAX_LEVELS];
+    int mg_level_count;
+    struct FftPlan* fft_plans[FFT_PLAN_CACHE];
+    int fft_plan_count;
+    float partial_max[MAX_THREADS];    // Per-thread results of the parallel reductions
+    double partial_sum[MAX_THREADS];
+} Simulation;
+
+// Every thread starts with sim pointing here; the front ends use only this one
+extern Simulation default_simulation;
+
+// A plane of the current simulation by its offsetof(Simulation, ...), so
+// tables of planes can be built at compile time. Scalar planes may be
+// compact; read them through fluid_read_cells().
+#define SIM_PLANE(offset) (*(void**)((char*)sim + (offset)))
+
+extern const char* pressure_solver_names[PRESSURE_SOLVER_COUNT];
+extern const char* viscosity_solver_names[VISCOSITY_SOLVER_COUNT];
+extern const char* pressure_solver_options[PRESSURE_SOLVER_COUNT];
+extern const char* viscosity_solver_options[VISCOSITY_SOLVER_COUNT];
+extern const char* simd_level_names[SIMD_LEVEL_COUNT];
+extern SimdLevel simd_level;
+extern const char* stage_names[STAGE_COUNT];
+extern const char* turbulence_mode_names[TURBULENCE_MODE_COUNT];
+extern const char* field_storage_names[FIELD_STORAGE_COUNT];
+
+// Whole-grid measures for comparing runs
+typedef struct {
+    double total_density;
+    double kinetic_energy;       // Half the sum of squared speeds, cells^2 per reference step^2
+    double plume_height;         // Highest row holding smoke, in cells above the floor
+    double centroid_height;      // Density-weighted mean height above the floor
+} FluidSummary;
+
+Simulation* simulation_create(int width, int height);
+void simulation_destroy(Simulation* simulation);
+float* fluid_param(FluidParams* params, const char* name);
+int find_name(const char* name, const char* const* names, int count);
+void fluid_summary(FluidSummary* summary);
+void fluid_seed(uint32_t seed);
+int fluid_resize(int width, int height);
+int fluid_rescale(int width, int height);
+int fluid_set_storage(FieldStorage storage);
+size_t storage_bytes(FieldStorage storage);
+void fluid_read_cells(const void* plane, int begin, int count, float* out);
+void fluid_write_cells(void* plane, int begin, int count, const float* in);
+void fluid_shutdown();
+void init_grid();
+void add_smoke(int x, int y);
+void add_candle(int x, int y);
+int stamp_add(const Stamp* stamp);
+void stamps_clear();
+Stamp mouse_stamp(int x, int y);
+int stamp_parse(const char* text, Stamp* stamp);
+int stamp_has_scalars(const Stamp* s);
+float stamp_weight(const Stamp* s, float dx, float dy, float* push_x, float* push_y);
+void stamp_scalars(const Stamp* s, float weight, float* density, float* temperature);
+void set_bnd(int b, float* field);
+SimdLevel simd_detect();
+void simd_select(SimdLevel requested);
+uint64_t fluid_hash(uint64_t hash, const void* data, size_t bytes);
+uint64_t fluid_checksum();
+void run_stage(SimulationStage stage);
+int update_simulation(float dt);
+
+#endif
@@ -0,0 +1,211 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "governor.h"
+#include "profile.h"
+
+const GovernorLevel governor_levels[] = {
+    {"full", 1.00f, 2, 4, 1},
+    {"high", 0.70f, 2, 4, 1},
+    {"medium", 0.50f, 2, 3, 1},
+    {"low", 0.35f, 1, 2, 1},
+    {"lower", 0.25f, 1, 2, 0},
+    {"lowest", 0.15f, 1, 1, 0},
+};
+const int governor_level_count = sizeof(governor_levels) / sizeof(governor_levels[0]);
+
+// Grid side, interior, relative to the grid the governor started with
+const float governor_scales[GOVERNOR_SCALES] = {1.0f, 0.75f, 0.5f};
+
+static inline int imin(int a, int b) {
+    return a < b ? a : b;
+}
+
+static inline int imax(int a, int b) {
+    return a > b ? a : b;
+}
+
+SolverEffort governor_effort(const FrameGovernor* governor, int level) {
+    const GovernorLevel* l = &governor_levels[level];
+    SolverEffort effort = governor->full;
+    effort.pressure_iterations = imax(1, (int)lroundf(governor->full.pressure_iterations * l->pressure));
+    effort.multigrid_max_cycles = imax(1, (int)lroundf(governor->full.multigrid_max_cycles * l->pressure));
+    effort.pressure_tolerance = governor->full.pressure_tolerance / l->pressure;
+    effort.viscosity_iterations = imin(governor->full.viscosity_iterations, l->viscosity_iterations);
+    effort.damping_iterations = imin(governor->full.damping_iterations, l->damping_iterations);
+    effort.vorticity = governor->full.vorticity && l->vorticity;
+    effort.pressure_warm_start = 1;
+    return effort;
+}
+
+// Takes over the current simulation's effort as the best level
+void governor_init(FrameGovernor* governor, double budget_seconds) {
+    memset(governor, 0, sizeof(*governor));
+    governor->budget = budget_seconds;
+    governor->full = sim->effort;
+    governor->base_width = governor->width = sim->grid_width;
+    governor->base_height = governor->height = sim->grid_height;
+    sim->effort = governor_effort(governor, 0);
+}
+
+// Pressure iterations or cycles a solve would run at a level. Multigrid
+// stops at its tolerance: from the cycles and residual it ends with now,
+// a stricter tolerance costs the cycles that close the gap at a typical
+// convergence rate.
+double governor_pressure_work(const FrameGovernor* governor, int level) {
+    SolverEffort effort = governor_effort(governor, level);
+    if (sim->pressure_solver == PRESSURE_SOLVER_SPECTRAL) return 1.0;
+    if (sim->pressure_solver == PRESSURE_SOLVER_GAUSS_SEIDEL) return effort.pressure_iterations;
+    double cycles = governor->pressure_work;
+    if (governor->pressure_residual > effort.pressure_tolerance) {
+        cycles += log(effort.pressure_tolerance / governor->pressure_residual) / log(GOVERNOR_MULTIGRID_RATE);
+    }
+    return fmin(cycles, effort.multigrid_max_cycles);
+}
+
+double governor_predict(const FrameGovernor* governor, int level) {
+    SolverEffort effort = governor_effort(governor, level);
+    double substep = governor->fixed_cost +
+                     governor_pressure_work(governor, level) * governor->pressure_cost +
+                     (effort.viscosity_iterations + effort.damping_iterations) * governor->sweep_cost +
+                     (effort.vorticity ? governor->vorticity_cost : 0.0);
+    return governor->substeps * substep;
+}
+
+double average_in(double average, double sample, int first) {
+    return first ? sample : average + (sample - average) * GOVERNOR_SMOOTHING;
+}
+
+// Folds the last update_simulation() into the cost model
+void governor_measure(FrameGovernor* governor) {
+    const double* t = sim->stage_seconds;
+    int substeps = sim->substeps_taken > 0 ? sim->substeps_taken : 1;
+    int first = governor->measured == 0;
+    double total = 0.0;
+    for (int s = 0; s < STAGE_COUNT; s++) total += t[s];
+    double pressure = t[STAGE_PRESSURE_SOLVE];
+    double sweeps = t[STAGE_VISCOSITY] + t[STAGE_DAMPING];
+    double vorticity = sim->effort.vorticity ? t[STAGE_VORTICITY] : 0.0;
+    int sweep_count = (sim->effort.viscosity_iterations + sim->effort.damping_iterations) * substeps;
+
+    governor->frame_seconds = total;
+    governor->substeps = average_in(governor->substeps, substeps, first);
+    governor->fixed_cost = average_in(governor->fixed_cost, (total - pressure - sweeps - vorticity) / substeps, first);
+    if (sim->pressure_work > 0) {
+        governor->pressure_cost = average_in(governor->pressure_cost, pressure / sim->pressure_work, first);
+        governor->pressure_work = average_in(governor->pressure_work, (double)sim->pressure_work / substeps, first);
+        governor->pressure_residual = average_in(governor->pressure_residual, sim->pressure_residual, first);
+    }
+    if (sweep_count > 0) governor->sweep_cost = average_in(governor->sweep_cost, sweeps / sweep_count, first);
+    if (sim->effort.vorticity) {
+        governor->vorticity_cost = average_in(governor->vorticity_cost, vorticity / substeps, first || governor->vorticity_cost == 0.0);
+    }
+    governor->measured++;
+}
+
+void governor_describe(const FrameGovernor* governor, char* text, size_t size) {
+    const SolverEffort* e = &sim->effort;
+    int pressure = sim->pressure_solver == PRESSURE_SOLVER_MULTIGRID ? e->multigrid_max_cycles : e->pressure_iterations;
+    snprintf(text, size, "%s: pressure %d %s, %d+%d sweeps, vorticity %s, grid %dx%d",
+             governor_levels[governor->level].name, pressure,
+             sim->pressure_solver == PRESSURE_SOLVER_MULTIGRID ? "cycles" : "iterations",
+             e->viscosity_iterations, e->damping_iterations, e->vorticity ? "on" : "off",
+             sim->grid_width, sim->grid_height);
+}
+
+void governor_note(FrameGovernor* governor, const char* what) {
+    char effort[128];
+    governor_describe(governor, effort, sizeof(effort));
+    snprintf(governor->decision, sizeof(governor->decision), "%s -> %s (took %.2f ms, predicts %.2f of %.2f ms)",
+             what, effort, governor->frame_seconds * 1e3, governor->predicted * 1e3, governor->budget * 1e3);
+    governor->changed = 1;
+    governor->changes++;
+}
+
+// Resamples the grid to a scale; the per-substep costs follow the cell count
+int governor_rescale(FrameGovernor* governor, int scale) {
+    int width = imax(MIN_GRID_SIZE, (int)lroundf((governor->base_width - 2) * governor_scales[scale]) + 2);
+    int height = imax(MIN_GRID_SIZE, (int)lroundf((governor->base_height - 2) * governor_scales[scale]) + 2);
+    double ratio = (double)width * height / ((double)sim->grid_width * sim->grid_height);
+    if (!fluid_rescale(width, height)) return 0;
+    governor->scale = scale;
+    governor->width = width;
+    governor->height = height;
+    governor->fixed_cost *= ratio;
+    governor->pressure_cost *= ratio;
+    governor->sweep_cost *= ratio;
+    governor->vorticity_cost *= ratio;
+    return 1;
+}
+
+// Call after every update_simulation(); sets the effort for the next one
+void governor_update(FrameGovernor* governor) {
+    governor->changed = 0;
+    governor->frames++;
+    // Resized from outside: that grid is the new full size
+    if (sim->grid_width != governor->width || sim->grid_height != governor->height) {
+        governor->base_width = governor->width = sim->grid_width;
+        governor->base_height = governor->height = sim->grid_height;
+        governor->scale = 0;
+        governor->measured = 0;
+    }
+    governor_measure(governor);
+
+    double fits = governor->budget * GOVERNOR_HEADROOM;
+    int best = governor_level_count - 1;
+    for (int l = 0; l < governor_level_count; l++) {
+        if (governor_predict(governor, l) <= fits) {
+            best = l;
+            break;
+        }
+    }
+
+    int previous = governor->level;
+    if (best > governor->level) {
+        governor->level = best;
+        governor->climb_frames = 0;
+    } else if (best < governor->level &&
+               governor_predict(governor, governor->level - 1) <= governor->budget * GOVERNOR_CLIMB) {
+        if (++governor->climb_frames >= GOVERNOR_CLIMB_FRAMES) {
+            governor->level--;
+            governor->climb_frames = 0;
+        }
+    } else {
+        governor->climb_frames = 0;
+    }
+    sim->effort = governor_effort(governor, governor->level);
+    governor->predicted = governor_predict(governor, governor->level);
+    if (governor->level != previous) {
+        governor_note(governor, governor->level > previous ? "over budget" : "room to spare");
+    }
+
+    // The grid is the last resort, and comes back only with ample room
+    int lowest = governor->level == governor_level_count - 1;
+    governor->over_frames = lowest && governor->predicted > fits ? governor->over_frames + 1 : 0;
+    if (governor->over_frames >= GOVERNOR_SHRINK_FRAMES && governor->scale < GOVERNOR_SCALES - 1) {
+        governor->over_frames = 0;
+        if (governor_rescale(governor, governor->scale + 1)) {
+            governor->predicted = governor_predict(governor, governor->level);
+            governor_note(governor, "over budget at the lowest level, grid shrunk");
+        }
+    }
+    if (governor->level == 0 && governor->scale > 0) {
+        float larger = governor_scales[governor->scale - 1] / governor_scales[governor->scale];
+        int grows = governor->predicted * larger * larger <= governor->budget * GOVERNOR_CLIMB;
+        governor->grow_frames = grows ? governor->grow_frames + 1 : 0;
+        if (governor->grow_frames >= GOVERNOR_GROW_FRAMES) {
+            governor->grow_frames = 0;
+            if (governor_rescale(governor, governor->scale - 1)) {
+                governor->predicted = governor_predict(governor, governor->level);
+                governor_note(governor, "room to spare, grid grown");
+            }
+        }
+    } else {
+        governor->grow_frames = 0;
+    }
+
+    profile_counter("budget_level", governor->level);
+    profile_counter("budget_scale", governor_scales[governor->scale]);
+    profile_counter("predicted_ms", governor->predicted * 1e3);
+}
@@ -0,0 +1,72 @@
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include "fluid.h"
+
+// Adapts the solver effort so update_simulation() stays within a time
+// budget per frame. After each frame governor_update() folds the measured
+// stage times into a per-substep cost model, predicts each quality level's
+// frame time from it and switches to the best level that fits, dropping at
+// once and climbing back one level at a time after a calm spell. When even
+// the lowest level does not fit for a while it shrinks the grid, keeping
+// the flow, and grows it back once the larger grid fits with room to spare.
+// Pressure solves are warm-started from the previous substep throughout.
+
+#define GOVERNOR_HEADROOM 0.9        // Share of the budget a level may be predicted to use
+#define GOVERNOR_CLIMB 0.75          // Predicted share that allows a better level
+#define GOVERNOR_CLIMB_FRAMES 30     // Frames a better level must fit before switching to it
+#define GOVERNOR_SHRINK_FRAMES 20    // Frames over budget at the lowest level before shrinking
+#define GOVERNOR_GROW_FRAMES 120     // Frames the larger grid must fit before growing back
+#define GOVERNOR_SMOOTHING 0.2       // Weight of the newest frame in the cost averages
+#define GOVERNOR_MULTIGRID_RATE 0.2  // Residual reduction per V-cycle assumed for predictions
+#define GOVERNOR_SCALES 3
+
+// One rung of the quality ladder, best first
+typedef struct {
+    const char* name;
+    float pressure;              // Share of the full pressure iterations or multigrid cycles
+    int viscosity_iterations;
+    int damping_iterations;
+    int vorticity;
+} GovernorLevel;
+
+typedef struct {
+    double budget;               // Seconds per frame
+    SolverEffort full;           // The effort at the best level
+    int level;
+    int scale;                   // Index into governor_scales
+    int base_width;              // Grid at scale 0
+    int base_height;
+    int width;                   // Grid the governor last saw or set
+    int height;
+
+    // Costs per substep, averaged over recent frames
+    double fixed_cost;           // Everything the knobs do not touch
+    double pressure_cost;        // Per Gauss-Seidel iteration or multigrid cycle
+    double sweep_cost;           // Per viscosity or damping sweep
+    double vorticity_cost;
+    double pressure_work;        // Iterations or cycles a solve runs at the current level
+    double pressure_residual;    // Relative residual multigrid ends with there
+    double substeps;
+    int measured;                // Frames folded in since the model was reset
+
+    double frame_seconds;        // Last frame as measured
+    double predicted;            // The chosen level's prediction for the next frame
+    int climb_frames;
+    int over_frames;
+    int grow_frames;
+    long long frames;
+    long long changes;
+    char decision[256];          // The last change, for logs and the stats panel
+    int changed;                 // Set by governor_update() when decision is new
+} FrameGovernor;
+
+extern const GovernorLevel governor_levels[];
+extern const int governor_level_count;
+extern const float governor_scales[GOVERNOR_SCALES];
+
+void governor_init(FrameGovernor* governor, double budget_seconds);
+void governor_update(FrameGovernor* governor);
+void governor_describe(const FrameGovernor* governor, char* text, size_t size);
+
+#endif
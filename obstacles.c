@@ -0,0 +1,388 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fluid.h"
+#include "obstacles.h"
+#include "thread_pool.h"
+
+#define SIDE_LEFT 1
+#define SIDE_RIGHT 2
+#define SIDE_ABOVE 4
+#define SIDE_BELOW 8
+
+const char* obstacle_shape_names[OBSTACLE_SHAPE_COUNT] = {"disc", "box"};
+
+// An empty map for the current simulation; NULL when it cannot be allocated
+ObstacleMap* obstacles_create() {
+    ObstacleMap* map = calloc(1, sizeof(ObstacleMap));
+    if (!map) return NULL;
+    if (!obstacles_fit(map)) {
+        obstacles_destroy(map);
+        return NULL;
+    }
+    return map;
+}
+
+void obstacles_destroy(ObstacleMap* map) {
+    if (!map) return;
+    free(map->block);
+    free(map);
+}
+
+// Lays the map out for the current simulation grid, carrying the painted
+// cells and the bodies over interior to interior. Returns 0, leaving the
+// old layout, when the allocation fails.
+int obstacles_fit(ObstacleMap* map) {
+    const int width = sim->grid_width;
+    const int height = sim->grid_height;
+    size_t cells = (size_t)width * height;
+    // A row holds at most width / 2 runs
+    size_t runs = (size_t)height * (width / 2);
+    size_t ints = height + 1 + 2 * runs + cells;
+    char* block = calloc(1, ints * sizeof(int) + 3 * cells);
+    if (!block) return 0;
+
+    int* base = (int*)block;
+    uint8_t* painted = (uint8_t*)(base + ints);
+    if (map->width) {
+        float scale_x = (float)(map->width - 2) / (width - 2);
+        float scale_y = (float)(map->height - 2) / (height - 2);
+        for (int y = 1; y < height - 1; y++) {
+            int oy = 1 + (int)((y - 0.5f) * scale_y);
+            for (int x = 1; x < width - 1; x++) {
+                int ox = 1 + (int)((x - 0.5f) * scale_x);
+                painted[(size_t)y * width + x] = map->painted[(size_t)oy * map->width + ox];
+            }
+        }
+        for (int k = 0; k < map->body_count; k++) {
+            ObstacleBody* body = &map->bodies[k];
+            body->x = (body->x - 0.5f) / scale_x + 0.5f;
+            body->y = (body->y - 0.5f) / scale_y + 0.5f;
+            body->x2 = (body->x2 - 0.5f) / scale_x + 0.5f;
+            body->y2 = (body->y2 - 0.5f) / scale_y + 0.5f;
+            body->radius /= scale_x;
+            body->velocity_x /= scale_x;
+            body->velocity_y /= scale_y;
+        }
+    }
+    free(map->block);
+    map->block = block;
+    map->row_runs = base;
+    map->run_begin = base + height + 1;
+    map->run_end = map->run_begin + runs;
+    map->boundary = map->run_end + runs;
+    map->painted = painted;
+    map->owner = painted + cells;
+    map->boundary_sides = painted + 2 * cells;
+    map->width = width;
+    map->height = height;
+    obstacles_build(map);
+    return 1;
+}
+
+// Paints or erases the interior cells whose centres lie within radius of (x, y)
+void obstacles_paint(ObstacleMap* map, float x, float y, float radius, int solid) {
+    int x_begin = (int)fmaxf(1.0f, ceilf(x - radius));
+    int x_end = (int)fminf(map->width - 1.0f, floorf(x + radius) + 1.0f);
+    int y_begin = (int)fmaxf(1.0f, ceilf(y - radius));
+    int y_end = (int)fminf(map->height - 1.0f, floorf(y + radius) + 1.0f);
+    for (int cy = y_begin; cy < y_end; cy++) {
+        for (int cx = x_begin; cx < x_end; cx++) {
+            float dx = cx - x;
+            float dy = cy - y;
+            if (dx * dx + dy * dy <= radius * radius) map->painted[(size_t)cy * map->width + cx] = solid ? 1 : 0;
+        }
+    }
+    map->dirty = 1;
+}
+
+// Removes every painted cell and body
+void obstacles_clear(ObstacleMap* map) {
+    memset(map->painted, 0, (size_t)map->width * map->height);
+    map->body_count = 0;
+    map->dirty = 1;
+}
+
+// Replaces the painted cells with a mask of width x height, row 0 at the
+// top, stretched over the interior; nonzero is solid
+void obstacles_load_mask(ObstacleMap* map, const uint8_t* mask, int width, int height) {
+    memset(map->painted, 0, (size_t)map->width * map->height);
+    for (int y = 1; y < map->height - 1; y++) {
+        int my = (int)((y - 0.5f) * height / (map->height - 2));
+        const uint8_t* row = mask + (size_t)my * width;
+        for (int x = 1; x < map->width - 1; x++) {
+            int mx = (int)((x - 0.5f) * width / (map->width - 2));
+            map->painted[(size_t)y * map->width + x] = row[mx] ? 1 : 0;
+        }
+    }
+    map->dirty = 1;
+}
+
+// Returns 0 when MAX_OBSTACLE_BODIES are already in place
+int obstacles_add_body(ObstacleMap* map, const ObstacleBody* body) {
+    if (map->body_count >= MAX_OBSTACLE_BODIES) return 0;
+    map->bodies[map->body_count++] = *body;
+    map->dirty = 1;
+    return 1;
+}
+
+// "shape:name=value,..." with the shape from obstacle_shape_names and names
+// x, y, x2, y2, radius, vx and vy; returns 0 on anything else
+int obstacles_parse(const char* text, ObstacleBody* body) {
+    static const char* names[] = {"x", "y", "x2", "y2", "radius", "vx", "vy"};
+    float* values[] = {
+        &body->x, &body->y, &body->x2, &body->y2, &body->radius, &body->velocity_x, &body->velocity_y
+    };
+    const int count = sizeof(names) / sizeof(names[0]);
+    const char* colon = strchr(text, ':');
+    size_t length = colon ? (size_t)(colon - text) : strlen(text);
+    int shape = -1;
+    for (int k = 0; k < OBSTACLE_SHAPE_COUNT; k++) {
+        if (strlen(obstacle_shape_names[k]) == length && strncmp(text, obstacle_shape_names[k], length) == 0) shape = k;
+    }
+    if (shape < 0) return 0;
+    *body = (ObstacleBody){.shape = shape, .radius = OBSTACLE_DEFAULT_RADIUS};
+    for (const char* p = colon ? colon + 1 : ""; *p;) {
+        const char* equals = strchr(p, '=');
+        if (!equals) return 0;
+        int field = -1;
+        for (int k = 0; k < count; k++) {
+            if (strlen(names[k]) == (size_t)(equals - p) && strncmp(p, names[k], equals - p) == 0) field = k;
+        }
+        char* end;
+        float value = strtof(equals + 1, &end);
+        if (field < 0 || end == equals + 1 || (*end && *end != ',')) return 0;
+        *values[field] = value;
+        p = *end ? end + 1 : end;
+    }
+    return 1;
+}
+
+// Cells the body covers, clipped to the interior
+void obstacles_body_bounds(const ObstacleMap* map, const ObstacleBody* body,
+                           int* x_begin, int* x_end, int* y_begin, int* y_end) {
+    float lo_x = body->shape == OBSTACLE_DISC ? body->x - body->radius : fminf(body->x, body->x2);
+    float hi_x = body->shape == OBSTACLE_DISC ? body->x + body->radius : fmaxf(body->x, body->x2);
+    float lo_y = body->shape == OBSTACLE_DISC ? body->y - body->radius : fminf(body->y, body->y2);
+    float hi_y = body->shape == OBSTACLE_DISC ? body->y + body->radius : fmaxf(body->y, body->y2);
+    *x_begin = (int)fmaxf(1.0f, ceilf(lo_x));
+    *x_end = (int)fminf(map->width - 1.0f, floorf(hi_x) + 1.0f);
+    *y_begin = (int)fmaxf(1.0f, ceilf(lo_y));
+    *y_end = (int)fminf(map->height - 1.0f, floorf(hi_y) + 1.0f);
+}
+
+// Works out the owners, the fluid runs and the boundary cells from the
+// painted cells and the bodies where they are now
+void obstacles_build(ObstacleMap* map) {
+    const int width = map->width;
+    const int height = map->height;
+    memcpy(map->owner, map->painted, (size_t)width * height);
+    map->owner_velocity_x[0] = map->owner_velocity_y[0] = 0.0f;
+    map->owner_velocity_x[OBSTACLE_PAINTED] = map->owner_velocity_y[OBSTACLE_PAINTED] = 0.0f;
+    for (int k = 0; k < map->body_count; k++) {
+        const ObstacleBody* body = &map->bodies[k];
+        uint8_t owner = (uint8_t)(2 + k);
+        map->owner_velocity_x[owner] = body->velocity_x;
+        map->owner_velocity_y[owner] = body->velocity_y;
+        int x_begin, x_end, y_begin, y_end;
+        obstacles_body_bounds(map, body, &x_begin, &x_end, &y_begin, &y_end);
+        for (int y = y_begin; y < y_end; y++) {
+            uint8_t* row = map->owner + (size_t)y * width;
+            if (body->shape == OBSTACLE_BOX) {
+                if (x_end > x_begin) memset(row + x_begin, owner, x_end - x_begin);
+                continue;
+            }
+            for (int x = x_begin; x < x_end; x++) {
+                float dx = x - body->x;
+                float dy = y - body->y;
+                if (dx * dx + dy * dy <= body->radius * body->radius) row[x] = owner;
+            }
+        }
+    }
+
+    int run_count = 0;
+    int boundary_count = 0;
+    int solid_count = 0;
+    map->row_runs[0] = 0;
+    for (int y = 0; y < height; y++) {
+        const uint8_t* row = map->owner + (size_t)y * width;
+        int interior = y > 0 && y < height - 1;
+        for (int x = 1; interior && x < width - 1;) {
+            if (row[x]) {
+                // The ring and the other solids are not fluid neighbours
+                int sides = 0;
+                if (x > 1 && !row[x - 1]) sides |= SIDE_LEFT;
+                if (x < width - 2 && !row[x + 1]) sides |= SIDE_RIGHT;
+                if (y > 1 && !row[x - width]) sides |= SIDE_ABOVE;
+                if (y < height - 2 && !row[x + width]) sides |= SIDE_BELOW;
+                if (sides) {
+                    map->boundary[boundary_count] = y * width + x;
+                    map->boundary_sides[boundary_count++] = (uint8_t)sides;
+                }
+                solid_count++;
+                x++;
+                continue;
+            }
+            int begin = x;
+            while (x < width - 1 && !row[x]) x++;
+            map->run_begin[run_count] = begin;
+            map->run_end[run_count++] = x;
+        }
+        map->row_runs[y + 1] = run_count;
+    }
+    map->boundary_count = boundary_count;
+    map->solid_count = solid_count;
+    map->dirty = 0;
+}
+
+// Every solid cell of interior rows y_begin..y_end - 1 to its owner's
+// velocity and no smoke
+void obstacles_fill_rows(void* ctx, int y_begin, int y_end, int thread) {
+    const ObstacleMap* map = ctx;
+    size_t stored = storage_bytes(sim->scalar_storage);
+    char* density = sim->scalars.density;
+    char* temperature = sim->scalars.temperature;
+    for (int y = y_begin; y < y_end; y++) {
+        int x = 1;
+        for (int r = map->row_runs[y]; r <= map->row_runs[y + 1]; r++) {
+            int gap_end = r < map->row_runs[y + 1] ? map->run_begin[r] : map->width - 1;
+            if (gap_end > x) {
+                int i = IX(x, y);
+                int count = gap_end - x;
+                memset(density + i * stored, 0, count * stored);
+                memset(temperature + i * stored, 0, count * stored);
+                for (int k = i; k < i + count; k++) {
+                    sim->fields.velocity_x[k] = map->owner_velocity_x[map->owner[k]];
+                    sim->fields.velocity_y[k] = map->owner_velocity_y[map->owner[k]];
+                }
+            }
+            if (r < map->row_runs[y + 1]) x = map->run_end[r];
+        }
+    }
+}
+
+// Moves the bodies over the substep, bouncing them off the box walls
+int obstacles_move(ObstacleMap* map) {
+    int moved = 0;
+    const float h = sim->substep;
+    for (int k = 0; k < map->body_count; k++) {
+        ObstacleBody* body = &map->bodies[k];
+        if (body->velocity_x == 0.0f && body->velocity_y == 0.0f) continue;
+        float dx = body->velocity_x * h;
+        float dy = body->velocity_y * h;
+        float lo_x = body->shape == OBSTACLE_DISC ? body->x - body->radius : fminf(body->x, body->x2);
+        float hi_x = body->shape == OBSTACLE_DISC ? body->x + body->radius : fmaxf(body->x, body->x2);
+        float lo_y = body->shape == OBSTACLE_DISC ? body->y - body->radius : fminf(body->y, body->y2);
+        float hi_y = body->shape == OBSTACLE_DISC ? body->y + body->radius : fmaxf(body->y, body->y2);
+        if ((lo_x + dx < 0.5f && dx < 0.0f) || (hi_x + dx > map->width - 1.5f && dx > 0.0f)) {
+            body->velocity_x = -body->velocity_x;
+            dx = 0.0f;
+        }
+        if ((lo_y + dy < 0.5f && dy < 0.0f) || (hi_y + dy > map->height - 1.5f && dy > 0.0f)) {
+            body->velocity_y = -body->velocity_y;
+            dy = 0.0f;
+        }
+        body->x += dx;
+        body->x2 += dx;
+        body->y += dy;
+        body->y2 += dy;
+        moved = 1;
+    }
+    return moved;
+}
+
+// Called at the start of STAGE_ADVECTION: moves the bodies, rebuilds the
+// lists when anything changed, and resets the solid cells and the ghosts
+void obstacles_step(ObstacleMap* map) {
+    if (map->width != sim->grid_width || map->height != sim->grid_height) {
+        if (!obstacles_fit(map)) return;
+    }
+    if (obstacles_move(map) || map->dirty) obstacles_build(map);
+    parallel_for(1, map->height - 1, obstacles_fill_rows, map);
+    obstacles_bound_state(map, 1, 1);
+}
+
+typedef struct {
+    ObstacleMap* map;
+    int b;
+    float* field;        // A velocity component or the pressure
+    void* stored;        // Or a stored scalar plane
+} ObstacleBound;
+
+// The ghost value of each boundary cell from its fluid neighbours. Across a
+// face the normal velocity is mirrored about the body's, so the face moves
+// with it; along a face the tangential one is copied for free slip and
+// mirrored for no slip. A corner cell takes a component from the faces it
+// is normal to, as the box corners do, so no flux leaks through them.
+// Scalars and pressure copy the neighbours' mean.
+void obstacles_bound_rows(void* ctx, int begin, int end, int thread) {
+    const ObstacleBound* pass = ctx;
+    const ObstacleMap* map = pass->map;
+    const int width = map->width;
+    const int b = pass->b;
+    const int mirror_x = b == 1 || (b == 2 && map->no_slip);
+    const int mirror_y = b == 2 || (b == 1 && map->no_slip);
+    const int normal = b == 1 ? SIDE_LEFT | SIDE_RIGHT : b == 2 ? SIDE_ABOVE | SIDE_BELOW : 0;
+    const float* wall = b == 2 ? map->owner_velocity_y : map->owner_velocity_x;
+    const int offsets[4] = {-1, 1, -width, width};
+    for (int k = begin; k < end; k++) {
+        int i = map->boundary[k];
+        int sides = map->boundary_sides[k];
+        if (sides & normal) sides &= normal;
+        float body = b ? wall[map->owner[i]] : 0.0f;
+        float sum = 0.0f;
+        int count = 0;
+        for (int side = 0; side < 4; side++) {
+            if (!(sides & (1 << side))) continue;
+            float value;
+            if (pass->field) {
+                value = pass->field[i + offsets[side]];
+            } else {
+                fluid_read_cells(pass->stored, i + offsets[side], 1, &value);
+            }
+            int mirror = side < 2 ? mirror_x : mirror_y;
+            sum += mirror ? 2.0f * body - value : value;
+            count++;
+        }
+        float ghost = sum / count;
+        if (pass->field) {
+            pass->field[i] = ghost;
+        } else {
+            fluid_write_cells(pass->stored, i, 1, &ghost);
+        }
+    }
+}
+
+// The obstacles' counterpart of set_bnd(b, field) on a velocity component
+// or the pressure
+void obstacles_bound(ObstacleMap* map, int b, float* field) {
+    if (!map->boundary_count) return;
+    ObstacleBound pass = {map, b, field, NULL};
+    parallel_for(0, map->boundary_count, obstacles_bound_rows, &pass);
+}
+
+// Refreshes the ghosts of the stored scalars and the velocity
+void obstacles_bound_state(ObstacleMap* map, int scalars, int velocity) {
+    if (!map->boundary_count) return;
+    if (scalars) {
+        ObstacleBound density = {map, 0, NULL, sim->scalars.density};
+        ObstacleBound temperature = {map, 0, NULL, sim->scalars.temperature};
+        parallel_for(0, map->boundary_count, obstacles_bound_rows, &density);
+        parallel_for(0, map->boundary_count, obstacles_bound_rows, &temperature);
+    }
+    if (velocity) {
+        obstacles_bound(map, 1, sim->fields.velocity_x);
+        obstacles_bound(map, 2, sim->fields.velocity_y);
+    }
+}
+
+// 1 for every cell of a width x height image of the grid at scale cells per
+// simulation cell, mapped interior to interior, that lies in a solid cell
+void obstacles_mask(const ObstacleMap* map, int scale, uint8_t* mask, int width, int height) {
+    for (int y = 0; y < height; y++) {
+        const uint8_t* owner = map->owner + (size_t)((y + scale - 1) / scale) * map->width;
+        uint8_t* row = mask + (size_t)y * width;
+        for (int x = 0; x < width; x++) row[x] = owner[(x + scale - 1) / scale] != 0;
+    }
+}
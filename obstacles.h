@@ -0,0 +1,84 @@
+#ifndef OBSTACLES_H
+#define OBSTACLES_H
+
+#include <stdint.h>
+
+// Solid cells inside the box walls: painted ones, drawn or loaded from an
+// image, and moving bodies that bounce off the walls. Whenever they change
+// obstacles_build() works out every cell's owner and two compact lists:
+// the fluid runs of each row, and the boundary cells, solid cells with a
+// fluid neighbour. No hot loop branches on whether a cell is solid.
+//
+// The boundary cells are ghosts, like the ring set_bnd() fills: wherever
+// the box walls are refreshed, they take the mean of their fluid
+// neighbours, with the velocity mirrored about the body's own where the
+// wall condition asks for it. Divergence, the Gauss-Seidel pressure sweeps
+// and the projection only visit the fluid runs. Before advection every
+// solid cell is set to its body's velocity and no smoke, so backtraces
+// that reach into a body find it. Multigrid and spectral solves see the
+// obstacles as fluid with no divergence and are finished by
+// OBSTACLE_PRESSURE_SWEEPS sweeps that do see them.
+//
+// Slabs and checkpoints do not carry obstacles.
+
+#define MAX_OBSTACLE_BODIES 32
+#define OBSTACLE_PRESSURE_SWEEPS 8
+#define OBSTACLE_PAINTED 1           // Owner of painted cells; body k is owner 2 + k
+#define OBSTACLE_BRUSH 3.0f          // Radius in cells of the interactive brush
+#define OBSTACLE_DEFAULT_RADIUS 10.0f
+
+typedef enum {
+    OBSTACLE_DISC,
+    OBSTACLE_BOX,
+    OBSTACLE_SHAPE_COUNT
+} ObstacleShape;
+
+// Positions in cells, velocity in cells per reference step
+typedef struct {
+    ObstacleShape shape;
+    float x, y;                  // Centre of a disc or a corner of a box
+    float x2, y2;                // Opposite corner of a box
+    float radius;
+    float velocity_x, velocity_y;
+} ObstacleBody;
+
+typedef struct ObstacleMap {
+    int width;                   // Grid the cells are laid out for
+    int height;
+    uint8_t* painted;            // 1 for a painted solid cell; the ring is never painted
+    ObstacleBody bodies[MAX_OBSTACLE_BODIES];
+    int body_count;
+    int no_slip;                 // Walls also hold the tangential velocity to the body's
+    int dirty;                   // Painted cells or bodies changed since the last build
+
+    // Set by obstacles_build()
+    uint8_t* owner;              // Per cell: 0 for fluid, else the owner of a solid cell
+    int* row_runs;               // Fluid runs of interior row y are row_runs[y]..row_runs[y + 1] - 1
+    int* run_begin;              // Columns run_begin[r]..run_end[r] - 1
+    int* run_end;
+    int* boundary;               // Solid cells with a fluid neighbour
+    uint8_t* boundary_sides;     // Which neighbours are fluid: 1 left, 2 right, 4 above, 8 below
+    int boundary_count;
+    int solid_count;
+    float owner_velocity_x[2 + MAX_OBSTACLE_BODIES];
+    float owner_velocity_y[2 + MAX_OBSTACLE_BODIES];
+    void* block;
+} ObstacleMap;
+
+extern const char* obstacle_shape_names[OBSTACLE_SHAPE_COUNT];
+
+ObstacleMap* obstacles_create();
+void obstacles_destroy(ObstacleMap* map);
+int obstacles_fit(ObstacleMap* map);
+void obstacles_paint(ObstacleMap* map, float x, float y, float radius, int solid);
+void obstacles_clear(ObstacleMap* map);
+void obstacles_load_mask(ObstacleMap* map, const uint8_t* mask, int width, int height);
+int obstacles_add_body(ObstacleMap* map, const ObstacleBody* body);
+int obstacles_parse(const char* text, ObstacleBody* body);
+void obstacles_build(ObstacleMap* map);
+void obstacles_step(ObstacleMap* map);
+void obstacles_bound(ObstacleMap* map, int b, float* field);
+void obstacles_bound_state(ObstacleMap* map, int scalars, int velocity);
+void obstacles_mask(const ObstacleMap* map, int scale, uint8_t* mask, int width, int height);
+
+#endif
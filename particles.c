@@ -0,0 +1,226 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+
+#include "fluid.h"
+#include "particles.h"
+#include "rng.h"
+
+#define PARTICLE_KEY 0x7472u         // Second key word of the spawn jitter draws
+
+// One block holds the struct and every array; capacity is rounded up to
+// whole blocks so the SIMD loop never needs a partial one inside a band
+ParticlePool* particles_create(int capacity) {
+    if (capacity < 1) return NULL;
+    capacity = (capacity + PARTICLE_BLOCK - 1) / PARTICLE_BLOCK * PARTICLE_BLOCK;
+    size_t arrays = (size_t)capacity * (3 * sizeof(float) + sizeof(int));
+    ParticlePool* pool = calloc(1, sizeof(ParticlePool) + arrays);
+    if (!pool) return NULL;
+    pool->capacity = capacity;
+    pool->x = (float*)(pool + 1);
+    pool->y = pool->x + capacity;
+    pool->life = pool->y + capacity;
+    pool->free_slots = (int*)(pool->life + capacity);
+    pool->spawn_rate = PARTICLE_SPAWN_RATE;
+    pool->lifetime = PARTICLE_LIFETIME;
+    return pool;
+}
+
+void particles_destroy(ParticlePool* pool) {
+    free(pool);
+}
+
+void particles_clear(ParticlePool* pool) {
+    pool->used = 0;
+    pool->live = 0;
+    pool->free_count = 0;
+}
+
+// Called by add_smoke() for an emitter cell with a random word of its draw.
+// Spawns spawn_rate tracers per reference step on average, jittered over
+// the cell, with the fraction carried by the draw rather than a remainder.
+void particles_spawn(ParticlePool* pool, int x, int y, uint32_t bits) {
+    int count = (int)(pool->spawn_rate * sim->substep + rng_unit(bits));
+    for (int k = 0; k < count; k++) {
+        int slot;
+        if (pool->free_count > 0) {
+            slot = pool->free_slots[--pool->free_count];
+        } else if (pool->used < pool->capacity) {
+            slot = pool->used++;
+        } else {
+            pool->dropped += count - k;
+            return;
+        }
+        Philox4x32 r = philox4x32(bits, (uint32_t)k, 0, 0, sim->noise_seed, PARTICLE_KEY);
+        pool->x[slot] = x + 0.5f * rng_signed(r.v[0]);
+        pool->y[slot] = y + 0.5f * rng_signed(r.v[1]);
+        pool->life[slot] = pool->lifetime * (1.0f + 0.25f * rng_signed(r.v[2]));
+        pool->spawned++;
+        pool->live++;
+    }
+}
+
+// Bilinear velocity at a position, clamped inside the walls like the
+// advection backtrace
+static inline void particle_velocity(float x, float y, float* u, float* v) {
+    const int width = sim->grid_width;
+    x = fmaxf(0.5f, fminf(width - 1.5f, x));
+    y = fmaxf(0.5f, fminf(sim->grid_height - 1.5f, y));
+    int x0 = (int)x;
+    int y0 = (int)y;
+    float s1 = x - x0;
+    float s0 = 1.0f - s1;
+    float t1 = y - y0;
+    float t0 = 1.0f - t1;
+    int i00 = IX(x0, y0);
+    const float* vx = sim->fields.velocity_x;
+    const float* vy = sim->fields.velocity_y;
+    *u = s0 * (t0 * vx[i00] + t1 * vx[i00 + width]) + s1 * (t0 * vx[i00 + 1] + t1 * vx[i00 + width + 1]);
+    *v = s0 * (t0 * vy[i00] + t1 * vy[i00 + width]) + s1 * (t0 * vy[i00 + 1] + t1 * vy[i00 + width + 1]);
+}
+
+// Midpoint step through the substep's projected velocity; positions stay
+// inside the walls and expired tracers are left at zero life
+void particle_advect_span(ParticlePool* pool, int begin, int end) {
+    const float h = sim->substep;
+    const float hi_x = sim->grid_width - 1.5f;
+    const float hi_y = sim->grid_height - 1.5f;
+    for (int i = begin; i < end; i++) {
+        float life = pool->life[i];
+        if (life <= 0.0f) continue;
+        float x = pool->x[i];
+        float y = pool->y[i];
+        float u, v;
+        particle_velocity(x, y, &u, &v);
+        particle_velocity(x + 0.5f * h * u, y + 0.5f * h * v, &u, &v);
+        pool->x[i] = fmaxf(0.5f, fminf(hi_x, x + h * u));
+        pool->y[i] = fmaxf(0.5f, fminf(hi_y, y + h * v));
+        life -= h;
+        pool->life[i] = life > 0.0f ? life : 0.0f;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+TARGET_AVX2 static inline __m256 particle_bilerp_avx2(const float* f, int width, __m256i i00,
+                                                     __m256 s0, __m256 s1, __m256 t0, __m256 t1) {
+    __m256 a00 = _mm256_i32gather_ps(f, i00, 4);
+    __m256 a01 = _mm256_i32gather_ps(f + width, i00, 4);
+    __m256 a10 = _mm256_i32gather_ps(f + 1, i00, 4);
+    __m256 a11 = _mm256_i32gather_ps(f + width + 1, i00, 4);
+    __m256 left = _mm256_fmadd_ps(t1, a01, _mm256_mul_ps(t0, a00));
+    __m256 right = _mm256_fmadd_ps(t1, a11, _mm256_mul_ps(t0, a10));
+    return _mm256_fmadd_ps(s1, right, _mm256_mul_ps(s0, left));
+}
+
+// Positions are clamped before they are sampled, so the free lanes index
+// inside the grid too and are simply not written back
+TARGET_AVX2 static inline void particle_velocity_avx2(__m256 x, __m256 y, __m256* u, __m256* v) {
+    const int width = sim->grid_width;
+    const __m256 one = _mm256_set1_ps(1.0f);
+    x = _mm256_max_ps(_mm256_set1_ps(0.5f), _mm256_min_ps(_mm256_set1_ps(width - 1.5f), x));
+    y = _mm256_max_ps(_mm256_set1_ps(0.5f), _mm256_min_ps(_mm256_set1_ps(sim->grid_height - 1.5f), y));
+    __m256i x0 = _mm256_cvttps_epi32(x);
+    __m256i y0 = _mm256_cvttps_epi32(y);
+    __m256 s1 = _mm256_sub_ps(x, _mm256_cvtepi32_ps(x0));
+    __m256 t1 = _mm256_sub_ps(y, _mm256_cvtepi32_ps(y0));
+    __m256 s0 = _mm256_sub_ps(one, s1);
+    __m256 t0 = _mm256_sub_ps(one, t1);
+    __m256i i00 = _mm256_add_epi32(_mm256_mullo_epi32(y0, _mm256_set1_epi32(width)), x0);
+    *u = particle_bilerp_avx2(sim->fields.velocity_x, width, i00, s0, s1, t0, t1);
+    *v = particle_bilerp_avx2(sim->fields.velocity_y, width, i00, s0, s1, t0, t1);
+}
+
+TARGET_AVX2 void particle_advect_span_avx2(ParticlePool* pool, int begin, int end) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 lo = _mm256_set1_ps(0.5f);
+    const __m256 hi_x = _mm256_set1_ps(sim->grid_width - 1.5f);
+    const __m256 hi_y = _mm256_set1_ps(sim->grid_height - 1.5f);
+    const __m256 h = _mm256_set1_ps(sim->substep);
+    const __m256 half_h = _mm256_set1_ps(0.5f * sim->substep);
+    int i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256 life = _mm256_loadu_ps(pool->life + i);
+        __m256 live = _mm256_cmp_ps(life, zero, _CMP_GT_OQ);
+        if (_mm256_movemask_ps(live) == 0) continue;
+        __m256 x = _mm256_loadu_ps(pool->x + i);
+        __m256 y = _mm256_loadu_ps(pool->y + i);
+        __m256 u, v;
+        particle_velocity_avx2(x, y, &u, &v);
+        particle_velocity_avx2(_mm256_fmadd_ps(half_h, u, x), _mm256_fmadd_ps(half_h, v, y), &u, &v);
+        __m256 nx = _mm256_max_ps(lo, _mm256_min_ps(hi_x, _mm256_fmadd_ps(h, u, x)));
+        __m256 ny = _mm256_max_ps(lo, _mm256_min_ps(hi_y, _mm256_fmadd_ps(h, v, y)));
+        __m256 left = _mm256_max_ps(zero, _mm256_sub_ps(life, h));
+        _mm256_storeu_ps(pool->x + i, _mm256_blendv_ps(x, nx, live));
+        _mm256_storeu_ps(pool->y + i, _mm256_blendv_ps(y, ny, live));
+        _mm256_storeu_ps(pool->life + i, _mm256_blendv_ps(life, left, live));
+    }
+    particle_advect_span(pool, i, end);
+}
+#endif
+
+void particle_advect_blocks(void* ctx, int block_begin, int block_end, int thread) {
+    ParticlePool* pool = ctx;
+    int begin = block_begin * PARTICLE_BLOCK;
+    int end = block_end * PARTICLE_BLOCK < pool->used ? block_end * PARTICLE_BLOCK : pool->used;
+#ifdef HAVE_X86_SIMD
+    if (simd_level >= SIMD_AVX2) {
+        particle_advect_span_avx2(pool, begin, end);
+        return;
+    }
+#endif
+    particle_advect_span(pool, begin, end);
+}
+
+// Gathers the free slots below the last live one, lowest on top of the
+// stack, and drops the rest from the used range
+void particles_reclaim(ParticlePool* pool) {
+    int used = 0;
+    int live = 0;
+    for (int i = 0; i < pool->used; i++) {
+        if (pool->life[i] > 0.0f) {
+            used = i + 1;
+            live++;
+        }
+    }
+    pool->free_count = 0;
+    for (int i = used - 1; i >= 0; i--) {
+        if (pool->life[i] <= 0.0f) pool->free_slots[pool->free_count++] = i;
+    }
+    pool->used = used;
+    pool->live = live;
+}
+
+// STAGE_PARTICLES: one substep for every live tracer
+void particles_advect(ParticlePool* pool) {
+    int blocks = (pool->used + PARTICLE_BLOCK - 1) / PARTICLE_BLOCK;
+    parallel_for(0, blocks, particle_advect_blocks, pool);
+    particles_reclaim(pool);
+}
+
+// Follows fluid_rescale(): scale is new cells per old cell on each axis,
+// interior mapped onto interior
+void particles_rescale(ParticlePool* pool, float scale_x, float scale_y) {
+    for (int i = 0; i < pool->used; i++) {
+        pool->x[i] = (pool->x[i] - 0.5f) * scale_x + 0.5f;
+        pool->y[i] = (pool->y[i] - 0.5f) * scale_y + 0.5f;
+    }
+}
+
+// Packs the live tracers into arrays of at least pool->live entries, for a
+// renderer on another thread. Returns how many were written.
+int particles_copy_live(const ParticlePool* pool, float* x, float* y, float* life) {
+    int count = 0;
+    for (int i = 0; i < pool->used; i++) {
+        if (pool->life[i] <= 0.0f) continue;
+        x[count] = pool->x[i];
+        y[count] = pool->y[i];
+        life[count] = pool->life[i];
+        count++;
+    }
+    return count;
+}
@@ -0,0 +1,47 @@
+#ifndef PARTICLES_H
+#define PARTICLES_H
+
+#include <stdint.h>
+
+// Passive tracers for detail finer than the grid. add_smoke() spawns a few
+// per emitter cell and substep, STAGE_PARTICLES carries them through the
+// projected velocity with a bilinear midpoint step, and the renderer splats
+// them over the smoke. They never feed back into the flow, so the fields
+// and their checksum are the same with or without them.
+//
+// A pool is fixed-size structure-of-arrays storage allocated once. A slot
+// whose life is not positive is free; after each substep the free slots
+// below the last live one are gathered into a stack, lowest on top, so new
+// tracers fill the holes near the front and the advection range stays
+// short. Nothing is allocated while stepping.
+
+#define PARTICLE_DEFAULT_CAPACITY 262144
+#define PARTICLE_SPAWN_RATE 4.0f     // Tracers per emitter cell per reference step
+#define PARTICLE_LIFETIME 300.0f     // Reference steps a tracer lives, give or take a quarter
+#define PARTICLE_FADE 60.0f          // Reference steps over which a tracer fades out
+#define PARTICLE_BLOCK 64            // Tracers per parallel work item, a multiple of the SIMD width
+
+typedef struct ParticlePool {
+    int capacity;
+    int used;                    // Slots from here up have never been live since the last reclaim
+    int live;
+    float* x;                    // Position in cells, as grid indices
+    float* y;
+    float* life;                 // Reference steps left
+    int* free_slots;             // Free slots below used, lowest last
+    int free_count;
+    float spawn_rate;
+    float lifetime;
+    long long spawned;
+    long long dropped;           // Spawns refused because the pool was full
+} ParticlePool;
+
+ParticlePool* particles_create(int capacity);
+void particles_destroy(ParticlePool* pool);
+void particles_clear(ParticlePool* pool);
+void particles_spawn(ParticlePool* pool, int x, int y, uint32_t bits);
+void particles_advect(ParticlePool* pool);
+void particles_rescale(ParticlePool* pool, float scale_x, float scale_y);
+int particles_copy_live(const ParticlePool* pool, float* x, float* y, float* life);
+
+#endif
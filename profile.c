@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "profile.h"
+
+typedef struct {
+    const char* name;
+    double start;
+    double value;    // Duration for a zone, the sample for a counter
+    int counter;
+    int thread;
+} TraceEvent;
+
+atomic_int profile_enabled = 0;
+ProfileZone profile_zones[PROFILE_MAX_ZONES];
+int profile_zone_count = 0;
+ProfileCounter profile_counters[PROFILE_MAX_COUNTERS];
+int profile_counter_count = 0;
+
+int profile_frames = 0;     // Frames pushed into the zone histories
+double trace_epoch = 0.0;   // Trace timestamps are relative to the first enable
+TraceEvent trace_events[PROFILE_TRACE_EVENTS];
+long long trace_count = 0;
+const char* thread_names[PROFILE_MAX_THREADS] = {NULL, "main"};
+_Thread_local int profile_thread = 1;
+pthread_mutex_t profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Guards the zones, counters and trace; taken only while profiling
+void profile_lock() {
+    pthread_mutex_lock(&profile_mutex);
+}
+
+void profile_unlock() {
+    pthread_mutex_unlock(&profile_mutex);
+}
+
+void profile_set_enabled(int enabled) {
+    profile_lock();
+    if (enabled && trace_epoch == 0.0) trace_epoch = timer_seconds();
+    for (int z = 0; z < profile_zone_count; z++) profile_zones[z].frame = 0.0;
+    profile_enabled = enabled;
+    profile_unlock();
+}
+
+// Trace thread id for the calling thread; the main thread is 1
+void profile_set_thread(int id, const char* name) {
+    if (id < 1 || id >= PROFILE_MAX_THREADS) return;
+    profile_thread = id;
+    profile_lock();
+    thread_names[id] = name;
+    profile_unlock();
+}
+
+// Names are nearly always the same string literal, so compare pointers first
+int same_name(const char* a, const char* b) {
+    return a == b || strcmp(a, b) == 0;
+}
+
+void trace_push(const char* name, double start, double value, int counter) {
+    TraceEvent* event = &trace_events[trace_count % PROFILE_TRACE_EVENTS];
+    event->name = name;
+    event->start = start;
+    event->value = value;
+    event->counter = counter;
+    event->thread = profile_thread;
+    trace_count++;
+}
+
+void profile_record(const char* name, double start, double end) {
+    // Zero start: profiling was switched on while the zone was open
+    if (start == 0.0) return;
+    profile_lock();
+    int z = 0;
+    while (z < profile_zone_count && !same_name(profile_zones[z].name, name)) z++;
+    if (z == profile_zone_count && z < PROFILE_MAX_ZONES) {
+        profile_zone_count++;
+        memset(&profile_zones[z], 0, sizeof(ProfileZone));
+        profile_zones[z].name = name;
+    }
+    if (z < PROFILE_MAX_ZONES) {
+        profile_zones[z].frame += end - start;
+        trace_push(name, start, end - start, 0);
+    }
+    profile_unlock();
+}
+
+void profile_counter(const char* name, double value) {
+    if (!profile_enabled) return;
+    double now = timer_seconds();
+    profile_lock();
+    int c = 0;
+    while (c < profile_counter_count && !same_name(profile_counters[c].name, name)) c++;
+    if (c == profile_counter_count && c < PROFILE_MAX_COUNTERS) {
+        profile_counter_count++;
+        profile_counters[c].name = name;
+    }
+    if (c < PROFILE_MAX_COUNTERS) {
+        profile_counters[c].value = value;
+        trace_push(name, now, value, 1);
+    }
+    profile_unlock();
+}
+
+// Closes the current frame: its zone totals go into the rolling history
+void profile_frame() {
+    if (!profile_enabled) return;
+    profile_lock();
+    int slot = profile_frames % PROFILE_HISTORY;
+    for (int z = 0; z < profile_zone_count; z++) {
+        profile_zones[z].history[slot] = profile_zones[z].frame;
+        profile_zones[z].frame = 0.0;
+    }
+    profile_frames++;
+    profile_unlock();
+}
+
+// Mean seconds per frame over the recorded history; call under profile_lock()
+double profile_average(const ProfileZone* zone) {
+    int count = profile_frames < PROFILE_HISTORY ? profile_frames : PROFILE_HISTORY;
+    if (count == 0) return 0.0;
+    double sum = 0.0;
+    for (int i = 0; i < count; i++) sum += zone->history[i];
+    return sum / count;
+}
+
+// Chrome trace_event format: complete ("X") events for zones and counter
+// ("C") events, timestamps in microseconds. Opens in chrome://tracing or
+// Perfetto.
+int profile_write_trace(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Cannot open %s for writing\n", path);
+        return 0;
+    }
+    profile_lock();
+    long long first = trace_count > PROFILE_TRACE_EVENTS ? trace_count - PROFILE_TRACE_EVENTS : 0;
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (int t = 1; t < PROFILE_MAX_THREADS; t++) {
+        if (!thread_names[t]) continue;
+        fprintf(file, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                      "\"args\": {\"name\": \"%s\"}},\n", t, thread_names[t]);
+    }
+    for (long long e = first; e < trace_count; e++) {
+        const TraceEvent* event = &trace_events[e % PROFILE_TRACE_EVENTS];
+        double ts = (event->start - trace_epoch) * 1e6;
+        if (event->counter) {
+            fprintf(file, "{\"name\": \"%s\", \"ph\": \"C\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d, "
+                          "\"args\": {\"value\": %g}}",
+                    event->name, ts, event->thread, event->value);
+        } else {
+            fprintf(file, "{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d}",
+                    event->name, ts, event->value * 1e6, event->thread);
+        }
+        fprintf(file, "%s\n", e + 1 < trace_count ? "," : "");
+    }
+    fprintf(file, "]}\n");
+    profile_unlock();
+    int ok = !ferror(file);
+    if (fclose(file) != 0) ok = 0;
+    if (!ok) fprintf(stderr, "Writing %s failed\n", path);
+    return ok;
+}
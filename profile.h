@@ -0,0 +1,55 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdatomic.h>
+
+#include "timer.h"
+
+// Scoped zone timers and counters for the stats panel and Chrome trace
+// export. Zones and counters are keyed by name and created on first use.
+// Any thread may record; events carry the id the thread registered with
+// profile_set_thread(). While profile_enabled is 0 a zone costs one load and
+// branch at each end.
+
+#define PROFILE_MAX_ZONES 32
+#define PROFILE_MAX_COUNTERS 12
+#define PROFILE_HISTORY 60             // Frames averaged for the stats panel
+#define PROFILE_TRACE_EVENTS 65536     // Ring buffer, oldest events overwritten
+#define PROFILE_MAX_THREADS 8
+
+typedef struct {
+    const char* name;
+    double frame;                      // Seconds spent in the current frame
+    double history[PROFILE_HISTORY];
+} ProfileZone;
+
+typedef struct {
+    const char* name;
+    double value;                      // Last value recorded
+} ProfileCounter;
+
+extern atomic_int profile_enabled;
+extern ProfileZone profile_zones[PROFILE_MAX_ZONES];
+extern int profile_zone_count;
+extern ProfileCounter profile_counters[PROFILE_MAX_COUNTERS];
+extern int profile_counter_count;
+
+void profile_set_enabled(int enabled);
+void profile_set_thread(int id, const char* name);
+void profile_lock();
+void profile_unlock();
+void profile_record(const char* zone, double start, double end);
+void profile_counter(const char* name, double value);
+void profile_frame();
+double profile_average(const ProfileZone* zone);
+int profile_write_trace(const char* path);
+
+static inline double profile_begin() {
+    return profile_enabled ? timer_seconds() : 0.0;
+}
+
+static inline void profile_end(const char* zone, double start) {
+    if (profile_enabled) profile_record(zone, start, timer_seconds());
+}
+
+#endif
@@ -0,0 +1,706 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fluid.h"
+#include "recording.h"
+
+#ifdef _WIN32
+#define file_seek _fseeki64
+#else
+#define file_seek fseeko
+#endif
+
+const char* record_field_names[RECORD_FIELD_COUNT] = {"density", "temperature", "velocity_x", "velocity_y"};
+
+const float record_field_min[RECORD_FIELD_COUNT] = {0.0f, 0.0f, -RECORD_VELOCITY_MAX, -RECORD_VELOCITY_MAX};
+const float record_field_max[RECORD_FIELD_COUNT] = {
+    RECORD_DENSITY_MAX, RECORD_TEMPERATURE_MAX, RECORD_VELOCITY_MAX, RECORD_VELOCITY_MAX
+};
+const uint32_t record_field_levels[RECORD_FIELD_COUNT] = {
+    RECORD_DENSITY_LEVELS, RECORD_TEMPERATURE_LEVELS, RECORD_VELOCITY_LEVELS, RECORD_VELOCITY_LEVELS
+};
+
+// Encoding
+
+typedef struct {
+    uint8_t* out;
+    uint64_t bits;
+    int count;
+} BitWriter;
+
+typedef struct {
+    const uint8_t* in;
+    const uint8_t* end;
+    uint64_t bits;
+    int count;
+    int overrun;                 // Set once a read goes past the end
+} BitReader;
+
+void put_bits(BitWriter* writer, uint32_t value, int count) {
+    writer->bits |= (uint64_t)value << writer->count;
+    writer->count += count;
+    while (writer->count >= 8) {
+        *writer->out++ = (uint8_t)writer->bits;
+        writer->bits >>= 8;
+        writer->count -= 8;
+    }
+}
+
+void flush_bits(BitWriter* writer) {
+    if (writer->count > 0) *writer->out++ = (uint8_t)writer->bits;
+    writer->bits = 0;
+    writer->count = 0;
+}
+
+uint32_t get_bits(BitReader* reader, int count) {
+    while (reader->count < count) {
+        if (reader->in == reader->end) {
+            reader->overrun = 1;
+            return 0;
+        }
+        reader->bits |= (uint64_t)*reader->in++ << reader->count;
+        reader->count += 8;
+    }
+    uint32_t value = (uint32_t)(reader->bits & ((1ull << count) - 1));
+    reader->bits >>= count;
+    reader->count -= count;
+    return value;
+}
+
+// Exp-Golomb: n + 1 written as its bit length in unary, then the bits below
+// the leading one; 0 costs one bit
+void put_exp_golomb(BitWriter* writer, uint32_t value) {
+    uint32_t v = value + 1;
+    int length = 31 - __builtin_clz(v);
+    put_bits(writer, 0, length);
+    put_bits(writer, 1, 1);
+    if (length > 0) put_bits(writer, v & ((1u << length) - 1), length);
+}
+
+uint32_t get_exp_golomb(BitReader* reader) {
+    int length = 0;
+    while (!get_bits(reader, 1)) {
+        if (reader->overrun || ++length > 31) {
+            reader->overrun = 1;
+            return 0;
+        }
+    }
+    uint32_t low = length > 0 ? get_bits(reader, length) : 0;
+    return ((1u << length) | low) - 1;
+}
+
+// Rice code with parameter k; quotients past RICE_ESCAPE are sent raw
+#define RICE_ESCAPE 24
+#define RICE_RAW_BITS 19
+
+void put_rice(BitWriter* writer, uint32_t value, int k) {
+    uint32_t quotient = value >> k;
+    if (quotient >= RICE_ESCAPE) {
+        put_bits(writer, (1u << RICE_ESCAPE) - 1, RICE_ESCAPE);
+        put_bits(writer, value, RICE_RAW_BITS);
+        return;
+    }
+    put_bits(writer, (1u << quotient) - 1, quotient + 1);
+    if (k > 0) put_bits(writer, value & ((1u << k) - 1), k);
+}
+
+uint32_t get_rice(BitReader* reader, int k) {
+    uint32_t quotient = 0;
+    while (get_bits(reader, 1)) {
+        if (reader->overrun) return 0;
+        if (++quotient == RICE_ESCAPE) return get_bits(reader, RICE_RAW_BITS);
+    }
+    uint32_t low = k > 0 ? get_bits(reader, k) : 0;
+    return quotient << k | low;
+}
+
+// The Rice parameter follows a running mean of recent magnitudes, so busy
+// and quiet parts of the frame each get a fitting code; encoder and decoder
+// update it identically
+#define RICE_MEAN_SHIFT 4
+
+int rice_parameter(uint32_t mean_sum) {
+    uint32_t mean = mean_sum >> RICE_MEAN_SHIFT;
+    return mean ? 32 - __builtin_clz(mean) : 0;
+}
+
+uint32_t update_mean(uint32_t mean_sum, uint32_t value) {
+    if (value > 1u << RICE_RAW_BITS) value = 1u << RICE_RAW_BITS;
+    return mean_sum - (mean_sum >> RICE_MEAN_SHIFT) + value;
+}
+
+// Small differences either way become small codes: 0, -1, 1, -2, ...
+uint32_t zigzag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+int32_t unzigzag(uint32_t code) {
+    return (int32_t)(code >> 1) ^ -(int32_t)(code & 1);
+}
+
+// Worst case: every cell an escaped Rice code plus a one-bit run length
+size_t encoded_bound(size_t count) {
+    return count * ((1 + RICE_ESCAPE + RICE_RAW_BITS + 7) / 8) + 16;
+}
+
+// Codes the change from previous to current. Each cell's change is
+// predicted by its left neighbour's, since smoke moving across the grid
+// changes neighbouring cells alike; the residuals are sent as the number of
+// zeros before each nonzero one (Exp-Golomb) and the nonzero value (Rice),
+// after a count of the nonzero ones.
+size_t encode_delta(const uint16_t* current, const uint16_t* previous, int width, int height, uint8_t* out) {
+    uint32_t nonzero = 0;
+    for (int y = 0; y < height; y++) {
+        const uint16_t* c = current + (size_t)y * width;
+        const uint16_t* p = previous + (size_t)y * width;
+        int32_t left = 0;
+        for (int x = 0; x < width; x++) {
+            int32_t change = (int32_t)c[x] - p[x];
+            nonzero += change != left;
+            left = change;
+        }
+    }
+
+    BitWriter writer = {out};
+    put_exp_golomb(&writer, nonzero);
+    uint32_t zeros = 0;
+    uint32_t mean_sum = 0;
+    for (int y = 0; y < height; y++) {
+        const uint16_t* c = current + (size_t)y * width;
+        const uint16_t* p = previous + (size_t)y * width;
+        int32_t left = 0;
+        for (int x = 0; x < width; x++) {
+            int32_t change = (int32_t)c[x] - p[x];
+            uint32_t code = zigzag(change - left);
+            left = change;
+            if (code == 0) {
+                zeros++;
+                continue;
+            }
+            put_exp_golomb(&writer, zeros);
+            put_rice(&writer, code - 1, rice_parameter(mean_sum));
+            mean_sum = update_mean(mean_sum, code);
+            zeros = 0;
+        }
+    }
+    flush_bits(&writer);
+    return (size_t)(writer.out - out);
+}
+
+// Applies one coded field to levels in place; returns 0 on corrupt input
+int decode_delta(const uint8_t* in, size_t bytes, uint16_t* levels, int width, int height) {
+    BitReader reader = {in, in + bytes};
+    size_t count = (size_t)width * height;
+    uint32_t remaining = get_exp_golomb(&reader);
+    if (reader.overrun || remaining > count) return 0;
+    uint32_t mean_sum = 0;
+    size_t i = 0;
+    int x = 0;
+    int32_t left = 0;            // Change of the cell before i; 0 at a row start
+    for (;;) {
+        size_t next = count;
+        int32_t residual = 0;
+        if (remaining > 0) {
+            uint32_t zeros = get_exp_golomb(&reader);
+            if (reader.overrun || zeros >= count - i) return 0;
+            next = i + zeros;
+            uint32_t code = get_rice(&reader, rice_parameter(mean_sum)) + 1;
+            if (reader.overrun) return 0;
+            mean_sum = update_mean(mean_sum, code);
+            residual = unzigzag(code);
+            remaining--;
+        }
+        // Up to the next nonzero residual each cell repeats the change to
+        // its left, which restarts at zero on every row
+        while (i < next) {
+            int run = next - i < (size_t)(width - x) ? (int)(next - i) : width - x;
+            if (left != 0) {
+                uint16_t* row = levels + i;
+                uint16_t change = (uint16_t)left;
+                for (int k = 0; k < run; k++) row[k] += change;
+            }
+            i += run;
+            x += run;
+            if (x == width) {
+                x = 0;
+                left = 0;
+            }
+        }
+        if (next == count) return 1;
+        left += residual;
+        levels[i] = (uint16_t)(levels[i] + left);
+        i++;
+        if (++x == width) {
+            x = 0;
+            left = 0;
+        }
+    }
+}
+
+void quantize(const float* values, size_t count, float min, float max, uint32_t levels, uint16_t* out) {
+    float scale = (levels - 1) / (max - min);
+    float top = (float)(levels - 1);
+    for (size_t i = 0; i < count; i++) {
+        float q = (values[i] - min) * scale + 0.5f;
+        q = q > 0.0f ? q : 0.0f;
+        q = q < top ? q : top;
+        out[i] = (uint16_t)q;
+    }
+}
+
+void dequantize(const uint16_t* levels, size_t count, float min, float max, uint32_t level_count, float* out) {
+    float step = (max - min) / (level_count - 1);
+    for (size_t i = 0; i < count; i++) out[i] = min + levels[i] * step;
+}
+
+// Writer
+
+typedef struct {
+    float* planes[RECORD_FIELD_COUNT];
+    size_t capacity;
+    long long step;
+    int width;
+    int height;
+} RecordSlot;
+
+RecordSlot record_slots[RECORDING_QUEUE_SIZE];
+unsigned record_head = 0;      // Next slot the writer takes
+unsigned record_tail = 0;      // Next slot the producer fills
+int record_stopping = 0;
+pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t record_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t record_space = PTHREAD_COND_INITIALIZER;
+pthread_t record_thread;
+
+FILE* record_file;
+RecordingHeader record_header;
+RecordingIndexEntry* record_index;
+size_t record_index_capacity;
+uint64_t record_offset;
+int record_failed;
+
+// Writer-side state: the last frame's levels per field, for the deltas
+uint16_t* record_previous[RECORD_FIELD_COUNT];
+uint16_t* record_current[RECORD_FIELD_COUNT];
+size_t record_level_capacity;
+int record_width;
+int record_height;
+uint8_t* record_buffer;
+size_t record_buffer_capacity;
+
+int recording_active = 0;
+long long recording_frames = 0;
+long long recording_dropped = 0;
+
+int record_write(const void* data, size_t bytes) {
+    if (record_failed) return 0;
+    if (fwrite(data, 1, bytes, record_file) != bytes) {
+        fprintf(stderr, "Recording write failed\n");
+        record_failed = 1;
+        return 0;
+    }
+    record_offset += bytes;
+    return 1;
+}
+
+int record_reserve(size_t cells) {
+    if (cells > record_level_capacity) {
+        for (int f = 0; f < RECORD_FIELD_COUNT; f++) {
+            free(record_previous[f]);
+            free(record_current[f]);
+            record_previous[f] = malloc(cells * sizeof(uint16_t));
+            record_current[f] = malloc(cells * sizeof(uint16_t));
+            if (!record_previous[f] || !record_current[f]) {
+                record_level_capacity = 0;
+                return 0;
+            }
+        }
+        record_level_capacity = cells;
+    }
+    size_t bytes = encoded_bound(cells) * RECORD_FIELD_COUNT;
+    if (bytes > record_buffer_capacity) {
+        free(record_buffer);
+        record_buffer = malloc(bytes);
+        record_buffer_capacity = record_buffer ? bytes : 0;
+        if (!record_buffer) return 0;
+    }
+    return 1;
+}
+
+void record_encode(const RecordSlot* slot) {
+    size_t cells = (size_t)slot->width * slot->height;
+    if (!record_reserve(cells)) {
+        fprintf(stderr, "Out of memory for recording\n");
+        record_failed = 1;
+        return;
+    }
+
+    RecordingFrameHeader frame = {RECORDING_FRAME_TAG, 0, slot->step, slot->width, slot->height};
+    int keyframe = recording_frames % RECORDING_KEYFRAME_INTERVAL == 0 ||
+                   slot->width != record_width || slot->height != record_height;
+    if (keyframe) {
+        frame.flags |= RECORDING_KEYFRAME;
+        for (int f = 0; f < RECORD_FIELD_COUNT; f++) memset(record_previous[f], 0, cells * sizeof(uint16_t));
+        record_width = slot->width;
+        record_height = slot->height;
+    }
+
+    uint8_t* out = record_buffer;
+    for (int f = 0; f < RECORD_FIELD_COUNT; f++) {
+        if (!(record_header.field_mask & RECORD_MASK(f))) continue;
+        quantize(slot->planes[f], cells, record_field_min[f], record_field_max[f], record_field_levels[f],
+                 record_current[f]);
+        size_t bytes = encode_delta(record_current[f], record_previous[f], slot->width, slot->height, out);
+        frame.field_bytes[f] = (uint32_t)bytes;
+        out += bytes;
+        uint16_t* tmp = record_previous[f];
+        record_previous[f] = record_current[f];
+        record_current[f] = tmp;
+    }
+
+    if (record_index_capacity == (size_t)recording_frames) {
+        size_t capacity = record_index_capacity ? record_index_capacity * 2 : 1024;
+        RecordingIndexEntry* index = realloc(record_index, capacity * sizeof(RecordingIndexEntry));
+        if (!index) {
+            fprintf(stderr, "Out of memory for recording\n");
+            record_failed = 1;
+            return;
+        }
+        record_index = index;
+        record_index_capacity = capacity;
+    }
+    size_t payload = (size_t)(out - record_buffer);
+    record_index[recording_frames] = (RecordingIndexEntry){
+        record_offset, slot->step, (uint32_t)(sizeof(frame) + payload), frame.flags
+    };
+    if (record_write(&frame, sizeof(frame)) && record_write(record_buffer, payload)) recording_frames++;
+}
+
+void* record_main(void* arg) {
+    pthread_mutex_lock(&record_lock);
+    for (;;) {
+        while (record_head == record_tail && !record_stopping) pthread_cond_wait(&record_ready, &record_lock);
+        if (record_head == record_tail) break;
+        RecordSlot* slot = &record_slots[record_head % RECORDING_QUEUE_SIZE];
+        pthread_mutex_unlock(&record_lock);
+
+        if (!record_failed) record_encode(slot);
+
+        pthread_mutex_lock(&record_lock);
+        record_head++;
+        pthread_cond_signal(&record_space);
+    }
+    pthread_mutex_unlock(&record_lock);
+    return NULL;
+}
+
+// Starts recording the fields in field_mask to path. frame_seconds is the
+// simulated time between pushes, kept so a replay runs at the right speed.
+int recording_start(const char* path, uint32_t field_mask, float frame_seconds) {
+    if (recording_active) recording_stop();
+    field_mask &= RECORD_ALL_MASK;
+    if (!field_mask) return 0;
+    record_file = fopen(path, "wb");
+    if (!record_file) {
+        fprintf(stderr, "Cannot open %s for writing\n", path);
+        return 0;
+    }
+
+    memset(&record_header, 0, sizeof(record_header));
+    memcpy(record_header.magic, RECORDING_MAGIC, sizeof(record_header.magic));
+    record_header.version = RECORDING_VERSION;
+    record_header.header_bytes = sizeof(record_header);
+    record_header.field_mask = field_mask;
+    record_header.keyframe_interval = RECORDING_KEYFRAME_INTERVAL;
+    record_header.frame_seconds = frame_seconds;
+    for (int f = 0; f < RECORD_FIELD_COUNT; f++) {
+        record_header.field_min[f] = record_field_min[f];
+        record_header.field_max[f] = record_field_max[f];
+        record_header.field_levels[f] = record_field_levels[f];
+    }
+    record_offset = 0;
+    record_failed = 0;
+    recording_frames = 0;
+    recording_dropped = 0;
+    record_width = 0;
+    record_height = 0;
+    record_head = record_tail = 0;
+    record_stopping = 0;
+    if (!record_write(&record_header, sizeof(record_header)) ||
+        pthread_create(&record_thread, NULL, record_main, NULL) != 0) {
+        fclose(record_file);
+        return 0;
+    }
+    recording_active = 1;
+    return 1;
+}
+
+// Queues the current fields as one frame. When the writer has fallen
+// RECORDING_QUEUE_SIZE frames behind, waits if wait is set and otherwise
+// drops the frame and returns 0.
+int recording_push(long long step, int wait) {
+    if (!recording_active) return 0;
+    pthread_mutex_lock(&record_lock);
+    while (record_tail - record_head == RECORDING_QUEUE_SIZE) {
+        if (!wait) {
+            pthread_mutex_unlock(&record_lock);
+            recording_dropped++;
+            return 0;
+        }
+        pthread_cond_wait(&record_space, &record_lock);
+    }
+    RecordSlot* slot = &record_slots[record_tail % RECORDING_QUEUE_SIZE];
+    pthread_mutex_unlock(&record_lock);
+
+    // The slot is ours until tail moves past it
+    const void* sources[RECORD_FIELD_COUNT] = {
+        sim->scalars.density, sim->scalars.temperature, sim->fields.velocity_x, sim->fields.velocity_y
+    };
+    size_t cells = (size_t)sim->grid_size;
+    if (slot->capacity < cells) {
+        for (int f = 0; f < RECORD_FIELD_COUNT; f++) {
+            free(slot->planes[f]);
+            slot->planes[f] = NULL;
+        }
+        slot->capacity = 0;
+        for (int f = 0; f < RECORD_FIELD_COUNT; f++) {
+            if (!(record_header.field_mask & RECORD_MASK(f))) continue;
+            slot->planes[f] = malloc(cells * sizeof(float));
+            if (!slot->planes[f]) {
+                recording_dropped++;
+                return 0;
+            }
+        }
+        slot->capacity = cells;
+    }
+    for (int f = 0; f < RECORD_FIELD_COUNT; f++) {
+        if (record_header.field_mask & RECORD_MASK(f)) fluid_read_cells(sources[f], 0, sim->grid_size, slot->planes[f]);
+    }
+    slot->step = step;
+    slot->width = sim->grid_width;
+    slot->height = sim->grid_height;
+
+    pthread_mutex_lock(&record_lock);
+    record_tail++;
+    pthread_cond_signal(&record_ready);
+    pthread_mutex_unlock(&record_lock);
+    return 1;
+}
+
+// Drains the queue, appends the index and closes the file
+void recording_stop() {
+    if (!recording_active) return;
+    pthread_mutex_lock(&record_lock);
+    record_stopping = 1;
+    pthread_cond_signal(&record_ready);
+    pthread_mutex_unlock(&record_lock);
+    pthread_join(record_thread, NULL);
+
+    record_header.index_offset = record_offset;
+    record_header.frame_count = recording_frames;
+    record_write(record_index, (size_t)recording_frames * sizeof(RecordingIndexEntry));
+    if (!record_failed && (file_seek(record_file, 0, SEEK_SET) != 0 ||
+                           fwrite(&record_header, sizeof(record_header), 1, record_file) != 1)) {
+        fprintf(stderr, "Recording index write failed\n");
+    }
+    fclose(record_file);
+    record_file = NULL;
+    recording_active = 0;
+
+    free(record_index);
+    record_index = NULL;
+    record_index_capacity = 0;
+    for (int f = 0; f < RECORD_FIELD_COUNT; f++) {
+        free(record_previous[f]);
+        free(record_current[f]);
+        record_previous[f] = record_current[f] = NULL;
+    }
+    record_level_capacity = 0;
+    free(record_buffer);
+    record_buffer = NULL;
+    record_buffer_capacity = 0;
+    for (int s = 0; s < RECORDING_QUEUE_SIZE; s++) {
+        for (int f = 0; f < RECORD_FIELD_COUNT; f++) free(record_slots[s].planes[f]);
+        record_slots[s] = (RecordSlot){0};
+    }
+}
+
+// Reader
+
+// Rebuilds the index of a recording that was never stopped, up to the
+// last complete frame
+int scan_frames(Recording* recording) {
+    size_t capacity = 0;
+    uint64_t offset = recording->header.header_bytes;
+    for (;;) {
+        RecordingFrameHeader frame;
+        if (file_seek(recording->file, (long long)offset, SEEK_SET) != 0 ||
+            fread(&frame, sizeof(frame), 1, recording->file) != 1 || frame.tag != RECORDING_FRAME_TAG) {
+            break;
+        }
+        uint64_t payload = 0;
+        for (int f = 0; f < RECORD_FIELD_COUNT; f++) payload += frame.field_bytes[f];
+        // A frame whose payload is cut short ends the scan
+        if (file_seek(recording->file, (long long)(offset + sizeof(frame) + payload - 1), SEEK_SET) != 0 ||
+            (payload > 0 && fgetc(recording->file) == EOF)) {
+            break;
+        }
+        if ((size_t)recording->frame_count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            RecordingIndexEntry* index = realloc(recording->index, capacity * sizeof(RecordingIndexEntry));
+            if (!index) return 0;
+            recording->index = index;
+        }
+        recording->index[recording->frame_count++] = (RecordingIndexEntry){
+            offset, frame.step, (uint32_t)(sizeof(frame) + payload), frame.flags
+        };
+        offset += sizeof(frame) + payload;
+    }
+    return 1;
+}
+
+int recording_open(Recording* recording, const char* path) {
+    memset(recording, 0, sizeof(*recording));
+    recording->frame = -1;
+    recording->file = fopen(path, "rb");
+    if (!recording->file) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return 0;
+    }
+    RecordingHeader* header = &recording->header;
+    if (fread(header, sizeof(*header), 1, recording->file) != 1 ||
+        memcmp(header->magic, RECORDING_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != RECORDING_VERSION || header->header_bytes < sizeof(*header)) {
+        fprintf(stderr, "%s is not a recording\n", path);
+        recording_close(recording);
+        return 0;
+    }
+    for (int f = 0; f < RECORD_FIELD_COUNT; f++) {
+        if ((header->field_mask & RECORD_MASK(f)) &&
+            (header->field_levels[f] < 2 || header->field_levels[f] > 65536)) {
+            fprintf(stderr, "%s has a bad %s range\n", path, record_field_names[f]);
+            recording_close(recording);
+            return 0;
+        }
+    }
+
+    int ok = 0;
+    if (header->index_offset) {
+        recording->frame_count = (long long)header->frame_count;
+        recording->index = malloc((size_t)recording->frame_count * sizeof(RecordingIndexEntry) + 1);
+        ok = recording->index && file_seek(recording->file, (long long)header->index_offset, SEEK_SET) == 0 &&
+             fread(recording->index, sizeof(RecordingIndexEntry), (size_t)recording->frame_count,
+                   recording->file) == (size_t)recording->frame_count;
+    }
+    if (!ok) {
+        recording->frame_count = 0;
+        ok = scan_frames(recording);
+        if (ok) printf("%s has no index; recovered %lld frames\n", path, recording->frame_count);
+    }
+    if (!ok || recording->frame_count == 0) {
+        fprintf(stderr, "%s has no readable frames\n", path);
+        recording_close(recording);
+        return 0;
+    }
+    return 1;
+}
+
+// Decodes one frame on top of the current levels
+int decode_frame(Recording* recording, long long frame_number) {
+    const RecordingIndexEntry* entry = &recording->index[frame_number];
+    if (entry->bytes > recording->buffer_capacity) {
+        free(recording->buffer);
+        recording->buffer = malloc(entry->bytes);
+        recording->buffer_capacity = recording->buffer ? entry->bytes : 0;
+        if (!recording->buffer) return 0;
+    }
+    if (file_seek(recording->file, (long long)entry->offset, SEEK_SET) != 0 ||
+        fread(recording->buffer, 1, entry->bytes, recording->file) != entry->bytes) {
+        return 0;
+    }
+    RecordingFrameHeader frame;
+    memcpy(&frame, recording->buffer, sizeof(frame));
+    if (frame.tag != RECORDING_FRAME_TAG || frame.width < 1 || frame.height < 1 ||
+        frame.width > MAX_GRID_SIZE || frame.height > MAX_GRID_SIZE) {
+        return 0;
+    }
+
+    size_t cells = (size_t)frame.width * frame.height;
+    if (frame.flags & RECORDING_KEYFRAME) {
+        if (cells > recording->capacity) {
+            for (int f = 0; f < RECORD_FIELD_COUNT; f++) {
+                free(recording->planes[f]);
+                free(recording->levels[f]);
+                recording->planes[f] = malloc(cells * sizeof(float));
+                recording->levels[f] = malloc(cells * sizeof(uint16_t));
+                if (!recording->planes[f] || !recording->levels[f]) {
+                    recording->capacity = 0;
+                    return 0;
+                }
+            }
+            recording->capacity = cells;
+        }
+        for (int f = 0; f < RECORD_FIELD_COUNT; f++) memset(recording->levels[f], 0, cells * sizeof(uint16_t));
+        recording->width = frame.width;
+        recording->height = frame.height;
+    } else if (frame.width != recording->width || frame.height != recording->height) {
+        return 0;
+    }
+
+    const uint8_t* in = recording->buffer + sizeof(frame);
+    const uint8_t* end = recording->buffer + entry->bytes;
+    for (int f = 0; f < RECORD_FIELD_COUNT; f++) {
+        if (!(recording->header.field_mask & RECORD_MASK(f))) continue;
+        if (frame.field_bytes[f] > (size_t)(end - in) ||
+            !decode_delta(in, frame.field_bytes[f], recording->levels[f], frame.width, frame.height)) {
+            return 0;
+        }
+        in += frame.field_bytes[f];
+    }
+    return 1;
+}
+
+// Makes planes[] hold the given frame, decoding forward from the nearest
+// keyframe, or from the current frame when that is closer
+int recording_seek(Recording* recording, long long frame) {
+    if (frame < 0) frame = 0;
+    if (frame >= recording->frame_count) frame = recording->frame_count - 1;
+    if (frame == recording->frame) return 1;
+
+    long long key = frame;
+    while (key > 0 && !(recording->index[key].flags & RECORDING_KEYFRAME)) key--;
+    long long first = recording->frame >= key && recording->frame < frame ? recording->frame + 1 : key;
+    for (long long f = first; f <= frame; f++) {
+        if (!decode_frame(recording, f)) {
+            fprintf(stderr, "Recording frame %lld is corrupt\n", f);
+            recording->frame = -1;
+            return 0;
+        }
+    }
+    recording->frame = frame;
+
+    size_t cells = (size_t)recording->width * recording->height;
+    for (int f = 0; f < RECORD_FIELD_COUNT; f++) {
+        if (recording->header.field_mask & RECORD_MASK(f)) {
+            dequantize(recording->levels[f], cells, recording->header.field_min[f],
+                       recording->header.field_max[f], recording->header.field_levels[f], recording->planes[f]);
+        } else {
+            memset(recording->planes[f], 0, cells * sizeof(float));
+        }
+    }
+    return 1;
+}
+
+void recording_close(Recording* recording) {
+    if (recording->file) fclose(recording->file);
+    free(recording->index);
+    free(recording->buffer);
+    for (int f = 0; f < RECORD_FIELD_COUNT; f++) {
+        free(recording->planes[f]);
+        free(recording->levels[f]);
+    }
+    memset(recording, 0, sizeof(*recording));
+    recording->frame = -1;
+}
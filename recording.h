@@ -0,0 +1,115 @@
+#ifndef RECORDING_H
+#define RECORDING_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+
+// Compressed time series of the fields for offline review. Each recorded
+// step is quantized to a fixed number of levels per field and stored as the
+// difference from the previous step. Every RECORDING_KEYFRAME_INTERVAL
+// frames, and whenever the grid size changes, a frame is coded against zero
+// instead so a reader can seek without decoding from the start. An index of
+// frame offsets is appended when the recording is stopped; a file cut short
+// by a crash is still readable by scanning the frames.
+//
+// A field's differences are coded in raster order, each predicted by the
+// one to its left (0 at a row start), as a bit stream filled from the low
+// bit of each byte up. The residuals are zigzagged (0, -1, 1, -2, ... become
+// 0, 1, 2, 3, ...) and sent as an Exp-Golomb count of the nonzero ones,
+// then for each nonzero one the Exp-Golomb length of the zero run before
+// it and its zigzag code minus one as a Rice code. The Rice parameter follows
+// a running mean of the earlier residuals, and quotients of 24 or more are
+// escaped to 19 raw bits.
+//
+// Recording runs on a background thread: recording_push() only copies the
+// planes into a bounded queue, and the writer quantizes, encodes and writes.
+
+#define RECORDING_MAGIC "SMOKEREC"
+#define RECORDING_VERSION 1
+#define RECORDING_FRAME_TAG 0x4D415246u   // "FRAM"
+#define RECORDING_KEYFRAME_INTERVAL 30
+#define RECORDING_QUEUE_SIZE 8
+#define RECORDING_KEYFRAME 1              // RecordingFrameHeader.flags
+
+// Quantization ranges; density and temperature resolve 4x finer than the
+// colour table in render.c, so a replay looks the same as the live run
+#define RECORD_DENSITY_MAX 4.0f
+#define RECORD_DENSITY_LEVELS 4096
+#define RECORD_TEMPERATURE_MAX 1.25f
+#define RECORD_TEMPERATURE_LEVELS 512
+#define RECORD_VELOCITY_MAX 32.0f
+#define RECORD_VELOCITY_LEVELS 65535
+
+typedef enum {
+    RECORD_DENSITY,
+    RECORD_TEMPERATURE,
+    RECORD_VELOCITY_X,
+    RECORD_VELOCITY_Y,
+    RECORD_FIELD_COUNT
+} RecordField;
+
+#define RECORD_MASK(field) (1u << (field))
+#define RECORD_DEFAULT_MASK (RECORD_MASK(RECORD_DENSITY) | RECORD_MASK(RECORD_TEMPERATURE))
+#define RECORD_ALL_MASK ((1u << RECORD_FIELD_COUNT) - 1)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_bytes;
+    uint32_t field_mask;
+    uint32_t keyframe_interval;
+    float frame_seconds;         // Simulated time between recorded frames
+    float field_min[RECORD_FIELD_COUNT];
+    float field_max[RECORD_FIELD_COUNT];
+    uint32_t field_levels[RECORD_FIELD_COUNT];
+    uint64_t index_offset;       // 0 until the recording is stopped
+    uint64_t frame_count;
+} RecordingHeader;
+
+typedef struct {
+    uint32_t tag;
+    uint32_t flags;
+    int64_t step;
+    int32_t width;
+    int32_t height;
+    uint32_t field_bytes[RECORD_FIELD_COUNT];   // Coded size of each recorded field, in order
+} RecordingFrameHeader;
+
+typedef struct {
+    uint64_t offset;             // Of the frame header
+    int64_t step;
+    uint32_t bytes;              // Frame header and payload
+    uint32_t flags;
+} RecordingIndexEntry;
+
+extern const char* record_field_names[RECORD_FIELD_COUNT];
+extern int recording_active;
+extern long long recording_frames;
+extern long long recording_dropped;
+
+int recording_start(const char* path, uint32_t field_mask, float frame_seconds);
+int recording_push(long long step, int wait);
+void recording_stop();
+
+// A recording opened for replay. planes[] hold the decoded frame.
+typedef struct {
+    FILE* file;
+    RecordingHeader header;
+    RecordingIndexEntry* index;
+    long long frame_count;
+    long long frame;             // Frame in planes[], -1 before the first seek
+    int width;
+    int height;
+    float* planes[RECORD_FIELD_COUNT];
+    uint16_t* levels[RECORD_FIELD_COUNT];
+    size_t capacity;
+    uint8_t* buffer;
+    size_t buffer_capacity;
+} Recording;
+
+int recording_open(Recording* recording, const char* path);
+int recording_seek(Recording* recording, long long frame);
+void recording_close(Recording* recording);
+
+#endif
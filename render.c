@@ -0,0 +1,298 @@
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#include "detail.h"
+#include "fluid.h"
+#include "obstacles.h"
+#include "particles.h"
+#include "render.h"
+
+#define SMOKE_MIN_DENSITY 0.005f
+#define EMPTY_PIXEL 0xFF000000u
+#define OBSTACLE_PIXEL 0xFF585E66u
+// A fresh tracer centred on a pixel adds this much of each channel
+#define PARTICLE_RED 96
+#define PARTICLE_GREEN 80
+#define PARTICLE_BLUE 64
+
+// Returns 0 for cells too thin to draw
+int smoke_color(float density, float temperature, SmokeColor* color) {
+    if (density <= SMOKE_MIN_DENSITY) return 0;
+
+    float temp = temperature;
+
+    // Enhanced color calculation
+    float heat = temp * temp;
+    float intensity = density * density;
+
+    int r = (int)((heat * 255 + intensity * 150) * (1.0f + sinf(temp * 3.14159f) * 0.2f));
+    int g = (int)((heat * 200 + intensity * 100) * (1.0f + sinf(temp * 2.0f) * 0.2f));
+    int b = (int)((heat * 100 + intensity * 50) * (1.0f + sinf(temp * 1.5f) * 0.2f));
+
+    r = fminf(255, fmaxf(0, r));
+    g = fminf(255, fmaxf(0, g));
+    b = fminf(255, fmaxf(0, b));
+
+    int alpha = (int)(pow(density, 0.6f) * (200 + temp * 150));
+    alpha = fminf(255, fmaxf(0, alpha));
+
+    *color = (SmokeColor){r, g, b, alpha};
+    return 1;
+}
+
+// Colour lookup indexed by quantized (temperature, density). smoke_color()
+// saturates every channel before density 4, and the emitters never heat
+// above 1.2, so clamping to those ranges changes nothing visible; at this
+// resolution the table is within 3 levels per channel of the exact colour.
+// The visibility cut-off is applied per cell, not per bin, so the edge of
+// the plume stays where smoke_color() puts it.
+#define LUT_DENSITY_BINS 1024
+#define LUT_TEMPERATURE_BINS 128
+#define LUT_DENSITY_MAX 4.0f
+#define LUT_TEMPERATURE_MAX 1.25f
+
+uint32_t color_lut[LUT_TEMPERATURE_BINS * LUT_DENSITY_BINS];
+int color_lut_ready = 0;
+
+void build_color_lut() {
+    for (int t = 0; t < LUT_TEMPERATURE_BINS; t++) {
+        float temperature = t * LUT_TEMPERATURE_MAX / (LUT_TEMPERATURE_BINS - 1);
+        for (int d = 0; d < LUT_DENSITY_BINS; d++) {
+            float density = d * LUT_DENSITY_MAX / (LUT_DENSITY_BINS - 1);
+            SmokeColor c;
+            smoke_color(fmaxf(density, nextafterf(SMOKE_MIN_DENSITY, 1.0f)), temperature, &c);
+            color_lut[t * LUT_DENSITY_BINS + d] =
+                (uint32_t)c.a << 24 | (uint32_t)c.r << 16 | (uint32_t)c.g << 8 | c.b;
+        }
+    }
+    color_lut_ready = 1;
+}
+
+typedef struct {
+    uint32_t* pixels;
+    int pitch;
+    const void* density;
+    const void* temperature;
+    int stored;                 // The planes are the simulation's compact ones, converted a row at a time
+    int width;
+    const uint8_t* tiles;       // TILE_SIZE tiles that may hold smoke, or NULL for all
+    int tiles_x;
+    const uint8_t* solid;       // Nonzero for obstacle cells, or NULL for none
+    int solid_width;
+    int solid_scale;            // Pixels per solid cell on each axis, mapped interior to interior
+} PixelTarget;
+
+#define DENSITY_SCALE ((LUT_DENSITY_BINS - 1) / LUT_DENSITY_MAX)
+#define TEMPERATURE_SCALE ((LUT_TEMPERATURE_BINS - 1) / LUT_TEMPERATURE_MAX)
+
+void colorize_span(uint32_t* row, const float* density, const float* temperature, int x_begin, int x_end) {
+    for (int x = x_begin; x < x_end; x++) {
+        // Plain compares rather than fminf/fmaxf, which are NaN-aware library calls
+        float d = density[x] * DENSITY_SCALE;
+        float t = temperature[x] * TEMPERATURE_SCALE;
+        d = d > 0.0f ? d : 0.0f;
+        d = d < LUT_DENSITY_BINS - 1 ? d : LUT_DENSITY_BINS - 1;
+        t = t > 0.0f ? t : 0.0f;
+        t = t < LUT_TEMPERATURE_BINS - 1 ? t : LUT_TEMPERATURE_BINS - 1;
+        uint32_t pixel = color_lut[(int)(t + 0.5f) * LUT_DENSITY_BINS + (int)(d + 0.5f)];
+        row[x] = density[x] > SMOKE_MIN_DENSITY ? pixel : EMPTY_PIXEL;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+// Eight cells per gather; max/min order sends NaN to bin 0 like the scalar path
+TARGET_AVX2 void colorize_span_avx2(uint32_t* row, const float* density, const float* temperature, int x_begin, int x_end) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 d_scale = _mm256_set1_ps(DENSITY_SCALE);
+    const __m256 t_scale = _mm256_set1_ps(TEMPERATURE_SCALE);
+    const __m256 d_max = _mm256_set1_ps(LUT_DENSITY_BINS - 1);
+    const __m256 t_max = _mm256_set1_ps(LUT_TEMPERATURE_BINS - 1);
+    const __m256i stride = _mm256_set1_epi32(LUT_DENSITY_BINS);
+    const __m256 threshold = _mm256_set1_ps(SMOKE_MIN_DENSITY);
+    const __m256i empty = _mm256_set1_epi32((int)EMPTY_PIXEL);
+    int x = x_begin;
+    for (; x + 8 <= x_end; x += 8) {
+        __m256 raw = _mm256_loadu_ps(density + x);
+        __m256 visible = _mm256_cmp_ps(raw, threshold, _CMP_GT_OQ);
+        __m256 d = _mm256_mul_ps(raw, d_scale);
+        __m256 t = _mm256_mul_ps(_mm256_loadu_ps(temperature + x), t_scale);
+        d = _mm256_min_ps(_mm256_max_ps(d, zero), d_max);
+        t = _mm256_min_ps(_mm256_max_ps(t, zero), t_max);
+        __m256i di = _mm256_cvttps_epi32(_mm256_add_ps(d, half));
+        __m256i ti = _mm256_cvttps_epi32(_mm256_add_ps(t, half));
+        __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(ti, stride), di);
+        __m256i pixels = _mm256_i32gather_epi32((const int*)color_lut, index, 4);
+        pixels = _mm256_blendv_epi8(empty, pixels, _mm256_castps_si256(visible));
+        _mm256_storeu_si256((__m256i*)(row + x), pixels);
+    }
+    colorize_span(row, density, temperature, x, x_end);
+}
+#endif
+
+void colorize(uint32_t* row, const float* density, const float* temperature, int x_begin, int x_end) {
+#ifdef HAVE_X86_SIMD
+    if (simd_level >= SIMD_AVX2) {
+        colorize_span_avx2(row, density, temperature, x_begin, x_end);
+        return;
+    }
+#endif
+    colorize_span(row, density, temperature, x_begin, x_end);
+}
+
+// Obstacle cells drawn over a coloured row with a select, not a branch
+void render_solid_row(const PixelTarget* target, uint32_t* row, int y) {
+    const int scale = target->solid_scale;
+    const uint8_t* solid = target->solid + (size_t)((y + scale - 1) / scale) * target->solid_width;
+    if (scale == 1) {
+        for (int x = 0; x < target->width; x++) row[x] = solid[x] ? OBSTACLE_PIXEL : row[x];
+        return;
+    }
+    for (int x = 0; x < target->width; x++) row[x] = solid[(x + scale - 1) / scale] ? OBSTACLE_PIXEL : row[x];
+}
+
+void render_rows(void* ctx, int y_begin, int y_end, int thread) {
+    const PixelTarget* target = ctx;
+    float density_row[MAX_GRID_SIZE];
+    float temperature_row[MAX_GRID_SIZE];
+    for (int y = y_begin; y < y_end; y++) {
+        uint32_t* row = target->pixels + (size_t)y * target->pitch;
+        const float* density = density_row;
+        const float* temperature = temperature_row;
+        if (target->stored) {
+            fluid_read_cells(target->density, y * target->width, target->width, density_row);
+            fluid_read_cells(target->temperature, y * target->width, target->width, temperature_row);
+        } else {
+            density = (const float*)target->density + (size_t)y * target->width;
+            temperature = (const float*)target->temperature + (size_t)y * target->width;
+        }
+        if (!target->tiles) {
+            colorize(row, density, temperature, 0, target->width);
+        } else {
+            // Tiles outside the set are empty, so runs of them are only filled
+            const uint8_t* tiles = &target->tiles[(y / TILE_SIZE) * target->tiles_x];
+            int tx = 0;
+            while (tx < target->tiles_x) {
+                int run = tx + 1;
+                while (run < target->tiles_x && tiles[run] == tiles[tx]) run++;
+                int x_begin = tx * TILE_SIZE;
+                int x_end = run * TILE_SIZE < target->width ? run * TILE_SIZE : target->width;
+                if (tiles[tx]) {
+                    colorize(row, density, temperature, x_begin, x_end);
+                } else {
+                    for (int x = x_begin; x < x_end; x++) row[x] = EMPTY_PIXEL;
+                }
+                tx = run;
+            }
+        }
+        if (target->solid) render_solid_row(target, row, y);
+    }
+}
+
+// Tracers are in simulation cells and the fine grid has a ring of its own,
+// so their positions are converted a block at a time and splatted at scale 1
+void render_detail_particles(const ParticlePool* pool, const DetailGrid* detail, uint32_t* pixels, int pitch) {
+    float x[PARTICLE_BLOCK];
+    float y[PARTICLE_BLOCK];
+    for (int begin = 0; begin < pool->used; begin += PARTICLE_BLOCK) {
+        int count = pool->used - begin < PARTICLE_BLOCK ? pool->used - begin : PARTICLE_BLOCK;
+        for (int k = 0; k < count; k++) {
+            x[k] = (pool->x[begin + k] - 0.5f) * detail->scale + 0.5f;
+            y[k] = (pool->y[begin + k] - 0.5f) * detail->scale + 0.5f;
+        }
+        render_particles(x, y, pool->life + begin, count, 1.0f, pixels, pitch, detail->width, detail->height);
+    }
+}
+
+// One ARGB8888 pixel per cell, or per fine cell when a detail grid is
+// attached; pitch is in pixels
+void render_to_buffer(uint32_t* pixels, int pitch) {
+    if (!color_lut_ready) build_color_lut();
+    const DetailGrid* detail = sim->detail;
+    const ObstacleMap* obstacles = sim->obstacles;
+    const uint8_t* solid = obstacles && obstacles->width == sim->grid_width && obstacles->height == sim->grid_height ? obstacles->owner : NULL;
+    if (detail && detail->width) {
+        PixelTarget target = {pixels, pitch, detail->density, detail->temperature, 0, detail->width, NULL, 0,
+                              solid, sim->grid_width, detail->scale};
+        parallel_for(0, detail->height, render_rows, &target);
+        if (sim->particles) render_detail_particles(sim->particles, detail, pixels, pitch);
+        return;
+    }
+    PixelTarget target = {pixels, pitch, sim->scalars.density, sim->scalars.temperature,
+                          sim->scalar_storage != FIELD_STORAGE_FLOAT32, sim->grid_width,
+                          sim->sparse_tiles ? sim->tile_processed : NULL, sim->tiles_x,
+                          solid, sim->grid_width, 1};
+    parallel_for(0, sim->grid_height, render_rows, &target);
+    if (sim->particles) {
+        render_particles(sim->particles->x, sim->particles->y, sim->particles->life, sim->particles->used,
+                         1.0f, pixels, pitch, sim->grid_width, sim->grid_height);
+    }
+}
+
+// Same for planes copied out of the simulation, on the calling thread only:
+// the pool belongs to whichever thread is stepping the solver. tiles, if not
+// NULL, marks the TILE_SIZE tiles that may hold smoke, and solid, if not
+// NULL, the cells inside obstacles.
+void render_planes(const float* density, const float* temperature, const uint8_t* tiles,
+                   const uint8_t* solid, int width, int height, uint32_t* pixels, int pitch) {
+    if (!color_lut_ready) build_color_lut();
+    PixelTarget target = {pixels, pitch, density, temperature, 0, width,
+                          tiles, (width + TILE_SIZE - 1) / TILE_SIZE, solid, width, 1};
+    render_rows(&target, 0, height, 0);
+}
+
+// Adds the tint at two weights, in 1/65536 of a full splat, to a pair of
+// neighbouring pixels; the channels saturate at 255
+static inline void splat_pair(uint32_t* pixel, int left, int right) {
+#ifdef __SSE2__
+    const __m128i tint = _mm_setr_epi16(PARTICLE_BLUE, PARTICLE_GREEN, PARTICLE_RED, 0,
+                                        PARTICLE_BLUE, PARTICLE_GREEN, PARTICLE_RED, 0);
+    __m128i weight = _mm_unpacklo_epi64(_mm_set1_epi16((short)left), _mm_set1_epi16((short)right));
+    __m128i add = _mm_packus_epi16(_mm_mulhi_epu16(tint, weight), _mm_setzero_si128());
+    __m128i sum = _mm_adds_epu8(_mm_loadl_epi64((const __m128i*)pixel), add);
+    _mm_storel_epi64((__m128i*)pixel, _mm_or_si128(sum, _mm_set1_epi32((int)0xFF000000u)));
+#else
+    for (int k = 0; k < 2; k++) {
+        int weight = k ? right : left;
+        uint32_t c = pixel[k];
+        uint32_t r = ((c >> 16) & 0xFF) + (PARTICLE_RED * weight >> 16);
+        uint32_t g = ((c >> 8) & 0xFF) + (PARTICLE_GREEN * weight >> 16);
+        uint32_t b = (c & 0xFF) + (PARTICLE_BLUE * weight >> 16);
+        r = r < 255 ? r : 255;
+        g = g < 255 ? g : 255;
+        b = b < 255 ? b : 255;
+        pixel[k] = 0xFF000000u | r << 16 | g << 8 | b;
+    }
+#endif
+}
+
+// Adds tracers to the pixels as bilinear point splats that fade over the
+// last PARTICLE_FADE steps of their life; slots with no life left are
+// skipped. scale is pixels per cell, so a buffer larger than the grid
+// shows them finer than the smoke. On the calling thread, as splats from
+// different tracers land on the same pixels.
+void render_particles(const float* x, const float* y, const float* life, int count, float scale,
+                      uint32_t* pixels, int pitch, int width, int height) {
+    const float offset = 0.5f * scale - 0.5f;
+    for (int i = 0; i < count; i++) {
+        if (life[i] <= 0.0f) continue;
+        // Cell centres land on pixel centres
+        float px = x[i] * scale + offset;
+        float py = y[i] * scale + offset;
+        if (px < 0.0f || py < 0.0f || px >= width - 1 || py >= height - 1) continue;
+        int x0 = (int)px;
+        int y0 = (int)py;
+        float fade = life[i] < PARTICLE_FADE ? life[i] * (65535.0f / PARTICLE_FADE) : 65535.0f;
+        float s = px - x0;
+        float t = py - y0;
+        float top = (1.0f - t) * fade;
+        float bottom = t * fade;
+        uint32_t* p = pixels + (size_t)y0 * pitch + x0;
+        splat_pair(p, (int)((1.0f - s) * top), (int)(s * top));
+        splat_pair(p + pitch, (int)((1.0f - s) * bottom), (int)(s * bottom));
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdint.h>
+
+// Smoke colouring shared by the SDL front end and the benchmark; no SDL here
+
+typedef struct {
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+    uint8_t a;
+} SmokeColor;
+
+int smoke_color(float density, float temperature, SmokeColor* color);
+void render_to_buffer(uint32_t* pixels, int pitch);
+void render_planes(const float* density, const float* temperature, const uint8_t* tiles,
+                   const uint8_t* solid, int width, int height, uint32_t* pixels, int pitch);
+void render_particles(const float* x, const float* y, const float* life, int count, float scale,
+                      uint32_t* pixels, int pitch, int width, int height);
+
+#endif
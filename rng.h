@@ -0,0 +1,50 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+// Philox4x32-10 counter-based generator (Salmon et al., "Parallel random
+// numbers: as easy as 1, 2, 3"). Each call maps a 128-bit counter and a
+// 64-bit key to four independent 32-bit words, so any cell can draw its
+// numbers on any thread, in any order, with the same result on every
+// platform. Callers put what identifies a draw (cell, step, stream) in the
+// counter and the seed in the key.
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+typedef struct {
+    uint32_t v[4];
+} Philox4x32;
+
+static inline Philox4x32 philox4x32(uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3,
+                                    uint32_t k0, uint32_t k1) {
+    for (int round = 0; round < PHILOX_ROUNDS; round++) {
+        uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+        uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+        uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)p1;
+        c3 = (uint32_t)p0;
+        c0 = n0;
+        c2 = n2;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    return (Philox4x32){{c0, c1, c2, c3}};
+}
+
+// Uniform in [-1, 1)
+static inline float rng_signed(uint32_t bits) {
+    return (float)(int32_t)bits * (1.0f / 2147483648.0f);
+}
+
+// Uniform in [0, 1), the top 24 bits so every value is exact
+static inline float rng_unit(uint32_t bits) {
+    return (float)(bits >> 8) * (1.0f / 16777216.0f);
+}
+
+#endif
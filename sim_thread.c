@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "checkpoint.h"
+#include "detail.h"
+#include "fluid.h"
+#include "governor.h"
+#include "obstacles.h"
+#include "particles.h"
+#include "profile.h"
+#include "recording.h"
+#include "sim_thread.h"
+#include "timer.h"
+
+#define FRAME_INDEX 3
+#define FRAME_FRESH 4    // Set while the middle slot holds a step the reader has not taken
+
+// Single producer (the front end), single consumer (the simulation thread)
+typedef struct {
+    SimCommand items[SIM_QUEUE_SIZE];
+    atomic_uint head;    // Next item to read, advanced by the consumer
+    atomic_uint tail;    // Next item to write, advanced by the producer
+} CommandQueue;
+
+CommandQueue commands;
+
+// Triple buffer: the writer and the reader each own a slot and trade it for
+// the middle one with a single exchange, so publishing never waits
+SimFrame frames[3];
+atomic_int frame_shared = 1;   // Middle slot, nothing fresh yet
+int frame_write = 0;
+int frame_read = 2;
+
+pthread_t sim_thread;
+atomic_int sim_quit;
+double sim_step_seconds;
+long long sim_steps = 0;
+
+// Input state, owned by the simulation thread
+int sim_emission = 1;
+FrameGovernor sim_governor;
+int sim_governed = 0;
+int sim_force_active = 0;
+float sim_force_x = 0.0f;
+float sim_force_y = 0.0f;
+
+int sim_send(SimCommand command) {
+    unsigned tail = atomic_load_explicit(&commands.tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&commands.head, memory_order_acquire);
+    if (tail - head == SIM_QUEUE_SIZE) return 0;
+    commands.items[tail % SIM_QUEUE_SIZE] = command;
+    atomic_store_explicit(&commands.tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+int sim_receive(SimCommand* command) {
+    unsigned head = atomic_load_explicit(&commands.head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&commands.tail, memory_order_acquire);
+    if (head == tail) return 0;
+    *command = commands.items[head % SIM_QUEUE_SIZE];
+    atomic_store_explicit(&commands.head, head + 1, memory_order_release);
+    return 1;
+}
+
+// Copies the fields the renderer needs into the writer's slot and swaps it
+// into the middle. With a detail grid the smoke is its fine planes, and the
+// tracers and the obstacle mask are converted to fine cells to match.
+void sim_publish(long long step) {
+    SimFrame* frame = &frames[frame_write];
+    const DetailGrid* detail = sim->detail && sim->detail->width ? sim->detail : NULL;
+    int width = detail ? detail->width : sim->grid_width;
+    int height = detail ? detail->height : sim->grid_height;
+    size_t cells = (size_t)width * height;
+    if (frame->capacity < cells) {
+        free(frame->density);
+        free(frame->temperature);
+        frame->density = malloc(cells * sizeof(float));
+        frame->temperature = malloc(cells * sizeof(float));
+        frame->capacity = frame->density && frame->temperature ? cells : 0;
+        if (frame->capacity == 0) return;
+    }
+    frame->width = width;
+    frame->height = height;
+    frame->step = step;
+    if (detail) {
+        memcpy(frame->density, detail->density, cells * sizeof(float));
+        memcpy(frame->temperature, detail->temperature, cells * sizeof(float));
+    } else {
+        fluid_read_cells(sim->scalars.density, 0, sim->grid_size, frame->density);
+        fluid_read_cells(sim->scalars.temperature, 0, sim->grid_size, frame->temperature);
+    }
+
+    size_t tiles = (size_t)sim->tiles_x * sim->tiles_y;
+    if (frame->tile_capacity < tiles) {
+        free(frame->tiles);
+        frame->tiles = malloc(tiles);
+        frame->tile_capacity = frame->tiles ? tiles : 0;
+    }
+    frame->sparse = !detail && sim->sparse_tiles && frame->tile_capacity >= tiles;
+    if (frame->sparse) memcpy(frame->tiles, sim->tile_processed, tiles);
+
+    int live = sim->particles ? sim->particles->live : 0;
+    if (frame->particle_capacity < live) {
+        free(frame->particle_x);
+        free(frame->particle_y);
+        free(frame->particle_life);
+        // Sized for the whole pool so a growing crowd allocates once
+        int capacity = sim->particles->capacity;
+        frame->particle_x = malloc(capacity * sizeof(float));
+        frame->particle_y = malloc(capacity * sizeof(float));
+        frame->particle_life = malloc(capacity * sizeof(float));
+        frame->particle_capacity = frame->particle_x && frame->particle_y && frame->particle_life ? capacity : 0;
+    }
+    frame->particle_count = 0;
+    if (live && frame->particle_capacity >= live) {
+        frame->particle_count = particles_copy_live(sim->particles, frame->particle_x, frame->particle_y,
+                                                    frame->particle_life);
+    }
+    for (int i = 0; detail && i < frame->particle_count; i++) {
+        frame->particle_x[i] = (frame->particle_x[i] - 0.5f) * detail->scale + 0.5f;
+        frame->particle_y[i] = (frame->particle_y[i] - 0.5f) * detail->scale + 0.5f;
+    }
+
+    if (sim->obstacles && frame->solid_capacity < cells) {
+        free(frame->solid);
+        frame->solid = malloc(cells);
+        frame->solid_capacity = frame->solid ? cells : 0;
+    }
+    frame->obstacles = sim->obstacles && sim->obstacles->width == sim->grid_width &&
+                       sim->obstacles->height == sim->grid_height && frame->solid_capacity >= cells;
+    if (frame->obstacles) obstacles_mask(sim->obstacles, detail ? detail->scale : 1, frame->solid, width, height);
+
+    int previous = atomic_exchange_explicit(&frame_shared, frame_write | FRAME_FRESH, memory_order_acq_rel);
+    frame_write = previous & FRAME_INDEX;
+}
+
+// The latest published step, or NULL before the first one. Valid until the
+// next call.
+const SimFrame* sim_latest_frame() {
+    if (atomic_load_explicit(&frame_shared, memory_order_relaxed) & FRAME_FRESH) {
+        int previous = atomic_exchange_explicit(&frame_shared, frame_read, memory_order_acq_rel);
+        frame_read = previous & FRAME_INDEX;
+    }
+    return frames[frame_read].capacity ? &frames[frame_read] : NULL;
+}
+
+void sim_apply(const SimCommand* command) {
+    switch (command->type) {
+    case SIM_FORCE:
+        sim_force_active = command->arg;
+        sim_force_x = command->x;
+        sim_force_y = command->y;
+        break;
+    case SIM_EMISSION:
+        sim_emission = command->arg;
+        break;
+    case SIM_EMISSION_AMOUNT:
+        sim->emission_density_amount = command->x;
+        break;
+    case SIM_RESET:
+        init_grid();
+        break;
+    case SIM_PRESSURE_SOLVER:
+        sim->pressure_solver = command->arg;
+        break;
+    case SIM_VISCOSITY_SOLVER:
+        sim->viscosity_solver = command->arg;
+        break;
+    case SIM_RESIZE:
+        if (fluid_resize(command->arg, command->arg2)) {
+            printf("Grid: %dx%d\n", sim->grid_width, sim->grid_height);
+        } else {
+            printf("Grid %dx%d could not be allocated\n", command->arg, command->arg2);
+        }
+        break;
+    case SIM_SAVE:
+        checkpoint_save_async(command->path, sim_steps);
+        break;
+    case SIM_LOAD:
+        if (checkpoint_load(command->path, &sim_steps, NULL)) {
+            printf("Loaded %s: %dx%d at step %lld\n", command->path, sim->grid_width, sim->grid_height, sim_steps);
+            sim_publish(sim_steps);
+        }
+        break;
+    case SIM_RECORD:
+        if (command->arg) {
+            if (recording_start(command->path, RECORD_DEFAULT_MASK, (float)sim_step_seconds)) {
+                printf("Recording to %s\n", command->path);
+            }
+        } else if (recording_active) {
+            recording_stop();
+            printf("Recorded %lld frames, %lld dropped\n", recording_frames, recording_dropped);
+        }
+        break;
+    case SIM_BUDGET:
+        if (sim_governed) sim->effort = sim_governor.full;
+        sim_governed = command->x > 0.0f;
+        if (sim_governed) {
+            governor_init(&sim_governor, command->x);
+            printf("Budget: %.2f ms per step\n", command->x * 1e3);
+        }
+        break;
+    case SIM_PARTICLES:
+        particles_destroy(sim->particles);
+        sim->particles = command->arg > 0 ? particles_create(command->arg) : NULL;
+        if (command->arg > 0 && !sim->particles) printf("%d tracers could not be allocated\n", command->arg);
+        if (sim->particles && command->x > 0.0f) sim->particles->spawn_rate = command->x;
+        break;
+    case SIM_DETAIL:
+        detail_destroy(sim->detail);
+        sim->detail = command->arg > 0 ? detail_create(command->arg) : NULL;
+        if (command->arg > 0 && !sim->detail) printf("Detail scale %d could not be set up\n", command->arg);
+        if (sim->detail) sim->detail->amount = command->x;
+        break;
+    case SIM_OBSTACLE_PAINT:
+        if (!sim->obstacles && (sim->obstacles = obstacles_create())) sim->obstacles->no_slip = command->arg2;
+        if (sim->obstacles) {
+            obstacles_paint(sim->obstacles, command->x * sim->grid_width, command->y * sim->grid_height,
+                            OBSTACLE_BRUSH, command->arg);
+        }
+        break;
+    case SIM_OBSTACLE_CLEAR:
+        obstacles_destroy(sim->obstacles);
+        sim->obstacles = NULL;
+        break;
+    }
+}
+
+void sim_emit() {
+    if (sim_emission) add_candle(sim->grid_width / 2, sim->grid_height - 2);
+}
+
+// Fixed-timestep loop: wall time accumulates and is spent in whole steps,
+// so the step rate does not follow the display rate
+void* sim_main(void* arg) {
+    profile_set_thread(2, "simulation");
+    sim->emit_sources = sim_emit;
+    double step = sim_step_seconds;
+    double previous = timer_seconds();
+    double accumulator = 0.0;
+
+    while (!atomic_load_explicit(&sim_quit, memory_order_acquire)) {
+        SimCommand command;
+        while (sim_receive(&command)) sim_apply(&command);
+
+        double now = timer_seconds();
+        accumulator += now - previous;
+        previous = now;
+        // After a stall, drop the backlog rather than fall further behind
+        if (accumulator > SIM_MAX_CATCH_UP * step) accumulator = SIM_MAX_CATCH_UP * step;
+        if (accumulator < step) {
+            timer_sleep(step - accumulator);
+            continue;
+        }
+
+        while (accumulator >= step) {
+            double start = profile_begin();
+            stamps_clear();
+            if (sim_force_active) {
+                Stamp mouse = mouse_stamp((int)(sim_force_x * sim->grid_width), (int)(sim_force_y * sim->grid_height));
+                stamp_add(&mouse);
+            }
+            update_simulation((float)step);
+            profile_end("simulation", start);
+            if (sim_governed) {
+                governor_update(&sim_governor);
+                if (sim_governor.changed) printf("Budget: %s\n", sim_governor.decision);
+            }
+            accumulator -= step;
+            sim_steps++;
+
+            // Every step, so a display that keeps up never shows a stale one
+            start = profile_begin();
+            sim_publish(sim_steps);
+            profile_end("publish", start);
+
+            // Never waits; a writer that falls behind drops frames instead
+            if (recording_active) {
+                start = profile_begin();
+                recording_push(sim_steps, 0);
+                profile_end("record", start);
+            }
+        }
+    }
+    return NULL;
+}
+
+int sim_thread_start(double step_seconds) {
+    sim_step_seconds = step_seconds;
+    atomic_store(&sim_quit, 0);
+    if (pthread_create(&sim_thread, NULL, sim_main, NULL) != 0) {
+        printf("Simulation thread creation failed\n");
+        return 0;
+    }
+    return 1;
+}
+
+void sim_thread_stop() {
+    atomic_store_explicit(&sim_quit, 1, memory_order_release);
+    pthread_join(sim_thread, NULL);
+    checkpoint_wait();
+    recording_stop();
+    for (int f = 0; f < 3; f++) {
+        free(frames[f].density);
+        free(frames[f].temperature);
+        free(frames[f].tiles);
+        free(frames[f].particle_x);
+        free(frames[f].particle_y);
+        free(frames[f].particle_life);
+        free(frames[f].solid);
+        frames[f] = (SimFrame){0};
+    }
+    particles_destroy(sim->particles);
+    sim->particles = NULL;
+    detail_destroy(sim->detail);
+    sim->detail = NULL;
+    obstacles_destroy(sim->obstacles);
+    sim->obstacles = NULL;
+}
@@ -0,0 +1,71 @@
+#ifndef SIM_THREAD_H
+#define SIM_THREAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Runs the solver on its own thread at a fixed step rate, decoupled from the
+// display. Input reaches it through a single-producer command queue and
+// finished steps come back through a triple buffer, so neither side ever
+// waits on the other. While the thread runs it owns default_simulation and
+// the thread pool; the front end only touches what sim_latest_frame() hands
+// back.
+
+#define SIM_QUEUE_SIZE 256      // Commands in flight; a power of two
+#define SIM_MAX_CATCH_UP 4      // Steps run back to back before time is dropped
+
+typedef enum {
+    SIM_FORCE,                  // arg = active, x/y = position as a fraction of the grid
+    SIM_EMISSION,               // arg = candle on or off
+    SIM_EMISSION_AMOUNT,        // x = density per emitter cell
+    SIM_RESET,
+    SIM_PRESSURE_SOLVER,        // arg = PressureSolver
+    SIM_VISCOSITY_SOLVER,       // arg = ViscositySolver
+    SIM_RESIZE,                 // arg = width, arg2 = height
+    SIM_SAVE,                   // path = checkpoint file, written in the background
+    SIM_LOAD,                   // path = checkpoint file
+    SIM_RECORD,                 // arg = start or stop, path = recording file
+    SIM_BUDGET,                 // x = seconds per step the solver may take, 0 for no limit
+    SIM_PARTICLES,              // arg = tracer capacity, 0 for none; x = spawn rate, 0 for the default
+    SIM_DETAIL,                 // arg = detail grid scale, 0 for none; x = swirl amount
+    SIM_OBSTACLE_PAINT,         // arg = paint or erase, x/y = position as a fraction of the grid;
+                                // arg2 = no slip, for when this creates the obstacles
+    SIM_OBSTACLE_CLEAR
+} SimCommandType;
+
+typedef struct {
+    SimCommandType type;
+    int arg;
+    int arg2;
+    float x;
+    float y;
+    const char* path;           // Must outlive the command; a string literal or static buffer
+} SimCommand;
+
+// What the renderer needs from one finished step
+typedef struct {
+    int width;
+    int height;
+    long long step;
+    float* density;
+    float* temperature;
+    uint8_t* tiles;             // Tiles that may hold smoke, tiles_x per row
+    int sparse;                 // 0 when stepping dense; tiles is then not filled
+    size_t capacity;            // Cells allocated in each plane
+    size_t tile_capacity;
+    float* particle_x;          // Live tracers, in cells; see particles.h
+    float* particle_y;
+    float* particle_life;
+    int particle_count;
+    int particle_capacity;
+    uint8_t* solid;             // Nonzero for cells inside obstacles, width x height
+    int obstacles;              // 0 when there are none; solid is then not filled
+    size_t solid_capacity;
+} SimFrame;
+
+int sim_thread_start(double step_seconds);
+void sim_thread_stop();
+int sim_send(SimCommand command);
+const SimFrame* sim_latest_frame();
+
+#endif
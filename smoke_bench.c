@@ -0,0 +1,514 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#include "detail.h"
+#include "fluid.h"
+#include "obstacles.h"
+#include "particles.h"
+#include "render.h"
+#include "timer.h"
+
+#define MAX_SIZES 16
+#define BENCH_RENDER STAGE_COUNT           // Sample slot for render-to-buffer
+#define BENCH_STEP (STAGE_COUNT + 1)       // Sample slot for the whole step
+#define BENCH_SLOTS (STAGE_COUNT + 2)
+
+typedef struct {
+    int width;
+    int height;
+} GridSize;
+
+typedef struct {
+    double mean;
+    double p50;
+    double p90;
+    double p99;
+    double min;
+    double max;
+} StageStats;
+
+// Final state against the same run with fp32 storage, over the interior
+typedef struct {
+    double density_rms;
+    double density_max;          // Largest absolute difference
+    double temperature_rms;
+    double total_density;        // Relative difference of the summed density
+} StorageError;
+
+typedef struct {
+    GridSize size;
+    uint64_t checksum;
+    StageStats stats[BENCH_SLOTS];
+    StorageError error;
+} BenchResult;
+
+GridSize sizes[MAX_SIZES] = {{100, 75}, {200, 150}, {400, 300}};
+int size_count = 3;
+
+const char* slot_name(int slot) {
+    if (slot == BENCH_RENDER) return "render";
+    if (slot == BENCH_STEP) return "step";
+    return stage_names[slot];
+}
+
+void print_usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --sizes LIST            comma-separated WxH grid sizes (default 100x75,200x150,400x300)\n"
+        "  --frames N              measured frames per size (default 300)\n"
+        "  --warmup N              unmeasured frames before that (default 50)\n"
+        "  --seed N                random seed (default 1)\n"
+        "  --pressure NAME         gauss-seidel, multigrid or spectral\n"
+        "  --viscosity NAME        gauss-seidel or spectral\n"
+        "  --turbulence NAME       white (per-cell kicks) or curl (smooth swirl)\n"
+        "  --threads N             worker threads (default: one per CPU)\n"
+        "  --simd LEVEL            cap kernels at scalar, sse4.1 or avx2\n"
+        "  --dense                 step every cell instead of only the active tiles\n"
+        "  --particles N           carry up to N tracers, timed as the particles stage\n"
+        "                          and splatted by the render\n"
+        "  --detail-scale F        carry the smoke on a grid F times finer than the flow,\n"
+        "                          timed with the advection stage and rendered at\n"
+        "                          its resolution\n"
+        "  --detail AMOUNT         sub-grid swirl for the fine grid (default 0)\n"
+        "  --stamps N              add N scripted sources of every shape, timed with\n"
+        "                          the forces stage (default 0)\n"
+        "  --obstacles N           add N scripted solid bodies, discs and boxes with\n"
+        "                          every other one moving (default 0)\n"
+        "  --storage FORMAT        density and temperature storage: float32, float16,\n"
+        "                          fixed16 or fixed8; others are also run as float32\n"
+        "                          and their error reported (default float32)\n"
+        "  --format FORMAT         csv or json (default csv)\n"
+        "  --output FILE           write results to FILE instead of stdout\n",
+        program);
+}
+
+int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples
+double percentile(const double* sorted, int count, double p) {
+    int rank = (int)(p / 100.0 * count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return sorted[rank - 1];
+}
+
+StageStats summarize(double* samples, int count) {
+    StageStats s = {0};
+    qsort(samples, count, sizeof(double), compare_double);
+    for (int i = 0; i < count; i++) s.mean += samples[i];
+    s.mean /= count;
+    s.p50 = percentile(samples, count, 50.0);
+    s.p90 = percentile(samples, count, 90.0);
+    s.p99 = percentile(samples, count, 99.0);
+    s.min = samples[0];
+    s.max = samples[count - 1];
+    return s;
+}
+
+// One frame: the candle emitter, then every stage and a render timed on its
+// own. samples is NULL during warmup.
+void bench_frame(uint32_t* pixels, double* samples) {
+    add_candle(sim->grid_width / 2, sim->grid_height - 2);
+
+    double step_start = timer_seconds();
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        double start = timer_seconds();
+        run_stage(stage);
+        if (samples) samples[stage] = timer_seconds() - start;
+    }
+    sim->noise_step++;
+    double start = timer_seconds();
+    render_to_buffer(pixels, sim->detail ? sim->detail->width : sim->grid_width);
+    double end = timer_seconds();
+    if (samples) {
+        samples[BENCH_RENDER] = end - start;
+        samples[BENCH_STEP] = end - step_start;
+    }
+}
+
+int stamp_sources = 0;
+int detail_scale = 0;
+float detail_amount = 0.0f;
+int obstacle_bodies = 0;
+
+// Scripted sources spread over the grid, cycling through the shapes:
+// emitters, sinks and heat sources alternately, each with a push
+void add_stamp_sources(int count) {
+    int inner_width = sim->grid_width - 2;
+    int inner_height = sim->grid_height - 2;
+    float radius = 2.0f + inner_width / 40.0f;
+    for (int k = 0; k < count; k++) {
+        float angle = 2.3999632f * k;
+        Stamp s = {
+            .shape = k % STAMP_SHAPE_COUNT,
+            .x = 1.0f + inner_width * fmodf(0.5f + 0.6180340f * k, 1.0f),
+            .y = 1.0f + inner_height * fmodf(0.5f + 0.7548777f * k, 1.0f),
+            .radius = radius,
+            .force = 0.05f,
+            .dir_x = cosf(angle),
+            .dir_y = sinf(angle),
+        };
+        s.x2 = s.x + 2.0f * radius * s.dir_x;
+        s.y2 = s.y + radius;
+        if (k % 3 == 0) s.density = 0.1f;
+        if (k % 3 == 1) s.drain = 0.05f;
+        if (k % 3 == 2) s.temperature = 0.05f;
+        stamp_add(&s);
+    }
+}
+
+// Bodies spread like the sources, alternately discs and boxes, with every
+// other one moving in its own direction
+void add_obstacle_bodies(int count) {
+    int inner_width = sim->grid_width - 2;
+    int inner_height = sim->grid_height - 2;
+    float radius = 2.0f + inner_width / 30.0f;
+    obstacles_clear(sim->obstacles);
+    for (int k = 0; k < count; k++) {
+        float angle = 2.3999632f * k;
+        float speed = k % 2 ? 0.5f : 0.0f;
+        ObstacleBody body = {
+            .shape = k % OBSTACLE_SHAPE_COUNT,
+            .x = 1.0f + inner_width * fmodf(0.25f + 0.6180340f * k, 1.0f),
+            .y = 1.0f + inner_height * fmodf(0.25f + 0.7548777f * k, 1.0f),
+            .radius = radius,
+            .velocity_x = speed * cosf(angle),
+            .velocity_y = speed * sinf(angle),
+        };
+        body.x2 = body.x + 2.0f * radius;
+        body.y2 = body.y + radius;
+        obstacles_add_body(sim->obstacles, &body);
+    }
+}
+
+// Same seed, a fixed mouse push and the same sources and bodies for every
+// size and build
+void bench_start(unsigned seed) {
+    fluid_seed(seed);
+    stamps_clear();
+    Stamp mouse = mouse_stamp(sim->grid_width / 2, sim->grid_height / 2);
+    stamp_add(&mouse);
+    add_stamp_sources(stamp_sources);
+    if (sim->obstacles) add_obstacle_bodies(obstacle_bodies);
+}
+
+// Runs the frames of bench_size() untimed with fp32 storage on the grid
+// already allocated and keeps the final density and temperature
+int reference_run(int frames, unsigned seed, uint32_t* pixels, float* density, float* temperature) {
+    FieldStorage storage = sim->scalar_storage;
+    int ok = fluid_set_storage(FIELD_STORAGE_FLOAT32);
+    if (ok) {
+        bench_start(seed);
+        for (int f = 0; f < frames; f++) bench_frame(pixels, NULL);
+        fluid_read_cells(sim->scalars.density, 0, sim->grid_size, density);
+        fluid_read_cells(sim->scalars.temperature, 0, sim->grid_size, temperature);
+    }
+    return fluid_set_storage(storage) && ok;
+}
+
+void measure_error(const float* density, const float* temperature, StorageError* error) {
+    float row[MAX_GRID_SIZE];
+    double density_sq = 0.0, temperature_sq = 0.0, total = 0.0, reference_total = 0.0;
+    double density_max = 0.0;
+    int interior = 0;
+    for (int y = 1; y < sim->grid_height - 1; y++) {
+        fluid_read_cells(sim->scalars.density, IX(0, y), sim->grid_width, row);
+        for (int x = 1; x < sim->grid_width - 1; x++) {
+            double diff = (double)row[x] - density[IX(x, y)];
+            density_sq += diff * diff;
+            if (fabs(diff) > density_max) density_max = fabs(diff);
+            total += row[x];
+            reference_total += density[IX(x, y)];
+        }
+        fluid_read_cells(sim->scalars.temperature, IX(0, y), sim->grid_width, row);
+        for (int x = 1; x < sim->grid_width - 1; x++) {
+            double diff = (double)row[x] - temperature[IX(x, y)];
+            temperature_sq += diff * diff;
+        }
+        interior += sim->grid_width - 2;
+    }
+    error->density_rms = sqrt(density_sq / interior);
+    error->density_max = density_max;
+    error->temperature_rms = sqrt(temperature_sq / interior);
+    error->total_density = reference_total > 0.0 ? (total - reference_total) / reference_total : 0.0;
+}
+
+int bench_size(GridSize size, int frames, int warmup, unsigned seed, BenchResult* result) {
+    if (!fluid_resize(size.width, size.height)) {
+        fprintf(stderr, "Cannot allocate a %dx%d grid\n", size.width, size.height);
+        return 0;
+    }
+    if (detail_scale > 0) {
+        detail_destroy(sim->detail);
+        sim->detail = detail_create(detail_scale);
+        if (!sim->detail) {
+            fprintf(stderr, "Cannot set up detail scale %d on a %dx%d grid\n", detail_scale, size.width, size.height);
+            return 0;
+        }
+        sim->detail->amount = detail_amount;
+    }
+    if (obstacle_bodies > 0 && !sim->obstacles) {
+        sim->obstacles = obstacles_create();
+        if (!sim->obstacles) {
+            fprintf(stderr, "Out of memory\n");
+            return 0;
+        }
+    }
+    size_t cells = (size_t)sim->grid_size;
+    size_t pixel_count = sim->detail ? (size_t)sim->detail->width * sim->detail->height : cells;
+    int compact = sim->scalar_storage != FIELD_STORAGE_FLOAT32;
+    uint32_t* pixels = malloc(pixel_count * sizeof(uint32_t));
+    double* samples = malloc((size_t)frames * BENCH_SLOTS * sizeof(double));
+    double* column = malloc((size_t)frames * sizeof(double));
+    float* reference = compact ? malloc(2 * cells * sizeof(float)) : NULL;
+    if (!pixels || !samples || !column || (compact && !reference)) {
+        fprintf(stderr, "Out of memory\n");
+        free(pixels);
+        free(samples);
+        free(column);
+        free(reference);
+        return 0;
+    }
+    if (compact && !reference_run(warmup + frames, seed, pixels, reference, reference + cells)) {
+        fprintf(stderr, "Cannot allocate a %dx%d grid\n", size.width, size.height);
+        free(pixels);
+        free(samples);
+        free(column);
+        free(reference);
+        return 0;
+    }
+
+    bench_start(seed);
+    for (int f = 0; f < warmup; f++) bench_frame(pixels, NULL);
+    for (int f = 0; f < frames; f++) bench_frame(pixels, &samples[(size_t)f * BENCH_SLOTS]);
+
+    result->size = size;
+    result->checksum = fluid_checksum();
+    for (int slot = 0; slot < BENCH_SLOTS; slot++) {
+        for (int f = 0; f < frames; f++) column[f] = samples[(size_t)f * BENCH_SLOTS + slot] * 1e6;
+        result->stats[slot] = summarize(column, frames);
+    }
+    memset(&result->error, 0, sizeof(result->error));
+    if (compact) measure_error(reference, reference + cells, &result->error);
+
+    free(pixels);
+    free(samples);
+    free(column);
+    free(reference);
+    return 1;
+}
+
+// The error columns are 0 for float32, the reference itself
+void write_csv(FILE* out, const BenchResult* results, int count, int frames) {
+    fprintf(out, "width,height,stage,frames,mean_us,p50_us,p90_us,p99_us,min_us,max_us,checksum,"
+                 "storage,density_rms_error,density_max_error,temperature_rms_error,total_density_error\n");
+    for (int r = 0; r < count; r++) {
+        const StorageError* e = &results[r].error;
+        for (int slot = 0; slot < BENCH_SLOTS; slot++) {
+            const StageStats* s = &results[r].stats[slot];
+            fprintf(out, "%d,%d,%s,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%016llx,%s,%.6g,%.6g,%.6g,%.6g\n",
+                    results[r].size.width, results[r].size.height, slot_name(slot), frames,
+                    s->mean, s->p50, s->p90, s->p99, s->min, s->max,
+                    (unsigned long long)results[r].checksum, field_storage_names[sim->scalar_storage],
+                    e->density_rms, e->density_max, e->temperature_rms, e->total_density);
+        }
+    }
+}
+
+void write_json(FILE* out, const BenchResult* results, int count, int frames, int warmup, unsigned seed) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\"frames\": %d, \"warmup\": %d, \"seed\": %u, \"threads\": %d, "
+                 "\"simd\": \"%s\", \"pressure\": \"%s\", \"viscosity\": \"%s\", \"storage\": \"%s\"},\n",
+            frames, warmup, seed, pool.thread_count, simd_level_names[simd_level],
+            pressure_solver_names[sim->pressure_solver], viscosity_solver_names[sim->viscosity_solver],
+            field_storage_names[sim->scalar_storage]);
+    fprintf(out, "  \"runs\": [\n");
+    for (int r = 0; r < count; r++) {
+        const StorageError* e = &results[r].error;
+        fprintf(out, "    {\"width\": %d, \"height\": %d, \"checksum\": \"%016llx\", ",
+                results[r].size.width, results[r].size.height, (unsigned long long)results[r].checksum);
+        if (sim->scalar_storage != FIELD_STORAGE_FLOAT32) {
+            fprintf(out, "\"error\": {\"density_rms\": %.6g, \"density_max\": %.6g, "
+                         "\"temperature_rms\": %.6g, \"total_density\": %.6g}, ",
+                    e->density_rms, e->density_max, e->temperature_rms, e->total_density);
+        }
+        fprintf(out, "\"stages\": {\n");
+        for (int slot = 0; slot < BENCH_SLOTS; slot++) {
+            const StageStats* s = &results[r].stats[slot];
+            fprintf(out, "      \"%s\": {\"mean_us\": %.3f, \"p50_us\": %.3f, \"p90_us\": %.3f, "
+                         "\"p99_us\": %.3f, \"min_us\": %.3f, \"max_us\": %.3f}%s\n",
+                    slot_name(slot), s->mean, s->p50, s->p90, s->p99, s->min, s->max,
+                    slot + 1 < BENCH_SLOTS ? "," : "");
+        }
+        fprintf(out, "    }}%s\n", r + 1 < count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char* argv[]) {
+    int frames = 300;
+    int warmup = 50;
+    unsigned seed = 1;
+    int threads = 0;
+    int json = 0;
+    const char* output_path = NULL;
+    SimdLevel simd_request = SIMD_LEVEL_COUNT - 1;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else if (strcmp(arg, "--dense") == 0) {
+            sim->sparse_tiles = 0;
+            continue;
+        } else if (!value) {
+            fprintf(stderr, "Missing value for %s\n", arg);
+            print_usage(argv[0]);
+            return 1;
+        } else if (strcmp(arg, "--sizes") == 0) {
+            char list[512];
+            snprintf(list, sizeof(list), "%s", value);
+            size_count = 0;
+            for (char* item = strtok(list, ","); item; item = strtok(NULL, ",")) {
+                GridSize size;
+                if (sscanf(item, "%dx%d", &size.width, &size.height) != 2) {
+                    fprintf(stderr, "Grid size must be WxH: %s\n", item);
+                    return 1;
+                }
+                if (size_count == MAX_SIZES) {
+                    fprintf(stderr, "At most %d sizes\n", MAX_SIZES);
+                    return 1;
+                }
+                sizes[size_count++] = size;
+            }
+        } else if (strcmp(arg, "--frames") == 0) {
+            frames = atoi(value);
+        } else if (strcmp(arg, "--warmup") == 0) {
+            warmup = atoi(value);
+        } else if (strcmp(arg, "--seed") == 0) {
+            seed = (unsigned)strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--pressure") == 0) {
+            int solver = find_name(value, pressure_solver_options, PRESSURE_SOLVER_COUNT);
+            if (solver < 0) {
+                fprintf(stderr, "Unknown pressure solver: %s\n", value);
+                return 1;
+            }
+            sim->pressure_solver = solver;
+        } else if (strcmp(arg, "--viscosity") == 0) {
+            int solver = find_name(value, viscosity_solver_options, VISCOSITY_SOLVER_COUNT);
+            if (solver < 0) {
+                fprintf(stderr, "Unknown viscosity solver: %s\n", value);
+                return 1;
+            }
+            sim->viscosity_solver = solver;
+        } else if (strcmp(arg, "--turbulence") == 0) {
+            int mode = find_name(value, turbulence_mode_names, TURBULENCE_MODE_COUNT);
+            if (mode < 0) {
+                fprintf(stderr, "Unknown turbulence: %s\n", value);
+                return 1;
+            }
+            sim->turbulence_mode = mode;
+        } else if (strcmp(arg, "--threads") == 0) {
+            threads = atoi(value);
+        } else if (strcmp(arg, "--particles") == 0) {
+            particles_destroy(sim->particles);
+            sim->particles = particles_create(atoi(value));
+        } else if (strcmp(arg, "--detail-scale") == 0) {
+            detail_scale = atoi(value);
+        } else if (strcmp(arg, "--detail") == 0) {
+            detail_amount = (float)atof(value);
+        } else if (strcmp(arg, "--stamps") == 0) {
+            stamp_sources = atoi(value);
+            if (stamp_sources < 0 || stamp_sources > MAX_STAMPS - 1) {
+                fprintf(stderr, "--stamps must be 0..%d\n", MAX_STAMPS - 1);
+                return 1;
+            }
+        } else if (strcmp(arg, "--obstacles") == 0) {
+            obstacle_bodies = atoi(value);
+            if (obstacle_bodies < 0 || obstacle_bodies > MAX_OBSTACLE_BODIES) {
+                fprintf(stderr, "--obstacles must be 0..%d\n", MAX_OBSTACLE_BODIES);
+                return 1;
+            }
+        } else if (strcmp(arg, "--simd") == 0) {
+            int level = find_name(value, simd_level_names, SIMD_LEVEL_COUNT);
+            if (level < 0) {
+                fprintf(stderr, "Unknown SIMD level: %s\n", value);
+                return 1;
+            }
+            simd_request = level;
+        } else if (strcmp(arg, "--storage") == 0) {
+            int storage = find_name(value, field_storage_names, FIELD_STORAGE_COUNT);
+            if (storage < 0) {
+                fprintf(stderr, "Unknown storage: %s\n", value);
+                return 1;
+            }
+            fluid_set_storage(storage);
+        } else if (strcmp(arg, "--format") == 0) {
+            if (strcasecmp(value, "json") == 0) {
+                json = 1;
+            } else if (strcasecmp(value, "csv") != 0) {
+                fprintf(stderr, "Unknown format: %s\n", value);
+                return 1;
+            }
+        } else if (strcmp(arg, "--output") == 0) {
+            output_path = value;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            print_usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+    if (frames < 1) frames = 1;
+    if (warmup < 0) warmup = 0;
+
+    thread_pool_init(threads);
+    simd_select(simd_request);
+    fprintf(stderr, "Threads: %d, SIMD: %s, pressure: %s, viscosity: %s, turbulence: %s, storage: %s\n",
+            pool.thread_count, simd_level_names[simd_level],
+            pressure_solver_names[sim->pressure_solver], viscosity_solver_names[sim->viscosity_solver],
+            turbulence_mode_names[sim->turbulence_mode], field_storage_names[sim->scalar_storage]);
+
+    BenchResult results[MAX_SIZES];
+    int count = 0;
+    for (int s = 0; s < size_count; s++) {
+        fprintf(stderr, "Benchmarking %dx%d\n", sizes[s].width, sizes[s].height);
+        if (!bench_size(sizes[s], frames, warmup, seed, &results[count])) continue;
+        count++;
+    }
+
+    FILE* out = stdout;
+    if (output_path) {
+        out = fopen(output_path, "w");
+        if (!out) {
+            fprintf(stderr, "Cannot open %s for writing\n", output_path);
+            return 1;
+        }
+    }
+    if (json) {
+        write_json(out, results, count, frames, warmup, seed);
+    } else {
+        write_csv(out, results, count, frames);
+    }
+    if (out != stdout) fclose(out);
+
+    particles_destroy(sim->particles);
+    sim->particles = NULL;
+    detail_destroy(sim->detail);
+    sim->detail = NULL;
+    obstacles_destroy(sim->obstacles);
+    sim->obstacles = NULL;
+    fluid_shutdown();
+    thread_pool_shutdown();
+    return count == size_count ? 0 : 1;
+}
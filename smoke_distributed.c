@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "distributed.h"
+#include "fluid.h"
+#include "timer.h"
+#include "transport.h"
+
+#define DEFAULT_RANKS 2
+#define DEFAULT_PORT 47100
+
+int width = DEFAULT_GRID_WIDTH;
+int height = DEFAULT_GRID_HEIGHT;
+int steps = 600;
+double dt = 1.0 / REFERENCE_RATE;
+unsigned seed = 1;
+int no_emitter = 0;
+int threads = 0;
+SimdLevel simd_request = SIMD_LEVEL_COUNT - 1;
+const char* output_path = NULL;
+int emitter_x;
+int emitter_y;                   // Global row
+
+void print_usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Runs one simulation split into horizontal slabs, one process per slab,\n"
+        "exchanging halo rows between neighbours. The result matches\n"
+        "smoke_headless --dense --pressure gauss-seidel bit for bit.\n"
+        "  --ranks N               processes to split the grid across (default %d)\n"
+        "  --transport NAME        shm (one host, forked ranks) or tcp (default shm)\n"
+        "  --port N                first loopback port for tcp, one per rank (default %d)\n"
+        "  --rank R --peers LIST   run only rank R of a tcp run across hosts; LIST is\n"
+        "                          host:port for every rank, comma-separated. Every\n"
+        "                          rank must be given the same options\n"
+        "  --width N, --height N   grid size including the boundary (default %dx%d)\n"
+        "  --steps N               simulation steps to run (default 600)\n"
+        "  --dt SECONDS            simulated time per step (default 1/60)\n"
+        "  --cfl CELLS             furthest a substep may carry smoke (default %.0f);\n"
+        "                          sets the halo depth\n"
+        "  --max-substeps N        substeps allowed per step (default %d)\n"
+        "  --seed N                random seed (default 1)\n"
+        "  --no-emitter            run without the candle emitter\n"
+        "  --param NAME=VALUE      set a physics parameter, repeatable\n"
+        "  --stamp SHAPE:NAME=V,.. add a force or source in global cells, repeatable;\n"
+        "                          see smoke_headless --help\n"
+        "  --turbulence NAME       white (per-cell kicks) or curl (smooth swirl)\n"
+        "  --storage FORMAT        density and temperature storage: float32, float16,\n"
+        "                          fixed16 or fixed8 (default float32)\n"
+        "  --threads N             worker threads per rank (default: the CPUs shared\n"
+        "                          out between local ranks)\n"
+        "  --simd LEVEL            cap kernels at scalar, sse4.1 or avx2\n"
+        "  --output FILE           gather the final density on rank 0 and write it\n"
+        "                          as a PFM\n",
+        program, DEFAULT_RANKS, DEFAULT_PORT, DEFAULT_GRID_WIDTH, DEFAULT_GRID_HEIGHT,
+        DEFAULT_CFL, DEFAULT_MAX_SUBSTEPS);
+}
+
+void emit_candle() {
+    add_candle(emitter_x, emitter_y - sim->origin_y);
+}
+
+// Whole-grid PFM, rows bottom-up like smoke_headless writes them
+int write_pfm(const char* path, const float* plane) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Cannot open %s for writing\n", path);
+        return 0;
+    }
+    fprintf(file, "Pf\n%d %d\n-1.0\n", width, height);
+    for (int y = height - 1; y >= 0; y--) fwrite(plane + (size_t)y * width, sizeof(float), width, file);
+    int ok = !ferror(file);
+    if (fclose(file) != 0) ok = 0;
+    if (!ok) fprintf(stderr, "Writing %s failed\n", path);
+    return ok;
+}
+
+// Everything one rank does once its transport is up
+int run_rank(Transport* transport, const SlabLayout* layout) {
+    thread_pool_init(threads);
+    simd_select(simd_request);
+    SlabContext context;
+    if (!slab_attach(&context, transport, layout)) {
+        fprintf(stderr, "Rank %d cannot allocate its slab\n", transport->rank);
+        return 1;
+    }
+    fluid_seed(seed);
+    int rank = transport->rank;
+    if (rank == 0) {
+        printf("Grid %dx%d on %d ranks over %s, halo %d rows, %d steps of %.4g s, seed %u\n",
+               width, height, layout->ranks, transport_kind_names[transport->kind], layout->halo, steps, dt, seed);
+        printf("Turbulence: %s, storage: %s, threads per rank: %d, SIMD: %s\n",
+               turbulence_mode_names[sim->turbulence_mode], field_storage_names[sim->scalar_storage],
+               pool.thread_count, simd_level_names[simd_level]);
+    }
+
+    long long substeps = 0;
+    transport_barrier(transport);
+    double start = timer_seconds();
+    for (int step = 1; step <= steps; step++) {
+        sim->emit_sources = no_emitter ? NULL : emit_candle;
+        substeps += update_simulation((float)dt);
+        if (context.failed) {
+            fprintf(stderr, "Rank %d lost a neighbour during step %d\n", rank, step);
+            fluid_shutdown();
+            thread_pool_shutdown();
+            return 1;
+        }
+    }
+    double elapsed = timer_seconds() - start;
+
+    double exchange = transport_max(transport, (float)context.exchange_seconds);
+    double sent = transport_sum(transport, (double)transport->bytes_sent);
+    uint64_t checksum = 0;
+    int status = 0;
+    if (!slab_checksum(&context, &checksum)) {
+        fprintf(stderr, "Rank %d could not take part in the checksum\n", rank);
+        status = 1;
+    }
+    if (status == 0 && output_path) {
+        float* plane = rank == 0 ? malloc((size_t)width * height * sizeof(float)) : NULL;
+        if (rank == 0 && !plane) {
+            fprintf(stderr, "Cannot allocate the gathered density\n");
+            status = 1;
+        } else if (!slab_gather(&context, sim->scalars.density, plane)) {
+            status = 1;
+        } else if (rank == 0 && !write_pfm(output_path, plane)) {
+            status = 1;
+        }
+        free(plane);
+    }
+    if (rank == 0) {
+        printf("%d steps in %.3f s, %.3f ms/step\n", steps, elapsed, steps > 0 ? elapsed * 1e3 / steps : 0.0);
+        printf("Exchange: %.1f%% of the slowest rank's time, %lld per rank, %.1f MB sent in all\n",
+               elapsed > 0.0 ? exchange * 100.0 / elapsed : 0.0, context.exchanges, sent / 1e6);
+        printf("Simulated %.3f s in %lld substeps\n", steps * dt, substeps);
+        if (status == 0) printf("Checksum: %016llx\n", (unsigned long long)checksum);
+    }
+    fluid_shutdown();
+    thread_pool_shutdown();
+    return status;
+}
+
+// Parses host:port,host:port,... into one peer per rank; returns the count
+int parse_peers(const char* list, TcpPeer* peers) {
+    int count = 0;
+    const char* p = list;
+    while (*p && count < MAX_RANKS) {
+        const char* comma = strchr(p, ',');
+        size_t length = comma ? (size_t)(comma - p) : strlen(p);
+        const char* colon = memrchr(p, ':', length);
+        if (!colon || colon == p || (size_t)(colon - p) >= sizeof(peers[count].host)) return -1;
+        snprintf(peers[count].host, sizeof(peers[count].host), "%.*s", (int)(colon - p), p);
+        peers[count].port = atoi(colon + 1);
+        if (peers[count].port <= 0 || peers[count].port > 65535) return -1;
+        count++;
+        p = comma ? comma + 1 : p + length;
+    }
+    return *p ? -1 : count;
+}
+
+int main(int argc, char* argv[]) {
+    int ranks = DEFAULT_RANKS;
+    TransportKind kind = TRANSPORT_SHM;
+    int port = DEFAULT_PORT;
+    int single_rank = -1;
+    const char* peer_list = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        int used = 1;
+
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else if (strcmp(arg, "--no-emitter") == 0) {
+            no_emitter = 1;
+            used = 0;
+        } else if (!value) {
+            fprintf(stderr, "Missing value for %s\n", arg);
+            print_usage(argv[0]);
+            return 1;
+        } else if (strcmp(arg, "--ranks") == 0) {
+            ranks = atoi(value);
+        } else if (strcmp(arg, "--transport") == 0) {
+            int k = find_name(value, transport_kind_names, TRANSPORT_KIND_COUNT);
+            if (k < 0) {
+                fprintf(stderr, "Unknown transport: %s\n", value);
+                return 1;
+            }
+            kind = k;
+        } else if (strcmp(arg, "--port") == 0) {
+            port = atoi(value);
+        } else if (strcmp(arg, "--rank") == 0) {
+            single_rank = atoi(value);
+        } else if (strcmp(arg, "--peers") == 0) {
+            peer_list = value;
+        } else if (strcmp(arg, "--width") == 0) {
+            width = atoi(value);
+        } else if (strcmp(arg, "--height") == 0) {
+            height = atoi(value);
+        } else if (strcmp(arg, "--steps") == 0) {
+            steps = atoi(value);
+        } else if (strcmp(arg, "--dt") == 0) {
+            dt = atof(value);
+        } else if (strcmp(arg, "--cfl") == 0) {
+            sim->cfl_limit = (float)atof(value);
+        } else if (strcmp(arg, "--max-substeps") == 0) {
+            sim->max_substeps = atoi(value);
+        } else if (strcmp(arg, "--seed") == 0) {
+            seed = (unsigned)strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--stamp") == 0) {
+            Stamp stamp;
+            if (!stamp_parse(value, &stamp) || !stamp_add(&stamp)) {
+                fprintf(stderr, "Bad stamp or more than %d: %s\n", MAX_STAMPS, value);
+                return 1;
+            }
+        } else if (strcmp(arg, "--param") == 0) {
+            char name[64];
+            const char* equals = strchr(value, '=');
+            snprintf(name, sizeof(name), "%.*s", equals ? (int)(equals - value) : 0, value);
+            float* param = equals ? fluid_param(&sim->params, name) : NULL;
+            if (!param) {
+                fprintf(stderr, "Unknown parameter in %s\n", value);
+                return 1;
+            }
+            *param = (float)atof(equals + 1);
+        } else if (strcmp(arg, "--turbulence") == 0) {
+            int mode = find_name(value, turbulence_mode_names, TURBULENCE_MODE_COUNT);
+            if (mode < 0) {
+                fprintf(stderr, "Unknown turbulence: %s\n", value);
+                return 1;
+            }
+            sim->turbulence_mode = mode;
+        } else if (strcmp(arg, "--storage") == 0) {
+            int storage = find_name(value, field_storage_names, FIELD_STORAGE_COUNT);
+            if (storage < 0) {
+                fprintf(stderr, "Unknown storage: %s\n", value);
+                return 1;
+            }
+            fluid_set_storage(storage);
+        } else if (strcmp(arg, "--threads") == 0) {
+            threads = atoi(value);
+        } else if (strcmp(arg, "--simd") == 0) {
+            int level = find_name(value, simd_level_names, SIMD_LEVEL_COUNT);
+            if (level < 0) {
+                fprintf(stderr, "Unknown SIMD level: %s\n", value);
+                return 1;
+            }
+            simd_request = level;
+        } else if (strcmp(arg, "--output") == 0) {
+            output_path = value;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            print_usage(argv[0]);
+            return 1;
+        }
+        i += used;
+    }
+
+    TcpPeer peers[MAX_RANKS];
+    if (single_rank >= 0 || peer_list) {
+        ranks = peer_list ? parse_peers(peer_list, peers) : -1;
+        if (ranks < 1 || single_rank < 0 || single_rank >= ranks) {
+            fprintf(stderr, "--rank needs --peers with a host:port for every rank, rank included\n");
+            return 1;
+        }
+        kind = TRANSPORT_TCP;
+    } else if (ranks >= 1 && ranks <= MAX_RANKS) {
+        for (int r = 0; r < ranks; r++) peers[r] = (TcpPeer){"127.0.0.1", port + r};
+    }
+    if (dt <= 0.0 || sim->cfl_limit <= 0.0f || sim->max_substeps < 1) {
+        fprintf(stderr, "--dt, --cfl and --max-substeps must be positive\n");
+        return 1;
+    }
+    if (width < MIN_GRID_SIZE || height < MIN_GRID_SIZE || width > MAX_GRID_SIZE || height > MAX_GRID_SIZE) {
+        fprintf(stderr, "Each side of the grid must be %d..%d\n", MIN_GRID_SIZE, MAX_GRID_SIZE);
+        return 1;
+    }
+    SlabLayout layout;
+    int halo = slab_halo(sim->cfl_limit);
+    if (!slab_layout(&layout, width, height, ranks, halo)) {
+        fprintf(stderr, "Cannot split %d rows into %d slabs of at least %d rows (1..%d ranks)\n",
+                height, ranks, halo + 1, MAX_RANKS);
+        return 1;
+    }
+    emitter_x = width / 2;
+    emitter_y = height - 2;
+
+    if (single_rank >= 0) {
+        Transport transport;
+        if (!tcp_transport_open(&transport, single_rank, ranks, peers)) return 1;
+        int status = run_rank(&transport, &layout);
+        transport.close(&transport);
+        return status;
+    }
+
+    // One host: every rank is a child, so the parent can stop the rest when
+    // one fails instead of leaving them waiting on it
+    if (threads <= 0) {
+        threads = cpu_count() / ranks;
+        if (threads < 1) threads = 1;
+    }
+    Transport transport;
+    if (kind == TRANSPORT_SHM && !shm_transport_create(&transport, ranks)) return 1;
+    fflush(stdout);
+    pid_t children[MAX_RANKS];
+    for (int r = 0; r < ranks; r++) {
+        children[r] = fork();
+        if (children[r] < 0) {
+            perror("fork");
+            for (int c = 0; c < r; c++) kill(children[c], SIGTERM);
+            return 1;
+        }
+        if (children[r] == 0) {
+            if (kind == TRANSPORT_SHM) {
+                shm_transport_attach(&transport, r);
+            } else if (!tcp_transport_open(&transport, r, ranks, peers)) {
+                _exit(1);
+            }
+            int status = run_rank(&transport, &layout);
+            fflush(stdout);
+            _exit(status);
+        }
+    }
+    int status = 0;
+    for (int left = ranks; left > 0; left--) {
+        int child_status;
+        pid_t pid = wait(&child_status);
+        if (pid < 0) break;
+        if (!WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0) {
+            if (status == 0) {
+                for (int r = 0; r < ranks; r++) {
+                    if (children[r] != pid) kill(children[r], SIGTERM);
+                }
+            }
+            status = 1;
+        }
+    }
+    if (kind == TRANSPORT_SHM) transport.close(&transport);
+    return status;
+}
@@ -0,0 +1,389 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <sched.h>
+#endif
+
+#include "fluid.h"
+#include "timer.h"
+
+#define MAX_VALUES 64          // Per --param axis
+#define MAX_LINE 1024
+
+// One simulation of the ensemble: the physics and seed it runs with
+typedef struct {
+    FluidParams params;
+    unsigned seed;
+} Run;
+
+// Values given for one parameter with --param; the runs are every
+// combination of the axes
+typedef struct {
+    const char* name;          // One of fluid_param_names
+    float values[MAX_VALUES];
+    int count;
+} Axis;
+
+// Shared by every worker; each run is claimed from next_run
+Run* runs;
+int run_count = 0;
+atomic_int next_run;
+int width = DEFAULT_GRID_WIDTH;
+int height = DEFAULT_GRID_HEIGHT;
+int steps = 600;
+int sample_every = 0;
+double dt = 1.0 / REFERENCE_RATE;
+int dense = 0;
+PressureSolver pressure_choice = PRESSURE_SOLVER_MULTIGRID;
+TurbulenceMode turbulence_choice = TURBULENCE_WHITE;
+FieldStorage storage_choice = FIELD_STORAGE_FLOAT32;
+FILE* out;
+pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+atomic_int failed;
+
+void print_usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "Runs many simulations at once, one per worker thread, and writes one CSV\n"
+        "row of plume height, total density and kinetic energy per run.\n"
+        "  --param NAME=V1,V2,...  values for a physics parameter, repeatable; every\n"
+        "                          combination is run. NAME is one of buoyancy,\n"
+        "                          turbulence_amount, vorticity_strength,\n"
+        "                          density_decay, temperature_decay, mouse_force\n"
+        "  --list FILE             one run per line of NAME=VALUE pairs instead;\n"
+        "                          unnamed parameters keep their defaults, seed=N\n"
+        "                          sets the seed, # starts a comment\n"
+        "  --seed N                first random seed (default 1)\n"
+        "  --seeds N               run every combination with N seeds from there\n"
+        "  --width N, --height N   grid size including the boundary (default %dx%d)\n"
+        "  --steps N               steps per run (default 600)\n"
+        "  --dt SECONDS            simulated time per step (default 1/60)\n"
+        "  --every N               also write a row every N steps (default: last only)\n"
+        "  --pressure NAME         gauss-seidel, multigrid or spectral\n"
+        "  --turbulence NAME       white (per-cell kicks) or curl (smooth swirl)\n"
+        "  --dense                 step every cell instead of only the active tiles\n"
+        "  --storage FORMAT        density and temperature storage: float32, float16,\n"
+        "                          fixed16 or fixed8 (default float32)\n"
+        "  --workers N             simulations run at once (default: one per CPU)\n"
+        "  --simd LEVEL            cap kernels at scalar, sse4.1 or avx2\n"
+        "  --output FILE           write the CSV to FILE instead of stdout\n",
+        program, DEFAULT_GRID_WIDTH, DEFAULT_GRID_HEIGHT);
+}
+
+// Splits NAME=VALUES at the '='; returns the name as spelled in
+// fluid_param_names, or NULL if there is no such parameter
+const char* parse_param_name(char* assignment, char** values) {
+    char* equals = strchr(assignment, '=');
+    if (!equals) return NULL;
+    *equals = '\0';
+    *values = equals + 1;
+    int p = find_name(assignment, fluid_param_names, FLUID_PARAM_COUNT);
+    return p < 0 ? NULL : fluid_param_names[p];
+}
+
+int add_run(FluidParams params, unsigned seed, int* capacity) {
+    if (run_count == *capacity) {
+        int grown = *capacity ? *capacity * 2 : 64;
+        Run* bigger = realloc(runs, (size_t)grown * sizeof(Run));
+        if (!bigger) return 0;
+        runs = bigger;
+        *capacity = grown;
+    }
+    runs[run_count++] = (Run){params, seed};
+    return 1;
+}
+
+// Every combination of the axes, the first axis changing slowest
+int build_grid(const Axis* axes, int axis_count, unsigned seed, int seeds, int* capacity) {
+    long long combinations = 1;
+    for (int a = 0; a < axis_count; a++) combinations *= axes[a].count;
+    for (long long c = 0; c < combinations; c++) {
+        FluidParams params = DEFAULT_FLUID_PARAMS;
+        long long rest = c;
+        for (int a = axis_count - 1; a >= 0; a--) {
+            *fluid_param(&params, axes[a].name) = axes[a].values[rest % axes[a].count];
+            rest /= axes[a].count;
+        }
+        for (int s = 0; s < seeds; s++) {
+            if (!add_run(params, seed + s, capacity)) return 0;
+        }
+    }
+    return 1;
+}
+
+int read_list(const char* path, unsigned seed, int seeds, int* capacity) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return 0;
+    }
+    char line[MAX_LINE];
+    int line_number = 0;
+    int ok = 1;
+    while (ok && fgets(line, sizeof(line), file)) {
+        line_number++;
+        char* comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+        FluidParams params = DEFAULT_FLUID_PARAMS;
+        unsigned line_seed = seed;
+        int fields = 0;
+        for (char* token = strtok(line, " \t\r\n,"); token && ok; token = strtok(NULL, " \t\r\n,")) {
+            char* value;
+            if (strncmp(token, "seed=", 5) == 0) {
+                line_seed = (unsigned)strtoul(token + 5, NULL, 10);
+            } else {
+                const char* name = parse_param_name(token, &value);
+                if (!name) {
+                    fprintf(stderr, "%s:%d: unknown parameter %s\n", path, line_number, token);
+                    ok = 0;
+                    break;
+                }
+                *fluid_param(&params, name) = (float)atof(value);
+            }
+            fields++;
+        }
+        if (!ok || fields == 0) continue;
+        for (int s = 0; s < seeds && ok; s++) ok = add_run(params, line_seed + s, capacity);
+    }
+    fclose(file);
+    return ok;
+}
+
+// Keeps a worker on one CPU so the pages it first touches stay on that
+// CPU's memory node. Best effort; an unpinned worker still runs.
+void pin_to_cpu(int cpu) {
+#ifdef _WIN32
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (cpu % (int)(8 * sizeof(DWORD_PTR))));
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpu;
+#endif
+}
+
+void ensemble_emit() {
+    add_candle(sim->grid_width / 2, sim->grid_height - 2);
+}
+
+void write_row(int r, long long step, double ms_per_step) {
+    FluidSummary summary;
+    fluid_summary(&summary);
+    FluidParams params = runs[r].params;
+    pthread_mutex_lock(&out_lock);
+    fprintf(out, "%d,%u", r, runs[r].seed);
+    for (int p = 0; p < FLUID_PARAM_COUNT; p++) {
+        fprintf(out, ",%.6g", *fluid_param(&params, fluid_param_names[p]));
+    }
+    fprintf(out, ",%lld,%.0f,%.3f,%.6g,%.6g,%.4f,%.4f,%016llx\n",
+            step, summary.plume_height, summary.centroid_height, summary.total_density,
+            summary.kinetic_energy, sim->max_speed, ms_per_step, (unsigned long long)fluid_checksum());
+    pthread_mutex_unlock(&out_lock);
+}
+
+// One simulation per worker, created on the worker after pinning so its
+// arena is allocated and first touched on the worker's node, and reused
+// for every run the worker claims
+void* ensemble_worker(void* arg) {
+    int worker = (int)(intptr_t)arg;
+    pin_to_cpu(worker % cpu_count());
+    sim = simulation_create(width, height);
+    if (sim && !fluid_set_storage(storage_choice)) {
+        simulation_destroy(sim);
+        sim = NULL;
+    }
+    if (!sim) {
+        fprintf(stderr, "Worker %d cannot allocate a %dx%d grid\n", worker, width, height);
+        atomic_store(&failed, 1);
+        return NULL;
+    }
+    sim->sparse_tiles = !dense;
+    sim->pressure_solver = pressure_choice;
+    sim->turbulence_mode = turbulence_choice;
+    sim->emit_sources = ensemble_emit;
+
+    for (;;) {
+        int r = atomic_fetch_add(&next_run, 1);
+        if (r >= run_count) break;
+        sim->params = runs[r].params;
+        init_grid();
+        fluid_seed(runs[r].seed);
+
+        double start = timer_seconds();
+        for (int step = 1; step <= steps; step++) {
+            update_simulation((float)dt);
+            if (sample_every > 0 && step % sample_every == 0 && step != steps) {
+                write_row(r, step, (timer_seconds() - start) * 1e3 / step);
+            }
+        }
+        write_row(r, steps, steps > 0 ? (timer_seconds() - start) * 1e3 / steps : 0.0);
+    }
+    simulation_destroy(sim);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    int workers = 0;
+    unsigned seed = 1;
+    int seeds = 1;
+    const char* list_path = NULL;
+    const char* output_path = NULL;
+    SimdLevel simd_request = SIMD_LEVEL_COUNT - 1;
+    Axis axes[FLUID_PARAM_COUNT];
+    int axis_count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        int used = 1;
+
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else if (strcmp(arg, "--dense") == 0) {
+            dense = 1;
+            used = 0;
+        } else if (!value) {
+            fprintf(stderr, "Missing value for %s\n", arg);
+            print_usage(argv[0]);
+            return 1;
+        } else if (strcmp(arg, "--param") == 0) {
+            char assignment[MAX_LINE];
+            snprintf(assignment, sizeof(assignment), "%s", value);
+            char* values;
+            const char* name = parse_param_name(assignment, &values);
+            if (!name) {
+                fprintf(stderr, "Unknown parameter in %s\n", value);
+                return 1;
+            }
+            int a = 0;
+            while (a < axis_count && axes[a].name != name) a++;
+            if (a == axis_count) axis_count++;
+            axes[a].name = name;
+            axes[a].count = 0;
+            for (char* v = strtok(values, ","); v && axes[a].count < MAX_VALUES; v = strtok(NULL, ",")) {
+                axes[a].values[axes[a].count++] = (float)atof(v);
+            }
+            if (axes[a].count == 0) {
+                fprintf(stderr, "No values in %s\n", value);
+                return 1;
+            }
+        } else if (strcmp(arg, "--list") == 0) {
+            list_path = value;
+        } else if (strcmp(arg, "--seed") == 0) {
+            seed = (unsigned)strtoul(value, NULL, 10);
+        } else if (strcmp(arg, "--seeds") == 0) {
+            seeds = atoi(value);
+        } else if (strcmp(arg, "--width") == 0) {
+            width = atoi(value);
+        } else if (strcmp(arg, "--height") == 0) {
+            height = atoi(value);
+        } else if (strcmp(arg, "--steps") == 0) {
+            steps = atoi(value);
+        } else if (strcmp(arg, "--dt") == 0) {
+            dt = atof(value);
+        } else if (strcmp(arg, "--every") == 0) {
+            sample_every = atoi(value);
+        } else if (strcmp(arg, "--pressure") == 0) {
+            int solver = find_name(value, pressure_solver_options, PRESSURE_SOLVER_COUNT);
+            if (solver < 0) {
+                fprintf(stderr, "Unknown pressure solver: %s\n", value);
+                return 1;
+            }
+            pressure_choice = solver;
+        } else if (strcmp(arg, "--turbulence") == 0) {
+            int mode = find_name(value, turbulence_mode_names, TURBULENCE_MODE_COUNT);
+            if (mode < 0) {
+                fprintf(stderr, "Unknown turbulence: %s\n", value);
+                return 1;
+            }
+            turbulence_choice = mode;
+        } else if (strcmp(arg, "--storage") == 0) {
+            int storage = find_name(value, field_storage_names, FIELD_STORAGE_COUNT);
+            if (storage < 0) {
+                fprintf(stderr, "Unknown storage: %s\n", value);
+                return 1;
+            }
+            storage_choice = storage;
+        } else if (strcmp(arg, "--workers") == 0) {
+            workers = atoi(value);
+        } else if (strcmp(arg, "--simd") == 0) {
+            int level = find_name(value, simd_level_names, SIMD_LEVEL_COUNT);
+            if (level < 0) {
+                fprintf(stderr, "Unknown SIMD level: %s\n", value);
+                return 1;
+            }
+            simd_request = level;
+        } else if (strcmp(arg, "--output") == 0) {
+            output_path = value;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            print_usage(argv[0]);
+            return 1;
+        }
+        i += used;
+    }
+
+    if (dt <= 0.0 || steps < 0 || seeds < 1) {
+        fprintf(stderr, "--dt and --seeds must be positive\n");
+        return 1;
+    }
+    if (list_path && axis_count > 0) {
+        fprintf(stderr, "--list and --param cannot be combined\n");
+        return 1;
+    }
+    int capacity = 0;
+    int ok = list_path ? read_list(list_path, seed, seeds, &capacity)
+                       : build_grid(axes, axis_count, seed, seeds, &capacity);
+    if (!ok) return 1;
+    if (run_count == 0) {
+        fprintf(stderr, "No runs\n");
+        return 1;
+    }
+
+    out = output_path ? fopen(output_path, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Cannot open %s for writing\n", output_path);
+        return 1;
+    }
+
+    // The pool stays at one thread: the runs are the parallelism, and each
+    // worker's parallel_for then runs inline on its own simulation
+    simd_select(simd_request);
+    if (workers <= 0) workers = cpu_count();
+    if (workers > run_count) workers = run_count;
+    fprintf(stderr, "%d runs of %d steps on a %dx%d grid, %d workers, SIMD: %s\n",
+            run_count, steps, width, height, workers, simd_level_names[simd_level]);
+
+    fprintf(out, "run,seed");
+    for (int p = 0; p < FLUID_PARAM_COUNT; p++) fprintf(out, ",%s", fluid_param_names[p]);
+    fprintf(out, ",step,plume_height,centroid_height,total_density,kinetic_energy,max_speed,ms_per_step,checksum\n");
+
+    double start = timer_seconds();
+    pthread_t* threads = malloc((size_t)workers * sizeof(pthread_t));
+    int started = 0;
+    for (int w = 0; threads && w < workers; w++) {
+        if (pthread_create(&threads[w], NULL, ensemble_worker, (void*)(intptr_t)w) != 0) break;
+        started++;
+    }
+    if (started == 0) {
+        fprintf(stderr, "Cannot start worker threads\n");
+        return 1;
+    }
+    for (int w = 0; w < started; w++) pthread_join(threads[w], NULL);
+    fprintf(stderr, "Finished in %.2f s\n", timer_seconds() - start);
+
+    free(threads);
+    free(runs);
+    if (out != stdout) fclose(out);
+    return atomic_load(&failed) ? 1 : 0;
+}
@@ -0,0 +1,524 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "checkpoint.h"
+#include "detail.h"
+#include "fluid.h"
+#include "governor.h"
+#include "obstacles.h"
+#include "particles.h"
+#include "profile.h"
+#include "recording.h"
+#include "timer.h"
+
+#define MAX_EMITTERS 16
+
+typedef struct {
+    int x;
+    int y;
+} Emitter;
+
+typedef struct {
+    const char* name;
+    size_t plane;                // offsetof(Simulation, ...), or offsetof(DetailGrid, ...) for detail
+    int detail;
+} DumpField;
+
+Emitter emitters[MAX_EMITTERS];
+int emitter_count = 0;
+
+DumpField dump_fields[] = {
+    {"density", offsetof(Simulation, scalars.density)},
+    {"temperature", offsetof(Simulation, scalars.temperature)},
+    {"velocity_x", offsetof(Simulation, fields.velocity_x)},
+    {"velocity_y", offsetof(Simulation, fields.velocity_y)},
+    {"pressure", offsetof(Simulation, pressure)},
+    {"detail_density", offsetof(DetailGrid, density), 1},
+    {"detail_temperature", offsetof(DetailGrid, temperature), 1},
+};
+#define DUMP_FIELD_COUNT ((int)(sizeof(dump_fields) / sizeof(dump_fields[0])))
+
+void print_usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --width N, --height N   grid size including the boundary (default %dx%d)\n"
+        "  --steps N               simulation steps to run (default 600)\n"
+        "  --dt SECONDS            simulated time per step (default 1/60); substeps are\n"
+        "                          added when the flow is too fast for one\n"
+        "  --time SECONDS          run until this much time is simulated instead\n"
+        "  --cfl CELLS             furthest a substep may carry smoke (default %.0f)\n"
+        "  --max-substeps N        substeps allowed per step (default %d)\n"
+        "  --seed N                random seed (default 1)\n"
+        "  --emitter X,Y           candle emitter base cell, repeatable\n"
+        "                          (default one centred on the bottom row above the wall)\n"
+        "  --no-emitter            run without emitters\n"
+        "  --emission AMOUNT       density added per emitter cell per 1/60 s (default %.2f)\n"
+        "  --emit-steps N          stop emitting after N steps (default: never)\n"
+        "  --stamp SHAPE:NAME=V,.. add a force, emitter, sink or heat source applied\n"
+        "                          every substep, repeatable. SHAPE is radial,\n"
+        "                          directional, vortex, line or box; NAME is x, y,\n"
+        "                          x2, y2, radius, force, dir_x, dir_y, density,\n"
+        "                          temperature, drain or min_density, rates per\n"
+        "                          1/60 s, e.g. vortex:x=100,y=60,radius=20,force=0.3\n"
+        "  --param NAME=VALUE      set a physics parameter, repeatable: buoyancy,\n"
+        "                          turbulence_amount, vorticity_strength,\n"
+        "                          density_decay, temperature_decay, mouse_force\n"
+        "  --pressure NAME         gauss-seidel, multigrid or spectral\n"
+        "  --viscosity NAME        gauss-seidel or spectral\n"
+        "  --turbulence NAME       white (per-cell kicks) or curl (smooth swirl)\n"
+        "  --threads N             worker threads (default: one per CPU)\n"
+        "  --simd LEVEL            cap kernels at scalar, sse4.1 or avx2\n"
+        "  --dense                 step every cell instead of only the active tiles\n"
+        "  --budget MS             adapt solver effort, and as a last resort the grid,\n"
+        "                          to keep each step within MS milliseconds; changes\n"
+        "                          are logged as they happen\n"
+        "  --storage FORMAT        density and temperature storage: float32, float16,\n"
+        "                          fixed16 or fixed8 (default float32)\n"
+        "  --particles N           carry up to N tracer particles from the emitters;\n"
+        "                          they do not change the fields or the checksum\n"
+        "  --particle-rate R       tracers per emitter cell per 1/60 s (default 4)\n"
+        "  --detail-scale F        carry density and temperature on a grid F (2..%d)\n"
+        "                          times finer than velocity and pressure\n"
+        "  --detail AMOUNT         add a sub-grid swirl of AMOUNT times the resolved\n"
+        "                          speed to the fine grid (default 0)\n"
+        "  --obstacle SHAPE:NAME=V,.. add a solid body, repeatable. SHAPE is disc or\n"
+        "                          box; NAME is x, y, x2, y2, radius, vx or vy, the\n"
+        "                          velocity in cells per 1/60 s bouncing it off the\n"
+        "                          walls, e.g. disc:x=100,y=60,radius=12\n"
+        "  --no-slip               obstacles also hold the flow along their walls\n"
+        "  --dump-every N          also dump fields every N steps (default: final only)\n"
+        "  --fields LIST           comma-separated fields to dump (default density);\n"
+        "                          density, temperature, velocity_x, velocity_y, pressure,\n"
+        "                          detail_density, detail_temperature\n"
+        "  --output DIR            directory for dumps (default .)\n"
+        "  --trace FILE            write per-stage timings as a Chrome trace\n"
+        "  --load FILE             continue from a checkpoint; its grid and step count\n"
+        "                          are used and --steps more are run. --seed overrides\n"
+        "                          the saved seed to branch the run\n"
+        "  --save FILE             write a checkpoint after the last step\n"
+        "  --checkpoint-every N    also write DIR/checkpoint_STEP.bin every N steps,\n"
+        "                          in the background\n"
+        "  --record FILE           record every step, compressed, for replay in the\n"
+        "                          SDL build (--replay FILE)\n"
+        "  --record-fields LIST    comma-separated fields to record (default\n"
+        "                          density,temperature); also velocity_x, velocity_y\n",
+        program, DEFAULT_GRID_WIDTH, DEFAULT_GRID_HEIGHT, DEFAULT_CFL, DEFAULT_MAX_SUBSTEPS,
+        sim->emission_density_amount, DETAIL_MAX_SCALE);
+}
+
+// Portable float map, one channel, little-endian, rows stored bottom-up so
+// the image has the same orientation as the window
+int write_pfm(const char* path, const void* plane, int width, int height) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Cannot open %s for writing\n", path);
+        return 0;
+    }
+    fprintf(file, "Pf\n%d %d\n-1.0\n", width, height);
+    float row[MAX_GRID_SIZE];
+    for (int y = height - 1; y >= 0; y--) {
+        fluid_read_cells(plane, y * width, width, row);
+        fwrite(row, sizeof(float), width, file);
+    }
+    int ok = !ferror(file);
+    if (fclose(file) != 0) ok = 0;
+    if (!ok) fprintf(stderr, "Writing %s failed\n", path);
+    return ok;
+}
+
+int dump_step(const char* dir, const int* selected, int step) {
+    char path[4096];
+    for (int f = 0; f < DUMP_FIELD_COUNT; f++) {
+        if (!selected[f]) continue;
+        snprintf(path, sizeof(path), "%s/%s_%06d.pfm", dir, dump_fields[f].name, step);
+        if (dump_fields[f].detail) {
+            const DetailGrid* detail = sim->detail;
+            if (!detail || !detail->width) continue;
+            const void* plane = *(void* const*)((const char*)detail + dump_fields[f].plane);
+            if (!write_pfm(path, plane, detail->width, detail->height)) return 0;
+        } else if (!write_pfm(path, SIM_PLANE(dump_fields[f].plane), sim->grid_width, sim->grid_height)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Emitters are placed on the grid the run starts with and follow it, interior
+// onto interior, when the budget governor resamples it
+int emitter_grid_width;
+int emitter_grid_height;
+
+void emit_candles() {
+    float scale_x = (float)(sim->grid_width - 2) / (emitter_grid_width - 2);
+    float scale_y = (float)(sim->grid_height - 2) / (emitter_grid_height - 2);
+    for (int e = 0; e < emitter_count; e++) {
+        add_candle((int)lroundf((emitters[e].x - 0.5f) * scale_x + 0.5f),
+                   (int)lroundf((emitters[e].y - 0.5f) * scale_y + 0.5f));
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int width = DEFAULT_GRID_WIDTH;
+    int height = DEFAULT_GRID_HEIGHT;
+    int steps = 600;
+    double dt = 1.0 / REFERENCE_RATE;
+    double target_time = 0.0;
+    unsigned seed = 1;
+    int seed_set = 0;
+    int emit_steps = -1;
+    int no_emitter = 0;
+    int threads = 0;
+    SimdLevel simd_request = SIMD_LEVEL_COUNT - 1;
+    int dump_every = 0;
+    const char* output_dir = ".";
+    const char* trace_path = NULL;
+    const char* load_path = NULL;
+    const char* save_path = NULL;
+    int checkpoint_every = 0;
+    double budget = 0.0;
+    int particle_capacity = 0;
+    float particle_rate = PARTICLE_SPAWN_RATE;
+    int detail_scale = 0;
+    float detail_amount = 0.0f;
+    ObstacleBody bodies[MAX_OBSTACLE_BODIES];
+    int body_count = 0;
+    int no_slip = 0;
+    const char* record_path = NULL;
+    uint32_t record_mask = RECORD_DEFAULT_MASK;
+    int selected[DUMP_FIELD_COUNT] = {1};
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        int used = 1;
+
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else if (strcmp(arg, "--no-emitter") == 0) {
+            no_emitter = 1;
+            used = 0;
+        } else if (strcmp(arg, "--dense") == 0) {
+            sim->sparse_tiles = 0;
+            used = 0;
+        } else if (strcmp(arg, "--no-slip") == 0) {
+            no_slip = 1;
+            used = 0;
+        } else if (!value) {
+            fprintf(stderr, "Missing value for %s\n", arg);
+            print_usage(argv[0]);
+            return 1;
+        } else if (strcmp(arg, "--width") == 0) {
+            width = atoi(value);
+        } else if (strcmp(arg, "--height") == 0) {
+            height = atoi(value);
+        } else if (strcmp(arg, "--steps") == 0) {
+            steps = atoi(value);
+        } else if (strcmp(arg, "--dt") == 0) {
+            dt = atof(value);
+        } else if (strcmp(arg, "--time") == 0) {
+            target_time = atof(value);
+        } else if (strcmp(arg, "--cfl") == 0) {
+            sim->cfl_limit = (float)atof(value);
+        } else if (strcmp(arg, "--max-substeps") == 0) {
+            sim->max_substeps = atoi(value);
+        } else if (strcmp(arg, "--seed") == 0) {
+            seed = (unsigned)strtoul(value, NULL, 10);
+            seed_set = 1;
+        } else if (strcmp(arg, "--emitter") == 0) {
+            Emitter e;
+            if (sscanf(value, "%d,%d", &e.x, &e.y) != 2) {
+                fprintf(stderr, "Emitter must be X,Y: %s\n", value);
+                return 1;
+            }
+            if (emitter_count == MAX_EMITTERS) {
+                fprintf(stderr, "At most %d emitters\n", MAX_EMITTERS);
+                return 1;
+            }
+            emitters[emitter_count++] = e;
+        } else if (strcmp(arg, "--stamp") == 0) {
+            Stamp stamp;
+            if (!stamp_parse(value, &stamp)) {
+                fprintf(stderr, "Stamp must be SHAPE:NAME=VALUE,...: %s\n", value);
+                return 1;
+            }
+            if (!stamp_add(&stamp)) {
+                fprintf(stderr, "Stamp needs a positive radius, at most %d stamps: %s\n", MAX_STAMPS, value);
+                return 1;
+            }
+        } else if (strcmp(arg, "--emission") == 0) {
+            sim->emission_density_amount = (float)atof(value);
+        } else if (strcmp(arg, "--emit-steps") == 0) {
+            emit_steps = atoi(value);
+        } else if (strcmp(arg, "--param") == 0) {
+            char name[64];
+            const char* equals = strchr(value, '=');
+            snprintf(name, sizeof(name), "%.*s", equals ? (int)(equals - value) : 0, value);
+            float* param = equals ? fluid_param(&sim->params, name) : NULL;
+            if (!param) {
+                fprintf(stderr, "Unknown parameter in %s\n", value);
+                return 1;
+            }
+            *param = (float)atof(equals + 1);
+        } else if (strcmp(arg, "--pressure") == 0) {
+            int solver = find_name(value, pressure_solver_options, PRESSURE_SOLVER_COUNT);
+            if (solver < 0) {
+                fprintf(stderr, "Unknown pressure solver: %s\n", value);
+                return 1;
+            }
+            sim->pressure_solver = solver;
+        } else if (strcmp(arg, "--viscosity") == 0) {
+            int solver = find_name(value, viscosity_solver_options, VISCOSITY_SOLVER_COUNT);
+            if (solver < 0) {
+                fprintf(stderr, "Unknown viscosity solver: %s\n", value);
+                return 1;
+            }
+            sim->viscosity_solver = solver;
+        } else if (strcmp(arg, "--turbulence") == 0) {
+            int mode = find_name(value, turbulence_mode_names, TURBULENCE_MODE_COUNT);
+            if (mode < 0) {
+                fprintf(stderr, "Unknown turbulence: %s\n", value);
+                return 1;
+            }
+            sim->turbulence_mode = mode;
+        } else if (strcmp(arg, "--threads") == 0) {
+            threads = atoi(value);
+        } else if (strcmp(arg, "--simd") == 0) {
+            int level = find_name(value, simd_level_names, SIMD_LEVEL_COUNT);
+            if (level < 0) {
+                fprintf(stderr, "Unknown SIMD level: %s\n", value);
+                return 1;
+            }
+            simd_request = level;
+        } else if (strcmp(arg, "--storage") == 0) {
+            int storage = find_name(value, field_storage_names, FIELD_STORAGE_COUNT);
+            if (storage < 0) {
+                fprintf(stderr, "Unknown storage: %s\n", value);
+                return 1;
+            }
+            fluid_set_storage(storage);
+        } else if (strcmp(arg, "--budget") == 0) {
+            budget = atof(value) * 1e-3;
+        } else if (strcmp(arg, "--particles") == 0) {
+            particle_capacity = atoi(value);
+        } else if (strcmp(arg, "--particle-rate") == 0) {
+            particle_rate = (float)atof(value);
+        } else if (strcmp(arg, "--detail-scale") == 0) {
+            detail_scale = atoi(value);
+        } else if (strcmp(arg, "--detail") == 0) {
+            detail_amount = (float)atof(value);
+        } else if (strcmp(arg, "--obstacle") == 0) {
+            if (!obstacles_parse(value, &bodies[body_count])) {
+                fprintf(stderr, "Obstacle must be SHAPE:NAME=VALUE,...: %s\n", value);
+                return 1;
+            }
+            if (++body_count > MAX_OBSTACLE_BODIES) {
+                fprintf(stderr, "At most %d obstacles\n", MAX_OBSTACLE_BODIES);
+                return 1;
+            }
+        } else if (strcmp(arg, "--dump-every") == 0) {
+            dump_every = atoi(value);
+        } else if (strcmp(arg, "--output") == 0) {
+            output_dir = value;
+        } else if (strcmp(arg, "--trace") == 0) {
+            trace_path = value;
+        } else if (strcmp(arg, "--load") == 0) {
+            load_path = value;
+        } else if (strcmp(arg, "--save") == 0) {
+            save_path = value;
+        } else if (strcmp(arg, "--checkpoint-every") == 0) {
+            checkpoint_every = atoi(value);
+        } else if (strcmp(arg, "--record") == 0) {
+            record_path = value;
+        } else if (strcmp(arg, "--record-fields") == 0) {
+            record_mask = 0;
+            char list[256];
+            snprintf(list, sizeof(list), "%s", value);
+            for (char* name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+                int f = find_name(name, record_field_names, RECORD_FIELD_COUNT);
+                if (f < 0) {
+                    fprintf(stderr, "Unknown field: %s\n", name);
+                    return 1;
+                }
+                record_mask |= RECORD_MASK(f);
+            }
+        } else if (strcmp(arg, "--fields") == 0) {
+            memset(selected, 0, sizeof(selected));
+            char list[256];
+            snprintf(list, sizeof(list), "%s", value);
+            for (char* name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+                int f = 0;
+                while (f < DUMP_FIELD_COUNT && strcmp(name, dump_fields[f].name) != 0) f++;
+                if (f == DUMP_FIELD_COUNT) {
+                    fprintf(stderr, "Unknown field: %s\n", name);
+                    return 1;
+                }
+                selected[f] = 1;
+            }
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            print_usage(argv[0]);
+            return 1;
+        }
+        i += used;
+    }
+
+    if (dt <= 0.0 || sim->cfl_limit <= 0.0f || sim->max_substeps < 1) {
+        fprintf(stderr, "--dt, --cfl and --max-substeps must be positive\n");
+        return 1;
+    }
+    // The last step is shortened to land on the target time
+    if (target_time > 0.0) steps = (int)ceil(target_time / dt - 1e-9);
+    if (steps < 0) steps = 0;
+    if (no_emitter) emitter_count = 0;
+
+    thread_pool_init(threads);
+    simd_select(simd_request);
+    if (!fluid_resize(width, height)) {
+        fprintf(stderr, "Cannot allocate a %dx%d grid (each side must be %d..%d)\n",
+                width, height, MIN_GRID_SIZE, MAX_GRID_SIZE);
+        return 1;
+    }
+    fluid_seed(seed);
+
+    // A checkpoint replaces the grid, the state and the RNG position
+    long long first_step = 1;
+    if (load_path) {
+        CheckpointHeader header;
+        long long loaded_step;
+        double load_start = timer_seconds();
+        if (!checkpoint_load(load_path, &loaded_step, &header)) return 1;
+        printf("Loaded %s at step %lld in %.1f ms (saved with %s pressure, %s turbulence, %s, %s storage)\n",
+               load_path, loaded_step, (timer_seconds() - load_start) * 1e3,
+               pressure_solver_names[(unsigned)header.pressure_solver % PRESSURE_SOLVER_COUNT],
+               turbulence_mode_names[(unsigned)header.turbulence_mode % TURBULENCE_MODE_COUNT],
+               header.sparse_tiles ? "sparse" : "dense", field_storage_names[sim->scalar_storage]);
+        if (seed_set) sim->noise_seed = seed;
+        seed = sim->noise_seed;
+        first_step = loaded_step + 1;
+    }
+    if (!no_emitter && emitter_count == 0) {
+        emitters[emitter_count++] = (Emitter){sim->grid_width / 2, sim->grid_height - 2};
+    }
+    emitter_grid_width = sim->grid_width;
+    emitter_grid_height = sim->grid_height;
+    long long last_step = first_step + steps - 1;
+
+    printf("Grid %dx%d, %d steps of %.4g s, seed %u, %d emitter(s)\n",
+           sim->grid_width, sim->grid_height, steps, dt, seed, emitter_count);
+    if (sim->stamp_count > 0) printf("Stamps: %d\n", sim->stamp_count);
+    printf("Pressure: %s, viscosity: %s, turbulence: %s, threads: %d, SIMD: %s\n",
+           pressure_solver_names[sim->pressure_solver], viscosity_solver_names[sim->viscosity_solver],
+           turbulence_mode_names[sim->turbulence_mode], pool.thread_count, simd_level_names[simd_level]);
+
+    if (particle_capacity > 0) {
+        sim->particles = particles_create(particle_capacity);
+        if (!sim->particles) {
+            fprintf(stderr, "%d particles could not be allocated\n", particle_capacity);
+            return 1;
+        }
+        sim->particles->spawn_rate = particle_rate;
+    }
+    if (detail_scale > 0) {
+        sim->detail = detail_create(detail_scale);
+        if (!sim->detail) {
+            fprintf(stderr, "Detail scale %d is outside 2..%d or too fine for the grid\n", detail_scale,
+                    DETAIL_MAX_SCALE);
+            return 1;
+        }
+        sim->detail->amount = detail_amount;
+        printf("Detail: %dx%d, swirl %.2f\n", sim->detail->width, sim->detail->height, detail_amount);
+    }
+    if (body_count > 0) {
+        sim->obstacles = obstacles_create();
+        if (!sim->obstacles) {
+            fprintf(stderr, "Obstacles could not be allocated\n");
+            return 1;
+        }
+        for (int k = 0; k < body_count; k++) obstacles_add_body(sim->obstacles, &bodies[k]);
+        sim->obstacles->no_slip = no_slip;
+        obstacles_build(sim->obstacles);
+        printf("Obstacles: %d, %d solid cells, %d on the boundary, %s\n", body_count,
+               sim->obstacles->solid_count, sim->obstacles->boundary_count, no_slip ? "no slip" : "free slip");
+    }
+
+    FrameGovernor governor;
+    if (budget > 0.0) {
+        governor_init(&governor, budget);
+        char effort[128];
+        governor_describe(&governor, effort, sizeof(effort));
+        printf("Budget %.2f ms per step, starting at %s\n", budget * 1e3, effort);
+    }
+    double slowest = 0.0;
+    long long over_budget = 0;
+
+    int status = 0;
+    if (record_path && !recording_start(record_path, record_mask, (float)dt)) return 1;
+    long long substeps = 0;
+    double simulated = 0.0;
+    if (trace_path) profile_set_enabled(1);
+    double start = timer_seconds();
+    for (long long step = first_step; step <= last_step; step++) {
+        double step_dt = target_time > 0.0 && target_time - simulated < dt ? target_time - simulated : dt;
+        sim->emit_sources = emit_steps < 0 || step <= emit_steps ? emit_candles : NULL;
+        double step_start = timer_seconds();
+        substeps += update_simulation((float)step_dt);
+        double step_seconds = timer_seconds() - step_start;
+        simulated += step_dt;
+        if (step_seconds > slowest) slowest = step_seconds;
+        if (budget > 0.0) {
+            if (step_seconds > budget) over_budget++;
+            governor_update(&governor);
+            if (governor.changed) printf("Step %lld: %s\n", step, governor.decision);
+        }
+        profile_frame();
+
+        if (dump_every > 0 && step % dump_every == 0 && step != last_step) {
+            if (!dump_step(output_dir, selected, (int)step)) {
+                status = 1;
+                break;
+            }
+        }
+        if (checkpoint_every > 0 && step % checkpoint_every == 0) {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/checkpoint_%06lld.bin", output_dir, step);
+            checkpoint_save_async(path, step);
+        }
+        recording_push(step, 1);
+    }
+    double elapsed = timer_seconds() - start;
+    checkpoint_wait();
+    if (record_path) {
+        recording_stop();
+        printf("Recorded %lld frames to %s\n", recording_frames, record_path);
+    }
+
+    if (status == 0 && !dump_step(output_dir, selected, (int)last_step)) status = 1;
+    if (status == 0 && save_path && !checkpoint_save(save_path, last_step)) status = 1;
+    if (trace_path && !profile_write_trace(trace_path)) status = 1;
+
+    printf("%d steps in %.3f s, %.3f ms/step\n", steps, elapsed, steps > 0 ? elapsed * 1e3 / steps : 0.0);
+    printf("Simulated %.3f s in %lld substeps\n", simulated, substeps);
+    if (budget > 0.0) {
+        char effort[128];
+        governor_describe(&governor, effort, sizeof(effort));
+        printf("Budget: %lld of %d steps over %.2f ms, slowest %.2f ms, %lld changes, ending at %s\n",
+               over_budget, steps, budget * 1e3, slowest * 1e3, governor.changes, effort);
+    }
+    if (sim->particles) {
+        printf("Particles: %d live of %d, %lld spawned, %lld dropped\n", sim->particles->live,
+               sim->particles->capacity, sim->particles->spawned, sim->particles->dropped);
+    }
+    printf("Checksum: %016llx\n", (unsigned long long)fluid_checksum());
+    particles_destroy(sim->particles);
+    sim->particles = NULL;
+    detail_destroy(sim->detail);
+    sim->detail = NULL;
+    obstacles_destroy(sim->obstacles);
+    sim->obstacles = NULL;
+    fluid_shutdown();
+    thread_pool_shutdown();
+    return status;
+}
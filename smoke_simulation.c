@@ -3,22 +3,23 @@
 #include <SDL_ttf.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <math.h>
 
-#define WINDOW_WIDTH 100*4
-#define WINDOW_HEIGHT 75*4
-#define GRID_WIDTH 100*2
-#define GRID_HEIGHT 75*2
-#define CELL_SIZE 2
-#define MOUSE_FORCE 0.5f
-#define MOUSE_RADIUS 50
-#define PRESSURE_ITERATIONS 100
-#define VISCOSITY_ITERATIONS 2
-#define TURBULENCE_AMOUNT 0.08f
-#define VORTICITY_STRENGTH 0.015f
-#define DENSITY_DECAY 0.998f
-#define TEMPERATURE_DECAY 0.998f
+#include "fluid.h"
+#include "obstacles.h"
+#include "particles.h"
+#include "profile.h"
+#include "recording.h"
+#include "render.h"
+#include "sim_thread.h"
+#include "timer.h"
+
+#define WINDOW_WIDTH (100*4)
+#define WINDOW_HEIGHT (75*4)
+#define SIM_RATE 60            // Solver steps per second, independent of the display
+#define DISPLAY_MAX_RATE 120   // Frame cap for when the renderer has no vsync
 
 // UI Constants
 #define BUTTON_WIDTH 120
@@ -27,23 +28,18 @@
 #define SLIDER_HEIGHT 20
 #define UI_PADDING 10
 #define FONT_SIZE 20
+#define STATS_FONT_SIZE 12
+#define STATS_WIDTH 170
+#define GLYPH_FIRST 32
+#define GLYPH_COUNT 95     // Printable ASCII
+#define TRACE_PATH "smoke_trace.json"
+#define CHECKPOINT_PATH "smoke_checkpoint.bin"
+#define RECORDING_PATH "smoke_recording.rec"
 
-typedef struct {
-    float density;
-    float velocity_x;
-    float velocity_y;
-    float temperature;
-} Cell;
-
-Cell grid[GRID_WIDTH][GRID_HEIGHT];
-Cell temp_grid[GRID_WIDTH][GRID_HEIGHT];
-Cell divergence_grid[GRID_WIDTH][GRID_HEIGHT];
-Cell pressure_grid[GRID_WIDTH][GRID_HEIGHT];
 int mouse_x = 0;
 int mouse_y = 0;
 int mouse_clicked = 0;
 int window_dragging = 0;
-float emission_density_amount = 0.25f;
 
 typedef struct {
     SDL_Rect rect;
@@ -51,7 +47,6 @@ typedef struct {
     SDL_Color hover_color;
     SDL_Color text_color;
     char* label;
-    SDL_Texture* texture;
     int is_hovered;
     int is_pressed;
 } Button;
@@ -74,359 +69,298 @@ Slider emission_slider;
 TTF_Font* font;
 int emission_enabled = 1;
 
-float random_float(float min, float max) {
-    return min + ((float)rand() / RAND_MAX) * (max - min);
-}
+// Printable ASCII rendered once into one texture; text is drawn by copying
+// glyph rectangles out of it, so labels and stats never go through TTF again
+typedef struct {
+    SDL_Texture* texture;
+    SDL_Rect glyphs[GLYPH_COUNT];
+    int height;
+} GlyphAtlas;
 
-void init_grid() {
-    for (int x = 0; x < GRID_WIDTH; x++) {
-        for (int y = 0; y < GRID_HEIGHT; y++) {
-            grid[x][y].density = 0.0f;
-            grid[x][y].velocity_x = 0.0f;
-            grid[x][y].velocity_y = 0.0f;
-            grid[x][y].temperature = 0.0f;
-        }
-    }
-}
+GlyphAtlas label_atlas;
+GlyphAtlas stats_atlas;
 
-void add_smoke(int x, int y) {
-    if (x >= 0 && x < GRID_WIDTH && y >= 0 && y < GRID_HEIGHT) {
-        grid[x][y].density += emission_density_amount;
-        grid[x][y].temperature = 1.0f + random_float(-0.2f, 0.2f);
-        if (grid[x][y].temperature < 0.5f) grid[x][y].temperature = 0.5f;
-        
-        // Add more dynamic initial velocity
-        float angle = random_float(0, 2 * 3.14159f);
-        float speed = random_float(0.3f, 0.7f);
-        grid[x][y].velocity_y = -0.5f + speed * sinf(angle);
-        grid[x][y].velocity_x = speed * cosf(angle);
-    }
+// Grid sizes cycled with [ and ]; the window keeps its size and rescales
+typedef struct {
+    int width;
+    int height;
+} GridPreset;
+
+GridPreset grid_presets[] = {
+    {100, 75},
+    {128, 96},
+    {200, 150},
+    {256, 192},
+    {400, 300},
+    {512, 384},
+};
+#define GRID_PRESET_COUNT ((int)(sizeof(grid_presets) / sizeof(grid_presets[0])))
+int grid_preset = 2;
+
+// The simulation thread does the resize and reports the outcome
+void change_grid_preset(int step) {
+    int next = grid_preset + step;
+    if (next < 0 || next >= GRID_PRESET_COUNT) return;
+    SimCommand command = {SIM_RESIZE, grid_presets[next].width, grid_presets[next].height};
+    if (sim_send(command)) grid_preset = next;
 }
 
-void apply_mouse_force() {
-    if (!mouse_clicked && !window_dragging) return;
-    
-    int grid_mouse_x = mouse_x / CELL_SIZE;
-    int grid_mouse_y = mouse_y / CELL_SIZE;
-    
-    for (int x = 0; x < GRID_WIDTH; x++) {
-        for (int y = 0; y < GRID_HEIGHT; y++) {
-            if (grid[x][y].density > 0.1f) {
-                float dx = x - grid_mouse_x;
-                float dy = y - grid_mouse_y;
-                float distance = sqrtf(dx * dx + dy * dy);
-                
-                if (distance < MOUSE_RADIUS) {
-                    if (distance < 1e-6) distance = 1e-6;
-
-                    float force = (1.0f - distance / MOUSE_RADIUS) * MOUSE_FORCE;
-                    grid[x][y].velocity_x += (dx / distance) * force;
-                    grid[x][y].velocity_y += (dy / distance) * force;
-                }
-            }
-        }
-    }
+// Mouse push in window coordinates, forwarded as a fraction of the grid
+void send_force() {
+    SimCommand command = {
+        SIM_FORCE,
+        mouse_clicked || window_dragging,
+        0,
+        (float)mouse_x / WINDOW_WIDTH,
+        (float)mouse_y / WINDOW_HEIGHT
+    };
+    sim_send(command);
 }
 
-void set_bnd(int b, Cell field[GRID_WIDTH][GRID_HEIGHT]) {
-    for (int i = 1; i < GRID_WIDTH - 1; i++) {
-        if (b == 1) {
-            field[0][i].velocity_x = -field[1][i].velocity_x;
-            field[GRID_WIDTH - 1][i].velocity_x = -field[GRID_WIDTH - 2][i].velocity_x;
-            field[i][0].velocity_x = field[i][1].velocity_x;
-            field[i][GRID_HEIGHT - 1].velocity_x = field[i][GRID_HEIGHT - 2].velocity_x;
-        } else if (b == 2) {
-            field[i][0].velocity_y = -field[i][1].velocity_y;
-            field[i][GRID_HEIGHT - 1].velocity_y = -field[i][GRID_HEIGHT - 2].velocity_y;
-            field[0][i].velocity_y = field[1][i].velocity_y;
-            field[GRID_WIDTH - 1][i].velocity_y = field[GRID_WIDTH - 2][i].velocity_y;
-        } else {
-            field[i][0] = field[i][1];
-            field[i][GRID_HEIGHT - 1] = field[i][GRID_HEIGHT - 2];
-            field[0][i] = field[1][i];
-            field[GRID_WIDTH - 1][i] = field[GRID_WIDTH - 2][i];
-        }
-    }
-
-    if (b == 0) {
-        field[0][0].density = (field[1][0].density + field[0][1].density) * 0.5f;
-        field[0][GRID_HEIGHT - 1].density = (field[1][GRID_HEIGHT - 1].density + field[0][GRID_HEIGHT - 2].density) * 0.5f;
-        field[GRID_WIDTH - 1][0].density = (field[GRID_WIDTH - 2][0].density + field[GRID_WIDTH - 1][1].density) * 0.5f;
-        field[GRID_WIDTH - 1][GRID_HEIGHT - 1].density = (field[GRID_WIDTH - 2][GRID_HEIGHT - 1].density + field[GRID_WIDTH - 1][GRID_HEIGHT - 2].density) * 0.5f;
-
-        field[0][0].temperature = (field[1][0].temperature + field[0][1].temperature) * 0.5f;
-        field[0][GRID_HEIGHT - 1].temperature = (field[1][GRID_HEIGHT - 1].temperature + field[0][GRID_HEIGHT - 2].temperature) * 0.5f;
-        field[GRID_WIDTH - 1][0].temperature = (field[GRID_WIDTH - 2][0].temperature + field[GRID_WIDTH - 1][1].temperature) * 0.5f;
-        field[GRID_WIDTH - 1][GRID_HEIGHT - 1].temperature = (field[GRID_WIDTH - 2][GRID_HEIGHT - 1].temperature + field[GRID_WIDTH - 1][GRID_HEIGHT - 2].temperature) * 0.5f;
-
-    } else if (b == 1) {
-        field[0][0].velocity_x = (field[1][0].velocity_x + field[0][1].velocity_x) * 0.5f;
-        field[0][GRID_HEIGHT - 1].velocity_x = (field[1][GRID_HEIGHT - 1].velocity_x + field[0][GRID_HEIGHT - 2].velocity_x) * 0.5f;
-        field[GRID_WIDTH - 1][0].velocity_x = (field[GRID_WIDTH - 2][0].velocity_x + field[GRID_WIDTH - 1][1].velocity_x) * 0.5f;
-        field[GRID_WIDTH - 1][GRID_HEIGHT - 1].velocity_x = (field[GRID_WIDTH - 2][GRID_HEIGHT - 1].velocity_x + field[GRID_WIDTH - 1][GRID_HEIGHT - 2].velocity_x) * 0.5f;
-
-    } else if (b == 2) {
-        field[0][0].velocity_y = (field[1][0].velocity_y + field[0][1].velocity_y) * 0.5f;
-        field[0][GRID_HEIGHT - 1].velocity_y = (field[1][GRID_HEIGHT - 1].velocity_y + field[0][GRID_HEIGHT - 2].velocity_y) * 0.5f;
-        field[GRID_WIDTH - 1][0].velocity_y = (field[GRID_WIDTH - 2][0].velocity_y + field[GRID_WIDTH - 1][1].velocity_y) * 0.5f;
-        field[GRID_WIDTH - 1][GRID_HEIGHT - 1].velocity_y = (field[GRID_WIDTH - 2][GRID_HEIGHT - 1].velocity_y + field[GRID_WIDTH - 1][GRID_HEIGHT - 2].velocity_y) * 0.5f;
-    }
+// Right button paints obstacles, with shift held erases them
+int obstacle_painting = 0;
+int obstacle_erasing = 0;
+int obstacle_no_slip = 0;
+
+void send_obstacle_paint() {
+    SimCommand command = {
+        SIM_OBSTACLE_PAINT,
+        !obstacle_erasing,
+        obstacle_no_slip,
+        (float)mouse_x / WINDOW_WIDTH,
+        (float)mouse_y / WINDOW_HEIGHT
+    };
+    sim_send(command);
 }
 
-void calculate_divergence() {
-    for (int x = 1; x < GRID_WIDTH - 1; x++) {
-        for (int y = 1; y < GRID_HEIGHT - 1; y++) {
-            divergence_grid[x][y].density = 
-                (grid[x+1][y].velocity_x - grid[x-1][y].velocity_x + 
-                 grid[x][y+1].velocity_y - grid[x][y-1].velocity_y) * 0.5f;
-        }
+// Opaque dark pixels of the image become solid cells, the image stretched
+// over the grid. Only before the solver thread starts.
+int load_obstacle_image(const char* path) {
+    SDL_Surface* loaded = IMG_Load(path);
+    if (!loaded) {
+        printf("Obstacle image %s could not be loaded: %s\n", path, IMG_GetError());
+        return 0;
     }
-}
-
-void solve_pressure() {
-    for (int iter = 0; iter < 40; iter++) {
-        for (int x = 1; x < GRID_WIDTH - 1; x++) {
-            for (int y = 1; y < GRID_HEIGHT - 1; y++) {
-                pressure_grid[x][y].density = 
-                    (pressure_grid[x-1][y].density + pressure_grid[x+1][y].density +
-                     pressure_grid[x][y-1].density + pressure_grid[x][y+1].density -
-                     divergence_grid[x][y].density) * 0.25f;
-            }
-        }
+    SDL_Surface* surface = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_ARGB8888, 0);
+    SDL_FreeSurface(loaded);
+    if (!surface) {
+        printf("Obstacle image %s could not be converted: %s\n", path, SDL_GetError());
+        return 0;
     }
-}
-
-void apply_pressure() {
-    for (int x = 1; x < GRID_WIDTH - 1; x++) {
-        for (int y = 1; y < GRID_HEIGHT - 1; y++) {
-            grid[x][y].velocity_x -= (pressure_grid[x+1][y].density - pressure_grid[x-1][y].density) * 0.5f;
-            grid[x][y].velocity_y -= (pressure_grid[x][y+1].density - pressure_grid[x][y-1].density) * 0.5f;
+    int ok = 0;
+    uint8_t* mask = malloc((size_t)surface->w * surface->h);
+    if (!sim->obstacles) sim->obstacles = obstacles_create();
+    if (mask && sim->obstacles && SDL_LockSurface(surface) == 0) {
+        for (int y = 0; y < surface->h; y++) {
+            const uint32_t* row = (const uint32_t*)((const uint8_t*)surface->pixels + (size_t)y * surface->pitch);
+            for (int x = 0; x < surface->w; x++) {
+                uint32_t p = row[x];
+                int luminance = 299 * (p >> 16 & 0xFF) + 587 * (p >> 8 & 0xFF) + 114 * (p & 0xFF);
+                mask[(size_t)y * surface->w + x] = (p >> 24) >= 128 && luminance < 128 * 1000;
+            }
         }
+        SDL_UnlockSurface(surface);
+        obstacles_load_mask(sim->obstacles, mask, surface->w, surface->h);
+        obstacles_build(sim->obstacles);
+        printf("Obstacles from %s: %d solid cells\n", path, sim->obstacles->solid_count);
+        ok = 1;
     }
-    set_bnd(1, grid);
-    set_bnd(2, grid);
+    free(mask);
+    SDL_FreeSurface(surface);
+    return ok;
 }
 
-void add_turbulence(float amount) {
-    for (int x = 1; x < GRID_WIDTH - 1; x++) {
-        for (int y = 1; y < GRID_HEIGHT - 1; y++) {
-            float noise_x = (float)(rand() % 201 - 100) / 100.0f;
-            float noise_y = (float)(rand() % 201 - 100) / 100.0f;
-
-            grid[x][y].velocity_x += noise_x * amount;
-            grid[x][y].velocity_y += noise_y * amount;
-        }
-    }
-}
+GlyphAtlas create_glyph_atlas(TTF_Font* atlas_font, SDL_Renderer* renderer) {
+    GlyphAtlas atlas = {0};
+    if (!atlas_font) return atlas;
+
+    char text[GLYPH_COUNT + 1];
+    for (int i = 0; i < GLYPH_COUNT; i++) text[i] = (char)(GLYPH_FIRST + i);
+    text[GLYPH_COUNT] = '\0';
+
+    // Without kerning every glyph's cell is the difference of prefix widths
+    TTF_SetFontKerning(atlas_font, 0);
+    SDL_Color white = {255, 255, 255, 255};
+    SDL_Surface* surface = TTF_RenderText_Blended(atlas_font, text, white);
+    if (!surface) return atlas;
+    atlas.texture = SDL_CreateTextureFromSurface(renderer, surface);
+    atlas.height = surface->h;
+    SDL_FreeSurface(surface);
 
-void add_viscosity(float amount) {
-    for (int iter = 0; iter < 4; iter++) {
-        for (int x = 1; x < GRID_WIDTH - 1; x++) {
-            for (int y = 1; y < GRID_HEIGHT - 1; y++) {
-                grid[x][y].velocity_x = (
-                    grid[x][y].velocity_x + 
-                    amount * (grid[x-1][y].velocity_x + grid[x+1][y].velocity_x +
-                              grid[x][y-1].velocity_x + grid[x][y+1].velocity_x))
-                    / (1 + 4 * amount);
-
-                grid[x][y].velocity_y = (
-                    grid[x][y].velocity_y + 
-                    amount * (grid[x-1][y].velocity_y + grid[x+1][y].velocity_y +
-                              grid[x][y-1].velocity_y + grid[x][y+1].velocity_y))
-                    / (1 + 4 * amount);
-            }
-        }
+    int left = 0;
+    for (int i = 0; i < GLYPH_COUNT; i++) {
+        char next = text[i + 1];
+        int right, h;
+        text[i + 1] = '\0';
+        TTF_SizeText(atlas_font, text, &right, &h);
+        text[i + 1] = next;
+        atlas.glyphs[i] = (SDL_Rect){left, 0, right - left, atlas.height};
+        left = right;
     }
-    set_bnd(1, grid);
-    set_bnd(2, grid);
+    return atlas;
 }
 
-void calculate_vorticity() {
-    for (int x = 1; x < GRID_WIDTH - 1; x++) {
-        for (int y = 1; y < GRID_HEIGHT - 1; y++) {
-            divergence_grid[x][y].density = 
-                (grid[x+1][y].velocity_y - grid[x-1][y].velocity_y) * 0.5f -
-                (grid[x][y+1].velocity_x - grid[x][y-1].velocity_x) * 0.5f;
-        }
+int text_width(const GlyphAtlas* atlas, const char* text) {
+    int width = 0;
+    for (const char* c = text; *c; c++) {
+        int g = (unsigned char)*c - GLYPH_FIRST;
+        if (g >= 0 && g < GLYPH_COUNT) width += atlas->glyphs[g].w;
     }
+    return width;
 }
 
-void apply_vorticity_confinement(float strength) {
-    calculate_vorticity();
-
-    for (int x = 1; x < GRID_WIDTH - 1; x++) {
-        for (int y = 1; y < GRID_HEIGHT - 1; y++) {
-            float omega = divergence_grid[x][y].density;
-
-            float grad_omega_x = (fabs(divergence_grid[x+1][y].density) - fabs(divergence_grid[x-1][y].density)) * 0.5f;
-            float grad_omega_y = (fabs(divergence_grid[x][y+1].density) - fabs(divergence_grid[x][y-1].density)) * 0.5f;
-
-            float grad_omega_mag = sqrtf(grad_omega_x * grad_omega_x + grad_omega_y * grad_omega_y);
-
-            if (grad_omega_mag > 1e-6) {
-                float Nx = grad_omega_x / grad_omega_mag;
-                float Ny = grad_omega_y / grad_omega_mag;
-
-                float force_x = Ny * omega;
-                float force_y = -Nx * omega;
-
-                grid[x][y].velocity_x += force_x * strength;
-                grid[x][y].velocity_y += force_y * strength;
-            }
-        }
+void draw_text(SDL_Renderer* renderer, const GlyphAtlas* atlas, int x, int y, const char* text, SDL_Color color) {
+    if (!atlas->texture) return;
+    SDL_SetTextureColorMod(atlas->texture, color.r, color.g, color.b);
+    for (const char* c = text; *c; c++) {
+        int g = (unsigned char)*c - GLYPH_FIRST;
+        if (g < 0 || g >= GLYPH_COUNT) continue;
+        SDL_Rect dst = {x, y, atlas->glyphs[g].w, atlas->glyphs[g].h};
+        SDL_RenderCopy(renderer, atlas->texture, &atlas->glyphs[g], &dst);
+        x += dst.w;
     }
 }
 
-void update_simulation() {
-    for (int x = 0; x < GRID_WIDTH; x++) {
-        for (int y = 0; y < GRID_HEIGHT; y++) {
-            temp_grid[x][y] = grid[x][y];
-        }
+// Per-zone milliseconds averaged over the last PROFILE_HISTORY frames, then
+// the latest counter values
+void render_stats(SDL_Renderer* renderer, const SimFrame* frame, PressureSolver solver) {
+    profile_lock();
+    int line = stats_atlas.height;
+    SDL_Rect panel = {
+        WINDOW_WIDTH - STATS_WIDTH - UI_PADDING,
+        UI_PADDING,
+        STATS_WIDTH,
+        (profile_zone_count + profile_counter_count + 1) * line + UI_PADDING
+    };
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 160);
+    SDL_RenderFillRect(renderer, &panel);
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+
+    SDL_Color name_color = {180, 180, 180, 255};
+    SDL_Color value_color = {255, 255, 255, 255};
+    int x = panel.x + UI_PADDING / 2;
+    int right = panel.x + panel.w - UI_PADDING / 2;
+    int y = panel.y + UI_PADDING / 2;
+    char value[64];
+
+    snprintf(value, sizeof(value), "%dx%d  %s  %d threads", frame->width, frame->height,
+             pressure_solver_names[solver], pool.thread_count);
+    draw_text(renderer, &stats_atlas, x, y, value, value_color);
+    y += line;
+
+    for (int z = 0; z < profile_zone_count; z++) {
+        snprintf(value, sizeof(value), "%.2f ms", profile_average(&profile_zones[z]) * 1e3);
+        draw_text(renderer, &stats_atlas, x, y, profile_zones[z].name, name_color);
+        draw_text(renderer, &stats_atlas, right - text_width(&stats_atlas, value), y, value, value_color);
+        y += line;
     }
-
-    for (int x = 1; x < GRID_WIDTH - 1; x++) {
-        for (int y = 1; y < GRID_HEIGHT - 1; y++) {
-            float vx = temp_grid[x][y].velocity_x;
-            float vy = temp_grid[x][y].velocity_y;
-
-            float prev_x = x - vx;
-            float prev_y = y - vy;
-
-            prev_x = fmaxf(0.5f, fminf(GRID_WIDTH - 1.5f, prev_x));
-            prev_y = fmaxf(0.5f, fminf(GRID_HEIGHT - 1.5f, prev_y));
-
-            int x0 = (int)prev_x;
-            int y0 = (int)prev_y;
-            int x1 = x0 + 1;
-            int y1 = y0 + 1;
-
-            float s1 = prev_x - x0;
-            float s0 = 1.0f - s1;
-            float t1 = prev_y - y0;
-            float t0 = 1.0f - t1;
-
-            grid[x][y].density = s0 * (t0 * temp_grid[x0][y0].density + t1 * temp_grid[x0][y1].density) +
-                                s1 * (t0 * temp_grid[x1][y0].density + t1 * temp_grid[x1][y1].density);
-
-            grid[x][y].temperature = s0 * (t0 * temp_grid[x0][y0].temperature + t1 * temp_grid[x0][y1].temperature) +
-                                    s1 * (t0 * temp_grid[x1][y0].temperature + t1 * temp_grid[x1][y1].temperature);
-
-            grid[x][y].velocity_x = s0 * (t0 * temp_grid[x0][y0].velocity_x + t1 * temp_grid[x0][y1].velocity_x) +
-                                  s1 * (t0 * temp_grid[x1][y0].velocity_x + t1 * temp_grid[x1][y1].velocity_x);
-
-            grid[x][y].velocity_y = s0 * (t0 * temp_grid[x0][y0].velocity_y + t1 * temp_grid[x0][y1].velocity_y) +
-                                  s1 * (t0 * temp_grid[x1][y0].velocity_y + t1 * temp_grid[x1][y1].velocity_y);
-        }
+    for (int c = 0; c < profile_counter_count; c++) {
+        snprintf(value, sizeof(value), "%.3g", profile_counters[c].value);
+        draw_text(renderer, &stats_atlas, x, y, profile_counters[c].name, name_color);
+        draw_text(renderer, &stats_atlas, right - text_width(&stats_atlas, value), y, value, value_color);
+        y += line;
     }
-    set_bnd(0, grid);
-    set_bnd(1, grid);
-    set_bnd(2, grid);
+    profile_unlock();
+}
 
-    for (int x = 1; x < GRID_WIDTH - 1; x++) {
-        for (int y = 1; y < GRID_HEIGHT - 1; y++) {
-            grid[x][y].velocity_y -= grid[x][y].density * grid[x][y].temperature * 0.15f;
+// One texel per cell of the latest published step, stretched over the
+// window by the renderer; recreated when the grid size changes
+SDL_Texture* smoke_texture = NULL;
+int smoke_texture_width = 0;
+int smoke_texture_height = 0;
+
+// Tracers are splatted at the window's resolution, finer than the smoke
+// texture, and added on top of it
+SDL_Texture* particle_texture = NULL;
+int particle_texture_width = 0;
+int particle_texture_height = 0;
+
+void render_tracers(SDL_Renderer* renderer, const SimFrame* frame) {
+    int width, height;
+    if (SDL_GetRendererOutputSize(renderer, &width, &height) != 0) return;
+    if (!particle_texture || particle_texture_width != width || particle_texture_height != height) {
+        if (particle_texture) SDL_DestroyTexture(particle_texture);
+        particle_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                             width, height);
+        if (!particle_texture) {
+            printf("Texture creation failed: %s\n", SDL_GetError());
+            return;
         }
+        SDL_SetTextureBlendMode(particle_texture, SDL_BLENDMODE_ADD);
+        particle_texture_width = width;
+        particle_texture_height = height;
     }
-    apply_mouse_force();
-
-    add_turbulence(TURBULENCE_AMOUNT);
 
-    apply_vorticity_confinement(VORTICITY_STRENGTH);
-
-    set_bnd(1, grid);
-    set_bnd(2, grid);
-
-    for (int iter = 0; iter < VISCOSITY_ITERATIONS; iter++) {
-        for (int x = 1; x < GRID_WIDTH - 1; x++) {
-            for (int y = 1; y < GRID_HEIGHT - 1; y++) {
-                grid[x][y].velocity_x = (
-                    grid[x][y].velocity_x + 
-                    0.008f * (grid[x-1][y].velocity_x + grid[x+1][y].velocity_x +
-                              grid[x][y-1].velocity_x + grid[x][y+1].velocity_x))
-                    / (1 + 4 * 0.008f);
-
-                grid[x][y].velocity_y = (
-                    grid[x][y].velocity_y + 
-                    0.008f * (grid[x-1][y].velocity_y + grid[x+1][y].velocity_y +
-                              grid[x][y-1].velocity_y + grid[x][y+1].velocity_y))
-                    / (1 + 4 * 0.008f);
-            }
-        }
-        set_bnd(1, grid);
-        set_bnd(2, grid);
-    }
+    void* pixels;
+    int pitch;
+    if (SDL_LockTexture(particle_texture, NULL, &pixels, &pitch) != 0) return;
+    for (int y = 0; y < height; y++) memset((char*)pixels + (size_t)y * pitch, 0, (size_t)width * sizeof(uint32_t));
+    render_particles(frame->particle_x, frame->particle_y, frame->particle_life, frame->particle_count,
+                     (float)width / frame->width, pixels, pitch / (int)sizeof(uint32_t), width, height);
+    SDL_UnlockTexture(particle_texture);
+    SDL_RenderCopy(renderer, particle_texture, NULL, NULL);
+}
 
-    for (int x = 0; x < GRID_WIDTH; x++) {
-        for (int y = 0; y < GRID_HEIGHT; y++) {
-            pressure_grid[x][y].density = 0.0f;
+void render_simulation(SDL_Renderer* renderer, const SimFrame* frame) {
+    if (!smoke_texture || smoke_texture_width != frame->width || smoke_texture_height != frame->height) {
+        if (smoke_texture) SDL_DestroyTexture(smoke_texture);
+        smoke_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                          frame->width, frame->height);
+        if (!smoke_texture) {
+            printf("Texture creation failed: %s\n", SDL_GetError());
+            return;
         }
+        // Smoke is drawn opaque over black, as the per-cell rectangles were
+        SDL_SetTextureBlendMode(smoke_texture, SDL_BLENDMODE_NONE);
+        smoke_texture_width = frame->width;
+        smoke_texture_height = frame->height;
     }
-    calculate_divergence();
 
-    for (int iter = 0; iter < PRESSURE_ITERATIONS; iter++) {
-        for (int x = 1; x < GRID_WIDTH - 1; x++) {
-            for (int y = 1; y < GRID_HEIGHT - 1; y++) {
-                pressure_grid[x][y].density = 
-                    (pressure_grid[x-1][y].density + pressure_grid[x+1][y].density +
-                     pressure_grid[x][y-1].density + pressure_grid[x][y+1].density -
-                     divergence_grid[x][y].density) * 0.25f;
-            }
-        }
-        set_bnd(0, pressure_grid);
-    }
+    void* pixels;
+    int pitch;
+    if (SDL_LockTexture(smoke_texture, NULL, &pixels, &pitch) != 0) return;
+    render_planes(frame->density, frame->temperature, frame->sparse ? frame->tiles : NULL,
+                  frame->obstacles ? frame->solid : NULL, frame->width, frame->height,
+                  pixels, pitch / (int)sizeof(uint32_t));
+    SDL_UnlockTexture(smoke_texture);
+    SDL_RenderCopy(renderer, smoke_texture, NULL, NULL);
+    if (frame->particle_count > 0) render_tracers(renderer, frame);
+}
 
-    apply_pressure();
-    set_bnd(1, grid);
-    set_bnd(2, grid);
+// --replay FILE plays a recording instead of running the solver
+Recording replay;
+int replaying = 0;
+int replay_paused = 0;
+double replay_position = 0.0;   // In frames, fractional between them
+SimFrame replay_frame;
 
-    for (int x = 0; x < GRID_WIDTH; x++) {
-        for (int y = 0; y < GRID_HEIGHT; y++) {
-            grid[x][y].density *= DENSITY_DECAY;
-            grid[x][y].temperature *= TEMPERATURE_DECAY;
-        }
-    }
+double replay_frame_seconds() {
+    return replay.header.frame_seconds > 0.0f ? replay.header.frame_seconds : 1.0 / SIM_RATE;
+}
 
-    add_viscosity(0.05f);
+void replay_jump(double frames) {
+    replay_position += frames;
+    if (replay_position < 0.0) replay_position = 0.0;
+    if (replay_position > replay.frame_count - 1) replay_position = replay.frame_count - 1;
 }
 
-void render_simulation(SDL_Renderer* renderer) {
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-    SDL_RenderClear(renderer);
-
-    for (int x = 0; x < GRID_WIDTH; x++) {
-        for (int y = 0; y < GRID_HEIGHT; y++) {
-            if (grid[x][y].density > 0.005f) {
-                float density = grid[x][y].density;
-                float temp = grid[x][y].temperature;
-                
-                // Enhanced color calculation
-                float heat = temp * temp;
-                float intensity = density * density;
-                
-                int r = (int)((heat * 255 + intensity * 150) * (1.0f + sinf(temp * 3.14159f) * 0.2f));
-                int g = (int)((heat * 200 + intensity * 100) * (1.0f + sinf(temp * 2.0f) * 0.2f));
-                int b = (int)((heat * 100 + intensity * 50) * (1.0f + sinf(temp * 1.5f) * 0.2f));
-
-                r = fminf(255, fmaxf(0, r));
-                g = fminf(255, fmaxf(0, g));
-                b = fminf(255, fmaxf(0, b));
-
-                int alpha = (int)(pow(density, 0.6f) * (200 + temp * 150));
-                alpha = fminf(255, fmaxf(0, alpha));
-                
-                SDL_SetRenderDrawColor(renderer, r, g, b, alpha);
-                SDL_Rect rect = {
-                    x * CELL_SIZE,
-                    y * CELL_SIZE,
-                    CELL_SIZE,
-                    CELL_SIZE
-                };
-                SDL_RenderFillRect(renderer, &rect);
-            }
-        }
+// Advances playback by the wall time since the last frame, looping at the
+// end, and decodes the frame to show
+const SimFrame* replay_next(double elapsed) {
+    if (!replay_paused) {
+        replay_position += elapsed / replay_frame_seconds();
+        if (replay_position >= replay.frame_count) replay_position = fmod(replay_position, replay.frame_count);
     }
-
-    SDL_RenderPresent(renderer);
+    if (!recording_seek(&replay, (long long)replay_position)) return NULL;
+    replay_frame.width = replay.width;
+    replay_frame.height = replay.height;
+    replay_frame.step = replay.index[replay.frame].step;
+    replay_frame.density = replay.planes[RECORD_DENSITY];
+    replay_frame.temperature = replay.planes[RECORD_TEMPERATURE];
+    replay_frame.sparse = 0;
+    replay_frame.capacity = (size_t)replay.width * replay.height;
+    return &replay_frame;
 }
 
 Button create_button(int x, int y, int w, int h, SDL_Color color, SDL_Color hover_color, SDL_Color text_color, char* label, SDL_Renderer* renderer) {
@@ -439,10 +373,6 @@ Button create_button(int x, int y, int w, int h, SDL_Color color, SDL_Color hove
     button.is_hovered = 0;
     button.is_pressed = 0;
 
-    SDL_Surface* surface = TTF_RenderText_Solid(font, label, text_color);
-    button.texture = SDL_CreateTextureFromSurface(renderer, surface);
-    SDL_FreeSurface(surface);
-
     return button;
 }
 
@@ -474,15 +404,10 @@ void render_button(Button* button, SDL_Renderer* renderer) {
     SDL_RenderDrawRect(renderer, &button->rect);
 
     // Center the text
-    int text_w, text_h;
-    SDL_QueryTexture(button->texture, NULL, NULL, &text_w, &text_h);
-    SDL_Rect text_rect = {
-        button->rect.x + (button->rect.w - text_w) / 2,
-        button->rect.y + (button->rect.h - text_h) / 2,
-        text_w,
-        text_h
-    };
-    SDL_RenderCopy(renderer, button->texture, NULL, &text_rect);
+    draw_text(renderer, &label_atlas,
+              button->rect.x + (button->rect.w - text_width(&label_atlas, button->label)) / 2,
+              button->rect.y + (button->rect.h - label_atlas.height) / 2,
+              button->label, button->text_color);
 }
 
 void render_slider(Slider* slider, SDL_Renderer* renderer) {
@@ -531,7 +456,7 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
     if (!renderer) {
         printf("Renderer creation failed: %s\n", SDL_GetError());
         SDL_DestroyWindow(window);
@@ -545,6 +470,10 @@ int main(int argc, char* argv[]) {
         printf("Font loading failed: %s\n", TTF_GetError());
         // Continue without font, but UI won't have text
     }
+    label_atlas = create_glyph_atlas(font, renderer);
+    TTF_Font* stats_font = TTF_OpenFont("arial.ttf", STATS_FONT_SIZE);
+    stats_atlas = create_glyph_atlas(stats_font, renderer);
+    if (stats_font) TTF_CloseFont(stats_font);
 
     // Create UI elements
     SDL_Color button_color = {50, 50, 50, 255};
@@ -584,19 +513,167 @@ int main(int argc, char* argv[]) {
         SLIDER_HEIGHT,
         0.0f,
         1.0f,
-        emission_density_amount,
+        sim->emission_density_amount,
         slider_color,
         handle_color,
         renderer
     );
 
-    init_grid();
-    srand(time(NULL));
+    // Worker threads: --threads N, else SMOKE_THREADS, else one per CPU
+    int threads = 0;
+    const char* threads_env = getenv("SMOKE_THREADS");
+    if (threads_env) threads = atoi(threads_env);
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0) threads = atoi(argv[i + 1]);
+    }
+    thread_pool_init(threads);
+    printf("Simulation threads: %d\n", pool.thread_count);
+
+    // Widest kernels the CPU supports unless --simd scalar|sse4.1|avx2 caps them
+    SimdLevel simd_request = SIMD_LEVEL_COUNT - 1;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--simd") != 0) continue;
+        for (int level = 0; level < SIMD_LEVEL_COUNT; level++) {
+            if (strcmp(argv[i + 1], simd_level_names[level]) == 0) simd_request = level;
+        }
+    }
+    simd_select(simd_request);
+    printf("SIMD kernels: %s\n", simd_level_names[simd_level]);
+
+    // --storage float16|fixed16|fixed8 keeps density and temperature compact
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--storage") != 0) continue;
+        for (int storage = 0; storage < FIELD_STORAGE_COUNT; storage++) {
+            if (strcmp(argv[i + 1], field_storage_names[storage]) == 0) fluid_set_storage(storage);
+        }
+    }
+
+    // Grid size: --grid WxH, else the default preset
+    int width = grid_presets[grid_preset].width;
+    int height = grid_presets[grid_preset].height;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--grid") == 0 && sscanf(argv[i + 1], "%dx%d", &width, &height) != 2) {
+            printf("Grid size must be WxH: %s\n", argv[i + 1]);
+        }
+    }
+    if (!fluid_resize(width, height) &&
+        !fluid_resize(grid_presets[grid_preset].width, grid_presets[grid_preset].height)) {
+        printf("Grid allocation failed\n");
+        return 1;
+    }
+    printf("Grid: %dx%d\n", sim->grid_width, sim->grid_height);
+    // --seed N makes the emitter and turbulence repeat run to run
+    unsigned seed = (unsigned)time(NULL);
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0) seed = (unsigned)strtoul(argv[i + 1], NULL, 10);
+    }
+    fluid_seed(seed);
+
+    // --turbulence white|curl picks the noise that stirs the smoke
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--turbulence") != 0) continue;
+        for (int mode = 0; mode < TURBULENCE_MODE_COUNT; mode++) {
+            if (strcmp(argv[i + 1], turbulence_mode_names[mode]) == 0) sim->turbulence_mode = mode;
+        }
+    }
+
+    // --max-substeps N caps the substeps a fast flow may split a step into
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--max-substeps") == 0 && atoi(argv[i + 1]) > 0) sim->max_substeps = atoi(argv[i + 1]);
+    }
+
+    // --profile starts with the stats panel up; i toggles it, t writes a trace
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--profile") == 0) profile_set_enabled(1);
+    }
+    int profile_toggle = 0;
+
+    // The solver runs on its own thread from here on and owns
+    // default_simulation; the loop below only sends it commands and draws what it
+    // publishes. Solver choices are mirrored here for the key handlers.
+    PressureSolver selected_pressure = sim->pressure_solver;
+    ViscositySolver selected_viscosity = sim->viscosity_solver;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--replay") == 0) {
+            if (!recording_open(&replay, argv[i + 1])) return 1;
+            printf("Replaying %s: %lld frames; space pauses, arrows seek, comma and period step\n",
+                   argv[i + 1], replay.frame_count);
+            replaying = 1;
+        }
+    }
+
+    // --obstacles IMAGE makes the opaque dark pixels of an image solid; the
+    // right button paints more, with shift erases them, and o clears them
+    // all. --no-slip also holds the flow along their walls.
+    for (int i = 1; i < argc && !replaying; i++) {
+        if (strcmp(argv[i], "--no-slip") == 0) obstacle_no_slip = 1;
+    }
+    for (int i = 1; i + 1 < argc && !replaying; i++) {
+        if (strcmp(argv[i], "--obstacles") == 0 && load_obstacle_image(argv[i + 1])) {
+            sim->obstacles->no_slip = obstacle_no_slip;
+        }
+    }
+    if (!replaying && !sim_thread_start(1.0 / SIM_RATE)) return 1;
+
+    // --record FILE starts recording at once; r toggles it
+    int recording = 0;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--record") == 0 && !replaying) {
+            SimCommand command = {SIM_RECORD, 1, .path = argv[i + 1]};
+            recording = sim_send(command);
+        }
+    }
+
+    // --load FILE resumes a checkpoint; F5 saves one, F9 loads it back
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--load") == 0 && !replaying) {
+            SimCommand command = {SIM_LOAD, .path = argv[i + 1]};
+            sim_send(command);
+        }
+    }
+
+    // --particles [N] adds N tracers (default PARTICLE_DEFAULT_CAPACITY) to
+    // the smoke, drawn at the window's resolution; --particle-rate R spawns
+    // R per emitter cell per 1/60 s
+    float particle_rate = 0.0f;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--particle-rate") == 0) particle_rate = (float)atof(argv[i + 1]);
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--particles") != 0 || replaying) continue;
+        int capacity = i + 1 < argc && atoi(argv[i + 1]) > 0 ? atoi(argv[i + 1]) : PARTICLE_DEFAULT_CAPACITY;
+        SimCommand command = {SIM_PARTICLES, capacity, .x = particle_rate};
+        sim_send(command);
+    }
+
+    // --detail-scale F carries the smoke on a grid F times finer than the
+    // flow; --detail A adds a sub-grid swirl of A times the resolved speed
+    float detail_amount = 0.0f;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--detail") == 0) detail_amount = (float)atof(argv[i + 1]);
+    }
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--detail-scale") != 0 || replaying) continue;
+        SimCommand command = {SIM_DETAIL, atoi(argv[i + 1]), .x = detail_amount};
+        sim_send(command);
+    }
+
+    // --budget MS trades solver accuracy, then resolution, to keep each step
+    // within MS milliseconds
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--budget") == 0 && atof(argv[i + 1]) > 0.0 && !replaying) {
+            SimCommand command = {SIM_BUDGET, .x = (float)(atof(argv[i + 1]) * 1e-3)};
+            sim_send(command);
+        }
+    }
 
     int quit = 0;
     SDL_Event e;
+    double next_frame = timer_seconds();
+    double last_frame = next_frame;
 
     while (!quit) {
+        double frame_start = profile_begin();
         while (SDL_PollEvent(&e) != 0) {
             if (e.type == SDL_QUIT) {
                 quit = 1;
@@ -619,24 +696,32 @@ int main(int argc, char* argv[]) {
                 // Update slider if dragging
                 if (emission_slider.is_dragging) {
                     update_slider_value(&emission_slider, mouse_x);
-                    emission_density_amount = emission_slider.value;
+                    SimCommand command = {SIM_EMISSION_AMOUNT, .x = emission_slider.value};
+                    sim_send(command);
                 }
+                if (mouse_clicked) send_force();
+                if (obstacle_painting) send_obstacle_paint();
             }
             else if (e.type == SDL_MOUSEBUTTONDOWN) {
+                if (e.button.button == SDL_BUTTON_RIGHT && !replaying) {
+                    obstacle_painting = 1;
+                    obstacle_erasing = (SDL_GetModState() & KMOD_SHIFT) != 0;
+                    send_obstacle_paint();
+                }
                 if (e.button.button == SDL_BUTTON_LEFT) {
                     mouse_clicked = 1;
+                    send_force();
 
                     // Check button clicks
                     if (emission_button.is_hovered) {
                         emission_enabled = !emission_enabled;
-                        SDL_DestroyTexture(emission_button.texture);
-                        emission_button.texture = SDL_CreateTextureFromSurface(renderer,
-                            TTF_RenderText_Solid(font, 
-                                emission_enabled ? "Emission: ON" : "Emission: OFF",
-                                text_color));
+                        emission_button.label = emission_enabled ? "Emission: ON" : "Emission: OFF";
+                        SimCommand command = {SIM_EMISSION, emission_enabled};
+                        sim_send(command);
                     }
                     else if (reset_button.is_hovered) {
-                        init_grid();
+                        SimCommand command = {SIM_RESET};
+                        sim_send(command);
                     }
 
                     // Check slider drag
@@ -648,56 +733,124 @@ int main(int argc, char* argv[]) {
                     }
                 }
             }
+            else if (e.type == SDL_KEYDOWN) {
+                if (e.key.keysym.sym == SDLK_p) {
+                    selected_pressure = (selected_pressure + 1) % PRESSURE_SOLVER_COUNT;
+                    SimCommand command = {SIM_PRESSURE_SOLVER, selected_pressure};
+                    sim_send(command);
+                    printf("Pressure solver: %s\n", pressure_solver_names[selected_pressure]);
+                }
+                else if (e.key.keysym.sym == SDLK_v) {
+                    selected_viscosity = (selected_viscosity + 1) % VISCOSITY_SOLVER_COUNT;
+                    SimCommand command = {SIM_VISCOSITY_SOLVER, selected_viscosity};
+                    sim_send(command);
+                    printf("Viscosity solver: %s\n", viscosity_solver_names[selected_viscosity]);
+                }
+                else if (e.key.keysym.sym == SDLK_LEFTBRACKET) {
+                    change_grid_preset(-1);
+                }
+                else if (e.key.keysym.sym == SDLK_RIGHTBRACKET) {
+                    change_grid_preset(1);
+                }
+                else if (e.key.keysym.sym == SDLK_i) {
+                    profile_toggle = 1;
+                }
+                else if (e.key.keysym.sym == SDLK_t) {
+                    if (!profile_enabled) printf("Profiling is off; press i to record\n");
+                    if (profile_write_trace(TRACE_PATH)) printf("Trace written to %s\n", TRACE_PATH);
+                }
+                else if (e.key.keysym.sym == SDLK_r && !replaying) {
+                    SimCommand command = {SIM_RECORD, !recording, .path = RECORDING_PATH};
+                    if (sim_send(command)) recording = !recording;
+                }
+                else if (replaying && e.key.keysym.sym == SDLK_SPACE) {
+                    replay_paused = !replay_paused;
+                }
+                else if (replaying && (e.key.keysym.sym == SDLK_LEFT || e.key.keysym.sym == SDLK_RIGHT)) {
+                    replay_jump((e.key.keysym.sym == SDLK_LEFT ? -1.0 : 1.0) / replay_frame_seconds());
+                }
+                else if (replaying && (e.key.keysym.sym == SDLK_COMMA || e.key.keysym.sym == SDLK_PERIOD)) {
+                    replay_paused = 1;
+                    replay_position = floor(replay_position);
+                    replay_jump(e.key.keysym.sym == SDLK_COMMA ? -1.0 : 1.0);
+                }
+                else if (e.key.keysym.sym == SDLK_o && !replaying) {
+                    SimCommand command = {SIM_OBSTACLE_CLEAR};
+                    sim_send(command);
+                }
+                else if (e.key.keysym.sym == SDLK_F5) {
+                    SimCommand command = {SIM_SAVE, .path = CHECKPOINT_PATH};
+                    sim_send(command);
+                }
+                else if (e.key.keysym.sym == SDLK_F9) {
+                    SimCommand command = {SIM_LOAD, .path = CHECKPOINT_PATH};
+                    sim_send(command);
+                }
+            }
             else if (e.type == SDL_MOUSEBUTTONUP) {
+                if (e.button.button == SDL_BUTTON_RIGHT) obstacle_painting = 0;
                 if (e.button.button == SDL_BUTTON_LEFT) {
                     mouse_clicked = 0;
                     window_dragging = 0;
                     emission_slider.is_dragging = 0;
+                    send_force();
                 }
             }
         }
         
-        // Update simulation
-        if (emission_enabled) {
-            // Candle base
-            for (int i = -3; i <= 3; i++) {
-                add_smoke(GRID_WIDTH / 2 + i, GRID_HEIGHT - 2);
-            }
-            
-            // Candle middle
-            for (int i = -2; i <= 2; i++) {
-                add_smoke(GRID_WIDTH / 2 + i, GRID_HEIGHT - 3);
-            }
-            
-            // Candle top
-            for (int i = -1; i <= 1; i++) {
-                add_smoke(GRID_WIDTH / 2 + i, GRID_HEIGHT - 4);
-            }
-            
-            // Candle tip
-            add_smoke(GRID_WIDTH / 2, GRID_HEIGHT - 5);
-        }
-        
-        update_simulation();
-        
-        // Render
+        // Render the newest finished step; nothing here waits on the solver
+        double frame_time = timer_seconds();
+        const SimFrame* frame = replaying ? replay_next(frame_time - last_frame) : sim_latest_frame();
+        last_frame = frame_time;
+        double start = profile_begin();
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
         SDL_RenderClear(renderer);
         
-        render_simulation(renderer);
+        if (frame) render_simulation(renderer, frame);
+        profile_end("render", start);
         
         // Render UI
+        start = profile_begin();
         render_button(&emission_button, renderer);
         render_button(&reset_button, renderer);
         render_slider(&emission_slider, renderer);
+        if (profile_enabled && frame) render_stats(renderer, frame, selected_pressure);
+        profile_end("ui", start);
         
+        start = profile_begin();
         SDL_RenderPresent(renderer);
-        SDL_Delay(16);
+        profile_end("present", start);
+        profile_end("frame", frame_start);
+        profile_frame();
+
+        // Switched between frames so no zone straddles the change
+        if (profile_toggle) {
+            profile_set_enabled(!profile_enabled);
+            profile_toggle = 0;
+        }
+
+        // Vsync normally paces the loop; this only stops it spinning without
+        next_frame += 1.0 / DISPLAY_MAX_RATE;
+        double now = timer_seconds();
+        if (next_frame > now) {
+            timer_sleep(next_frame - now);
+        } else {
+            next_frame = now;
+        }
     }
 
     // Cleanup
-    SDL_DestroyTexture(emission_button.texture);
-    SDL_DestroyTexture(reset_button.texture);
+    if (replaying) {
+        recording_close(&replay);
+    } else {
+        sim_thread_stop();
+    }
+    fluid_shutdown();
+    thread_pool_shutdown();
+    if (smoke_texture) SDL_DestroyTexture(smoke_texture);
+    if (particle_texture) SDL_DestroyTexture(particle_texture);
+    if (label_atlas.texture) SDL_DestroyTexture(label_atlas.texture);
+    if (stats_atlas.texture) SDL_DestroyTexture(stats_atlas.texture);
     TTF_CloseFont(font);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
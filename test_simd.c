@@ -0,0 +1,256 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fluid.h"
+#include "rng.h"
+#include "thread_pool.h"
+
+// Runs every kernel simd_select() installs on seeded random state at each
+// level this CPU supports and compares the result with the scalar kernel's.
+// The odd grid sends the row tails through the scalar spans. Exits nonzero
+// on any mismatch.
+
+#define TEST_SEED 0x5EEDu
+#define FLOAT_TOLERANCE 5e-7f    // Relative above magnitude 1; FMA and reassociation
+#define STORE_SITE 0             // A dithered store site, as advection uses
+
+// The dispatched kernels are fluid.c internals
+typedef void (*SpanKernel)(int y, int x_begin, int x_end);
+typedef void (*CellLoader)(const void* plane, int field, int begin, int count, float* out);
+typedef void (*CellStorer)(void* plane, int field, int begin, int count, const float* in, int site);
+
+extern RangeKernel advect_kernel;
+extern SpanKernel advect_span_kernel;
+extern RangeKernel advect_stored_kernel;
+extern SpanKernel advect_stored_span_kernel;
+extern CellLoader load_cells_kernel;
+extern CellStorer store_cells_kernel;
+extern SpanKernel turbulence_span_kernel;
+extern RangeKernel divergence_kernel;
+extern RangeKernel vorticity_kernel;
+extern RangeKernel confinement_kernel;
+
+typedef struct {
+    int width;
+    int height;
+} GridSize;
+
+typedef struct {
+    const char* name;
+    void (*run)();
+    int compact;                 // 1 runs with every compact storage, 0 with fp32 only
+    float tolerance;             // On the fp32 planes; 0 is exact
+    int code_tolerance;          // On the stored codes of compact planes
+} KernelTest;
+
+// Spans start at a column that varies by row so they begin misaligned too
+void run_spans(SpanKernel kernel) {
+    for (int y = 1; y < sim->grid_height - 1; y++) kernel(y, 1 + y % 3, sim->grid_width - 1);
+}
+
+void run_advect() {
+    advect_kernel(NULL, 1, sim->grid_height - 1, 0);
+}
+
+void run_advect_span() {
+    run_spans(advect_span_kernel);
+}
+
+void run_advect_stored() {
+    advect_stored_kernel(NULL, 1, sim->grid_height - 1, 0);
+}
+
+void run_advect_stored_span() {
+    run_spans(advect_stored_span_kernel);
+}
+
+void run_load_cells() {
+    load_cells_kernel(sim->scalars.density, SCALAR_DENSITY, 0, sim->grid_size, sim->scratch);
+    load_cells_kernel(sim->scalars.temperature, SCALAR_TEMPERATURE, 3, sim->grid_size - 3, sim->divergence);
+}
+
+void run_store_cells() {
+    store_cells_kernel(sim->scalars.density, SCALAR_DENSITY, 0, sim->grid_size, sim->pressure, STORE_SITE);
+    store_cells_kernel(sim->scalars.temperature, SCALAR_TEMPERATURE, 3, sim->grid_size - 3, sim->pressure, STORE_SITE);
+}
+
+void run_turbulence() {
+    run_spans(turbulence_span_kernel);
+}
+
+void run_divergence() {
+    divergence_kernel(NULL, 1, sim->grid_height - 1, 0);
+}
+
+void run_vorticity() {
+    vorticity_kernel(NULL, 1, sim->grid_height - 1, 0);
+}
+
+void run_confinement() {
+    float strength = sim->params.vorticity_strength;
+    confinement_kernel(&strength, 1, sim->grid_height - 1, 0);
+}
+
+KernelTest tests[] = {
+    {"advect", run_advect, 0, FLOAT_TOLERANCE, 0},
+    {"advect span", run_advect_span, 0, FLOAT_TOLERANCE, 0},
+    {"advect stored", run_advect_stored, 1, FLOAT_TOLERANCE, 1},
+    {"advect stored span", run_advect_stored_span, 1, FLOAT_TOLERANCE, 1},
+    {"load cells", run_load_cells, 1, 0.0f, 0},
+    {"store cells", run_store_cells, 1, 0.0f, 0},
+    {"turbulence", run_turbulence, 0, 0.0f, 0},
+    {"divergence", run_divergence, 0, 0.0f, 0},
+    {"curl", run_vorticity, 0, 0.0f, 0},
+    {"confinement", run_confinement, 0, FLOAT_TOLERANCE, 0},
+};
+
+GridSize sizes[] = {{DEFAULT_GRID_WIDTH, DEFAULT_GRID_HEIGHT}, {37, 23}};
+
+// Uniform in [lo, hi) for cell i of plane p, the same on every run
+float sample(int p, int i, float lo, float hi) {
+    return lo + (hi - lo) * rng_unit(philox4x32((uint32_t)i, (uint32_t)p, 0, 0, TEST_SEED, 0).v[0]);
+}
+
+void fill_plane(void* plane, int p, float lo, float hi) {
+    float* values = malloc((size_t)sim->grid_size * sizeof(float));
+    for (int i = 0; i < sim->grid_size; i++) values[i] = sample(p, i, lo, hi);
+    fluid_write_cells(plane, 0, sim->grid_size, values);
+    free(values);
+}
+
+// The previous velocity reaches a few cells, so backtraces cross cells and
+// clamp at the walls; pressure holds values beyond both scalar ranges for
+// the stores to clamp
+void fill_state() {
+    simd_select(SIMD_SCALAR);
+    fill_plane(sim->prev_fields.velocity_x, 0, -3.0f, 3.0f);
+    fill_plane(sim->prev_fields.velocity_y, 1, -3.0f, 3.0f);
+    fill_plane(sim->prev_scalars.density, 2, 0.0f, 12.0f);
+    fill_plane(sim->prev_scalars.temperature, 3, 0.0f, 1.5f);
+    fill_plane(sim->fields.velocity_x, 4, -1.0f, 1.0f);
+    fill_plane(sim->fields.velocity_y, 5, -1.0f, 1.0f);
+    fill_plane(sim->scalars.density, 6, 0.0f, 12.0f);
+    fill_plane(sim->scalars.temperature, 7, 0.0f, 1.5f);
+    fill_plane(sim->pressure, 8, -1.0f, 17.0f);
+    fill_plane(sim->divergence, 9, -1.0f, 1.0f);
+    fill_plane(sim->scratch, 10, -1.0f, 1.0f);
+}
+
+#define SNAPSHOT_FLOATS 5
+
+// The planes a kernel may write: five fp32 ones, then the two stored scalars
+typedef struct {
+    float* floats[SNAPSHOT_FLOATS];
+    uint8_t* stored[2];
+} Snapshot;
+
+void take_snapshot(Snapshot* shot) {
+    const float* floats[SNAPSHOT_FLOATS] = {
+        sim->fields.velocity_x, sim->fields.velocity_y, sim->pressure, sim->divergence, sim->scratch
+    };
+    const void* stored[2] = {sim->scalars.density, sim->scalars.temperature};
+    size_t element = storage_bytes(sim->scalar_storage);
+    for (int p = 0; p < SNAPSHOT_FLOATS; p++) {
+        shot->floats[p] = malloc((size_t)sim->grid_size * sizeof(float));
+        memcpy(shot->floats[p], floats[p], (size_t)sim->grid_size * sizeof(float));
+    }
+    for (int p = 0; p < 2; p++) {
+        shot->stored[p] = malloc((size_t)sim->grid_size * element);
+        memcpy(shot->stored[p], stored[p], (size_t)sim->grid_size * element);
+    }
+}
+
+void free_snapshot(Snapshot* shot) {
+    for (int p = 0; p < SNAPSHOT_FLOATS; p++) free(shot->floats[p]);
+    for (int p = 0; p < 2; p++) free(shot->stored[p]);
+}
+
+int float_mismatch(float value, float reference, float tolerance) {
+    if (tolerance == 0.0f) return value != reference;
+    return !(fabsf(value - reference) <= tolerance * fmaxf(1.0f, fabsf(reference)));
+}
+
+// Codes of one cell as the storage keeps them; adjacent fp16 values of the
+// same sign differ by one in their bits as the fixed-point ones do
+int code_mismatch(const uint8_t* plane, const uint8_t* reference, int i, const KernelTest* test) {
+    switch (sim->scalar_storage) {
+    case FIELD_STORAGE_FLOAT16:
+    case FIELD_STORAGE_FIXED16:
+        return abs(((const uint16_t*)plane)[i] - ((const uint16_t*)reference)[i]) > test->code_tolerance;
+    case FIELD_STORAGE_FIXED8:
+        return abs(plane[i] - reference[i]) > test->code_tolerance;
+    default:
+        return float_mismatch(((const float*)plane)[i], ((const float*)reference)[i], test->tolerance);
+    }
+}
+
+// Mismatching cells, reporting the first
+int compare(const Snapshot* shot, const Snapshot* reference, const KernelTest* test, const char* label) {
+    static const char* names[SNAPSHOT_FLOATS + 2] = {
+        "velocity_x", "velocity_y", "pressure", "divergence", "scratch", "density", "temperature"
+    };
+    int mismatches = 0;
+    for (int p = 0; p < SNAPSHOT_FLOATS + 2; p++) {
+        for (int i = 0; i < sim->grid_size; i++) {
+            int bad = p < SNAPSHOT_FLOATS
+                ? float_mismatch(shot->floats[p][i], reference->floats[p][i], test->tolerance)
+                : code_mismatch(shot->stored[p - SNAPSHOT_FLOATS], reference->stored[p - SNAPSHOT_FLOATS], i, test);
+            if (bad && mismatches++ == 0) {
+                printf("FAIL %s: %s differs at (%d, %d)", label, names[p], i % sim->grid_width, i / sim->grid_width);
+                if (p < SNAPSHOT_FLOATS) printf(", %.9g against %.9g", shot->floats[p][i], reference->floats[p][i]);
+                printf("\n");
+            }
+        }
+    }
+    return mismatches;
+}
+
+int main() {
+    thread_pool_init(1);
+    SimdLevel supported = simd_detect();
+    printf("SIMD levels checked against scalar: ");
+    for (int level = SIMD_SCALAR + 1; level <= supported; level++) printf("%s ", simd_level_names[level]);
+    printf("%s\n", supported == SIMD_SCALAR ? "none" : "");
+
+    int checks = 0;
+    int failures = 0;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (int storage = 0; storage < FIELD_STORAGE_COUNT; storage++) {
+            if (!fluid_set_storage(storage) || !fluid_resize(sizes[s].width, sizes[s].height)) {
+                fprintf(stderr, "Failed to allocate a %dx%d grid\n", sizes[s].width, sizes[s].height);
+                return 1;
+            }
+            sim->substep = 1.0f;
+            sim->noise_seed = TEST_SEED;
+            sim->noise_step = 7;
+            for (size_t t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
+                const KernelTest* test = &tests[t];
+                if (test->compact != (storage != FIELD_STORAGE_FLOAT32)) continue;
+                Snapshot reference;
+                fill_state();
+                test->run();
+                take_snapshot(&reference);
+                for (int level = SIMD_SCALAR + 1; level <= supported; level++) {
+                    char label[128];
+                    snprintf(label, sizeof(label), "%s %s %dx%d %s", test->name, simd_level_names[level],
+                             sizes[s].width, sizes[s].height, field_storage_names[storage]);
+                    Snapshot shot;
+                    fill_state();
+                    simd_select(level);
+                    test->run();
+                    take_snapshot(&shot);
+                    checks++;
+                    if (compare(&shot, &reference, test, label)) failures++;
+                    free_snapshot(&shot);
+                }
+                free_snapshot(&reference);
+            }
+        }
+    }
+    fluid_shutdown();
+    thread_pool_shutdown();
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
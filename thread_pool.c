@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "thread_pool.h"
+
+ThreadPool pool = {.thread_count = 1};
+
+void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+int cpu_count() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+void run_band(RangeKernel kernel, void* ctx, int begin, int end, int thread, int bands) {
+    int rows = end - begin;
+    int band_begin = begin + (int)((long long)rows * thread / bands);
+    int band_end = begin + (int)((long long)rows * (thread + 1) / bands);
+    if (band_begin < band_end) kernel(ctx, band_begin, band_end, thread);
+}
+
+void* worker_main(void* arg) {
+    int thread = (int)(intptr_t)arg;
+    unsigned seen = 0;
+
+    for (;;) {
+        // Spin briefly: stages follow each other within microseconds
+        int spin = 0;
+        while (atomic_load_explicit(&pool.generation, memory_order_acquire) == seen && spin < POOL_SPIN) {
+            cpu_relax();
+            spin++;
+        }
+        if (atomic_load_explicit(&pool.generation, memory_order_acquire) == seen) {
+            pthread_mutex_lock(&pool.lock);
+            while (atomic_load_explicit(&pool.generation, memory_order_acquire) == seen) {
+                pthread_cond_wait(&pool.start, &pool.lock);
+            }
+            pthread_mutex_unlock(&pool.lock);
+        }
+        seen = atomic_load_explicit(&pool.generation, memory_order_acquire);
+        if (pool.quit) break;
+
+        sim = pool.sim;
+        run_band(pool.kernel, pool.ctx, pool.begin, pool.end, thread, pool.thread_count);
+
+        if (atomic_fetch_sub_explicit(&pool.pending, 1, memory_order_acq_rel) == 1) {
+            pthread_mutex_lock(&pool.lock);
+            pthread_cond_signal(&pool.done);
+            pthread_mutex_unlock(&pool.lock);
+        }
+    }
+    return NULL;
+}
+
+// requested <= 0 uses every online CPU
+void thread_pool_init(int requested) {
+    int count = requested > 0 ? requested : cpu_count();
+    if (count > MAX_THREADS) count = MAX_THREADS;
+
+    pool.thread_count = count;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.start, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    for (int t = 1; t < count; t++) {
+        if (pthread_create(&pool.threads[t], NULL, worker_main, (void*)(intptr_t)t) != 0) {
+            printf("Worker thread creation failed, running with %d threads\n", t);
+            pool.thread_count = t;
+            break;
+        }
+    }
+}
+
+void thread_pool_shutdown() {
+    if (pool.thread_count <= 1) return;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = 1;
+    atomic_fetch_add_explicit(&pool.generation, 1, memory_order_release);
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+    for (int t = 1; t < pool.thread_count; t++) {
+        pthread_join(pool.threads[t], NULL);
+    }
+    pool.thread_count = 1;
+}
+
+void parallel_for(int begin, int end, RangeKernel kernel, void* ctx) {
+    if (end <= begin) return;
+    if (pool.thread_count <= 1 || end - begin < PARALLEL_MIN_RANGE) {
+        kernel(ctx, begin, end, 0);
+        return;
+    }
+
+    pool.kernel = kernel;
+    pool.ctx = ctx;
+    pool.sim = sim;
+    pool.begin = begin;
+    pool.end = end;
+    atomic_store_explicit(&pool.pending, pool.thread_count - 1, memory_order_relaxed);
+    pthread_mutex_lock(&pool.lock);
+    atomic_fetch_add_explicit(&pool.generation, 1, memory_order_release);
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    run_band(kernel, ctx, begin, end, 0, pool.thread_count);
+
+    int spin = 0;
+    while (atomic_load_explicit(&pool.pending, memory_order_acquire) != 0 && spin < POOL_SPIN) {
+        cpu_relax();
+        spin++;
+    }
+    if (atomic_load_explicit(&pool.pending, memory_order_acquire) != 0) {
+        pthread_mutex_lock(&pool.lock);
+        while (atomic_load_explicit(&pool.pending, memory_order_acquire) != 0) {
+            pthread_cond_wait(&pool.done, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define MAX_THREADS 64
+#define POOL_SPIN 4000
+#define PARALLEL_MIN_RANGE 16
+
+// Persistent worker pool. parallel_for() splits [begin, end) into one
+// contiguous band per thread, runs band 0 on the calling thread and returns
+// once every band is finished, which is the barrier between stages. Bands
+// depend only on the range and the thread count; kernels get the band and
+// their thread index for per-thread partial results.
+typedef void (*RangeKernel)(void* ctx, int begin, int end, int thread);
+
+// The simulation the calling thread works on (fluid.h). parallel_for()
+// hands the caller's to every worker for the length of the job.
+struct Simulation;
+extern _Thread_local struct Simulation* sim;
+
+typedef struct {
+    pthread_t threads[MAX_THREADS];
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    atomic_uint generation;
+    atomic_int pending;
+    int quit;
+    RangeKernel kernel;
+    void* ctx;
+    struct Simulation* sim;
+    int begin;
+    int end;
+} ThreadPool;
+
+extern ThreadPool pool;
+
+int cpu_count();
+void thread_pool_init(int requested);
+void thread_pool_shutdown();
+void parallel_for(int begin, int end, RangeKernel kernel, void* ctx);
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+// Monotonic wall clock in seconds, for timing stages and whole runs
+double timer_seconds();
+void timer_sleep(double seconds);
+
+#endif
@@ -0,0 +1,319 @@
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "timer.h"
+#include "transport.h"
+
+#define SHM_SPIN 1000
+#define SHM_MAPPING_LIMIT (256u << 20)
+
+const char* transport_kind_names[TRANSPORT_KIND_COUNT] = {"shm", "tcp"};
+
+// Single-producer, single-consumer ring, one per ordered pair of ranks.
+// head and tail count bytes ever written and read; they sit on their own
+// cache lines so the two sides do not share one.
+typedef struct {
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+} ShmChannel;
+
+typedef struct {
+    unsigned char* base;
+    size_t mapping_bytes;
+    size_t channel_bytes;        // Ring capacity, a power of two
+} ShmState;
+
+ShmChannel* shm_channel(ShmState* state, int ranks, int from, int to) {
+    size_t stride = sizeof(ShmChannel) + state->channel_bytes;
+    return (ShmChannel*)(state->base + ((size_t)from * ranks + to) * stride);
+}
+
+// Spins briefly, then yields, so ranks sharing a core still make progress
+void shm_wait(int* spins) {
+    if (++*spins > SHM_SPIN) sched_yield();
+}
+
+int shm_send(Transport* transport, int peer, const void* data, size_t bytes) {
+    ShmState* state = transport->state;
+    ShmChannel* channel = shm_channel(state, transport->ranks, transport->rank, peer);
+    unsigned char* ring = (unsigned char*)(channel + 1);
+    const unsigned char* src = data;
+    size_t mask = state->channel_bytes - 1;
+    size_t head = atomic_load_explicit(&channel->head, memory_order_relaxed);
+    int spins = 0;
+    while (bytes > 0) {
+        size_t tail = atomic_load_explicit(&channel->tail, memory_order_acquire);
+        size_t free_bytes = state->channel_bytes - (head - tail);
+        if (free_bytes == 0) {
+            shm_wait(&spins);
+            continue;
+        }
+        size_t offset = head & mask;
+        size_t n = bytes < free_bytes ? bytes : free_bytes;
+        if (n > state->channel_bytes - offset) n = state->channel_bytes - offset;
+        memcpy(ring + offset, src, n);
+        head += n;
+        src += n;
+        bytes -= n;
+        atomic_store_explicit(&channel->head, head, memory_order_release);
+        spins = 0;
+    }
+    transport->bytes_sent += src - (const unsigned char*)data;
+    return 1;
+}
+
+int shm_recv(Transport* transport, int peer, void* data, size_t bytes) {
+    ShmState* state = transport->state;
+    ShmChannel* channel = shm_channel(state, transport->ranks, peer, transport->rank);
+    const unsigned char* ring = (const unsigned char*)(channel + 1);
+    unsigned char* dst = data;
+    size_t mask = state->channel_bytes - 1;
+    size_t tail = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+    int spins = 0;
+    while (bytes > 0) {
+        size_t head = atomic_load_explicit(&channel->head, memory_order_acquire);
+        size_t ready = head - tail;
+        if (ready == 0) {
+            shm_wait(&spins);
+            continue;
+        }
+        size_t offset = tail & mask;
+        size_t n = bytes < ready ? bytes : ready;
+        if (n > state->channel_bytes - offset) n = state->channel_bytes - offset;
+        memcpy(dst, ring + offset, n);
+        tail += n;
+        dst += n;
+        bytes -= n;
+        atomic_store_explicit(&channel->tail, tail, memory_order_release);
+        spins = 0;
+    }
+    return 1;
+}
+
+void shm_close(Transport* transport) {
+    ShmState* state = transport->state;
+    if (!state) return;
+    munmap(state->base, state->mapping_bytes);
+    free(state);
+    transport->state = NULL;
+}
+
+// Anonymous shared mapping, so only the processes forked after this see
+// it. Rings shrink with the rank count to keep the mapping bounded.
+int shm_transport_create(Transport* transport, int ranks) {
+    if (ranks < 1 || ranks > MAX_RANKS) return 0;
+    size_t channel_bytes = SHM_CHANNEL_BYTES;
+    while (channel_bytes > 4096 && (size_t)ranks * ranks * channel_bytes > SHM_MAPPING_LIMIT) channel_bytes /= 2;
+    ShmState* state = calloc(1, sizeof(ShmState));
+    if (!state) return 0;
+    state->channel_bytes = channel_bytes;
+    state->mapping_bytes = (size_t)ranks * ranks * (sizeof(ShmChannel) + channel_bytes);
+    void* base = mmap(NULL, state->mapping_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %zu bytes of shared memory: %s\n", state->mapping_bytes, strerror(errno));
+        free(state);
+        return 0;
+    }
+    state->base = base;
+    *transport = (Transport){
+        .kind = TRANSPORT_SHM, .rank = 0, .ranks = ranks,
+        .send = shm_send, .recv = shm_recv, .close = shm_close, .state = state
+    };
+    return 1;
+}
+
+void shm_transport_attach(Transport* transport, int rank) {
+    transport->rank = rank;
+}
+
+typedef struct {
+    int fds[MAX_RANKS];          // Socket to each peer, -1 for this rank
+} TcpState;
+
+int tcp_send(Transport* transport, int peer, const void* data, size_t bytes) {
+    TcpState* state = transport->state;
+    const char* src = data;
+    while (bytes > 0) {
+        ssize_t n = send(state->fds[peer], src, bytes, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        src += n;
+        bytes -= n;
+        transport->bytes_sent += n;
+    }
+    return 1;
+}
+
+int tcp_recv(Transport* transport, int peer, void* data, size_t bytes) {
+    TcpState* state = transport->state;
+    char* dst = data;
+    while (bytes > 0) {
+        ssize_t n = recv(state->fds[peer], dst, bytes, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        dst += n;
+        bytes -= n;
+    }
+    return 1;
+}
+
+void tcp_close(Transport* transport) {
+    TcpState* state = transport->state;
+    if (!state) return;
+    for (int p = 0; p < transport->ranks; p++) {
+        if (state->fds[p] >= 0) close(state->fds[p]);
+    }
+    free(state);
+    transport->state = NULL;
+}
+
+// Halo exchanges are small and latency-bound
+void tcp_configure(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+int tcp_listen(int port, int backlog) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((uint16_t)port);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, backlog) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int tcp_connect(const TcpPeer* peer) {
+    char port[16];
+    snprintf(port, sizeof(port), "%d", peer->port);
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    double deadline = timer_seconds() + TCP_CONNECT_SECONDS;
+    do {
+        struct addrinfo* list = NULL;
+        if (getaddrinfo(peer->host, port, &hints, &list) == 0) {
+            for (struct addrinfo* a = list; a; a = a->ai_next) {
+                int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+                if (fd < 0) continue;
+                if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+                    freeaddrinfo(list);
+                    return fd;
+                }
+                close(fd);
+            }
+            freeaddrinfo(list);
+        }
+        usleep(50000);
+    } while (timer_seconds() < deadline);
+    return -1;
+}
+
+// Every rank connects to the ranks below it and accepts the ones above.
+// A connection opens with the connecting rank's number, since accepts
+// arrive in any order.
+int tcp_transport_open(Transport* transport, int rank, int ranks, const TcpPeer* peers) {
+    if (ranks < 1 || ranks > MAX_RANKS || rank < 0 || rank >= ranks) return 0;
+    TcpState* state = malloc(sizeof(TcpState));
+    if (!state) return 0;
+    for (int p = 0; p < MAX_RANKS; p++) state->fds[p] = -1;
+    *transport = (Transport){
+        .kind = TRANSPORT_TCP, .rank = rank, .ranks = ranks,
+        .send = tcp_send, .recv = tcp_recv, .close = tcp_close, .state = state
+    };
+
+    int listener = -1;
+    if (rank < ranks - 1) {
+        listener = tcp_listen(peers[rank].port, ranks);
+        if (listener < 0) {
+            fprintf(stderr, "Rank %d cannot listen on port %d: %s\n", rank, peers[rank].port, strerror(errno));
+            tcp_close(transport);
+            return 0;
+        }
+    }
+    for (int p = 0; p < rank; p++) {
+        int fd = tcp_connect(&peers[p]);
+        int32_t id = rank;
+        if (fd < 0 || send(fd, &id, sizeof(id), MSG_NOSIGNAL) != sizeof(id)) {
+            fprintf(stderr, "Rank %d cannot reach rank %d at %s:%d\n", rank, p, peers[p].host, peers[p].port);
+            if (fd >= 0) close(fd);
+            if (listener >= 0) close(listener);
+            tcp_close(transport);
+            return 0;
+        }
+        tcp_configure(fd);
+        state->fds[p] = fd;
+    }
+    for (int accepted = rank + 1; accepted < ranks; accepted++) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0 && errno == EINTR) {
+            accepted--;
+            continue;
+        }
+        int32_t id = -1;
+        if (fd < 0 || recv(fd, &id, sizeof(id), MSG_WAITALL) != sizeof(id) ||
+            id <= rank || id >= ranks || state->fds[id] >= 0) {
+            fprintf(stderr, "Rank %d got a bad connection\n", rank);
+            if (fd >= 0) close(fd);
+            close(listener);
+            tcp_close(transport);
+            return 0;
+        }
+        tcp_configure(fd);
+        state->fds[id] = fd;
+    }
+    if (listener >= 0) close(listener);
+    return 1;
+}
+
+float transport_max(Transport* transport, float value) {
+    if (transport->rank == 0) {
+        for (int p = 1; p < transport->ranks; p++) {
+            float other = value;
+            transport->recv(transport, p, &other, sizeof(other));
+            value = other > value ? other : value;
+        }
+        for (int p = 1; p < transport->ranks; p++) transport->send(transport, p, &value, sizeof(value));
+    } else {
+        transport->send(transport, 0, &value, sizeof(value));
+        transport->recv(transport, 0, &value, sizeof(value));
+    }
+    return value;
+}
+
+// Summed in rank order, so every run of the same layout rounds alike
+double transport_sum(Transport* transport, double value) {
+    if (transport->rank == 0) {
+        for (int p = 1; p < transport->ranks; p++) {
+            double other = 0.0;
+            transport->recv(transport, p, &other, sizeof(other));
+            value += other;
+        }
+        for (int p = 1; p < transport->ranks; p++) transport->send(transport, p, &value, sizeof(value));
+    } else {
+        transport->send(transport, 0, &value, sizeof(value));
+        transport->recv(transport, 0, &value, sizeof(value));
+    }
+    return value;
+}
+
+void transport_barrier(Transport* transport) {
+    transport_max(transport, 0.0f);
+}
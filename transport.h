@@ -0,0 +1,51 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stddef.h>
+
+#define MAX_RANKS 64
+#define SHM_CHANNEL_BYTES (1 << 20)
+#define TCP_CONNECT_SECONDS 30
+
+typedef enum {
+    TRANSPORT_SHM,       // Rings in memory shared by processes forked on one host
+    TRANSPORT_TCP,       // One socket per pair of ranks, loopback or across hosts
+    TRANSPORT_KIND_COUNT
+} TransportKind;
+
+extern const char* transport_kind_names[TRANSPORT_KIND_COUNT];
+
+// Ordered byte streams between the ranks 0..ranks - 1 of one run. send()
+// may return before the peer has read the data; recv() blocks until all
+// of it has arrived. Both return 0 once the peer is gone.
+typedef struct Transport {
+    TransportKind kind;
+    int rank;
+    int ranks;
+    int (*send)(struct Transport* transport, int peer, const void* data, size_t bytes);
+    int (*recv)(struct Transport* transport, int peer, void* data, size_t bytes);
+    void (*close)(struct Transport* transport);
+    void* state;
+    size_t bytes_sent;
+} Transport;
+
+typedef struct {
+    char host[256];
+    int port;
+} TcpPeer;
+
+// The shared-memory transport maps its rings before the ranks are forked;
+// each child then calls shm_transport_attach() with its rank.
+int shm_transport_create(Transport* transport, int ranks);
+void shm_transport_attach(Transport* transport, int rank);
+
+// Listens on peers[rank] and connects to every other rank, retrying for
+// up to TCP_CONNECT_SECONDS while they start
+int tcp_transport_open(Transport* transport, int rank, int ranks, const TcpPeer* peers);
+
+// Collectives over every rank, gathered at rank 0 and sent back
+float transport_max(Transport* transport, float value);
+double transport_sum(Transport* transport, double value);
+void transport_barrier(Transport* transport);
+
+#endif